@@ -34,12 +34,15 @@
   #include <netdb.h>
   #include <sys/socket.h>
   #include <sys/time.h>
+  #include <sys/resource.h>
   #include <string.h>
 #endif
 
 
 #include "slimproto/slimproto.h"
 #include "slimaudio/slimaudio.h"
+#include "slimaudio/slimaudio_trace.h"
+#include "slimproto/slimproto_clock.h"
 
 
 #ifdef SLIMPROTO_DEBUG
@@ -75,6 +78,9 @@ int slimaudio_init(slimaudio_t *audio, slimproto_t *proto,
 	audio->proto = proto;
 	audio->decoder_buffer = slimaudio_buffer_init(DECODER_BUFFER_SIZE);
 	audio->output_buffer = slimaudio_buffer_init(OUTPUT_BUFFER_SIZE);
+	audio->decoder_buffer_min = audio->decoder_buffer_max = DECODER_BUFFER_SIZE;
+	audio->output_buffer_min = audio->output_buffer_max = OUTPUT_BUFFER_SIZE;
+	audio->buffer_boost = 1.0;
 
 	DEBUGF("decoder buffer pointer: %p\n", audio->decoder_buffer);
 	DEBUGF("output buffer pointer: %p\n", audio->output_buffer);
@@ -98,7 +104,10 @@ int slimaudio_init(slimaudio_t *audio, slimproto_t *proto,
  * Frees slimaudio resources.
  */
 void slimaudio_destroy(slimaudio_t *audio) {
-	/* FIXME remove slimproto callback */
+	slimproto_remove_command_callback(audio->proto, "strm", &strm_callback, audio);
+	slimproto_remove_command_callback(audio->proto, "vers", &vers_callback, audio);
+	slimproto_remove_connect_callback(audio->proto, connect_callback, audio);
+
 	slimaudio_output_destroy(audio);	
 	slimaudio_buffer_close(audio->output_buffer);
 	slimaudio_buffer_free(audio->output_buffer);
@@ -144,6 +153,76 @@ void slimaudio_set_output_predelay(slimaudio_t *audio, unsigned int msec, unsign
 	pthread_cond_broadcast(&audio->output_cond);
 }
 
+void slimaudio_set_output_watermarks(slimaudio_t *audio, unsigned int low_msec, unsigned int high_msec) {
+	pthread_mutex_lock(&audio->output_mutex);
+	audio->output_low_watermark_msec = low_msec;
+	audio->output_high_watermark_msec = high_msec;
+	slimaudio_output_set_watermarks(audio);
+	pthread_mutex_unlock(&audio->output_mutex);
+}
+
+/* Replaces buf by one of max bytes sized to min, if max changed. */
+static void audio_buffer_limits(slimaudio_buffer_t **buf, int min, int max) {
+	if ((*buf)->buffer_max != max) {
+		slimaudio_buffer_free(*buf);
+		*buf = slimaudio_buffer_init(max);
+	}
+
+	slimaudio_buffer_resize(*buf, min);
+}
+
+void slimaudio_set_buffer_limits(slimaudio_t *audio, int decoder_min, int decoder_max,
+	int output_min, int output_max) {
+	/* room for a few chunks at least */
+	if (decoder_min < AUDIO_CHUNK_SIZE * 8)
+		decoder_min = AUDIO_CHUNK_SIZE * 8;
+	if (decoder_max < decoder_min)
+		decoder_max = decoder_min;
+	if (output_min < AUDIO_CHUNK_SIZE * 8)
+		output_min = AUDIO_CHUNK_SIZE * 8;
+	if (output_max < output_min)
+		output_max = output_min;
+
+	DEBUGF("slimaudio_set_buffer_limits: decoder %i-%i output %i-%i\n",
+		decoder_min, decoder_max, output_min, output_max);
+
+	audio->decoder_buffer_min = decoder_min;
+	audio->decoder_buffer_max = decoder_max;
+	audio->output_buffer_min = output_min;
+	audio->output_buffer_max = output_max;
+
+	audio_buffer_limits(&audio->decoder_buffer, decoder_min, decoder_max);
+	audio_buffer_limits(&audio->output_buffer, output_min, output_max);
+}
+
+int slimaudio_get_capabilities(slimaudio_t *audio, char *buf, int buf_len) {
+	unsigned int max_rate;
+	int len;
+
+	len = slimaudio_decoder_formats(buf, buf_len);
+
+	/* Decoders switch the output to the rate of their stream, so the
+	** server may send anything the device plays.
+	*/
+	max_rate = OUTPUT_RATE;
+	if (audio->output_device_max_rate > 0)
+		max_rate = audio->output_device_max_rate;
+
+	len += snprintf(buf + len, buf_len - len, ",SampleRate=%u,MaxSampleRate=%u,HasPreAmp",
+		OUTPUT_RATE, max_rate);
+	if (len >= buf_len)
+		len = buf_len - 1;
+
+	DEBUGF("slimaudio_get_capabilities: %s\n", buf);
+
+	return len;
+}
+
+bool slimaudio_strm_next(slimproto_msg_t *msg) {
+	return (msg->strm.autostart == '2') || (msg->strm.autostart == '3') ||
+		((msg->strm.flags & STRM_FLAG_NO_RESTART) != 0);
+}
+
 /*
  * Close audio resources
  */
@@ -160,15 +239,59 @@ int slimaudio_close(slimaudio_t *audio) {
 	return 0;
 }
 
+/* Refreshes the context switch and decoder wakeup counters. */
+void slimaudio_stat_counters(slimaudio_t *audio) {
+#ifndef __WIN32__
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		audio->context_switches = usage.ru_nvcsw + usage.ru_nivcsw;
+#endif
+	audio->decoder_wakeups = slimaudio_buffer_writer_wakeups(audio->output_buffer);
+}
+
+#ifdef SLIMPROTO_DEBUG
+/* Logs context switches and decoder wakeups per second since the last call. */
+static void audio_stat_rates(slimaudio_t *audio) {
+	u64_t now;
+	unsigned long cswitches = audio->context_switches;
+	unsigned long wakeups = audio->decoder_wakeups;
+	double secs;
+
+	now = slimproto_clock_usec();
+	secs = (now - audio->stat_time) / 1000000.0;
+
+	if ( (audio->stat_time != 0) && (secs >= 1.0) ) {
+		DEBUGF("slimaudio_stat: %.0f context switches/s, %.1f decoder wakeups/s\n",
+			(cswitches - audio->stat_cswitches) / secs,
+			(wakeups - audio->stat_wakeups) / secs);
+	}
+
+	if ( (audio->stat_time == 0) || (secs >= 1.0) ) {
+		audio->stat_time = now;
+		audio->stat_cswitches = cswitches;
+		audio->stat_wakeups = wakeups;
+	}
+}
+#endif
+
 int slimaudio_stat(slimaudio_t *audio, const char *code, u32_t interval) {
 	int decoder_available = slimaudio_buffer_available(audio->decoder_buffer);
 	int output_available = slimaudio_buffer_available(audio->output_buffer);
         u32_t msec =
-                (u32_t) ((audio->stream_samples - audio->pa_streamtime_offset) / 44.100)
+                (u32_t) ((audio->stream_samples - audio->pa_streamtime_offset) * 1000 / audio->output_rate)
 			+ audio->output_predelay_msec;
 
-	return slimproto_stat(audio->proto, code, DECODER_BUFFER_SIZE, decoder_available,
-			audio->http_total_bytes, OUTPUT_BUFFER_SIZE, output_available,
+	if (strcmp(code, "STMt") == 0) {
+		slimaudio_stat_counters(audio);
+#ifdef SLIMPROTO_DEBUG
+		if (slimaudio_debug)
+			audio_stat_rates(audio);
+#endif
+	}
+
+	return slimproto_stat(audio->proto, code, slimaudio_buffer_size(audio->decoder_buffer), decoder_available,
+			audio->http_total_bytes, slimaudio_buffer_size(audio->output_buffer), output_available,
 			msec < 0 ? 0 : msec, interval );
 }
 
@@ -185,6 +308,9 @@ static int strm_callback(slimproto_t *proto, const unsigned char *buf, int buf_l
 
 	switch (msg.strm.command) {
 		case 's': /* start */
+			audio->trace_track = slimaudio_trace_track();
+			slimaudio_trace(TRACE_STRM, audio->trace_track);
+
 			replay_gain = (float) (msg.strm.replay_gain) / 65536.0;
 			audio->start_replay_gain = replay_gain == 0.0 ? 1.0 : replay_gain;
 
@@ -291,6 +417,7 @@ static void audio_stop(slimaudio_t *audio) {
 	pthread_cond_broadcast(&audio->decoder_cond);
 
 	audio->http_state = STREAM_STOP;
+	audio->http_next_pending = false;
 	pthread_cond_broadcast(&audio->http_cond);
 	
 	slimaudio_buffer_flush(audio->output_buffer);
@@ -309,11 +436,27 @@ static void audio_stop(slimaudio_t *audio) {
 }
 
 static int connect_callback(slimproto_t *p, bool isConnected, void *user_data) {
-	slimaudio_t *audio = (slimaudio_t*)user_data;
+	/* Keep playing, a HELO with isReconnect lets the server pick the
+	** stream up again.  The client calls slimaudio_stop if it cannot.
+	*/
 	if (!isConnected) {
-		DEBUGF("Stopping audio because of disconnection.\n");
-		audio_stop(audio);
+		DEBUGF("Disconnected, audio plays on from the buffers.\n");
 	}
 	
 	return 0;
 }
+
+void slimaudio_stop(slimaudio_t *audio) {
+	DEBUGF("Stopping audio because of disconnection.\n");
+	audio_stop(audio);
+}
+
+u64_t slimaudio_get_bytes_received(slimaudio_t *audio) {
+	u64_t bytes;
+
+	pthread_mutex_lock(&audio->http_mutex);
+	bytes = audio->http_total_bytes;
+	pthread_mutex_unlock(&audio->http_mutex);
+
+	return bytes;
+}
@@ -30,17 +30,6 @@
 #include <portmixer.h>
 #endif
 
-#include <mad.h>
-#include <FLAC/stream_decoder.h>
-
-#define OV_EXCLUDE_STATIC_CALLBACKS
-
-#ifdef TREMOR_DECODER
-#include <vorbis/ivorbisfile.h>
-#else
-#include <vorbis/vorbisfile.h>
-#endif /* TREMOR_DECODER */
-
 #include "slimproto/slimproto.h"
 #include "slimaudio/slimaudio_buffer.h"
 
@@ -48,7 +37,18 @@
 #define DECODER_BUFFER_SIZE	(2048*1024)
 #define OUTPUT_BUFFER_SIZE	(8*2*44100*4)
 #define BUFFERING_TIMEOUT	(12)
-#define OUTPUT_THRESHOLD        (211680)  /* 1.2 seconds, 44100Hz, 2 channels, 2 bytes (16bit/sample) */
+#define OUTPUT_THRESHOLD_MSEC	(1200)    /* decoded audio buffered before playback starts */
+#define AUTOSTART_THRESHOLD_MSEC	(2000)    /* audio buffered before autostart */
+#define THRESHOLD_OVERRIDE_MSEC	(1000)    /* as above for ogg and mp3 with threshold_override */
+#define OUTPUT_RATE		(44100)   /* default output stream rate */
+
+/* Format of a stream in the output buffer: its rate, with a flag for DoP
+** in 32-bit frames.  Kept per stream in the buffer, 0 if not set.
+*/
+#define OUTPUT_FORMAT_DOP		(0x80000000)
+#define OUTPUT_FORMAT(rate, dop)	((rate) | ((dop) ? OUTPUT_FORMAT_DOP : 0))
+#define OUTPUT_FORMAT_RATE(format)	((format) & ~OUTPUT_FORMAT_DOP)
+#define OUTPUT_FORMAT_FRAME(format)	(((format) & OUTPUT_FORMAT_DOP) ? 2 * 4 : 2 * 2)
 
 #ifdef ZONES
 #define MAX_ZONES		(4)
@@ -63,6 +63,8 @@ extern unsigned long pa_numberOfBuffers;
 
 #define AUDIO_CHUNK_SIZE 8192
 
+#define SLIMAUDIO_MAX_DECODERS	(16)
+
 #ifdef SLIMPROTO_DEBUG
   extern bool slimaudio_debug;
   extern bool slimaudio_buffer_debug;
@@ -76,6 +78,13 @@ extern unsigned long pa_numberOfBuffers;
   extern bool slimaudio_output_debug_v;
 #endif
 
+/* Plays into nothing instead of a device, slimaudio_output_null_speed
+** times faster than real time, for replays and tests.  Set before
+** slimaudio_init.
+*/
+extern bool slimaudio_output_null;
+extern unsigned int slimaudio_output_null_speed;
+
 #ifdef RENICE
 extern bool renice;
 bool renice_thread ( int );
@@ -87,7 +96,24 @@ typedef enum { QUIT=0, PLAY, BUFFERING, PLAYING, PAUSE, PAUSED, STOP, STOPPED }
 
 typedef enum { VOLUME_NONE, VOLUME_SOFTWARE, VOLUME_DRIVER } slimaudio_volume_t;
 
+typedef struct slimaudio slimaudio_t;
+
+/* Decoder interface.  Each codec provides one of these and is listed in
+** the decoder table in slimaudio_decoder.c.  A decoder is initialized the
+** first time a stream in its mode is played, its private state is kept in
+** audio->decoder_priv while it is the active decoder.
+*/
 typedef struct {
+	char mode;				/* strm mode byte */
+	const char *formats;			/* formats advertised to the server */
+	int (*init)(slimaudio_t *audio);	/* allocate private state */
+	bool (*probe)(slimaudio_t *audio);	/* optional, can this stream be decoded */
+	int (*process)(slimaudio_t *audio);	/* decode a stream until it ends */
+	void (*flush)(slimaudio_t *audio);	/* optional, reset state between streams */
+	void (*free)(slimaudio_t *audio);	/* release private state */
+} slimaudio_decoder_t;
+
+struct slimaudio {
 	slimproto_t *proto;				/* slimproto connection */
 	
 	slimaudio_buffer_t *decoder_buffer;		/* decoder buffer */
@@ -104,11 +130,36 @@ typedef struct {
 	u32_t http_stream_bytes;
 	u8_t autostart_mode;
 	bool autostart_threshold_reached;
-	u32_t autostart_threshold;
-	u32_t output_threshold;
+	u32_t autostart_threshold;			/* bytes, used until the bitrate is known */
+	u32_t autostart_threshold_msec;
+	u32_t output_threshold_msec;
+	bool http_next_pending;				/* next stream waits for this one to end */
+	bool http_connecting;				/* http thread connects the next stream */
+	struct sockaddr_in http_addr;			/* server of the stream */
+	slimproto_msg_t http_msg;			/* strm of the stream, to resume it */
+	u64_t http_content_length;			/* bytes of the whole body */
+	u64_t http_content_left;			/* bytes left of the response body */
+	bool http_content_known;			/* response has a Content-Length */
+	bool http_keepalive;				/* server keeps the connection */
+	bool http_reuse;				/* keep streamfd open when the stream stops */
+	bool http_idle;					/* http_idle_fd is open for the next request */
+	int http_idle_fd;
+	struct sockaddr_in http_idle_addr;
+	slimproto_msg_t http_next_msg;
+	u32_t http_trace, http_next_trace;		/* tracks of the streams, see slimaudio_trace */
 	float replay_gain;
 	float start_replay_gain;
 
+	/* adaptive buffer sizing, see http_adapt_buffers */
+	int decoder_buffer_min, decoder_buffer_max;	/* bytes */
+	int output_buffer_min, output_buffer_max;
+	u64_t http_rate_time;				/* start of the receive rate window, usec */
+	u32_t http_rate_bytes;				/* bytes received in the window */
+	double http_rate_mean;				/* receive rate, bytes/s */
+	double http_rate_dev;				/* its mean deviation */
+	double buffer_boost;				/* grows with underruns */
+	u32_t buffer_underruns;				/* underruns seen by the controller */
+
 	/* decode state */
 	pthread_t decoder_thread;
 	pthread_mutex_t decoder_mutex;
@@ -117,7 +168,15 @@ typedef struct {
 	slimaudio_stream_state_t decoder_state;
 	char decoder_mode;
 	u8_t decoder_endianness;
+	u8_t decoder_sample_size;
+	u8_t decoder_sample_rate;
+	u8_t decoder_channels;
 	bool decoder_end_of_stream;
+	bool decoder_next_pending;			/* next stream decodes after this one */
+	slimproto_msg_t decoder_next_msg;
+	u32_t decoder_trace, decoder_next_trace;
+	bool decoder_traced;				/* first audio of the stream recorded */
+	u64_t decoder_audio_usec;			/* audio decoded, ever */
 		
 	/* output state */
 	pthread_t output_thread;
@@ -131,6 +190,8 @@ typedef struct {
 	PortAudioStream *pa_stream;
 	PxMixer *px_mixer;
 #endif
+	pthread_t output_null_thread;		/* plays for the null output */
+	volatile bool output_null_running;
 	slimaudio_volume_t volume_control;
 	float volume;
 	float prev_volume;
@@ -138,6 +199,8 @@ typedef struct {
 	unsigned int output_predelay_msec;
 	unsigned int output_predelay_frames;
 	unsigned int output_predelay_amplitude;
+	unsigned int output_low_watermark_msec;		/* decoder refills below this */
+	unsigned int output_high_watermark_msec;	/* up to this, 0 for a full buffer */
 #ifdef ZONES
 	u8_t output_num_zones;
 	u8_t output_zone;
@@ -147,23 +210,40 @@ typedef struct {
 
 	volatile bool output_STMs;
 	volatile bool output_STMu;
+	volatile bool output_underrun;
+	volatile u32_t output_underruns;		/* times the output buffer ran dry */
+	volatile u32_t output_underflows;		/* paOutputUnderflow seen by the callback */
+	u32_t output_STMu_count;			/* STMu sent */
+	volatile u32_t output_trace;			/* track the callback started */
 
 	int keepalive_interval;
 	int buffering_timeout;
 	
 	PaDeviceIndex output_device_id;
+	unsigned int output_rate;		/* rate the output stream runs at */
+	unsigned int output_device_max_rate;	/* highest 16-bit stereo rate of the device */
+	unsigned int output_device_dop_rate;	/* highest DoP rate of the device, 0 for none */
+	bool output_dop;			/* stream carries DoP in 32-bit frames */
+	unsigned int decoder_format;		/* the decoder writes, OUTPUT_FORMAT */
+	volatile bool output_format_change;	/* callback waits for the stream to reopen */
 
 	u32_t decode_num_tracks_started;
+	u32_t trace_track;				/* of the last strm s */
 
-	/* mad decoder */
-	struct mad_decoder mad_decoder;
-	char *decoder_data;
-	
-	/* flac decoder */
-	FLAC__StreamDecoder *flac_decoder;
+	/* counters, refreshed by slimaudio_stat_counters */
+	unsigned long context_switches;			/* of the process, ever */
+	unsigned long decoder_wakeups;			/* decoder waited for output space */
 
-	/* ogg decoder */
-	OggVorbis_File oggvorbis_file;
+	/* counters for the debug statistics */
+	u64_t stat_time;				/* usec */
+	unsigned long stat_cswitches;
+	unsigned long stat_wakeups;
+
+	/* decoders */
+	const slimaudio_decoder_t *decoder;		/* decoder of the current stream */
+	void *decoder_priv;				/* and its private state */
+	bool decoder_ready[SLIMAUDIO_MAX_DECODERS];	/* initialized on first use */
+	void *decoder_privs[SLIMAUDIO_MAX_DECODERS];
 
 #ifdef WMA_DECODER	
 	/* WMA decoder */
@@ -177,7 +257,7 @@ typedef struct {
 	u8_t aac_format;
 #endif
 
-} slimaudio_t;
+};
 
 #ifdef ZONES
 int slimaudio_init(slimaudio_t *audio, slimproto_t *proto, PaDeviceIndex, char *, char *, bool, int, int);
@@ -189,6 +269,16 @@ void slimaudio_destroy(slimaudio_t *audio);
 int slimaudio_open(slimaudio_t *audio);
 int slimaudio_close(slimaudio_t *audio);
 int slimaudio_stat(slimaudio_t *, const char *, u32_t);
+void slimaudio_stat_counters(slimaudio_t *audio);
+
+/* Playback carries on from the buffers when the server connection drops,
+** so a reconnect can resume it.  This stops it, for when the server stays
+** away.
+*/
+void slimaudio_stop(slimaudio_t *audio);
+
+/* Gets the stream bytes received, as reported in STAT and HELO. */
+u64_t slimaudio_get_bytes_received(slimaudio_t *audio);
 /* Sets the interval between keepalive signals sent to the server
 ** while playback is stopped.  Defaults to -1, which means auto-select
 ** based on server version.
@@ -209,6 +299,33 @@ void slimaudio_set_volume_control(slimaudio_t *audio, slimaudio_volume_t vol);
 */
 void slimaudio_set_output_predelay(slimaudio_t *audio, unsigned int msec, unsigned int amplitude);
 
+/* Sets output buffer hysteresis: once the output buffer holds high_msec
+** of audio the decoder sleeps until it drains below low_msec, then refills
+** in one burst.  Fewer, longer decoder runs mean fewer wakeups and context
+** switches.  Zero for both (the default) keeps the buffer topped up.
+*/
+void slimaudio_set_output_watermarks(slimaudio_t *audio, unsigned int low_msec, unsigned int high_msec);
+
+/* Sets the size limits of the decoder and output buffers in bytes.  The
+** buffers are allocated at the maximum and sized between the limits at
+** run time from the network receive rate, its jitter and output
+** underruns.  Equal limits give a fixed size.  Call before slimaudio_open.
+*/
+void slimaudio_set_buffer_limits(slimaudio_t *audio, int decoder_min, int decoder_max,
+	int output_min, int output_max);
+
+/* Writes the player capabilities sent to the server in HELO: the formats
+** of the compiled-in decoders followed by the sample rates we can play,
+** e.g. "ogg,flc,aif,pcm,mp3,SampleRate=44100,MaxSampleRate=44100".
+*/
+int slimaudio_get_capabilities(slimaudio_t *audio, char *buf, int buf_len);
+
+/* True if a strm 's' may follow on from the stream still being fetched and
+** decoded, rather than replacing it: direct streaming (autostart '2' or '3')
+** or the "stream without restarting decoder" flag.
+*/
+bool slimaudio_strm_next(slimproto_msg_t *msg);
+
 int slimaudio_http_open(slimaudio_t *a);
 int slimaudio_http_close(slimaudio_t *a);
 void slimaudio_http_connect(slimaudio_t *a, slimproto_msg_t *msg);
@@ -219,6 +336,8 @@ int slimaudio_decoder_open(slimaudio_t *audio);
 int slimaudio_decoder_close(slimaudio_t *audio);
 void slimaudio_decoder_connect(slimaudio_t *a, slimproto_msg_t *msg);
 void slimaudio_decoder_disconnect(slimaudio_t *a);
+/* Writes decoded audio to the output buffer, as decoders do. */
+void slimaudio_decoder_output(slimaudio_t *audio, char *data, int len);
 
 
 int slimaudio_output_init(slimaudio_t *a, PaDeviceIndex, char *, char *, bool);
@@ -232,41 +351,56 @@ void slimaudio_output_pause(slimaudio_t *audio);
 void slimaudio_output_unpause(slimaudio_t *audio);
 /* Returns milliseconds since track began playing */
 u32_t slimaudio_output_streamtime(slimaudio_t *audio);
-
-
-int slimaudio_decoder_mad_init(slimaudio_t *audio);
-void slimaudio_decoder_mad_free(slimaudio_t *audio);
-int slimaudio_decoder_mad_process(slimaudio_t *audio);
-
-
-int slimaudio_decoder_flac_init(slimaudio_t *audio);
-void slimaudio_decoder_flac_free(slimaudio_t *audio);
-int slimaudio_decoder_flac_process(slimaudio_t *audio);
-
-
-int slimaudio_decoder_vorbis_init(slimaudio_t *audio);
-void slimaudio_decoder_vorbis_free(slimaudio_t *audio);
-int slimaudio_decoder_vorbis_process(slimaudio_t *audio);
-
-
-int slimaudio_decoder_pcm_init(slimaudio_t *audio);
-void slimaudio_decoder_pcm_free(slimaudio_t *audio);
-int slimaudio_decoder_pcm_process(slimaudio_t *audio);
+/* Asks for the output stream to run at rate from the start of the stream
+** being decoded.  Returns -1 if the device cannot play that rate.
+*/
+int slimaudio_output_set_rate(slimaudio_t *audio, unsigned int rate);
+/* As above, for DSD over PCM: 32-bit frames carrying 24-bit DoP samples
+** that bypass software volume.
+*/
+int slimaudio_output_set_dop(slimaudio_t *audio, unsigned int rate);
+/* Converts bytes of decoded audio in the output buffer to msec, at the
+** format of the stream playing, or about to.
+*/
+u32_t slimaudio_output_msec(slimaudio_t *audio, int bytes);
+u64_t slimaudio_output_usec(slimaudio_t *audio, int bytes);
+/* As above, for bytes in format. */
+u64_t slimaudio_output_format_usec(unsigned int format, int bytes);
+/* Converts the output watermarks to bytes at the current output format. */
+void slimaudio_output_set_watermarks(slimaudio_t *audio);
+/* Returns the highest sample rate the device plays as 16-bit stereo */
+unsigned int slimaudio_output_probe_rate(PaDeviceIndex device);
+
+
+/* Returns the registered decoder for a strm mode byte, or NULL */
+const slimaudio_decoder_t *slimaudio_decoder_find(char mode);
+/* Writes the comma separated list of decodable formats, e.g. "flc,mp3" */
+int slimaudio_decoder_formats(char *buf, int buf_len);
+
+extern const slimaudio_decoder_t slimaudio_decoder_mad;
+extern const slimaudio_decoder_t slimaudio_decoder_flac;
+extern const slimaudio_decoder_t slimaudio_decoder_vorbis;
+extern const slimaudio_decoder_t slimaudio_decoder_pcm;
+extern const slimaudio_decoder_t slimaudio_decoder_alac;
+extern const slimaudio_decoder_t slimaudio_decoder_dsd;
 
 #if defined(WMA_DECODER) || defined(AAC_DECODER)
-void av_lib_setup (void);
+/* Shared FFmpeg decoding, see slimaudio_decoder_av.c */
+int slimaudio_decoder_av_init(slimaudio_t *audio);
+void slimaudio_decoder_av_free(slimaudio_t *audio);
+int slimaudio_decoder_av_process(slimaudio_t *audio, const char *format, int stream_index);
 #endif /* WMA_DECODER || AAC_DECODER */
 
 #ifdef AAC_DECODER
-int slimaudio_decoder_aac_init(slimaudio_t *audio);
-void slimaudio_decoder_aac_free(slimaudio_t *audio);
-int slimaudio_decoder_aac_process(slimaudio_t *audio);
+extern const slimaudio_decoder_t slimaudio_decoder_aac;
 #endif /* AAC_DECODER */
 
 #ifdef WMA_DECODER
-int slimaudio_decoder_wma_init(slimaudio_t *audio);
-void slimaudio_decoder_wma_free(slimaudio_t *audio);
-int slimaudio_decoder_wma_process(slimaudio_t *audio);
+extern const slimaudio_decoder_t slimaudio_decoder_wma;
 #endif /* WMA_DECODER */
 
+#ifdef OPUS_DECODER
+extern const slimaudio_decoder_t slimaudio_decoder_opus;
+#endif /* OPUS_DECODER */
+
 #endif /* _SLIMAUDIO_H_ */
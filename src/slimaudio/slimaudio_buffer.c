@@ -46,7 +46,7 @@ slimaudio_buffer_t *slimaudio_buffer_init(int size) {
 	buf->buffer_start = (char *) malloc(size);
 	buf->buffer_end = buf->buffer_start + size;
 	buf->buffer_size = size;
-	buf->buffer_closed = false;
+	buf->buffer_max = size;
 	buf->read_ptr = buf->write_ptr = buf->buffer_start;
 
 	pthread_mutex_init(&(buf->buffer_mutex), NULL);
@@ -78,12 +78,16 @@ void slimaudio_buffer_open(slimaudio_buffer_t *buf, void *user_data) {
 	
 	stream->user_data = user_data;
 	
+	pthread_mutex_lock(&buf->buffer_mutex);
+
 	if (buf->write_stream != NULL)
 		buf->write_stream->next = stream;	
 	buf->write_stream = stream;
 
 	if (buf->read_stream == NULL)
 		buf->read_stream = stream;	
+
+	pthread_mutex_unlock(&buf->buffer_mutex);
 }
 
 void slimaudio_buffer_close(slimaudio_buffer_t *buf) {
@@ -101,7 +105,6 @@ void slimaudio_buffer_close(slimaudio_buffer_t *buf) {
 		{
 			DEBUGF("reader_blocked:%i ",buf->reader_blocked);
 			buf->reader_blocked = false;
-			buf->buffer_closed = true;
 			pthread_cond_signal(&buf->write_cond);
 		}
 	}
@@ -162,8 +165,211 @@ void slimaudio_buffer_set_readopt(slimaudio_buffer_t *buf, int opt) {
 	pthread_mutex_unlock(&buf->buffer_mutex);
 }
 
+/* Moves the end of the ring to buffer_size once the data does not wrap
+** around it, so a resize never has to move data.
+*/
+static void buffer_set_end(slimaudio_buffer_t *buf) {
+	char *end = buf->buffer_start + buf->buffer_size;
+
+	if (buf->buffer_end == end)
+		return;
+
+	if (buf->total_available == 0)
+		buf->read_ptr = buf->write_ptr = buf->buffer_start;
+	else if ( (buf->write_ptr <= buf->read_ptr) || (buf->write_ptr >= end) )
+		return;
+
+	DEBUGF("buffer_set_end: %p %i -> %i bytes\n", buf,
+		(int) (buf->buffer_end - buf->buffer_start), buf->buffer_size);
+
+	buf->buffer_end = end;
+}
+
+void slimaudio_buffer_resize(slimaudio_buffer_t *buf, int size) {
+	assert(buf);
+
+	pthread_mutex_lock(&buf->buffer_mutex);
+
+	if ( (size <= 0) || (size > buf->buffer_max) )
+		size = buf->buffer_max;
+
+	buf->buffer_size = size;
+	buffer_set_end(buf);
+
+	/* a writer may have room now */
+	if (buf->writer_blocked) {
+		buf->writer_blocked = false;
+		pthread_cond_signal(&buf->read_cond);
+	}
+
+	pthread_mutex_unlock(&buf->buffer_mutex);
+}
+
+int slimaudio_buffer_size(slimaudio_buffer_t *buf) {
+	int size;
+
+	pthread_mutex_lock(&buf->buffer_mutex);
+
+	size = buf->buffer_size;
+
+	pthread_mutex_unlock(&buf->buffer_mutex);
+
+	return size;
+}
+
+void slimaudio_buffer_set_watermarks(slimaudio_buffer_t *buf, int low, int high) {
+	assert(buf);
+
+	pthread_mutex_lock(&buf->buffer_mutex);
+
+	if ( (high <= 0) || (high > buf->buffer_size) )
+		high = buf->buffer_size;
+	if ( (low <= 0) || (low > high) )
+		low = (high == buf->buffer_size) ? 0 : high;
+
+	DEBUGF("buffer_set_watermarks: %p low=%i high=%i\n", buf, low, high);
+
+	buf->low_watermark = low;
+	buf->high_watermark = high;
+
+	/* a writer may be waiting on the old marks */
+	if (buf->writer_blocked) {
+		buf->writer_blocked = false;
+		pthread_cond_signal(&buf->read_cond);
+	}
+
+	pthread_mutex_unlock(&buf->buffer_mutex);
+}
+
+void slimaudio_buffer_set_tag(slimaudio_buffer_t *buf, unsigned int tag) {
+	pthread_mutex_lock(&buf->buffer_mutex);
+
+	if (buf->write_stream != NULL)
+		buf->write_stream->tag = tag;
+
+	pthread_mutex_unlock(&buf->buffer_mutex);
+}
+
+int slimaudio_buffer_drain(slimaudio_buffer_t *buf) {
+	slimaudio_buffer_status ok;
+	char data[4096];
+	int len, drained = 0;
+	bool done;
+
+	for (;;) {
+		/* once the end is returned the next read moves on */
+		pthread_mutex_lock(&buf->buffer_mutex);
+		done = (buf->read_stream == NULL) || buf->read_stream->eof_read;
+		pthread_mutex_unlock(&buf->buffer_mutex);
+
+		if (done)
+			break;
+
+		len = sizeof(data);
+		ok = slimaudio_buffer_read(buf, data, &len);
+		drained += len;
+
+		if (ok == SLIMAUDIO_BUFFER_STREAM_END)
+			break;
+	}
+
+	return drained;
+}
+
+/* Returns the stream the next read comes from, skipping streams it moves
+** on from.  Called with the buffer mutex held.
+*/
+static struct buffer_stream *buffer_next_read_stream(slimaudio_buffer_t *buf) {
+	struct buffer_stream *stream = buf->read_stream;
+
+	while ( (stream != NULL) && (stream->next != NULL) && (stream->available == 0) &&
+		(stream->eof_read || !stream->eof) ) {
+		stream = stream->next;
+	}
+
+	return stream;
+}
+
+unsigned int slimaudio_buffer_read_tag(slimaudio_buffer_t *buf) {
+	struct buffer_stream *stream;
+	unsigned int tag = 0;
+
+	pthread_mutex_lock(&buf->buffer_mutex);
+
+	stream = buffer_next_read_stream(buf);
+	if (stream != NULL)
+		tag = stream->tag;
+
+	pthread_mutex_unlock(&buf->buffer_mutex);
+
+	return tag;
+}
+
+void slimaudio_buffer_set_format(slimaudio_buffer_t *buf, unsigned int format) {
+	pthread_mutex_lock(&buf->buffer_mutex);
+
+	if (buf->write_stream != NULL)
+		buf->write_stream->format = format;
+
+	pthread_mutex_unlock(&buf->buffer_mutex);
+}
+
+unsigned int slimaudio_buffer_read_format(slimaudio_buffer_t *buf) {
+	struct buffer_stream *stream;
+	unsigned int format = 0;
+
+	pthread_mutex_lock(&buf->buffer_mutex);
+
+	stream = buffer_next_read_stream(buf);
+	if (stream != NULL)
+		format = stream->format;
+
+	pthread_mutex_unlock(&buf->buffer_mutex);
+
+	return format;
+}
+
+unsigned long slimaudio_buffer_writer_wakeups(slimaudio_buffer_t *buf) {
+	unsigned long wakeups;
+
+	pthread_mutex_lock(&buf->buffer_mutex);
+
+	wakeups = buf->writer_wakeups;
+
+	pthread_mutex_unlock(&buf->buffer_mutex);
+
+	return wakeups;
+}
+
+/* True if len bytes may be written now, watermarks permitting. */
+static bool buffer_writable(slimaudio_buffer_t *buf, int len) {
+	buffer_set_end(buf);
+
+	if (buf->total_available + len > buf->buffer_size)
+		return false;
+
+	/* the ring may still be shorter while a resize is pending */
+	if (buf->total_available + len > buf->buffer_end - buf->buffer_start)
+		return false;
+
+	/* the high watermark never holds up a write to an empty buffer */
+	if ( (buf->high_watermark > 0) && (buf->total_available > 0) &&
+	     (buf->total_available + len > buf->high_watermark) )
+		return false;
+
+	return true;
+}
+
+/* True if a reader should wake the blocked writer. */
+static bool buffer_refill(slimaudio_buffer_t *buf) {
+	if (buf->low_watermark > 0)
+		return buf->total_available <= buf->low_watermark;
+
+	return true;
+}
+
 void slimaudio_buffer_write(slimaudio_buffer_t *buf, char *data, int len) {
-	int free, trailing_space, remainder_len;
+	int trailing_space, remainder_len;
 
 	pthread_mutex_lock(&buf->buffer_mutex);
 	
@@ -176,23 +382,22 @@ void slimaudio_buffer_write(slimaudio_buffer_t *buf, char *data, int len) {
 		return;
 	}
 	
-	free = buf->buffer_size - buf->total_available;
-	VDEBUGF("buffer_write %p write_ptr=%p read_ptr=%p free=%i\n", buf, buf->write_ptr, buf->read_ptr, free);
+	VDEBUGF("buffer_write %p write_ptr=%p read_ptr=%p free=%i\n", buf, buf->write_ptr, buf->read_ptr,
+		buf->buffer_size - buf->total_available);
 	
 	/* Buffer full; block until we have enough space */
-	while (free < len) {
+	while (!buffer_writable(buf, len)) {
 		VDEBUGF("buffer_write waiting (need %i bytes) ..\n", len);
 
 		buf->writer_blocked = true;
 		pthread_cond_wait(&buf->read_cond, &buf->buffer_mutex);
+		buf->writer_wakeups++;
 
 		if (buf->write_stream == NULL || buf->write_stream->eof) {
 			pthread_mutex_unlock(&buf->buffer_mutex);
 			DEBUGF("buffer_write closed/flushed %p\n", buf);
 			return;
 		}
-		
-		free = buf->buffer_size - buf->total_available;
 	}
 
 	trailing_space = buf->buffer_end - buf->write_ptr;
@@ -216,6 +421,7 @@ void slimaudio_buffer_write(slimaudio_buffer_t *buf, char *data, int len) {
 	
 	buf->total_available += len;	
 	buf->write_stream->available += len;
+	buf->write_stream->written += len;
 	
 	if (buf->reader_blocked) {
 		buf->reader_blocked = false;	
@@ -235,7 +441,20 @@ slimaudio_buffer_status slimaudio_buffer_read(slimaudio_buffer_t *buf, char *dat
 
 	len = *data_len;
 	
-	while (buf->total_available == 0) {
+	for (;;) {
+		/* move on from streams that have been read to the end */
+		while ( (buf->read_stream != NULL) && (buf->read_stream->next != NULL) &&
+			(buf->read_stream->available == 0) &&
+			(buf->read_stream->eof_read || !buf->read_stream->eof) ) {
+			struct buffer_stream *next_stream = buf->read_stream->next;
+
+			if (buf->read_stream->user_data != NULL)
+				free(buf->read_stream->user_data);
+			free(buf->read_stream);
+
+			buf->read_stream = next_stream;
+		}
+
 		if (buf->read_stream == NULL)
 		{
 			DEBUGF("buffer_read: read_stream=NULL total_available=0 len=%i SLIMAUDIO_BUFFER_STREAM_END\n", len );
@@ -245,23 +464,28 @@ slimaudio_buffer_status slimaudio_buffer_read(slimaudio_buffer_t *buf, char *dat
 			return SLIMAUDIO_BUFFER_STREAM_END;			
 		}
 
-		if ( (buf->read_opt & BUFFER_NONBLOCKING) > 0)
-		{
-			DEBUGF("buffer_read: read_stream=%p, total_available=%i read_avail=%i read_count=%i len=%i eof=%i opt=%0x SLIMAUDIO_BUFFER_STREAM_CONTINUE\n",buf->read_stream,buf->total_available,buf->read_stream->available,buf->read_stream->read_count, len, buf->read_stream->eof, buf->read_opt);
+		/* The stream closed after its last data was read, report the
+		** end before the reader gets any data of the next stream.
+		*/
+		if ( (buf->read_stream->available == 0) && buf->read_stream->eof && !buf->read_stream->eof_read ) {
+			DEBUGF("buffer_read: read_stream=%p closed, SLIMAUDIO_BUFFER_STREAM_END\n", buf->read_stream);
 
+			buf->read_stream->eof_read = true;
 			*data_len = 0;
 			pthread_mutex_unlock(&buf->buffer_mutex);
-			return SLIMAUDIO_BUFFER_STREAM_CONTINUE;
+			return SLIMAUDIO_BUFFER_STREAM_END;
 		}
 
-		/* Don't block if the buffer closed, exit with EOS */
-		if ( buf->buffer_closed )
+		if (buf->total_available > 0)
+			break;
+
+		if ( (buf->read_opt & BUFFER_NONBLOCKING) > 0)
 		{
-			DEBUGF("buffer_read: buffer_closed=%d\n", buf->buffer_closed );
-			buf->buffer_closed = false;
+			DEBUGF("buffer_read: read_stream=%p, total_available=%i read_avail=%i read_count=%i len=%i eof=%i opt=%0x SLIMAUDIO_BUFFER_STREAM_CONTINUE\n",buf->read_stream,buf->total_available,buf->read_stream->available,buf->read_stream->read_count, len, buf->read_stream->eof, buf->read_opt);
 
+			*data_len = 0;
 			pthread_mutex_unlock(&buf->buffer_mutex);
-			return SLIMAUDIO_BUFFER_STREAM_END;
+			return SLIMAUDIO_BUFFER_STREAM_CONTINUE;
 		}
 
 		buf->reader_blocked = true;
@@ -279,14 +503,6 @@ slimaudio_buffer_status slimaudio_buffer_read(slimaudio_buffer_t *buf, char *dat
 		buf->writer_blocked, buf->read_stream->read_count, len, buf->read_stream->eof, buf->read_opt);
 
 
-	/* when the stream is complete, move on */
-	while (buf->read_stream->available == 0) {
-		if (buf->read_stream->user_data != NULL)
-			free(buf->read_stream->user_data);
-			
-		buf->read_stream = buf->read_stream->next;		
-	}
-
 	/* limit to buffered data */
 	len = (buf->read_stream->available < len) ? buf->read_stream->available : len;
 	assert(len > 0);
@@ -313,7 +529,7 @@ slimaudio_buffer_status slimaudio_buffer_read(slimaudio_buffer_t *buf, char *dat
 		buf->read_ptr = buf->buffer_start + remainder_len;		
 	}
 
-	if (buf->writer_blocked) {
+	if (buf->writer_blocked && buffer_refill(buf)) {
 		buf->writer_blocked = false;
 		pthread_cond_signal(&buf->read_cond);	
 	}
@@ -328,6 +544,7 @@ slimaudio_buffer_status slimaudio_buffer_read(slimaudio_buffer_t *buf, char *dat
 
 	if ( (buf->read_stream->available == 0) && buf->read_stream->eof) {
 		DEBUGF("slimaudio_buffer_read EOF\n");
+		buf->read_stream->eof_read = true;
 		status = SLIMAUDIO_BUFFER_STREAM_END;
 	}
 	
@@ -353,3 +570,18 @@ int slimaudio_buffer_available(slimaudio_buffer_t *buf)
 	return available;
 }
 
+void slimaudio_buffer_stream_stats(slimaudio_buffer_t *buf, int *written, int *available)
+{
+	pthread_mutex_lock(&buf->buffer_mutex);
+
+	if (buf->write_stream != NULL) {
+		*written = buf->write_stream->written;
+		*available = buf->write_stream->available;
+	}
+	else {
+		*written = 0;
+		*available = 0;
+	}
+
+	pthread_mutex_unlock(&buf->buffer_mutex);
+}
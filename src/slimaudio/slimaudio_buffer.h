@@ -32,7 +32,11 @@
 struct buffer_stream {
 	int available;							/* bytes available in stream */
 	int read_count;							/* number of bytes read from stream */
+	int written;							/* number of bytes written to stream */
 	bool eof;							/* true when eof */
+	bool eof_read;							/* true when eof returned to the reader */
+	unsigned int tag;						/* set by the writer, 0 if none */
+	unsigned int format;						/* as above, of the audio */
 	void *user_data;
 
 	struct buffer_stream *next;
@@ -41,7 +45,8 @@ struct buffer_stream {
 typedef struct {
 	char *buffer_start;
 	char *buffer_end;
-	int buffer_size;
+	int buffer_size;						/* capacity, up to buffer_max */
+	int buffer_max;							/* bytes allocated */
 	int total_available;
 	char *read_ptr;
 	char *write_ptr;
@@ -55,7 +60,10 @@ typedef struct {
 	pthread_cond_t read_cond;
 	bool writer_blocked;
 	bool reader_blocked;
-	bool buffer_closed;
+
+	int low_watermark;						/* blocked writer wakes below this */
+	int high_watermark;						/* writer blocks above this */
+	unsigned long writer_wakeups;
 } slimaudio_buffer_t;
 
 typedef enum { SLIMAUDIO_BUFFER_STREAM_START=0, SLIMAUDIO_BUFFER_STREAM_CONTINUE, SLIMAUDIO_BUFFER_STREAM_END, SLIMAUDIO_BUFFER_STREAM_UNDERRUN } slimaudio_buffer_status;
@@ -72,10 +80,52 @@ void slimaudio_buffer_flush(slimaudio_buffer_t *buf);
 
 void slimaudio_buffer_set_readopt(slimaudio_buffer_t *buf, int opt);
 
+/* Changes the capacity of the buffer, up to the size it was created with.
+** Buffered data is kept; a smaller buffer takes effect once the data no
+** longer wraps past the new end.
+*/
+void slimaudio_buffer_resize(slimaudio_buffer_t *buf, int size);
+
+/* Returns the capacity of the buffer. */
+int slimaudio_buffer_size(slimaudio_buffer_t *buf);
+
+/* Makes a writer that found the buffer above high wait until it drains
+** below low, so it refills in bursts instead of waking on every read.
+** Zero for both wakes the writer as soon as there is space.
+*/
+void slimaudio_buffer_set_watermarks(slimaudio_buffer_t *buf, int low, int high);
+
+/* Returns the number of times a blocked writer was woken. */
+unsigned long slimaudio_buffer_writer_wakeups(slimaudio_buffer_t *buf);
+
 void slimaudio_buffer_write(slimaudio_buffer_t *buf, char *data, int len);
 
 slimaudio_buffer_status slimaudio_buffer_read(slimaudio_buffer_t *buf, char *data, int *data_len);
 
 int slimaudio_buffer_available(slimaudio_buffer_t *buf);
 
+/* Reads and discards the rest of the stream being read, up to its end, but
+** nothing of the stream after it.  Returns the bytes discarded.
+*/
+int slimaudio_buffer_drain(slimaudio_buffer_t *buf);
+
+/* Tags the stream being written, so the reader can tell which it reads. */
+void slimaudio_buffer_set_tag(slimaudio_buffer_t *buf, unsigned int tag);
+
+/* Returns the tag of the stream the next read comes from, or 0 if there
+** is none.
+*/
+unsigned int slimaudio_buffer_read_tag(slimaudio_buffer_t *buf);
+
+/* As the tag, the format of the stream being written, for the reader to
+** play it in.
+*/
+void slimaudio_buffer_set_format(slimaudio_buffer_t *buf, unsigned int format);
+unsigned int slimaudio_buffer_read_format(slimaudio_buffer_t *buf);
+
+/* Returns the bytes written to the stream being written, and how many of
+** them are still in the buffer.  Both are 0 if no stream is open.
+*/
+void slimaudio_buffer_stream_stats(slimaudio_buffer_t *buf, int *written, int *available);
+
 #endif /*_SLIMAUDIO_BUFFER_H_ */
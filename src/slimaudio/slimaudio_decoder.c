@@ -25,15 +25,9 @@
 #include <string.h>
 #include <assert.h>
 
-#include <mad.h>
-
-#if defined(WMA_DECODER) || defined(AAC_DECODER)
-#include <libavcodec/avcodec.h>
-#include <libavformat/avformat.h>
-#endif /* WMA_DECODER || AAC_DECODER */
-
 #include "slimproto/slimproto.h"
 #include "slimaudio/slimaudio.h"
+#include "slimaudio/slimaudio_trace.h"
 
 #ifdef SLIMPROTO_DEBUG
   bool slimaudio_decoder_debug;
@@ -47,69 +41,86 @@
 #endif
 
 static void *decoder_thread(void *ptr);
+static void decoder_set_stream(slimaudio_t *audio, slimproto_msg_t *msg, u32_t track);
+
+/* Available decoders, looked up by strm mode byte.  The order is the order
+** formats are advertised to the server in.
+*/
+static const slimaudio_decoder_t *decoders[] = {
+	&slimaudio_decoder_vorbis,
+	&slimaudio_decoder_flac,
+	&slimaudio_decoder_pcm,
+	&slimaudio_decoder_mad,
+	&slimaudio_decoder_alac,
+	&slimaudio_decoder_dsd,
+#ifdef AAC_DECODER
+	&slimaudio_decoder_aac,
+#endif
+#ifdef WMA_DECODER
+	&slimaudio_decoder_wma,
+#endif
+#ifdef OPUS_DECODER
+	&slimaudio_decoder_opus,
+#endif
+	NULL
+};
 
-#if defined(WMA_DECODER) || defined(AAC_DECODER)
+const slimaudio_decoder_t *slimaudio_decoder_find(char mode) {
+	int i;
 
-bool av_lib_init = false; /* Only initialize ffmpeg library once */
+	for (i=0; decoders[i] != NULL; i++) {
+		if (decoders[i]->mode == mode)
+			return decoders[i];
+	}
 
-static void av_err_callback(void *ptr, int level, const char *fmt, va_list vargs)
-{
-	VDEBUGF(fmt, vargs);
+	return NULL;
 }
 
-void av_lib_setup (void)
-{
-	if ( !av_lib_init )
-	{
-		/* Setup error message capture */
-		av_log_set_callback(av_err_callback);
-		av_log_set_level(AV_LOG_VERBOSE);
-
-		/* Register all the codecs */
-		av_register_all();
-		DEBUGF("decoder_thread: av_register_all\n");
-
-		avcodec_init();
-		avcodec_register_all();
-		DEBUGF("decoder_thread: avcodec_register_all\n");
-
-		AVInputFormat *p = NULL;
-		p = av_iformat_next(p);
-		while (p)
-		{
-			VDEBUGF("decoder_thread: %s: %s:\n", p->name, p->long_name);
-			p = av_iformat_next(p);
-		};
+int slimaudio_decoder_formats(char *buf, int buf_len) {
+	int i, len = 0;
 
-		VDEBUGF("decoder_thread: %s\n", avformat_configuration() );
+	buf[0] = '\0';
+	for (i=0; decoders[i] != NULL; i++) {
+		len += snprintf(buf + len, buf_len - len, "%s%s", len ? "," : "", decoders[i]->formats);
+		if (len >= buf_len) {
+			len = buf_len - 1;
+			break;
+		}
+	}
+
+	return len;
+}
+
+/* Makes decoder the active decoder, initializing it on first use. */
+static int decoder_select(slimaudio_t *audio, const slimaudio_decoder_t *decoder) {
+	int i;
 
-		av_lib_init = true;
+	for (i=0; decoders[i] != decoder; i++)
+		;
+
+	if (!audio->decoder_ready[i]) {
+		DEBUGF("decoder_select: init %c (%s)\n", decoder->mode, decoder->formats);
+
+		audio->decoder_priv = NULL;
+		if (decoder->init(audio) != 0)
+			return -1;
+
+		audio->decoder_privs[i] = audio->decoder_priv;
+		audio->decoder_ready[i] = true;
 	}
+
+	audio->decoder = decoder;
+	audio->decoder_priv = audio->decoder_privs[i];
+
+	return 0;
 }
-#endif /* WMA_DECODER || AAC_DECODER */
 
 int slimaudio_decoder_open(slimaudio_t *audio) {
+	assert(sizeof(decoders) / sizeof(decoders[0]) <= SLIMAUDIO_MAX_DECODERS + 1);
+
 	pthread_mutex_init(&(audio->decoder_mutex), NULL);
 	pthread_cond_init(&(audio->decoder_cond), NULL);
-	audio->decoder_data = (char *) malloc(AUDIO_CHUNK_SIZE);
 
-	if (slimaudio_decoder_mad_init(audio) != 0)
-		return -1;		
-	if (slimaudio_decoder_flac_init(audio) != 0)
-		return -1;
-	if (slimaudio_decoder_vorbis_init(audio) != 0)
-		return -1;
-	if (slimaudio_decoder_pcm_init(audio) != 0)
-		return -1;
-#ifdef AAC_DECODER	
-	if (slimaudio_decoder_aac_init(audio) != 0)
-		return -1;
-#endif
-#ifdef WMA_DECODER	
-	if (slimaudio_decoder_wma_init(audio) != 0)
-		return -1;
-#endif
-	
 	/* 
 	 * Acquire the decoder mutex before the thread is started, to make sure
 	 * no other thread can acquire it before.  This would lead to a deadlock
@@ -132,6 +143,8 @@ int slimaudio_decoder_open(slimaudio_t *audio) {
 }
 
 int slimaudio_decoder_close(slimaudio_t *audio) {
+	int i;
+
 	pthread_mutex_lock(&audio->decoder_mutex);
 	
 	audio->decoder_state = STREAM_QUIT;
@@ -141,16 +154,19 @@ int slimaudio_decoder_close(slimaudio_t *audio) {
 	pthread_cond_broadcast(&audio->decoder_cond);
 	
 	pthread_join(audio->decoder_thread, NULL);	
-	slimaudio_decoder_mad_free(audio);
-	slimaudio_decoder_flac_free(audio);
-	slimaudio_decoder_vorbis_free(audio);
-	slimaudio_decoder_pcm_free(audio);
-#ifdef AAC_DECODER
-	slimaudio_decoder_aac_free(audio);
-#endif
-#ifdef WMA_DECODER
-	slimaudio_decoder_wma_free(audio);
-#endif
+
+	for (i=0; decoders[i] != NULL; i++) {
+		if (audio->decoder_ready[i]) {
+			audio->decoder_priv = audio->decoder_privs[i];
+			decoders[i]->free(audio);
+
+			audio->decoder_privs[i] = NULL;
+			audio->decoder_ready[i] = false;
+		}
+	}
+
+	audio->decoder = NULL;
+	audio->decoder_priv = NULL;
 	
 	pthread_mutex_destroy(&(audio->decoder_mutex));
 	pthread_cond_destroy(&(audio->decoder_cond));
@@ -159,8 +175,10 @@ int slimaudio_decoder_close(slimaudio_t *audio) {
 
 
 static void *decoder_thread(void *ptr) {
+	const slimaudio_decoder_t *decoder;
 	bool decoder_failed = false;	
 	unsigned char first_time = 1;
+	int n;
 
 	slimaudio_t *audio = (slimaudio_t *) ptr;
 #ifdef BSD_THREAD_LOCKING
@@ -204,45 +222,40 @@ static void *decoder_thread(void *ptr) {
 			case STREAM_PLAYING:
 				DEBUGF("decoder_thread: STREAM_PLAYING type %c\n", audio->decoder_mode);
 
-				switch (audio->decoder_mode) {
-				case 'm': /* mp3 */
-					slimaudio_decoder_mad_process(audio);
-					break;
-					
-				case 'f': /* flac */
-					slimaudio_decoder_flac_process(audio);
-					break;
-					
-				case 'o': /* ogg vorbis */
-					slimaudio_decoder_vorbis_process(audio);
-					break;
-
-				case 'p': /* wav */
-					slimaudio_decoder_pcm_process(audio);
-					break;
-#ifdef AAC_DECODER					
-				case 'a': /* aac */
-					if ( slimaudio_decoder_aac_process(audio) < 0 )
-					{
-						decoder_failed = true ;
-					}
-
-					break;
-#endif					
-#ifdef WMA_DECODER					
-				case 'w': /* wma */
-					if ( slimaudio_decoder_wma_process(audio) < 0 )
-					{
-						decoder_failed = true ;
-					}
-
-					break;
-#endif					
-				default:
+				decoder = slimaudio_decoder_find(audio->decoder_mode);
+				if (decoder == NULL) {
 					fprintf(stderr, "Cannot decode unknown format: %c\n", audio->decoder_mode);
-					/* decoder does not support format */
-					slimaudio_stat(audio, "STMn", (u32_t) 0);
-					break;
+					decoder_failed = true;
+				}
+				else if ( (decoder->probe != NULL) && !decoder->probe(audio) ) {
+					DEBUGF("decoder_thread: decoder %c cannot play stream\n", decoder->mode);
+					decoder_failed = true;
+				}
+				else if (decoder_select(audio, decoder) != 0) {
+					fprintf(stderr, "Cannot initialize decoder: %c\n", decoder->mode);
+					decoder_failed = true;
+				}
+				else {
+					/* decoders playing at another rate ask for it */
+					slimaudio_output_set_rate(audio, OUTPUT_RATE);
+
+					/* a stop or skip aborts the decoder too, only
+					** a stream still playing failed to decode
+					*/
+					if ( (decoder->process(audio) < 0) &&
+					     (audio->decoder_state == STREAM_PLAYING) )
+						decoder_failed = true;
+
+					if (decoder->flush != NULL)
+						decoder->flush(audio);
+
+					/* whatever the decoder left of its stream, trailing
+					** metadata or the rest of a stream it gave up on, must
+					** not reach the next stream queued behind it
+					*/
+					n = slimaudio_buffer_drain(audio->decoder_buffer);
+					if (n > 0)
+						DEBUGF("decoder_thread: drained %i bytes\n", n);
 				}
 
 				DEBUGF("decoder_thread: STREAM_PLAY (before STMd) previous state: %i\n",
@@ -259,10 +272,25 @@ static void *decoder_thread(void *ptr) {
 				DEBUGF("decoder_thread: STREAM_STOP previous state: %i\n", audio->decoder_state);
 				pthread_mutex_lock(&audio->decoder_mutex);
 				
-				audio->decoder_state = STREAM_STOPPED;
-
 				slimaudio_buffer_close(audio->output_buffer);
 
+				if ( (audio->decoder_state == STREAM_PLAYING) && audio->decoder_next_pending && !decoder_failed ) {
+					/* The next stream was queued while this one
+					** played, start on it straight away.  Its PCM
+					** follows this stream in the output buffer.
+					*/
+					DEBUGF("decoder_thread: next stream type %c\n", audio->decoder_next_msg.strm.mode);
+
+					decoder_set_stream(audio, &audio->decoder_next_msg, audio->decoder_next_trace);
+					slimaudio_buffer_open(audio->output_buffer, NULL);
+					slimaudio_buffer_set_tag(audio->output_buffer, audio->decoder_trace);
+				}
+				else {
+					audio->decoder_state = STREAM_STOPPED;
+				}
+
+				audio->decoder_next_pending = false;
+
 				pthread_mutex_unlock(&audio->decoder_mutex);
 
 				pthread_cond_broadcast(&audio->decoder_cond);
@@ -279,16 +307,47 @@ static void *decoder_thread(void *ptr) {
 }
 
 
+/* Takes the stream details from a strm 's', with the decoder mutex held. */
+static void decoder_set_stream(slimaudio_t *audio, slimproto_msg_t *msg, u32_t track) {
+	audio->decoder_trace = track;
+	audio->decoder_traced = false;
+	audio->decoder_mode = msg->strm.mode;
+	audio->decoder_endianness = msg->strm.pcm_endianness;
+	audio->decoder_sample_size = msg->strm.pcm_sample_size;
+	audio->decoder_sample_rate = msg->strm.pcm_sample_rate;
+	audio->decoder_channels = msg->strm.pcm_channels;
+}
+
 void slimaudio_decoder_connect(slimaudio_t *audio, slimproto_msg_t *msg) {
 	DEBUGF("slimaudio_decoder_connect\n");
+
+	pthread_mutex_lock(&audio->decoder_mutex);
+
+	if ( (audio->decoder_state == STREAM_PLAYING) && slimaudio_strm_next(msg) ) {
+		if ( (msg->strm.flags & STRM_FLAG_NO_RESTART) == 0 ) {
+			/* decoded when the current stream ends */
+			audio->decoder_next_msg = *msg;
+			audio->decoder_next_trace = audio->trace_track;
+			audio->decoder_next_pending = true;
+		}
+
+		DEBUGF("slimaudio_decoder_connect: next stream type %c queued:%i\n",
+			msg->strm.mode, audio->decoder_next_pending);
+
+		pthread_mutex_unlock(&audio->decoder_mutex);
+		return;
+	}
+
+	pthread_mutex_unlock(&audio->decoder_mutex);
+
 	slimaudio_decoder_disconnect(audio);
 
 	pthread_mutex_lock(&audio->decoder_mutex);
 
-	audio->decoder_mode = msg->strm.mode;
-	audio->decoder_endianness = msg->strm.pcm_endianness;
+	decoder_set_stream(audio, msg, audio->trace_track);
 
 	slimaudio_buffer_open(audio->output_buffer, NULL);
+	slimaudio_buffer_set_tag(audio->output_buffer, audio->decoder_trace);
 
 	audio->decoder_state = STREAM_PLAYING;
 
@@ -319,3 +378,14 @@ void slimaudio_decoder_disconnect(slimaudio_t *audio) {
 	pthread_mutex_unlock(&audio->decoder_mutex);
 }
 
+void slimaudio_decoder_output(slimaudio_t *audio, char *data, int len) {
+	if (!audio->decoder_traced) {
+		slimaudio_trace(TRACE_DECODED, audio->decoder_trace);
+		audio->decoder_traced = true;
+	}
+
+	audio->decoder_audio_usec += slimaudio_output_format_usec(audio->decoder_format, len);
+
+	slimaudio_buffer_write(audio->output_buffer, data, len);
+}
+
@@ -0,0 +1,836 @@
+/*
+ *   SlimProtoLib Copyright (c) 2004,2006 Richard Titmuss
+ *
+ *   This file is part of SlimProtoLib.
+ *
+ *   SlimProtoLib is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SlimProtoLib is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with SlimProtoLib; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Apple Lossless decoder.
+**
+** The MP4 container is parsed as it streams in: atoms before 'moov' are
+** skipped, 'moov' is read into memory to find the ALAC track's decoder
+** config and sample sizes, and the samples are then decoded one by one
+** as 'mdat' arrives.  Files with 'moov' after 'mdat' cannot be streamed
+** without seeking and are rejected.
+**
+** The frame decoder follows Apple's open source ALAC reference: adaptive
+** Golomb-Rice residuals, adaptive LPC and mid/side stereo.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slimproto/slimproto.h"
+#include "slimaudio/slimaudio.h"
+
+#ifdef SLIMPROTO_DEBUG
+  #define DEBUGF(...) if (slimaudio_decoder_debug) fprintf(stderr, __VA_ARGS__)
+  #define RDEBUGF(...) if (slimaudio_decoder_debug_r) fprintf(stderr, __VA_ARGS__)
+  #define VDEBUGF(...) if (slimaudio_decoder_debug_v) fprintf(stderr, __VA_ARGS__)
+#else
+  #define DEBUGF(...)
+  #define RDEBUGF(...)
+  #define VDEBUGF(...)
+#endif
+
+#define ALAC_MAX_CHANNELS	(2)
+#define ALAC_MAX_FRAME_LENGTH	(65536)		/* samples per frame */
+#define ALAC_MAX_FRAME_BYTES	(1024*1024)
+#define ALAC_MAX_MOOV_SIZE	(16*1024*1024)
+#define ALAC_MAX_LPC_ORDER	(32)
+
+/* syntactic elements of a frame */
+#define ALAC_ID_SCE	(0)	/* single channel */
+#define ALAC_ID_CPE	(1)	/* channel pair */
+#define ALAC_ID_LFE	(3)
+#define ALAC_ID_END	(7)
+
+#define unpackB2(ptr, off) ((ptr[off] << 8) | ptr[off+1])
+#define unpackB4(ptr, off) (((u32_t)ptr[off] << 24) | (ptr[off+1] << 16) | (ptr[off+2] << 8) | ptr[off+3])
+
+typedef struct {
+	/* ALACSpecificConfig */
+	u32_t frame_length;
+	u8_t bit_depth;
+	u8_t pb;			/* rice history multiplier */
+	u8_t mb;			/* rice initial history */
+	u8_t kb;			/* rice parameter limit */
+	u8_t channels;
+	u32_t max_frame_bytes;
+	u32_t sample_rate;
+
+	/* sample table of the track */
+	u32_t num_samples;
+	u32_t sample_size;		/* fixed sample size, or 0 */
+	u32_t *sample_sizes;
+	u64_t first_chunk;		/* file offset of the first sample */
+
+	u64_t stream_pos;		/* bytes of the stream consumed */
+
+	unsigned char *frame;
+	u32_t frame_alloc;
+	u32_t buffer_length;		/* samples allocated in the buffers below */
+	int32_t *predict[ALAC_MAX_CHANNELS];
+	int32_t *output[ALAC_MAX_CHANNELS];
+	u32_t *extra[ALAC_MAX_CHANNELS];
+	short *pcm;
+} alac_priv_t;
+
+typedef struct {
+	const unsigned char *buf;
+	int len;
+	int pos;			/* in bits */
+} alac_bits_t;
+
+static void alac_reset(alac_priv_t *priv) {
+	if (priv->sample_sizes != NULL)
+		free(priv->sample_sizes);
+
+	priv->sample_sizes = NULL;
+	priv->num_samples = 0;
+	priv->sample_size = 0;
+	priv->first_chunk = 0;
+	priv->frame_length = 0;
+}
+
+static void alac_free_buffers(alac_priv_t *priv) {
+	int ch;
+
+	for (ch=0; ch < ALAC_MAX_CHANNELS; ch++) {
+		free(priv->predict[ch]);
+		free(priv->output[ch]);
+		free(priv->extra[ch]);
+		priv->predict[ch] = NULL;
+		priv->output[ch] = NULL;
+		priv->extra[ch] = NULL;
+	}
+
+	free(priv->pcm);
+	priv->pcm = NULL;
+	priv->buffer_length = 0;
+}
+
+static int alac_init(slimaudio_t *audio) {
+	audio->decoder_priv = calloc(1, sizeof(alac_priv_t));
+	if (audio->decoder_priv == NULL)
+		return -1;
+
+	return 0;
+}
+
+static void alac_free(slimaudio_t *audio) {
+	alac_priv_t *priv = (alac_priv_t *) audio->decoder_priv;
+
+	if (priv == NULL)
+		return;
+
+	alac_reset(priv);
+	alac_free_buffers(priv);
+	free(priv->frame);
+	free(priv);
+
+	audio->decoder_priv = NULL;
+}
+
+/* Frame buffers are sized for the stream's frame length and kept for
+** the next stream.
+*/
+static int alac_alloc_buffers(alac_priv_t *priv) {
+	int ch;
+
+	if (priv->buffer_length >= priv->frame_length)
+		return 0;
+
+	alac_free_buffers(priv);
+
+	for (ch=0; ch < ALAC_MAX_CHANNELS; ch++) {
+		priv->predict[ch] = (int32_t *) malloc(priv->frame_length * sizeof(int32_t));
+		priv->output[ch] = (int32_t *) malloc(priv->frame_length * sizeof(int32_t));
+		priv->extra[ch] = (u32_t *) malloc(priv->frame_length * sizeof(u32_t));
+		if ( (priv->predict[ch] == NULL) || (priv->output[ch] == NULL) || (priv->extra[ch] == NULL) )
+			goto fail;
+	}
+
+	priv->pcm = (short *) malloc(priv->frame_length * 2 * sizeof(short));
+	if (priv->pcm == NULL)
+		goto fail;
+
+	priv->buffer_length = priv->frame_length;
+	return 0;
+
+fail:
+	alac_free_buffers(priv);
+	return -1;
+}
+
+/*
+ * Stream input
+ */
+
+static int alac_read(slimaudio_t *audio, alac_priv_t *priv, unsigned char *data, int len) {
+	slimaudio_buffer_status ok = SLIMAUDIO_BUFFER_STREAM_CONTINUE;
+	int n, got = 0;
+
+	while ( (got < len) && !audio->decoder_end_of_stream )
+	{
+		n = len - got;
+		ok = slimaudio_buffer_read(audio->decoder_buffer, (char*)(data + got), &n);
+		got += n;
+
+		if (ok == SLIMAUDIO_BUFFER_STREAM_END)
+			audio->decoder_end_of_stream = true;
+	}
+
+	priv->stream_pos += got;
+	return got;
+}
+
+static bool alac_skip(slimaudio_t *audio, alac_priv_t *priv, u64_t len) {
+	unsigned char scratch[512];
+	int n;
+
+	while (len > 0)
+	{
+		n = len < sizeof(scratch) ? len : sizeof(scratch);
+		if (alac_read(audio, priv, scratch, n) != n)
+			return false;
+		len -= n;
+	}
+
+	return true;
+}
+
+/*
+ * MP4 atoms
+ */
+
+/* Finds the next child atom of the given type, starting at *off within
+** buf.  Returns its body and sets *body_len, or NULL when there is none.
+*/
+static const unsigned char *alac_atom(const unsigned char *buf, u32_t len, u32_t *off,
+	const char *type, u32_t *body_len) {
+	u32_t size;
+
+	while (*off + 8 <= len) {
+		const unsigned char *atom = buf + *off;
+
+		size = unpackB4(atom, 0);
+		if ( (size < 8) || (size > len - *off) )
+			return NULL;
+
+		*off += size;
+
+		if (memcmp(atom + 4, type, 4) == 0) {
+			*body_len = size - 8;
+			return atom + 8;
+		}
+	}
+
+	return NULL;
+}
+
+/* Looks for the ALACSpecificConfig in an 'alac' sample description. */
+static bool alac_parse_stsd(alac_priv_t *priv, const unsigned char *stsd, u32_t len) {
+	const unsigned char *entry, *cfg;
+	u32_t off, entry_len, cfg_len;
+
+	/* version/flags, entry count */
+	if (len < 8)
+		return false;
+
+	off = 8;
+	entry = alac_atom(stsd, len, &off, "alac", &entry_len);
+	if (entry == NULL)
+		return false;
+
+	/* skip the AudioSampleEntry fields to the 'alac' child atom */
+	if (entry_len < 28)
+		return false;
+
+	off = 28;
+	cfg = alac_atom(entry, entry_len, &off, "alac", &cfg_len);
+	if ( (cfg == NULL) || (cfg_len < 4 + 24) )
+		return false;
+
+	cfg += 4;	/* version/flags */
+
+	priv->frame_length = unpackB4(cfg, 0);
+	priv->bit_depth = cfg[5];
+	priv->pb = cfg[6];
+	priv->mb = cfg[7];
+	priv->kb = cfg[8];
+	priv->channels = cfg[9];
+	priv->max_frame_bytes = unpackB4(cfg, 12);
+	priv->sample_rate = unpackB4(cfg, 20);
+
+	DEBUGF("alac: frame_length:%u bit_depth:%u channels:%u rate:%u pb:%u mb:%u kb:%u\n",
+		priv->frame_length, priv->bit_depth, priv->channels, priv->sample_rate,
+		priv->pb, priv->mb, priv->kb);
+
+	return true;
+}
+
+static bool alac_parse_stbl(alac_priv_t *priv, const unsigned char *stbl, u32_t len) {
+	const unsigned char *atom;
+	u32_t off, atom_len, i;
+
+	off = 0;
+	atom = alac_atom(stbl, len, &off, "stsd", &atom_len);
+	if ( (atom == NULL) || !alac_parse_stsd(priv, atom, atom_len) )
+		return false;
+
+	off = 0;
+	atom = alac_atom(stbl, len, &off, "stsz", &atom_len);
+	if ( (atom == NULL) || (atom_len < 12) )
+		return false;
+
+	priv->sample_size = unpackB4(atom, 4);
+	priv->num_samples = unpackB4(atom, 8);
+
+	if (priv->sample_size == 0) {
+		if ( (priv->num_samples > (atom_len - 12) / 4) )
+			return false;
+
+		priv->sample_sizes = (u32_t *) malloc(priv->num_samples * sizeof(u32_t));
+		if (priv->sample_sizes == NULL)
+			return false;
+
+		for (i=0; i < priv->num_samples; i++)
+			priv->sample_sizes[i] = unpackB4(atom, 12 + i * 4);
+	}
+
+	/* The samples of a single track are stored back to back, so we only
+	** need to know where the first chunk starts.
+	*/
+	off = 0;
+	atom = alac_atom(stbl, len, &off, "stco", &atom_len);
+	if ( (atom != NULL) && (atom_len >= 12) && (unpackB4(atom, 4) > 0) ) {
+		priv->first_chunk = unpackB4(atom, 8);
+	}
+	else {
+		off = 0;
+		atom = alac_atom(stbl, len, &off, "co64", &atom_len);
+		if ( (atom != NULL) && (atom_len >= 16) && (unpackB4(atom, 4) > 0) )
+			priv->first_chunk = ((u64_t) unpackB4(atom, 8) << 32) | unpackB4(atom, 12);
+	}
+
+	return true;
+}
+
+/* Walks moov/trak/mdia/minf/stbl for the first track holding ALAC. */
+static bool alac_parse_moov(alac_priv_t *priv, const unsigned char *moov, u32_t len) {
+	const unsigned char *trak, *mdia, *minf, *stbl;
+	u32_t trak_off, off, trak_len, mdia_len, minf_len, stbl_len;
+
+	trak_off = 0;
+	while ( (trak = alac_atom(moov, len, &trak_off, "trak", &trak_len)) != NULL ) {
+		off = 0;
+		if ( (mdia = alac_atom(trak, trak_len, &off, "mdia", &mdia_len)) == NULL )
+			continue;
+		off = 0;
+		if ( (minf = alac_atom(mdia, mdia_len, &off, "minf", &minf_len)) == NULL )
+			continue;
+		off = 0;
+		if ( (stbl = alac_atom(minf, minf_len, &off, "stbl", &stbl_len)) == NULL )
+			continue;
+
+		alac_reset(priv);
+		if (alac_parse_stbl(priv, stbl, stbl_len))
+			return true;
+	}
+
+	alac_reset(priv);
+	return false;
+}
+
+/*
+ * Frame decoding
+ */
+
+static u32_t alac_getbits(alac_bits_t *b, int n) {
+	u32_t v = 0;
+	int byte, bit, take;
+
+	while (n > 0) {
+		byte = b->pos >> 3;
+		bit = b->pos & 7;
+		take = 8 - bit;
+		if (take > n)
+			take = n;
+
+		if (byte < b->len)
+			v = (v << take) | ((b->buf[byte] >> (8 - bit - take)) & ((1 << take) - 1));
+		else
+			v <<= take;
+
+		b->pos += take;
+		n -= take;
+	}
+
+	return v;
+}
+
+static u32_t alac_showbits(alac_bits_t *b, int n) {
+	int pos = b->pos;
+	u32_t v = alac_getbits(b, n);
+
+	b->pos = pos;
+	return v;
+}
+
+static inline int32_t alac_sign_extend(u32_t v, int bits) {
+	int shift = 32 - bits;
+
+	return (int32_t) (v << shift) >> shift;
+}
+
+static inline int alac_sign(int v) {
+	return (v > 0) - (v < 0);
+}
+
+static inline int alac_log2(u32_t v) {
+	int n = 0;
+
+	while (v >>= 1)
+		n++;
+
+	return n;
+}
+
+static u32_t alac_scalar(alac_bits_t *b, int k, int bps) {
+	u32_t x = 0, extrabits;
+
+	/* unary prefix, at most 9 ones */
+	while ( (x < 9) && alac_getbits(b, 1) )
+		x++;
+
+	if (x > 8)
+		return alac_getbits(b, bps);	/* escaped value */
+
+	if (k != 1) {
+		extrabits = alac_showbits(b, k);
+		x = (x << k) - x;
+
+		if (extrabits > 1) {
+			x += extrabits - 1;
+			b->pos += k;
+		}
+		else {
+			b->pos += k - 1;
+		}
+	}
+
+	return x;
+}
+
+static void alac_rice(alac_priv_t *priv, alac_bits_t *b, int32_t *out, int nsamples, int bps, u32_t mult) {
+	u32_t history = priv->mb;
+	u32_t x;
+	int i, k, block_size, sign_modifier = 0;
+
+	for (i=0; i < nsamples; i++) {
+		k = alac_log2((history >> 9) + 3);
+		if (k > priv->kb)
+			k = priv->kb;
+
+		x = alac_scalar(b, k, bps) + sign_modifier;
+		sign_modifier = 0;
+		out[i] = (x >> 1) ^ -(int32_t)(x & 1);
+
+		if (x > 0xffff)
+			history = 0xffff;
+		else
+			history += x * mult - ((history * mult) >> 9);
+
+		/* runs of zeros are coded as a block length */
+		if ( (history < 128) && (i + 1 < nsamples) ) {
+			k = 7 - alac_log2(history) + ((history + 16) >> 6);
+			if (k > priv->kb)
+				k = priv->kb;
+
+			block_size = alac_scalar(b, k, 16);
+			if (block_size > 0) {
+				if (block_size >= nsamples - i)
+					block_size = nsamples - i - 1;
+
+				memset(&out[i + 1], 0, block_size * sizeof(int32_t));
+				i += block_size;
+			}
+
+			if (block_size <= 0xffff)
+				sign_modifier = 1;
+
+			history = 0;
+		}
+	}
+}
+
+static void alac_lpc(const int32_t *error, int32_t *out, int nsamples, int bps, int16_t *coefs, int order, int quant) {
+	const int32_t *pred = out;
+	int i, j, sign, error_sign, d;
+	int32_t val, error_val;
+
+	out[0] = error[0];
+	if (nsamples <= 1)
+		return;
+
+	if (order == 0) {
+		memcpy(&out[1], &error[1], (nsamples - 1) * sizeof(int32_t));
+		return;
+	}
+
+	if (order == 31) {
+		/* first order prediction */
+		for (i=1; i < nsamples; i++)
+			out[i] = alac_sign_extend(out[i - 1] + error[i], bps);
+		return;
+	}
+
+	/* warm up */
+	for (i=1; (i <= order) && (i < nsamples); i++)
+		out[i] = alac_sign_extend(out[i - 1] + error[i], bps);
+
+	for (; i < nsamples; i++) {
+		val = 0;
+		error_val = error[i];
+		d = *pred++;
+
+		for (j=0; j < order; j++)
+			val += (u32_t) (pred[j] - d) * coefs[j];
+
+		val = (val + (1 << (quant - 1))) >> quant;
+		val += d + error_val;
+		out[i] = alac_sign_extend(val, bps);
+
+		/* adapt the coefficients towards the error */
+		error_sign = alac_sign(error_val);
+		if (error_sign) {
+			for (j=0; (j < order) && (error_val * error_sign > 0); j++) {
+				val = d - pred[j];
+				sign = alac_sign(val) * error_sign;
+				coefs[j] -= sign;
+				val *= sign;
+				error_val -= (val >> quant) * (j + 1);
+			}
+		}
+	}
+}
+
+/* Decodes one SCE or CPE element into output[ch..ch+channels-1]. */
+static int alac_element(alac_priv_t *priv, alac_bits_t *b, int ch, int channels, int *nsamples) {
+	int16_t coefs[ALAC_MAX_CHANNELS][ALAC_MAX_LPC_ORDER];
+	int prediction_type[ALAC_MAX_CHANNELS];
+	int quant[ALAC_MAX_CHANNELS];
+	int mult[ALAC_MAX_CHANNELS];
+	int order[ALAC_MAX_CHANNELS];
+	int has_size, extra_bits, bps, is_compressed;
+	int shift = 0, weight = 0;
+	u32_t output_samples;
+	int c, i;
+
+	alac_getbits(b, 4);	/* element instance tag */
+	alac_getbits(b, 12);	/* unused */
+	has_size = alac_getbits(b, 1);
+	extra_bits = alac_getbits(b, 2) << 3;
+	bps = priv->bit_depth - extra_bits + channels - 1;
+	is_compressed = !alac_getbits(b, 1);
+
+	if ( (bps <= 0) || (bps > 32) )
+		return -1;
+
+	output_samples = has_size ? alac_getbits(b, 32) : priv->frame_length;
+	if ( (output_samples == 0) || (output_samples > priv->frame_length) )
+		return -1;
+
+	if (ch > 0 && output_samples != (u32_t) *nsamples)
+		return -1;
+	*nsamples = output_samples;
+
+	if (is_compressed) {
+		shift = alac_getbits(b, 8);
+		weight = alac_getbits(b, 8);
+
+		for (c=0; c < channels; c++) {
+			prediction_type[c] = alac_getbits(b, 4);
+			quant[c] = alac_getbits(b, 4);
+			mult[c] = alac_getbits(b, 3);
+			order[c] = alac_getbits(b, 5);
+
+			if (quant[c] == 0)
+				return -1;
+
+			/* stored most recent tap first */
+			for (i = order[c] - 1; i >= 0; i--)
+				coefs[c][i] = alac_sign_extend(alac_getbits(b, 16), 16);
+		}
+
+		if (extra_bits) {
+			for (i=0; i < output_samples; i++)
+				for (c=0; c < channels; c++)
+					priv->extra[ch + c][i] = alac_getbits(b, extra_bits);
+		}
+
+		for (c=0; c < channels; c++) {
+			alac_rice(priv, b, priv->predict[ch + c], output_samples, bps,
+				mult[c] * priv->pb / 4);
+
+			if (prediction_type[c] == 15) {
+				/* a first order pass applied before the real LPC */
+				alac_lpc(priv->predict[ch + c], priv->predict[ch + c], output_samples, bps, NULL, 31, 0);
+			}
+			else if (prediction_type[c] > 0) {
+				RDEBUGF("alac: unknown prediction type %d\n", prediction_type[c]);
+			}
+
+			alac_lpc(priv->predict[ch + c], priv->output[ch + c], output_samples, bps,
+				coefs[c], order[c], quant[c]);
+		}
+	}
+	else {
+		/* verbatim samples */
+		for (i=0; i < output_samples; i++)
+			for (c=0; c < channels; c++)
+				priv->output[ch + c][i] = alac_sign_extend(alac_getbits(b, priv->bit_depth), priv->bit_depth);
+
+		extra_bits = 0;
+	}
+
+	if ( (channels == 2) && weight ) {
+		int32_t *left = priv->output[ch], *right = priv->output[ch + 1];
+		int32_t l, r;
+
+		for (i=0; i < output_samples; i++) {
+			l = left[i];
+			r = right[i];
+			l -= (int32_t) ((u32_t) r * weight) >> shift;
+			r += l;
+			left[i] = r;
+			right[i] = l;
+		}
+	}
+
+	if (extra_bits) {
+		for (c=0; c < channels; c++)
+			for (i=0; i < output_samples; i++)
+				priv->output[ch + c][i] = ((u32_t) priv->output[ch + c][i] << extra_bits) | priv->extra[ch + c][i];
+	}
+
+	return 0;
+}
+
+/* Decodes a frame into pcm as 16-bit stereo, returns the sample count. */
+static int alac_decode_frame(alac_priv_t *priv, const unsigned char *data, int len) {
+	alac_bits_t b;
+	int element, channels, ch = 0, nsamples = 0;
+	int i, shift;
+	int32_t *left, *right;
+
+	b.buf = data;
+	b.len = len;
+	b.pos = 0;
+
+	while (b.pos < len * 8) {
+		element = alac_getbits(&b, 3);
+		if (element == ALAC_ID_END)
+			break;
+
+		if ( (element != ALAC_ID_SCE) && (element != ALAC_ID_CPE) && (element != ALAC_ID_LFE) )
+			return -1;
+
+		channels = (element == ALAC_ID_CPE) ? 2 : 1;
+		if (ch + channels > priv->channels || ch + channels > ALAC_MAX_CHANNELS)
+			return -1;
+
+		if (alac_element(priv, &b, ch, channels, &nsamples) < 0)
+			return -1;
+
+		ch += channels;
+	}
+
+	if (ch == 0 || b.pos > len * 8)
+		return -1;
+
+	/* the output path plays 16-bit stereo */
+	left = priv->output[0];
+	right = priv->output[ch > 1 ? 1 : 0];
+	shift = priv->bit_depth - 16;
+
+	for (i=0; i < nsamples; i++) {
+		if (shift > 0) {
+			priv->pcm[i*2] = left[i] >> shift;
+			priv->pcm[i*2+1] = right[i] >> shift;
+		}
+		else {
+			priv->pcm[i*2] = left[i] << -shift;
+			priv->pcm[i*2+1] = right[i] << -shift;
+		}
+	}
+
+	return nsamples;
+}
+
+static bool alac_playing(slimaudio_t *audio) {
+	bool playing;
+
+	pthread_mutex_lock(&audio->decoder_mutex);
+	playing = (audio->decoder_state == STREAM_PLAYING);
+	pthread_mutex_unlock(&audio->decoder_mutex);
+
+	return playing;
+}
+
+static int alac_decode_mdat(slimaudio_t *audio, alac_priv_t *priv, u64_t mdat_end) {
+	u32_t i, size;
+	int nsamples;
+
+	if ( (priv->channels == 0) || (priv->channels > ALAC_MAX_CHANNELS) ||
+		(priv->bit_depth < 16) || (priv->bit_depth > 32) ||
+		(priv->frame_length == 0) || (priv->frame_length > ALAC_MAX_FRAME_LENGTH) )
+	{
+		fprintf(stderr, "alac: unsupported stream %u channels %u bits\n", priv->channels, priv->bit_depth);
+		return -1;
+	}
+
+	if (slimaudio_output_set_rate(audio, priv->sample_rate) < 0) {
+		fprintf(stderr, "alac: cannot play %u Hz stream\n", priv->sample_rate);
+		return -1;
+	}
+
+	if (alac_alloc_buffers(priv) < 0)
+		return -1;
+
+	/* skip anything in mdat before the first sample */
+	if (priv->first_chunk > priv->stream_pos) {
+		if (!alac_skip(audio, priv, priv->first_chunk - priv->stream_pos))
+			return 0;
+	}
+
+	for (i=0; i < priv->num_samples; i++) {
+		size = priv->sample_size ? priv->sample_size : priv->sample_sizes[i];
+		if ( (size == 0) || (size > ALAC_MAX_FRAME_BYTES) )
+			return -1;
+
+		if ( (mdat_end > 0) && (priv->stream_pos + size > mdat_end) )
+			break;
+
+		if (size > priv->frame_alloc) {
+			unsigned char *frame = (unsigned char *) realloc(priv->frame, size);
+			if (frame == NULL)
+				return -1;
+
+			priv->frame = frame;
+			priv->frame_alloc = size;
+		}
+
+		if (alac_read(audio, priv, priv->frame, size) != size)
+			break;
+
+		if (!alac_playing(audio))
+			break;
+
+		nsamples = alac_decode_frame(priv, priv->frame, size);
+		if (nsamples < 0) {
+			RDEBUGF("alac: frame %u decoding error\n", i);
+			continue;
+		}
+
+		slimaudio_decoder_output(audio, (char*) priv->pcm, nsamples * 2 * sizeof(short));
+	}
+
+	return 0;
+}
+
+static int alac_process(slimaudio_t *audio) {
+	alac_priv_t *priv = (alac_priv_t *) audio->decoder_priv;
+	unsigned char header[16], *moov;
+	u64_t size, body;
+	bool have_moov = false;
+	int hdr, rc = -1;
+
+	DEBUGF("alac_process: start\n");
+
+	alac_reset(priv);
+	priv->stream_pos = 0;
+	audio->decoder_end_of_stream = false;
+
+	while (alac_read(audio, priv, header, 8) == 8)
+	{
+		hdr = 8;
+		size = unpackB4(header, 0);
+
+		if (size == 1) {
+			/* 64-bit atom size */
+			if (alac_read(audio, priv, header + 8, 8) != 8)
+				break;
+
+			size = ((u64_t) unpackB4(header, 8) << 32) | unpackB4(header, 12);
+			hdr = 16;
+		}
+
+		if ( (size != 0) && (size < hdr) )
+			break;
+
+		body = size ? size - hdr : 0;
+
+		VDEBUGF("alac: atom %4.4s size %llu\n", header + 4, size);
+
+		if (memcmp(header + 4, "mdat", 4) == 0) {
+			if (!have_moov) {
+				fprintf(stderr, "alac: moov after mdat, stream cannot be played\n");
+				break;
+			}
+
+			rc = alac_decode_mdat(audio, priv, size ? priv->stream_pos + body : 0);
+			break;
+		}
+		else if ( (memcmp(header + 4, "moov", 4) == 0) && !have_moov ) {
+			if ( (size == 0) || (body > ALAC_MAX_MOOV_SIZE) )
+				break;
+
+			moov = (unsigned char *) malloc(body);
+			if (moov == NULL)
+				break;
+
+			if (alac_read(audio, priv, moov, body) != body) {
+				free(moov);
+				break;
+			}
+
+			have_moov = alac_parse_moov(priv, moov, body);
+			free(moov);
+
+			if (!have_moov) {
+				fprintf(stderr, "alac: no ALAC track found\n");
+				break;
+			}
+		}
+		else {
+			if ( (size == 0) || !alac_skip(audio, priv, body) )
+				break;
+		}
+	}
+
+	DEBUGF("alac_process: end\n");
+
+	return rc;
+}
+
+const slimaudio_decoder_t slimaudio_decoder_alac = {
+	'l', "alc",
+	alac_init, NULL, alac_process, NULL, alac_free
+};
@@ -0,0 +1,577 @@
+/*
+ *   SlimProtoLib Copyright (c) 2004,2006 Richard Titmuss
+ *
+ *   This file is part of SlimProtoLib.
+ *
+ *   SlimProtoLib is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SlimProtoLib is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with SlimProtoLib; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* FFmpeg stream decoding shared by the AAC and WMA decoders. */
+
+#if defined(WMA_DECODER) || defined(AAC_DECODER)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include "slimproto/slimproto.h"
+#include "slimaudio/slimaudio.h"
+
+#ifdef SLIMPROTO_DEBUG
+  #define DEBUGF(...) if (slimaudio_decoder_debug) fprintf(stderr, __VA_ARGS__)
+  #define RDEBUGF(...) if (slimaudio_decoder_debug_r) fprintf(stderr, __VA_ARGS__)
+  #define VDEBUGF(...) if (slimaudio_decoder_debug_v) fprintf(stderr, __VA_ARGS__)
+#else
+  #define DEBUGF(...)
+  #define RDEBUGF(...)
+  #define VDEBUGF(...)
+#endif
+
+/* FFmpeg 3.1 added the send/receive decode API and AVCodecParameters */
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 37, 100)
+#define AV_SEND_RECEIVE
+#endif
+
+/* FFmpeg 5.0 returns const codecs and formats */
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+#define AV_CONST const
+#else
+#define AV_CONST
+#endif
+
+/* FFmpeg 5.1 replaced the channel count with AVChannelLayout */
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(59, 24, 100)
+#define AV_CHANNELS(x) ((x)->ch_layout.nb_channels)
+#else
+#define AV_CHANNELS(x) ((x)->channels)
+#endif
+
+#ifndef AVERROR_EXIT
+#define AVERROR_EXIT (-1)
+#endif
+
+#ifndef AV_INPUT_BUFFER_PADDING_SIZE
+#define AV_INPUT_BUFFER_PADDING_SIZE FF_INPUT_BUFFER_PADDING_SIZE
+#endif
+
+#define AUDIO_INBUF_SIZE (AUDIO_CHUNK_SIZE*2)
+
+typedef struct {
+#ifdef AV_SEND_RECEIVE
+	AVCodecContext *codec_ctx;	/* reused while the codec parameters match */
+	AVPacket *packet;
+	AVFrame *frame;
+	short outbuf[AUDIO_CHUNK_SIZE];	/* interleaved 16-bit stereo */
+#else
+	u8_t *outbuf;			/* AVCODEC_MAX_AUDIO_FRAME_SIZE */
+#endif
+} av_priv_t;
+
+static bool av_lib_init = false; /* Only initialize ffmpeg library once */
+
+static void av_err_callback(void *ptr, int level, const char *fmt, va_list vargs)
+{
+#ifdef SLIMPROTO_DEBUG
+	if (slimaudio_decoder_debug_v)
+		vfprintf(stderr, fmt, vargs);
+#endif
+}
+
+static void av_lib_setup(void)
+{
+	if ( av_lib_init )
+		return;
+
+	/* Setup error message capture */
+	av_log_set_callback(av_err_callback);
+	av_log_set_level(AV_LOG_VERBOSE);
+
+	/* Register all the codecs, newer FFmpeg does this itself */
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 9, 100)
+	av_register_all();
+	DEBUGF("av_lib_setup: av_register_all\n");
+#endif
+#if LIBAVCODEC_VERSION_MAJOR < 54
+	avcodec_init();
+#endif
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 10, 100)
+	avcodec_register_all();
+	DEBUGF("av_lib_setup: avcodec_register_all\n");
+#endif
+
+#ifdef SLIMPROTO_DEBUG
+	/* Walking every demuxer is only worth it when someone reads the output */
+	if (slimaudio_decoder_debug_v)
+	{
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 9, 100)
+		const AVInputFormat *p;
+		void *i = NULL;
+
+		while ( (p = av_demuxer_iterate(&i)) != NULL )
+			VDEBUGF("av_lib_setup: %s: %s:\n", p->name, p->long_name);
+#else
+		AVInputFormat *p = NULL;
+
+		while ( (p = av_iformat_next(p)) != NULL )
+			VDEBUGF("av_lib_setup: %s: %s:\n", p->name, p->long_name);
+#endif
+		VDEBUGF("av_lib_setup: %s\n", avformat_configuration() );
+	}
+#endif
+
+	av_lib_init = true;
+}
+
+int slimaudio_decoder_av_init(slimaudio_t *audio)
+{
+	av_priv_t *priv;
+
+	av_lib_setup();
+
+	priv = (av_priv_t *) calloc(1, sizeof(av_priv_t));
+	if ( priv == NULL )
+		return -1;
+
+#ifdef AV_SEND_RECEIVE
+	priv->packet = av_packet_alloc();
+	priv->frame = av_frame_alloc();
+	if ( (priv->packet == NULL) || (priv->frame == NULL) )
+	{
+		av_packet_free(&priv->packet);
+		av_frame_free(&priv->frame);
+		free(priv);
+		return -1;
+	}
+#else
+	priv->outbuf = av_malloc(AVCODEC_MAX_AUDIO_FRAME_SIZE);
+	if ( priv->outbuf == NULL )
+	{
+		free(priv);
+		return -1;
+	}
+#endif
+
+	audio->decoder_priv = priv;
+	return 0;
+}
+
+void slimaudio_decoder_av_free(slimaudio_t *audio)
+{
+	av_priv_t *priv = (av_priv_t *) audio->decoder_priv;
+
+	if ( priv == NULL )
+		return;
+
+#ifdef AV_SEND_RECEIVE
+	avcodec_free_context(&priv->codec_ctx);
+	av_packet_free(&priv->packet);
+	av_frame_free(&priv->frame);
+#else
+	av_free(priv->outbuf);
+#endif
+	free(priv);
+
+	audio->decoder_priv = NULL;
+}
+
+static int av_read_data(void *opaque, uint8_t *buffer, int buf_size)
+{
+	slimaudio_t *audio = (slimaudio_t *) opaque;
+	slimaudio_buffer_status ok;
+	int data_len;
+
+	pthread_mutex_lock(&audio->decoder_mutex);
+
+	VDEBUGF("av_read_data state=%i\n", audio->decoder_state);
+	if (audio->decoder_state != STREAM_PLAYING) {
+		pthread_mutex_unlock(&audio->decoder_mutex);
+		DEBUGF("av_read_data: STREAM_NOT_PLAYING\n");
+		return AVERROR_EXIT;
+	}
+
+	pthread_mutex_unlock(&audio->decoder_mutex);
+
+	if (audio->decoder_end_of_stream)
+		return AVERROR_EOF;
+
+	data_len = buf_size;
+	VDEBUGF("av: read ask: %d\n", data_len);
+	ok = slimaudio_buffer_read(audio->decoder_buffer, (char*) buffer, &data_len);
+	VDEBUGF("av: read actual: %d\n", data_len);
+
+	if (ok == SLIMAUDIO_BUFFER_STREAM_END) {
+		DEBUGF("av_read_data: EOS\n");
+		audio->decoder_end_of_stream = true;
+
+		if (data_len == 0)
+			return AVERROR_EOF;
+	}
+
+	return data_len;
+}
+
+/* Switches the output to the rate of the stream, before any of it is
+** written.
+*/
+static int av_set_rate(slimaudio_t *audio, int rate)
+{
+	if ( slimaudio_output_set_rate(audio, rate) < 0 )
+	{
+		fprintf(stderr, "av: cannot play %d Hz stream\n", rate);
+		return -1;
+	}
+
+	return 0;
+}
+
+#ifdef AV_SEND_RECEIVE
+
+static bool av_sample_fmt_supported(enum AVSampleFormat fmt)
+{
+	switch (fmt) {
+	case AV_SAMPLE_FMT_S16:
+	case AV_SAMPLE_FMT_S16P:
+	case AV_SAMPLE_FMT_S32:
+	case AV_SAMPLE_FMT_S32P:
+	case AV_SAMPLE_FMT_FLT:
+	case AV_SAMPLE_FMT_FLTP:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Returns sample i of channel ch as a native 16-bit sample. */
+static inline short av_sample(const AVFrame *frame, int channels, int ch, int i)
+{
+	float f;
+
+	switch (frame->format) {
+	case AV_SAMPLE_FMT_S16:
+		return ((const short *) frame->data[0])[i * channels + ch];
+	case AV_SAMPLE_FMT_S16P:
+		return ((const short *) frame->data[ch])[i];
+	case AV_SAMPLE_FMT_S32:
+		return ((const int32_t *) frame->data[0])[i * channels + ch] >> 16;
+	case AV_SAMPLE_FMT_S32P:
+		return ((const int32_t *) frame->data[ch])[i] >> 16;
+	case AV_SAMPLE_FMT_FLT:
+		f = ((const float *) frame->data[0])[i * channels + ch];
+		break;
+	case AV_SAMPLE_FMT_FLTP:
+		f = ((const float *) frame->data[ch])[i];
+		break;
+	default:
+		return 0;
+	}
+
+	if (f >= 1.0f)
+		return 32767;
+	if (f <= -1.0f)
+		return -32768;
+	return (short) (f * 32768.0f);
+}
+
+static void av_output_frame(slimaudio_t *audio, av_priv_t *priv, const AVFrame *frame)
+{
+	int channels = AV_CHANNELS(frame);
+	int right = (channels > 1) ? 1 : 0;	/* mono is duplicated */
+	int i, n = 0;
+
+	for (i=0; i < frame->nb_samples; i++) {
+		priv->outbuf[n++] = av_sample(frame, channels, 0, i);
+		priv->outbuf[n++] = av_sample(frame, channels, right, i);
+
+		if (n == AUDIO_CHUNK_SIZE) {
+			slimaudio_decoder_output(audio, (char*) priv->outbuf, n * sizeof(short));
+			n = 0;
+		}
+	}
+
+	if (n > 0)
+		slimaudio_decoder_output(audio, (char*) priv->outbuf, n * sizeof(short));
+}
+
+/* Opens a decoder for par, keeping the previous one if the parameters
+** are unchanged (the usual case for consecutive tracks of an album).
+*/
+static int av_codec_open(slimaudio_t *audio, av_priv_t *priv, const AVCodecParameters *par)
+{
+	AVCodecContext *ctx = priv->codec_ctx;
+	AV_CONST AVCodec *codec;
+
+	if ( ctx != NULL )
+	{
+		if ( (ctx->codec_id == par->codec_id) &&
+			(ctx->sample_rate == par->sample_rate) &&
+			(AV_CHANNELS(ctx) == AV_CHANNELS(par)) &&
+			(ctx->block_align == par->block_align) &&
+			(ctx->extradata_size == par->extradata_size) &&
+			( (par->extradata_size == 0) ||
+			  (memcmp(ctx->extradata, par->extradata, par->extradata_size) == 0) ) )
+		{
+			DEBUGF("av: reusing %s decoder\n", ctx->codec->name);
+			avcodec_flush_buffers(ctx);
+			return av_set_rate(audio, ctx->sample_rate);
+		}
+
+		avcodec_free_context(&priv->codec_ctx);
+	}
+
+	codec = avcodec_find_decoder(par->codec_id);
+	if ( !codec )
+	{
+		DEBUGF("av: codec not found.\n");
+		return -1;
+	}
+
+	ctx = avcodec_alloc_context3(codec);
+	if ( ctx == NULL )
+		return -1;
+
+	if ( (avcodec_parameters_to_context(ctx, par) < 0) ||
+		(avcodec_open2(ctx, codec, NULL) < 0) )
+	{
+		DEBUGF("av: could not open codec %s\n", codec->name);
+		avcodec_free_context(&ctx);
+		return -1;
+	}
+
+	if ( !av_sample_fmt_supported(ctx->sample_fmt) )
+	{
+		fprintf(stderr, "av: unsupported sample format: %s\n", av_get_sample_fmt_name(ctx->sample_fmt));
+		avcodec_free_context(&ctx);
+		return -1;
+	}
+
+	DEBUGF("av: opened %s decoder rate:%d channels:%d\n", codec->name, ctx->sample_rate, AV_CHANNELS(ctx));
+
+	priv->codec_ctx = ctx;
+	return av_set_rate(audio, ctx->sample_rate);
+}
+
+static int av_decode(slimaudio_t *audio, av_priv_t *priv, AVFormatContext *format_ctx, int stream_index)
+{
+	const AVCodecParameters *par;
+	bool eos = false;
+	int iRC;
+
+	iRC = avformat_find_stream_info(format_ctx, NULL);
+	if ( iRC < 0 )
+	{
+		DEBUGF("av: find stream info failed:%d\n", iRC);
+		return -1;
+	}
+
+	if ( (stream_index < 0) || (stream_index >= (int) format_ctx->nb_streams) )
+	{
+		DEBUGF("av: invalid stream.\n");
+		return -1;
+	}
+
+	par = format_ctx->streams[stream_index]->codecpar;
+	if ( par->codec_type != AVMEDIA_TYPE_AUDIO )
+	{
+		DEBUGF("av: stream: %d is not audio.\n", stream_index);
+		return -1;
+	}
+
+	if ( av_codec_open(audio, priv, par) < 0 )
+		return -1;
+
+	while ( ! eos )
+	{
+		iRC = av_read_frame(format_ctx, priv->packet);
+		if ( iRC < 0 )
+		{
+			DEBUGF("av: av_read_frame end: %d\n", iRC);
+
+			/* drain the frames still buffered in the decoder */
+			avcodec_send_packet(priv->codec_ctx, NULL);
+			eos = true;
+		}
+		else
+		{
+			if ( priv->packet->stream_index == stream_index )
+			{
+				iRC = avcodec_send_packet(priv->codec_ctx, priv->packet);
+				if ( iRC < 0 )
+					RDEBUGF("av: decoding error: %d\n", iRC);
+			}
+			av_packet_unref(priv->packet);
+		}
+
+		while ( avcodec_receive_frame(priv->codec_ctx, priv->frame) == 0 )
+			av_output_frame(audio, priv, priv->frame);
+	}
+
+	return 0;
+}
+
+#else /* !AV_SEND_RECEIVE */
+
+static int av_decode(slimaudio_t *audio, av_priv_t *priv, AVFormatContext *format_ctx, int stream_index)
+{
+	AVCodecContext *pCodecCtx;
+	AVCodec *pCodec;
+	AVPacket avpkt;
+	int out_size, len;
+	int iRC;
+
+	iRC = av_find_stream_info(format_ctx);
+	if ( iRC < 0 )
+	{
+		DEBUGF("av: find stream info failed:%d\n", iRC);
+		return -1;
+	}
+
+	if ( (stream_index < 0) || (stream_index >= (int) format_ctx->nb_streams) )
+	{
+		DEBUGF("av: invalid stream.\n");
+		return -1;
+	}
+
+	pCodecCtx = format_ctx->streams[stream_index]->codec;
+	if ( pCodecCtx->codec_type != AVMEDIA_TYPE_AUDIO )
+	{
+		DEBUGF("av: stream: %d is not audio.\n", stream_index);
+		return -1;
+	}
+
+	pCodec = avcodec_find_decoder(pCodecCtx->codec_id);
+	if ( !pCodec )
+	{
+		DEBUGF("av: codec not found.\n");
+		return -1;
+	}
+
+	iRC = avcodec_open(pCodecCtx, pCodec);
+	if ( iRC < 0 )
+	{
+		DEBUGF("av: could not open codec:%d\n", iRC);
+		return -1;
+	}
+
+	if ( av_set_rate(audio, pCodecCtx->sample_rate) < 0 )
+	{
+		avcodec_close(pCodecCtx);
+		return -1;
+	}
+
+	while ( av_read_frame(format_ctx, &avpkt) >= 0 )
+	{
+		if ( avpkt.stream_index == stream_index )
+		{
+			out_size = AVCODEC_MAX_AUDIO_FRAME_SIZE;
+			len = avcodec_decode_audio3(pCodecCtx, (int16_t *) priv->outbuf, &out_size, &avpkt);
+			if ( len < 0 )
+				RDEBUGF("av: decoding error: %d\n", len);
+			else if ( out_size > 0 )
+				slimaudio_decoder_output(audio, (char*) priv->outbuf, out_size);
+		}
+
+		av_free_packet(&avpkt);
+	}
+
+	DEBUGF("av: avcodec_close\n");
+	avcodec_close(pCodecCtx);
+
+	return 0;
+}
+
+#endif /* AV_SEND_RECEIVE */
+
+int slimaudio_decoder_av_process(slimaudio_t *audio, const char *format, int stream_index)
+{
+	av_priv_t *priv = (av_priv_t *) audio->decoder_priv;
+	AV_CONST AVInputFormat *input_format;
+	AVFormatContext *format_ctx = NULL;
+	AVIOContext *avio;
+	u8_t *inbuf;
+	int iRC = -1;
+
+	DEBUGF("av: play format: %s stream: %d\n", format, stream_index);
+
+	input_format = av_find_input_format(format);
+	if ( !input_format )
+	{
+		DEBUGF("av: probe failed\n");
+		return -1;
+	}
+
+	inbuf = av_malloc(AUDIO_INBUF_SIZE + AV_INPUT_BUFFER_PADDING_SIZE);
+	if ( !inbuf )
+	{
+		DEBUGF("av: inbuf alloc failed.\n");
+		return -1;
+	}
+
+	avio = avio_alloc_context(inbuf, AUDIO_INBUF_SIZE, 0, audio, av_read_data, NULL, NULL);
+	if ( avio == NULL )
+	{
+		DEBUGF("av: avio_alloc_context failed.\n");
+		av_free(inbuf);
+		return -1;
+	}
+#ifdef AV_SEND_RECEIVE
+	avio->seekable = 0;
+#else
+	avio->is_streamed = 1;
+#endif
+
+	audio->decoder_end_of_stream = false;
+
+	format_ctx = avformat_alloc_context();
+	if ( format_ctx == NULL )
+	{
+		DEBUGF("av: avformat_alloc_context failed.\n");
+		goto out;
+	}
+	format_ctx->pb = avio;
+
+	/* frees format_ctx on failure */
+	iRC = avformat_open_input(&format_ctx, "", input_format, NULL);
+	if ( iRC < 0 )
+	{
+		DEBUGF("av: input stream open failed:%d\n", iRC);
+		goto out;
+	}
+
+	iRC = av_decode(audio, priv, format_ctx, stream_index);
+
+out:
+	if ( format_ctx != NULL )
+	{
+		DEBUGF("av: close input\n");
+#ifdef AV_SEND_RECEIVE
+		avformat_close_input(&format_ctx);
+#else
+		av_close_input_stream(format_ctx);
+#endif
+	}
+
+	/* A custom AVIOContext and its (possibly reallocated) buffer belong to us */
+	av_freep(&avio->buffer);
+	av_freep(&avio);
+
+	return (iRC < 0) ? -1 : 0;
+}
+
+#endif /* WMA_DECODER || AAC_DECODER */
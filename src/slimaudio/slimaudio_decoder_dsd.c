@@ -0,0 +1,429 @@
+/*
+ *   SlimProtoLib Copyright (c) 2004,2006 Richard Titmuss
+ *
+ *   This file is part of SlimProtoLib.
+ *
+ *   SlimProtoLib is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SlimProtoLib is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with SlimProtoLib; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* DSD decoder for DSF and DSDIFF (DFF) streams.
+**
+** The 1-bit data is not converted to PCM.  It is packed into DoP (DSD over
+** PCM) frames instead: each 24-bit sample carries 16 DSD bits under a marker
+** byte alternating between 0x05 and 0xFA, which a DoP capable DAC detects
+** and plays as DSD.  DSD64 becomes 176.4kHz and DSD128 352.8kHz DoP.  The
+** samples are written as 32-bit words with the low byte clear.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slimproto/slimproto.h"
+#include "slimaudio/slimaudio.h"
+
+#ifdef SLIMPROTO_DEBUG
+  #define DEBUGF(...) if (slimaudio_decoder_debug) fprintf(stderr, __VA_ARGS__)
+  #define RDEBUGF(...) if (slimaudio_decoder_debug_r) fprintf(stderr, __VA_ARGS__)
+  #define VDEBUGF(...) if (slimaudio_decoder_debug_v) fprintf(stderr, __VA_ARGS__)
+#else
+  #define DEBUGF(...)
+  #define RDEBUGF(...)
+  #define VDEBUGF(...)
+#endif
+
+#define DSD_MARKER	(0x05)		/* alternates with its complement 0xFA */
+#define DSD_SILENCE	(0x69)		/* idle pattern used to pad odd lengths */
+#define DSD_SILENCE_LSB	(0x96)		/* the same, bit reversed */
+#define DSD_MAX_BLOCK	(8192)		/* DSF bytes per channel per block */
+#define DSD_HEADER_SCAN	(64)
+
+#define unpackL4(ptr, off) (((u32_t)ptr[off+3] << 24) | (ptr[off+2] << 16) | (ptr[off+1] << 8) | ptr[off])
+#define unpackL8(ptr, off) (((u64_t)unpackL4(ptr, off+4) << 32) | unpackL4(ptr, off))
+#define unpackB2(ptr, off) ((ptr[off] << 8) | ptr[off+1])
+#define unpackB4(ptr, off) (((u32_t)ptr[off] << 24) | (ptr[off+1] << 16) | (ptr[off+2] << 8) | ptr[off+3])
+#define unpackB8(ptr, off) (((u64_t)unpackB4(ptr, off) << 32) | unpackB4(ptr, off+4))
+
+typedef struct {
+	bool dsf;
+	u32_t channels;
+	u32_t dsd_rate;		/* bits per second per channel */
+	bool lsb_first;		/* DSF stores the oldest bit in bit 0 */
+	u32_t block_size;	/* DSF bytes per channel per block */
+	u64_t data_length;	/* bytes per channel, 0 if unknown */
+} dsd_format_t;
+
+static int dsd_init(slimaudio_t *audio) {
+	return 0;
+}
+
+static void dsd_free(slimaudio_t *audio) {
+}
+
+static bool dsd_probe(slimaudio_t *audio) {
+	if (audio->output_device_dop_rate == 0) {
+		fprintf(stderr, "dsd: output device cannot play DoP\n");
+		return false;
+	}
+
+	return true;
+}
+
+/* Reads exactly len bytes from the decoder buffer unless the stream ends
+** first.  Returns the number of bytes read.
+*/
+static int dsd_read(slimaudio_t *audio, unsigned char *data, int len, slimaudio_buffer_status *ok) {
+	int n, got = 0;
+
+	while ( (got < len) && (*ok != SLIMAUDIO_BUFFER_STREAM_END) )
+	{
+		n = len - got;
+		*ok = slimaudio_buffer_read(audio->decoder_buffer, (char*)(data + got), &n);
+		got += n;
+	}
+
+	return got;
+}
+
+static bool dsd_skip(slimaudio_t *audio, u64_t len, slimaudio_buffer_status *ok) {
+	unsigned char scratch[512];
+	int n;
+
+	while (len > 0)
+	{
+		n = len < sizeof(scratch) ? len : sizeof(scratch);
+		if (dsd_read(audio, scratch, n, ok) != n)
+			return false;
+		len -= n;
+	}
+
+	return true;
+}
+
+/* Parses the DSF chunks up to the start of the sample data. */
+static int dsd_parse_dsf(slimaudio_t *audio, dsd_format_t *fmt, slimaudio_buffer_status *ok) {
+	unsigned char chunk[DSD_HEADER_SCAN];
+	u64_t size, sample_count = 0;
+	bool have_fmt = false;
+	int len;
+
+	/* rest of the 'DSD ' chunk: file size and metadata pointer */
+	if (dsd_read(audio, chunk, 16, ok) != 16)
+		return -1;
+
+	while (dsd_read(audio, chunk, 12, ok) == 12) {
+		size = unpackL8(chunk, 4);
+		if (size < 12)
+			return -1;
+		size -= 12;
+
+		VDEBUGF("dsd: chunk %4.4s size %llu\n", chunk, size);
+
+		if (memcmp(chunk, "fmt ", 4) == 0) {
+			len = size < DSD_HEADER_SCAN ? size : DSD_HEADER_SCAN;
+			if ( (len < 40) || (dsd_read(audio, chunk, len, ok) != len) )
+				return -1;
+
+			if (unpackL4(chunk, 4) != 0) {
+				fprintf(stderr, "dsd: unsupported dsf format id %u\n", unpackL4(chunk, 4));
+				return -1;
+			}
+
+			fmt->channels = unpackL4(chunk, 12);
+			fmt->dsd_rate = unpackL4(chunk, 16);
+			fmt->lsb_first = (unpackL4(chunk, 20) == 1);
+			sample_count = unpackL8(chunk, 24);
+			fmt->block_size = unpackL4(chunk, 32);
+
+			have_fmt = true;
+			size -= len;
+		}
+		else if (memcmp(chunk, "data", 4) == 0) {
+			if (!have_fmt)
+				return -1;
+
+			/* the last block is padded, the sample count is exact */
+			fmt->data_length = (sample_count + 7) / 8;
+			return 0;
+		}
+
+		if (!dsd_skip(audio, size, ok))
+			return -1;
+	}
+
+	return -1;
+}
+
+/* Parses the DSDIFF chunks up to the start of the sample data. */
+static int dsd_parse_dff(slimaudio_t *audio, dsd_format_t *fmt, slimaudio_buffer_status *ok) {
+	unsigned char chunk[DSD_HEADER_SCAN];
+	u64_t size, sub_size, left;
+
+	/* rest of the 'FRM8' chunk header: form type */
+	if ( (dsd_read(audio, chunk, 4, ok) != 4) || (memcmp(chunk, "DSD ", 4) != 0) )
+		return -1;
+
+	while (dsd_read(audio, chunk, 12, ok) == 12) {
+		size = unpackB8(chunk, 4);
+
+		VDEBUGF("dsd: chunk %4.4s size %llu\n", chunk, size);
+
+		if (memcmp(chunk, "PROP", 4) == 0) {
+			if ( (size < 4) || (dsd_read(audio, chunk, 4, ok) != 4) || (memcmp(chunk, "SND ", 4) != 0) )
+				return -1;
+
+			left = size - 4;
+			while (left >= 12) {
+				if (dsd_read(audio, chunk, 12, ok) != 12)
+					return -1;
+
+				sub_size = unpackB8(chunk, 4);
+				left -= 12;
+				if (sub_size > left)
+					return -1;
+				left -= (sub_size + (sub_size & 1) > left) ? left : sub_size + (sub_size & 1);
+
+				if ( (memcmp(chunk, "FS  ", 4) == 0) && (sub_size >= 4) ) {
+					if (dsd_read(audio, chunk, 4, ok) != 4)
+						return -1;
+					fmt->dsd_rate = unpackB4(chunk, 0);
+					sub_size -= 4;
+				}
+				else if ( (memcmp(chunk, "CHNL", 4) == 0) && (sub_size >= 2) ) {
+					if (dsd_read(audio, chunk, 2, ok) != 2)
+						return -1;
+					fmt->channels = unpackB2(chunk, 0);
+					sub_size -= 2;
+				}
+				else if ( (memcmp(chunk, "CMPR", 4) == 0) && (sub_size >= 4) ) {
+					if (dsd_read(audio, chunk, 4, ok) != 4)
+						return -1;
+					if (memcmp(chunk, "DSD ", 4) != 0) {
+						fprintf(stderr, "dsd: unsupported dff compression %4.4s\n", chunk);
+						return -1;
+					}
+					sub_size -= 4;
+				}
+
+				if (!dsd_skip(audio, sub_size + (sub_size & 1), ok))
+					return -1;
+			}
+
+			size = left;
+		}
+		else if (memcmp(chunk, "DSD ", 4) == 0) {
+			if (fmt->channels == 0)
+				return -1;
+
+			fmt->data_length = size / fmt->channels;
+			return 0;
+		}
+		else if (memcmp(chunk, "DST ", 4) == 0) {
+			fprintf(stderr, "dsd: DST compressed dff not supported\n");
+			return -1;
+		}
+
+		/* chunks are padded to an even length */
+		if (!dsd_skip(audio, size + (size & 1), ok))
+			return -1;
+	}
+
+	return -1;
+}
+
+static int dsd_parse_header(slimaudio_t *audio, dsd_format_t *fmt, slimaudio_buffer_status *ok) {
+	unsigned char chunk[12];
+
+	memset(fmt, 0, sizeof(dsd_format_t));
+
+	if (dsd_read(audio, chunk, 12, ok) != 12)
+		return -1;
+
+	if (memcmp(chunk, "DSD ", 4) == 0) {
+		fmt->dsf = true;
+		return dsd_parse_dsf(audio, fmt, ok);
+	}
+
+	if (memcmp(chunk, "FRM8", 4) == 0) {
+		fmt->dsf = false;
+		fmt->lsb_first = false;
+		return dsd_parse_dff(audio, fmt, ok);
+	}
+
+	fprintf(stderr, "dsd: stream is not dsf or dff\n");
+	return -1;
+}
+
+/* DoP sends the oldest DSD bit first, in the most significant bit. */
+static inline u32_t dsd_byte(unsigned char b, bool reverse) {
+	if (reverse) {
+		b = ((b & 0xf0) >> 4) | ((b & 0x0f) << 4);
+		b = ((b & 0xcc) >> 2) | ((b & 0x33) << 2);
+		b = ((b & 0xaa) >> 1) | ((b & 0x55) << 1);
+	}
+
+	return b;
+}
+
+/* Packs nbytes DSD bytes of each channel into nbytes/2 stereo DoP frames.
+** left and right step through their channel by stride, which is 1 for the
+** planar DSF blocks and the channel count for interleaved DFF data.  Two
+** frames are built per pass so that the marker stays constant within the
+** loop body, leaving plain shifts and ors the compiler can vectorize.
+*/
+static void dsd_pack_dop(const unsigned char *left, const unsigned char *right, int stride,
+	int nbytes, bool reverse, u32_t *out, unsigned char *marker)
+{
+	const u32_t m0 = (u32_t) *marker << 24;
+	const u32_t m1 = (u32_t) (*marker ^ 0xff) << 24;
+	const int frames = nbytes / 2;
+	int i;
+
+	for (i=0; i + 1 < frames; i += 2) {
+		const int j = 2 * i * stride;
+
+		out[2*i]     = m0 | (dsd_byte(left[j], reverse) << 16) | (dsd_byte(left[j + stride], reverse) << 8);
+		out[2*i + 1] = m0 | (dsd_byte(right[j], reverse) << 16) | (dsd_byte(right[j + stride], reverse) << 8);
+		out[2*i + 2] = m1 | (dsd_byte(left[j + 2*stride], reverse) << 16) | (dsd_byte(left[j + 3*stride], reverse) << 8);
+		out[2*i + 3] = m1 | (dsd_byte(right[j + 2*stride], reverse) << 16) | (dsd_byte(right[j + 3*stride], reverse) << 8);
+	}
+
+	if (i < frames) {
+		const int j = 2 * i * stride;
+
+		out[2*i]     = m0 | (dsd_byte(left[j], reverse) << 16) | (dsd_byte(left[j + stride], reverse) << 8);
+		out[2*i + 1] = m0 | (dsd_byte(right[j], reverse) << 16) | (dsd_byte(right[j + stride], reverse) << 8);
+
+		*marker ^= 0xff;
+	}
+}
+
+/* DSF data comes in blocks of block_size bytes for each channel in turn. */
+static void dsd_play_dsf(slimaudio_t *audio, dsd_format_t *fmt, slimaudio_buffer_status *ok) {
+	unsigned char data[DSD_MAX_BLOCK * 2];
+	u32_t out[DSD_MAX_BLOCK];
+	unsigned char marker = DSD_MARKER;
+	u64_t left = fmt->data_length;
+	int group = fmt->block_size * fmt->channels;
+	int n;
+	u32_t ch;
+
+	while (left > 0) {
+		if (dsd_read(audio, data, group, ok) != group)
+			break;
+
+		/* last block is padded */
+		n = (left < fmt->block_size) ? left : fmt->block_size;
+		left -= n;
+
+		if (n & 1) {
+			for (ch=0; ch < fmt->channels; ch++)
+				data[ch * fmt->block_size + n] = fmt->lsb_first ? DSD_SILENCE_LSB : DSD_SILENCE;
+			n++;
+		}
+
+		dsd_pack_dop(data, data + (fmt->channels - 1) * fmt->block_size, 1,
+			n, fmt->lsb_first, out, &marker);
+
+		slimaudio_decoder_output(audio, (char *) out, (n / 2) * 2 * sizeof(u32_t));
+	}
+}
+
+/* DFF data interleaves one byte of each channel in turn. */
+static void dsd_play_dff(slimaudio_t *audio, dsd_format_t *fmt, slimaudio_buffer_status *ok) {
+	unsigned char data[AUDIO_CHUNK_SIZE];
+	u32_t out[AUDIO_CHUNK_SIZE];
+	unsigned char marker = DSD_MARKER;
+	u64_t left = fmt->data_length * fmt->channels;
+	int frame = 2 * fmt->channels;
+	int len, n;
+
+	while ( (left > 0) || (fmt->data_length == 0) ) {
+		len = AUDIO_CHUNK_SIZE - (AUDIO_CHUNK_SIZE % frame);
+		if ( (fmt->data_length > 0) && (len > left) )
+			len = left;
+
+		n = dsd_read(audio, data, len, ok);
+		left -= (fmt->data_length > 0) ? n : 0;
+
+		/* pad a partial frame at the end of the stream */
+		n -= n % fmt->channels;
+		if (n % frame) {
+			memset(data + n, DSD_SILENCE, fmt->channels);
+			n += fmt->channels;
+		}
+
+		if (n > 0) {
+			dsd_pack_dop(data, data + fmt->channels - 1, fmt->channels,
+				n / fmt->channels, false, out, &marker);
+
+			slimaudio_decoder_output(audio, (char *) out, n / fmt->channels * sizeof(u32_t));
+		}
+
+		if ( (n < len) || (*ok == SLIMAUDIO_BUFFER_STREAM_END) )
+			break;
+	}
+}
+
+static int dsd_process(slimaudio_t *audio) {
+	slimaudio_buffer_status ok = SLIMAUDIO_BUFFER_STREAM_CONTINUE;
+	dsd_format_t fmt;
+	int rc = -1;
+
+	DEBUGF("slimaudio_decoder_dsd_process: start\n");
+
+	if (dsd_parse_header(audio, &fmt, &ok) < 0) {
+		fprintf(stderr, "dsd: cannot parse stream header\n");
+		goto done;
+	}
+
+	DEBUGF("dsd: %s rate:%u channels:%u lsb_first:%i block_size:%u data_length:%llu\n",
+		fmt.dsf ? "dsf" : "dff", fmt.dsd_rate, fmt.channels, fmt.lsb_first,
+		fmt.block_size, fmt.data_length);
+
+	if ( (fmt.channels < 1) || (fmt.channels > 2) ) {
+		fprintf(stderr, "dsd: unsupported channel count %u\n", fmt.channels);
+		goto done;
+	}
+
+	if ( fmt.dsf && ((fmt.block_size == 0) || (fmt.block_size > DSD_MAX_BLOCK)) ) {
+		fprintf(stderr, "dsd: unsupported dsf block size %u\n", fmt.block_size);
+		goto done;
+	}
+
+	/* 16 DSD bits per DoP sample */
+	if ( (fmt.dsd_rate % 44100) || (slimaudio_output_set_dop(audio, fmt.dsd_rate / 16) < 0) ) {
+		fprintf(stderr, "dsd: cannot play DSD rate %u as DoP\n", fmt.dsd_rate);
+		goto done;
+	}
+
+	if (fmt.dsf)
+		dsd_play_dsf(audio, &fmt, &ok);
+	else
+		dsd_play_dff(audio, &fmt, &ok);
+
+	rc = 0;
+
+done:
+	DEBUGF("slimaudio_decoder_dsd_process: end\n");
+
+	return rc;
+}
+
+const slimaudio_decoder_t slimaudio_decoder_dsd = {
+	'd', "dsf,dff",
+	dsd_init, dsd_probe, dsd_process, NULL, dsd_free
+};
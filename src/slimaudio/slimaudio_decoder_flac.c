@@ -43,122 +43,327 @@
 static FLAC__StreamDecoderReadStatus flac_read_callback(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *bytes, void *client_data);
 static FLAC__StreamDecoderWriteStatus flac_write_callback(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data);
 static void flac_metadata_callback(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data);
+static void flac_set_rate(slimaudio_t *audio, unsigned int rate);
 static void flac_error_callback(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data);
 
-int slimaudio_decoder_flac_init(slimaudio_t *audio) {
+typedef struct flac_priv flac_priv_t;
+
+#ifdef FLAC_PARALLEL
+/* Parallel frame decoding.
+**
+** Until the output buffer reaches the output threshold, the compressed
+** stream is cut into batches of whole frames at frame sync codes, and the
+** batches are decoded by a pool of worker threads, each with its own
+** libFLAC decoder primed with the stream's STREAMINFO.  The PCM is written
+** to the output buffer in stream order.  Above the threshold decoding
+** carries on serially, which is cheaper.
+*/
+
+#define FLAC_WORKERS		(4)
+#define FLAC_BATCH_SIZE		(64*1024)	/* compressed bytes per batch */
+#define FLAC_HEADER_SIZE	(4 + 4 + FLAC__STREAM_METADATA_STREAMINFO_LENGTH)
+#define FLAC_FRAME_HEADER_MAX	(16)
+
+typedef struct {
+	FLAC__byte *data;			/* stream header and whole frames */
+	int data_len;
+	int data_pos;
+	char *pcm;				/* decoded 16-bit stereo */
+	int pcm_len;
+	int pcm_size;
+	bool done;
+} flac_job_t;
+
+typedef struct {
+	flac_priv_t *priv;
+	pthread_t thread;
+	FLAC__StreamDecoder *decoder;
+} flac_worker_t;
+
+typedef struct {
+	bool variable;				/* variable blocksize stream */
+	u64_t number;				/* frame or sample number */
+	int sample_rate_code;
+	int sample_size_code;
+} flac_frame_t;
+
+static void *flac_worker_thread(void *ptr);
+static int flac_process_parallel(slimaudio_t *audio);
+#endif /* FLAC_PARALLEL */
+
+struct flac_priv {
+	FLAC__StreamDecoder *decoder;
+
+	/* read by the decoder before the decoder buffer */
+	FLAC__byte *pending;
+	int pending_len;
+	int pending_pos;
+
+#ifdef FLAC_PARALLEL
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	bool quit;
+
+	flac_worker_t workers[FLAC_WORKERS];
+	flac_job_t jobs[FLAC_WORKERS];
+	int num_jobs;
+	int next_job;
+
+	FLAC__byte header[FLAC_HEADER_SIZE];	/* fLaC and STREAMINFO */
+	FLAC__byte *in;				/* frames read from the stream */
+	int in_len;
+#endif
+};
+
+/* Sets up decoder to read through read_callback and write through
+** write_callback, whichever libFLAC API we were built with.
+*/
+static bool flac_decoder_init(FLAC__StreamDecoder *decoder,
+	FLAC__StreamDecoderReadCallback read_callback,
+	FLAC__StreamDecoderWriteCallback write_callback,
+	FLAC__StreamDecoderMetadataCallback metadata_callback,
+	void *client_data)
+{
+#if !defined(FLAC_API_VERSION_CURRENT) || FLAC_API_VERSION_CURRENT < 8
+	FLAC__StreamDecoderState s;
+
+	FLAC__stream_decoder_set_client_data(decoder, client_data);
+ 	FLAC__stream_decoder_set_read_callback(decoder, read_callback);
+	FLAC__stream_decoder_set_write_callback(decoder, write_callback);
+	FLAC__stream_decoder_set_metadata_callback(decoder, metadata_callback);
+	FLAC__stream_decoder_set_error_callback(decoder, flac_error_callback);
+	s = FLAC__stream_decoder_init(decoder);
+#else
+	FLAC__StreamDecoderInitStatus s;
+
+	s = FLAC__stream_decoder_init_stream(decoder, read_callback, NULL, NULL, NULL, NULL, write_callback, metadata_callback, flac_error_callback, client_data);
+#endif
+	if (s != FLAC__STREAM_DECODER_SEARCH_FOR_METADATA) {
+		DEBUGF("slimaudio_decoder_flac: init failed %i\n", s);
+
+		FLAC__stream_decoder_finish(decoder);
+		return false;
+	}
+
+	return true;
+}
+
+static int flac_init(slimaudio_t *audio) {
+	flac_priv_t *priv;
+#ifdef FLAC_PARALLEL
+	int i;
+#endif
+
 	assert(audio != NULL);
 
-	audio->flac_decoder = FLAC__stream_decoder_new();
-	if (audio->flac_decoder == NULL)
+	priv = (flac_priv_t *) malloc(sizeof(flac_priv_t));
+	if (priv == NULL)
 		return -1;
-	
+
+	memset(priv, 0, sizeof(flac_priv_t));
+
+	priv->decoder = FLAC__stream_decoder_new();
+	if (priv->decoder == NULL) {
+		free(priv);
+		return -1;
+	}
+
+#ifdef FLAC_PARALLEL
+	priv->in = (FLAC__byte *) malloc(FLAC_WORKERS * FLAC_BATCH_SIZE);
+	if (priv->in == NULL)
+		fprintf(stderr, "Error allocating flac input, decoding serially\n");
+
+	pthread_mutex_init(&priv->mutex, NULL);
+	pthread_cond_init(&priv->work_cond, NULL);
+	pthread_cond_init(&priv->done_cond, NULL);
+
+	for (i=0; i<FLAC_WORKERS; i++) {
+		flac_worker_t *worker = &priv->workers[i];
+
+		worker->priv = priv;
+		worker->decoder = FLAC__stream_decoder_new();
+
+		if ( (worker->decoder == NULL) ||
+		     (pthread_create(&worker->thread, NULL, flac_worker_thread, (void *) worker) != 0) ) {
+			fprintf(stderr, "Error creating flac worker thread\n");
+
+			if (worker->decoder != NULL)
+				FLAC__stream_decoder_delete(worker->decoder);
+			worker->decoder = NULL;
+		}
+	}
+#endif
+
+	audio->decoder_priv = priv;
+
 	return 0;
 }
 
-void slimaudio_decoder_flac_free(slimaudio_t *audio) {
+static void flac_free(slimaudio_t *audio) {
+	flac_priv_t *priv = (flac_priv_t *) audio->decoder_priv;
+#ifdef FLAC_PARALLEL
+	int i;
+#endif
+
 	assert(audio != NULL);
-	
-	if (audio->flac_decoder != NULL) {
-		FLAC__stream_decoder_delete(audio->flac_decoder);
-		audio->flac_decoder = NULL;
-	}		
-}
 
-int slimaudio_decoder_flac_process(slimaudio_t *audio) {
-#if !defined(FLAC_API_VERSION_CURRENT) || FLAC_API_VERSION_CURRENT < 8
-	FLAC__StreamDecoderState s;
-#else
-	FLAC__StreamDecoderInitStatus s;
+	if (priv == NULL)
+		return;
+
+#ifdef FLAC_PARALLEL
+	pthread_mutex_lock(&priv->mutex);
+	priv->quit = true;
+	pthread_cond_broadcast(&priv->work_cond);
+	pthread_mutex_unlock(&priv->mutex);
+
+	for (i=0; i<FLAC_WORKERS; i++) {
+		if (priv->workers[i].decoder != NULL) {
+			pthread_join(priv->workers[i].thread, NULL);
+			FLAC__stream_decoder_delete(priv->workers[i].decoder);
+		}
+	}
+
+	for (i=0; i<FLAC_WORKERS; i++) {
+		free(priv->jobs[i].data);
+		free(priv->jobs[i].pcm);
+	}
+
+	pthread_mutex_destroy(&priv->mutex);
+	pthread_cond_destroy(&priv->work_cond);
+	pthread_cond_destroy(&priv->done_cond);
+
+	free(priv->in);
 #endif
+
+	FLAC__stream_decoder_delete(priv->decoder);
+	free(priv->pending);
+	free(priv);
+
+	audio->decoder_priv = NULL;
+}
+
+static int flac_process(slimaudio_t *audio) {
+	flac_priv_t *priv = (flac_priv_t *) audio->decoder_priv;
 	FLAC__bool b;
-	
+
 	assert(audio != NULL);
 
 	DEBUGF("slimaudio_decoder_flac_process: start\n");
 
-#if !defined(FLAC_API_VERSION_CURRENT) || FLAC_API_VERSION_CURRENT < 8
-	FLAC__stream_decoder_set_client_data(audio->flac_decoder, audio);
- 	FLAC__stream_decoder_set_read_callback(audio->flac_decoder, flac_read_callback);
-	FLAC__stream_decoder_set_write_callback(audio->flac_decoder, flac_write_callback);
-	FLAC__stream_decoder_set_metadata_callback(audio->flac_decoder, flac_metadata_callback);
-	FLAC__stream_decoder_set_error_callback(audio->flac_decoder, flac_error_callback);
-	s = FLAC__stream_decoder_init(audio->flac_decoder);
-#else
-	s = FLAC__stream_decoder_init_stream(audio->flac_decoder, flac_read_callback, NULL, NULL, NULL, NULL, flac_write_callback, flac_metadata_callback, flac_error_callback, audio);
-#endif
-	if (s != FLAC__STREAM_DECODER_SEARCH_FOR_METADATA) {
-		DEBUGF("slimaudio_decoder_flac_process: init failed %i\n", s);
+	audio->decoder_end_of_stream = false;
 
-		FLAC__stream_decoder_finish(audio->flac_decoder);
-		return -1;
+	free(priv->pending);
+	priv->pending = NULL;
+	priv->pending_len = priv->pending_pos = 0;
+
+#ifdef FLAC_PARALLEL
+	/* the whole stream may have been decoded in parallel */
+	if (flac_process_parallel(audio) > 0) {
+		DEBUGF("slimaudio_decoder_flac_process: end\n");
+		return 0;
 	}
+#endif
 
-	audio->decoder_end_of_stream = false;
+	if (!flac_decoder_init(priv->decoder, flac_read_callback, flac_write_callback, flac_metadata_callback, audio))
+		return -1;
 
-	b = FLAC__stream_decoder_process_until_end_of_stream(audio->flac_decoder);
-	FLAC__stream_decoder_finish(audio->flac_decoder);
+	b = FLAC__stream_decoder_process_until_end_of_stream(priv->decoder);
+	FLAC__stream_decoder_finish(priv->decoder);
 
 	DEBUGF("slimaudio_decoder_flac_process: end\n");
-	
+
 	return (b == true ? 0 : -1);
 }
 
-static FLAC__StreamDecoderReadStatus flac_read_callback(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *bytes, void *client_data) {
-	int data_len;
+const slimaudio_decoder_t slimaudio_decoder_flac = {
+	'f', "flc",
+	flac_init, NULL, flac_process, NULL, flac_free
+};
+
+/* Reads up to len bytes of the stream being decoded, waiting for data.
+** Returns 0 at the end of the stream, -1 if the stream stopped.
+*/
+static int flac_read(slimaudio_t *audio, FLAC__byte *buffer, int len) {
 	slimaudio_buffer_status ok;
-	
-	slimaudio_t *audio = (slimaudio_t *) client_data;
-	
+	int data_len;
+
 	pthread_mutex_lock(&audio->decoder_mutex);
-	
-	VDEBUGF("flac_read_callback state=%i\n", audio->decoder_state);
+
+	VDEBUGF("flac_read state=%i\n", audio->decoder_state);
 	if (audio->decoder_state != STREAM_PLAYING) {
 		pthread_mutex_unlock(&audio->decoder_mutex);
 		DEBUGF("slimaudio_decoder_flac_process: STREAM_NOT_PLAYING\n");
-				
-		*bytes = 0;
-		return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+		return -1;
 	}
-	
+
 	pthread_mutex_unlock(&audio->decoder_mutex);
-	
+
 	if (audio->decoder_end_of_stream) {
-		*bytes = 0;
 		DEBUGF("slimaudio_decoder_flac_process: done\n");
-		return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;		
+		return 0;
 	}
-	
-	data_len = *bytes;
+
+	data_len = len;
 	ok = slimaudio_buffer_read(audio->decoder_buffer, (char*) buffer, &data_len);
 	if (ok == SLIMAUDIO_BUFFER_STREAM_END) {
 		DEBUGF("slimaudio_decoder_flac_process: EOS\n");
 		audio->decoder_end_of_stream = true;
 	}
 
-	*bytes = data_len;
-	return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+	return data_len;
 }
 
-static FLAC__StreamDecoderWriteStatus flac_write_callback(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data) {
+static FLAC__StreamDecoderReadStatus flac_read_callback(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *bytes, void *client_data) {
 	slimaudio_t *audio = (slimaudio_t *) client_data;
+	flac_priv_t *priv = (flac_priv_t *) audio->decoder_priv;
+	int n;
+
+	/* data read ahead of the decoder comes first */
+	if (priv->pending_pos < priv->pending_len) {
+		n = priv->pending_len - priv->pending_pos;
+		if (n > (int) *bytes)
+			n = *bytes;
+
+		memcpy(buffer, priv->pending + priv->pending_pos, n);
+		priv->pending_pos += n;
+
+		*bytes = n;
+		return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+	}
+
+	n = flac_read(audio, buffer, *bytes);
+	if (n < 0) {
+		*bytes = 0;
+		return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+	}
+
+	if ( (n == 0) && audio->decoder_end_of_stream ) {
+		*bytes = 0;
+		return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+	}
+
+	*bytes = n;
+	return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+/* Converts a decoded frame to 16-bit stereo, returns the bytes written. */
+static int flac_pack(const FLAC__Frame *frame, const FLAC__int32 * const buffer[], char *ptr) {
 	int i;
-	
+
 	int nsamples = frame->header.blocksize;
 	int nchannels = frame->header.channels;
 	int bits_per_sample = frame->header.bits_per_sample;
-	
-	char * buf = (char *) malloc(nsamples * 2 * 2);
-	char * ptr = buf;
 
 #ifdef __BIG_ENDIAN__
 	for (i=0; i<nsamples; i++) {
 		FLAC__int32 sample;
 
 		/* left */
-	    sample = buffer[0][i] >> (bits_per_sample - 16);	    
+	    sample = buffer[0][i] >> (bits_per_sample - 16);
 	    *ptr++ = (sample >> 8) & 0xff;
 	    *ptr++ = (sample >> 0) & 0xff;
-	    
+
 	    /* right */
 	    if (nchannels == 2) {
 	    	sample = buffer[1][i] >> (bits_per_sample - 16);
@@ -183,18 +388,38 @@ static FLAC__StreamDecoderWriteStatus flac_write_callback(const FLAC__StreamDeco
             *ptr++ = (sample >> 8) & 0xff;
         }
 #endif
-	slimaudio_buffer_write(audio->output_buffer, buf, nsamples * 2 * 2);
+
+	return nsamples * 2 * 2;
+}
+
+static FLAC__StreamDecoderWriteStatus flac_write_callback(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data) {
+	slimaudio_t *audio = (slimaudio_t *) client_data;
+	int len;
+
+	char * buf = (char *) malloc(frame->header.blocksize * 2 * 2);
+
+	len = flac_pack(frame, buffer, buf);
+	slimaudio_decoder_output(audio, buf, len);
 
 	free(buf);
-	
+
 	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 }
 
+static void flac_set_rate(slimaudio_t *audio, unsigned int rate) {
+	if (slimaudio_output_set_rate(audio, rate) < 0)
+		fprintf(stderr, "flac: %u Hz stream played at %u Hz\n", rate, OUTPUT_RATE);
+}
+
 static void flac_metadata_callback(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data) {
+	slimaudio_t *audio = (slimaudio_t *) client_data;
+
 	if (metadata->type == FLAC__METADATA_TYPE_STREAMINFO) {
 		DEBUGF("flac channels:        %i\n", metadata->data.stream_info.channels);
 		DEBUGF("flac sample_rate:     %i\n", metadata->data.stream_info.sample_rate);
 		DEBUGF("flac bits_per_sample: %i\n", metadata->data.stream_info.bits_per_sample);
+
+		flac_set_rate(audio, metadata->data.stream_info.sample_rate);
 	}
 }
 
@@ -203,4 +428,410 @@ static void flac_error_callback(const FLAC__StreamDecoder *decoder, FLAC__Stream
 	;;
 }
 
+#ifdef FLAC_PARALLEL
+
+static FLAC__StreamDecoderReadStatus flac_job_read_callback(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *bytes, void *client_data) {
+	flac_job_t *job = (flac_job_t *) client_data;
+	int n = job->data_len - job->data_pos;
+
+	if (n == 0) {
+		*bytes = 0;
+		return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+	}
+
+	if (n > (int) *bytes)
+		n = *bytes;
+
+	memcpy(buffer, job->data + job->data_pos, n);
+	job->data_pos += n;
+
+	*bytes = n;
+	return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+static FLAC__StreamDecoderWriteStatus flac_job_write_callback(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data) {
+	flac_job_t *job = (flac_job_t *) client_data;
+	int len = frame->header.blocksize * 2 * 2;
+
+	if (job->pcm_len + len > job->pcm_size) {
+		char *pcm = (char *) realloc(job->pcm, (job->pcm_len + len) * 2);
+		if (pcm == NULL)
+			return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+
+		job->pcm = pcm;
+		job->pcm_size = (job->pcm_len + len) * 2;
+	}
+
+	job->pcm_len += flac_pack(frame, buffer, job->pcm + job->pcm_len);
+
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void flac_job_metadata_callback(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data) {
+}
+
+static void *flac_worker_thread(void *ptr) {
+	flac_worker_t *worker = (flac_worker_t *) ptr;
+	flac_priv_t *priv = worker->priv;
+	flac_job_t *job;
+
+	pthread_mutex_lock(&priv->mutex);
+
+	while (!priv->quit) {
+		if (priv->next_job == priv->num_jobs) {
+			pthread_cond_wait(&priv->work_cond, &priv->mutex);
+			continue;
+		}
+
+		job = &priv->jobs[priv->next_job++];
+
+		pthread_mutex_unlock(&priv->mutex);
+
+		if (flac_decoder_init(worker->decoder, flac_job_read_callback, flac_job_write_callback, flac_job_metadata_callback, job)) {
+			FLAC__stream_decoder_process_until_end_of_stream(worker->decoder);
+			FLAC__stream_decoder_finish(worker->decoder);
+		}
+
+		pthread_mutex_lock(&priv->mutex);
+
+		job->done = true;
+		pthread_cond_broadcast(&priv->done_cond);
+	}
+
+	pthread_mutex_unlock(&priv->mutex);
+
+	return 0;
+}
+
+/* CRC-8 of a frame header, polynomial x^8 + x^2 + x + 1. */
+static FLAC__byte flac_crc8(const FLAC__byte *data, int len) {
+	FLAC__byte crc = 0;
+	int i;
+
+	while (len--) {
+		crc ^= *data++;
+		for (i=0; i<8; i++)
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+	}
+
+	return crc;
+}
+
+/* Parses the frame header at ptr, returns false if there is none. */
+static bool flac_frame_header(const FLAC__byte *ptr, int len, flac_frame_t *frame) {
+	int blocksize_code, sample_rate_code, channels, sample_size_code;
+	int i, n, pos;
+	u64_t number;
+
+	if ( (len < FLAC_FRAME_HEADER_MAX) || (ptr[0] != 0xff) || ((ptr[1] & 0xfe) != 0xf8) )
+		return false;
+
+	blocksize_code = ptr[2] >> 4;
+	sample_rate_code = ptr[2] & 0x0f;
+	channels = ptr[3] >> 4;
+	sample_size_code = (ptr[3] >> 1) & 0x07;
+
+	if ( (blocksize_code == 0) || (sample_rate_code == 0x0f) || (channels > 10) ||
+	     (sample_size_code == 3) || (sample_size_code == 7) || (ptr[3] & 0x01) )
+		return false;
+
+	/* UTF-8 coded frame or sample number */
+	if (ptr[4] < 0x80) {
+		number = ptr[4];
+		n = 0;
+	}
+	else {
+		for (n=1; (n < 7) && (ptr[4] & (0x40 >> (n - 1))); n++)
+			;
+		if ( (n == 1) || (n == 7 && (ptr[4] & 0x01)) )
+			return false;
+
+		n--;
+		number = ptr[4] & (0x3f >> n);
+		for (i=1; i<=n; i++) {
+			if ((ptr[4 + i] & 0xc0) != 0x80)
+				return false;
+			number = (number << 6) | (ptr[4 + i] & 0x3f);
+		}
+	}
+	pos = 5 + n;
+
+	if (blocksize_code == 6)
+		pos += 1;
+	else if (blocksize_code == 7)
+		pos += 2;
+
+	if (sample_rate_code == 12)
+		pos += 1;
+	else if ( (sample_rate_code == 13) || (sample_rate_code == 14) )
+		pos += 2;
+
+	if (flac_crc8(ptr, pos) != ptr[pos])
+		return false;
+
+	frame->variable = ptr[1] & 0x01;
+	frame->number = number;
+	frame->sample_rate_code = sample_rate_code;
+	frame->sample_size_code = sample_size_code;
+
+	return true;
+}
+
+/* True if there is a frame at ptr that follows prev in the stream.  A
+** false sync code in the frame data is unlikely to pass the CRC and match
+** the stream and its numbering as well.
+*/
+static bool flac_next_frame(const FLAC__byte *ptr, int len, const flac_frame_t *prev, flac_frame_t *frame) {
+	return (ptr[0] == 0xff) &&
+		flac_frame_header(ptr, len, frame) &&
+		(frame->variable == prev->variable) &&
+		(frame->sample_rate_code == prev->sample_rate_code) &&
+		(frame->sample_size_code == prev->sample_size_code) &&
+		(frame->number > prev->number);
+}
+
+/* Finds the first frame after prev starting at from, and makes it prev.
+** Returns -1 if there is none.
+*/
+static int flac_find_frame(const FLAC__byte *buf, int from, int len, flac_frame_t *prev) {
+	flac_frame_t frame;
+	int i;
+
+	for (i=from; i <= len - FLAC_FRAME_HEADER_MAX; i++) {
+		if (flac_next_frame(buf + i, len - i, prev, &frame)) {
+			*prev = frame;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Finds the last frame after first, it may not be complete. */
+static int flac_last_frame(const FLAC__byte *buf, int len, const flac_frame_t *first) {
+	flac_frame_t frame;
+	int i;
+
+	for (i=len - FLAC_FRAME_HEADER_MAX; i > 0; i--) {
+		if (flac_next_frame(buf + i, len - i, first, &frame))
+			return i;
+	}
+
+	return -1;
+}
+
+/* Reads exactly len bytes, appending them to the pending data so the
+** serial decoder sees them if we give up.  Returns false if the stream
+** ended or stopped first.
+*/
+static bool flac_read_pending(slimaudio_t *audio, int len) {
+	flac_priv_t *priv = (flac_priv_t *) audio->decoder_priv;
+	FLAC__byte *pending;
+	int n;
+
+	pending = (FLAC__byte *) realloc(priv->pending, priv->pending_len + len);
+	if (pending == NULL)
+		return false;
+	priv->pending = pending;
+
+	while (len > 0) {
+		n = flac_read(audio, priv->pending + priv->pending_len, len);
+		if (n <= 0)
+			return false;
+
+		priv->pending_len += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/* Reads the stream header, keeping STREAMINFO for the workers.  Returns
+** false if this is not a native FLAC stream with STREAMINFO.
+*/
+static bool flac_read_header(slimaudio_t *audio) {
+	flac_priv_t *priv = (flac_priv_t *) audio->decoder_priv;
+	FLAC__byte *block;
+	bool last, streaminfo = false;
+	int type, len;
+
+	if ( !flac_read_pending(audio, 4) || (memcmp(priv->pending, "fLaC", 4) != 0) )
+		return false;
+
+	do {
+		if (!flac_read_pending(audio, 4))
+			return false;
+
+		block = priv->pending + priv->pending_len - 4;
+		last = (block[0] & 0x80) != 0;
+		type = block[0] & 0x7f;
+		len = (block[1] << 16) | (block[2] << 8) | block[3];
+
+		if (!flac_read_pending(audio, len))
+			return false;
+
+		if ( (type == FLAC__METADATA_TYPE_STREAMINFO) && (len == FLAC__STREAM_METADATA_STREAMINFO_LENGTH) ) {
+			memcpy(priv->header, "fLaC", 4);
+			priv->header[4] = 0x80 | FLAC__METADATA_TYPE_STREAMINFO;
+			priv->header[5] = 0;
+			priv->header[6] = 0;
+			priv->header[7] = FLAC__STREAM_METADATA_STREAMINFO_LENGTH;
+			memcpy(priv->header + 8, priv->pending + priv->pending_len - len, len);
+
+			/* 20 bits after the block and frame sizes */
+			flac_set_rate(audio, (priv->header[8 + 10] << 12) |
+				(priv->header[8 + 11] << 4) | (priv->header[8 + 12] >> 4));
+
+			/* batches stop short of the total and have no MD5 */
+			priv->header[8 + 13] &= 0xf0;
+			memset(priv->header + 8 + 14, 0, 4 + 16);
+
+			streaminfo = true;
+		}
+	} while (!last);
+
+	return streaminfo;
+}
+
+/* Decodes batches in parallel until the output buffer reaches the output
+** threshold.  Returns 1 if that decoded the whole stream, otherwise the
+** serial decoder carries on from priv->pending.
+*/
+static int flac_process_parallel(slimaudio_t *audio) {
+	flac_priv_t *priv = (flac_priv_t *) audio->decoder_priv;
+	flac_frame_t first, prev;
+	int bounds[FLAC_WORKERS + 1];
+	int i, n, end, batches, decoded;
+	bool eos = false;
+
+	if ( (priv->in == NULL) || (priv->workers[0].decoder == NULL) )
+		return 0;
+
+	if (slimaudio_output_msec(audio, slimaudio_buffer_available(audio->output_buffer)) >= audio->output_threshold_msec)
+		return 0;
+
+	if (!flac_read_header(audio)) {
+		DEBUGF("slimaudio_decoder_flac: no STREAMINFO, decoding serially\n");
+		return 0;
+	}
+
+	priv->in_len = 0;
+	decoded = 0;
+
+	while (slimaudio_output_msec(audio, slimaudio_buffer_available(audio->output_buffer)) < audio->output_threshold_msec) {
+		/* fill the input */
+		n = 0;
+		while ( !eos && (priv->in_len < FLAC_WORKERS * FLAC_BATCH_SIZE) ) {
+			n = flac_read(audio, priv->in + priv->in_len, FLAC_WORKERS * FLAC_BATCH_SIZE - priv->in_len);
+			if (n < 0)
+				break;
+			if (n == 0 && audio->decoder_end_of_stream)
+				eos = true;
+			priv->in_len += n;
+		}
+
+		if ( (n < 0) || !flac_frame_header(priv->in, priv->in_len, &first) )
+			break;
+
+		/* whole frames end where the last frame starts, unless the
+		** stream has ended.
+		*/
+		end = eos ? priv->in_len : flac_last_frame(priv->in, priv->in_len, &first);
+		if (end <= 0)
+			break;
+
+		/* cut into batches at frame boundaries */
+		bounds[0] = 0;
+		prev = first;
+		for (batches=1; batches < FLAC_WORKERS; batches++) {
+			int from = (end / FLAC_WORKERS) * batches;
+
+			if (from <= bounds[batches - 1])
+				from = bounds[batches - 1] + 1;
+
+			bounds[batches] = flac_find_frame(priv->in, from, end, &prev);
+			if (bounds[batches] < 0)
+				break;
+		}
+		bounds[batches] = end;
+
+		pthread_mutex_lock(&priv->mutex);
+
+		for (i=0; i<batches; i++) {
+			flac_job_t *job = &priv->jobs[i];
+			int len = bounds[i + 1] - bounds[i];
+
+			free(job->data);
+			job->data = (FLAC__byte *) malloc(FLAC_HEADER_SIZE + len);
+			if (job->data == NULL)
+				break;
+
+			memcpy(job->data, priv->header, FLAC_HEADER_SIZE);
+			memcpy(job->data + FLAC_HEADER_SIZE, priv->in + bounds[i], len);
+			job->data_len = FLAC_HEADER_SIZE + len;
+			job->data_pos = 0;
+			job->pcm_len = 0;
+			job->done = false;
+		}
+
+		if (i < batches) {
+			/* nothing was handed out, the serial decoder takes it all */
+			pthread_mutex_unlock(&priv->mutex);
+			fprintf(stderr, "Error allocating flac batch, decoding serially\n");
+			break;
+		}
+
+		priv->num_jobs = batches;
+		priv->next_job = 0;
+		pthread_cond_broadcast(&priv->work_cond);
+
+		/* write out in stream order */
+		for (i=0; i<batches; i++) {
+			while (!priv->jobs[i].done)
+				pthread_cond_wait(&priv->done_cond, &priv->mutex);
+
+			pthread_mutex_unlock(&priv->mutex);
+
+			if (priv->jobs[i].pcm_len > 0)
+				slimaudio_decoder_output(audio, priv->jobs[i].pcm, priv->jobs[i].pcm_len);
+
+			pthread_mutex_lock(&priv->mutex);
+		}
+
+		priv->num_jobs = priv->next_job = 0;
+
+		pthread_mutex_unlock(&priv->mutex);
+
+		decoded += batches;
+
+		/* keep the partial frame at the end */
+		priv->in_len -= bounds[batches];
+		memmove(priv->in, priv->in + bounds[batches], priv->in_len);
+
+		if ( eos && (priv->in_len == 0) ) {
+			DEBUGF("slimaudio_decoder_flac: stream decoded in parallel, %i batches\n", decoded);
+			return 1;
+		}
+	}
+
+	DEBUGF("slimaudio_decoder_flac: %i batches decoded in parallel, output %i\n",
+		decoded, slimaudio_buffer_available(audio->output_buffer));
+
+	/* the serial decoder carries on from the next frame */
+	free(priv->pending);
+	priv->pending = (FLAC__byte *) malloc(FLAC_HEADER_SIZE + priv->in_len);
+	priv->pending_len = 0;
+	priv->pending_pos = 0;
+	if (priv->pending == NULL) {
+		fprintf(stderr, "Error allocating flac input, %i bytes lost\n", priv->in_len);
+		return 0;
+	}
+
+	memcpy(priv->pending, priv->header, FLAC_HEADER_SIZE);
+	memcpy(priv->pending + FLAC_HEADER_SIZE, priv->in, priv->in_len);
+	priv->pending_len = FLAC_HEADER_SIZE + priv->in_len;
+
+	return 0;
+}
 
+#endif /* FLAC_PARALLEL */
@@ -38,7 +38,13 @@
   #define VDEBUGF(...)
 #endif
 
+/* libmad's synthesis filter delays the output by this many samples */
+#define MAD_DECODER_DELAY	(529)
+
+#define unpackB4(ptr, off) (((u32_t)ptr[off] << 24) | (ptr[off+1] << 16) | (ptr[off+2] << 8) | ptr[off+3])
+
 static enum mad_flow mad_input(void *data, struct mad_stream *stream);
+static enum mad_flow mad_filter(void *data, struct mad_stream const *stream, struct mad_frame *frame);
 static enum mad_flow mad_output(void *data, struct mad_header const *header, struct mad_pcm *pcm);
 static enum mad_flow mad_error(void *data, struct mad_stream *stream,struct mad_frame *frame);
 
@@ -53,9 +59,20 @@ struct audio_dither {
   mad_fixed_t random;
 };
 
-static struct audio_dither left_dither, right_dither;
+typedef struct {
+	struct mad_decoder decoder;
+	char *data;				/* input buffer, AUDIO_CHUNK_SIZE */
+	struct audio_dither left_dither, right_dither;
+	struct audio_stats stats;
+
+	/* gapless playback, from the Xing/Info and LAME headers */
+	bool first_frame;
+	u32_t skip;				/* samples still to drop at the start */
+	u64_t samples_left;			/* samples still to play, if known */
+	bool trim_end;
 
-static struct audio_stats stats;
+	bool rate_set;				/* output switched to the stream rate */
+} mad_priv_t;
 
 # if defined(_MSC_VER) || defined(__SUNPRO_C)
 extern  /* needed to satisfy bizarre MSVC++ interaction with inline */
@@ -65,32 +82,73 @@ inline signed long audio_linear_dither(unsigned int bits, mad_fixed_t sample,
 				struct audio_stats *stats);
 
 
-int slimaudio_decoder_mad_init(slimaudio_t *audio) {
+static int mad_init(slimaudio_t *audio) {
+	mad_priv_t *priv;
+
+	priv = (mad_priv_t *) calloc(1, sizeof(mad_priv_t));
+	if (priv == NULL)
+		return -1;
+
+	priv->data = (char *) malloc(AUDIO_CHUNK_SIZE);
+	if (priv->data == NULL) {
+		free(priv);
+		return -1;
+	}
+
+	audio->decoder_priv = priv;
 	return 0;
 }
 
-void slimaudio_decoder_mad_free(slimaudio_t *audio) {
+static void mad_free(slimaudio_t *audio) {
+	mad_priv_t *priv = (mad_priv_t *) audio->decoder_priv;
+
+	if (priv == NULL)
+		return;
+
+	free(priv->data);
+	free(priv);
+	audio->decoder_priv = NULL;
 }
 
-int slimaudio_decoder_mad_process(slimaudio_t *audio) {
+static void mad_flush(slimaudio_t *audio) {
+	mad_priv_t *priv = (mad_priv_t *) audio->decoder_priv;
+
+	/* start the next stream with fresh dither and clipping stats */
+	memset(&priv->left_dither, 0, sizeof(priv->left_dither));
+	memset(&priv->right_dither, 0, sizeof(priv->right_dither));
+	memset(&priv->stats, 0, sizeof(priv->stats));
+}
+
+static int mad_process(slimaudio_t *audio) {
+	mad_priv_t *priv = (mad_priv_t *) audio->decoder_priv;
 	int retcode = 0, result;
 
-	/* configure input, output, and error functions */
-    mad_decoder_init(&audio->mad_decoder, audio,
-		mad_input, 0 /* header */, 0 /* filter */, mad_output,
+	priv->first_frame = true;
+	priv->skip = 0;
+	priv->samples_left = 0;
+	priv->trim_end = false;
+	priv->rate_set = false;
+
+	/* configure input, filter, output, and error functions */
+	mad_decoder_init(&priv->decoder, audio,
+		mad_input, 0 /* header */, mad_filter, mad_output,
 		mad_error, 0 /* message */);
 
 	/* start decoding */
 	audio->decoder_end_of_stream = false;
-	result = mad_decoder_run(&audio->mad_decoder, MAD_DECODER_MODE_SYNC);
+	result = mad_decoder_run(&priv->decoder, MAD_DECODER_MODE_SYNC);
 	if (result != 0)
 		retcode = -1;
 
 	/* release the decoder */
-	mad_decoder_finish(&audio->mad_decoder);	
+	mad_decoder_finish(&priv->decoder);	
 	return (retcode);
 }
 
+const slimaudio_decoder_t slimaudio_decoder_mad = {
+	'm', "mp3",
+	mad_init, NULL, mad_process, mad_flush, mad_free
+};
 
 
 /*
@@ -106,6 +164,7 @@ enum mad_flow mad_input(void *data,
 		    struct mad_stream *stream)
 {
 	slimaudio_t *audio = (slimaudio_t *) data;
+	mad_priv_t *priv = (mad_priv_t *) audio->decoder_priv;
 	int remainder, data_len;
 	slimaudio_buffer_status ok;
 
@@ -129,23 +188,118 @@ enum mad_flow mad_input(void *data,
 	/* keep partial frame from last decode ... */
 	remainder = stream->bufend - stream->next_frame;
 
-	memcpy (audio->decoder_data, stream->this_frame, remainder);
+	memcpy (priv->data, stream->this_frame, remainder);
 	
 	data_len = AUDIO_CHUNK_SIZE-MAD_BUFFER_GUARD-remainder;
 	VDEBUGF("mad: data_len:%i remainder:%i available:%i\n", data_len, remainder, slimaudio_buffer_available(audio->decoder_buffer));
-	ok = slimaudio_buffer_read(audio->decoder_buffer, audio->decoder_data + remainder, &data_len);
+	ok = slimaudio_buffer_read(audio->decoder_buffer, priv->data + remainder, &data_len);
 	if (ok == SLIMAUDIO_BUFFER_STREAM_END) {
 		DEBUGF("mad: SLIMAUDIO_BUFFER_STREAM_END\n");
-		memset(audio->decoder_data + remainder + data_len, 0, MAD_BUFFER_GUARD);
+		/* libmad needs the guard bytes to decode the last frame */
+		memset(priv->data + remainder + data_len, 0, MAD_BUFFER_GUARD);
+		data_len += MAD_BUFFER_GUARD;
 		audio->decoder_end_of_stream = true;
 	}
 
-	mad_stream_buffer(stream, (const unsigned char *)audio->decoder_data, data_len + remainder);
+	mad_stream_buffer(stream, (const unsigned char *)priv->data, data_len + remainder);
 
 	VDEBUGF("mad: mad_input: CONTINUE\n");
 	return MAD_FLOW_CONTINUE;
 }
 
+/* Looks for a Xing or Info header in the first frame of the stream, and
+** for the encoder delay and padding in a LAME header following it.
+** Returns true if the frame is such an info frame, which carries no audio.
+*/
+static bool mad_parse_xing(mad_priv_t *priv, struct mad_stream const *stream,
+	struct mad_header const *header)
+{
+	const unsigned char *ptr = stream->this_frame;
+	const unsigned char *end = stream->next_frame;
+	const unsigned char *tag;
+	bool lsf = (header->flags & MAD_FLAG_LSF_EXT) != 0;
+	bool mono = (header->mode == MAD_MODE_SINGLE_CHANNEL);
+	u32_t frames = 0, delay, padding, samples_per_frame;
+	int flags;
+
+	if (header->layer != MAD_LAYER_III)
+		return false;
+
+	/* the Xing header follows the side information, and the CRC if any */
+	ptr += 4 + (lsf ? (mono ? 9 : 17) : (mono ? 17 : 32));
+	if (header->flags & MAD_FLAG_PROTECTION)
+		ptr += 2;
+
+	if ( (end - ptr < 8) || ((memcmp(ptr, "Xing", 4) != 0) && (memcmp(ptr, "Info", 4) != 0)) )
+		return false;
+
+	tag = ptr;
+	flags = ptr[7];
+	ptr += 8;
+
+	if (flags & 0x01) {
+		if (end - ptr < 4)
+			return true;
+		frames = unpackB4(ptr, 0);
+		ptr += 4;
+	}
+	if (flags & 0x02)
+		ptr += 4;		/* bytes */
+	if (flags & 0x04)
+		ptr += 100;		/* seek table */
+	if (flags & 0x08)
+		ptr += 4;		/* quality */
+
+	DEBUGF("mad: %4.4s header frames:%u\n", tag, frames);
+
+	/* encoder version string, then 12 bytes up to the delay and padding */
+	if ( (end - ptr < 24) ||
+	     ((memcmp(ptr, "LAME", 4) != 0) && (memcmp(ptr, "Lavf", 4) != 0) && (memcmp(ptr, "Lavc", 4) != 0)) )
+		return true;
+
+	delay = (ptr[21] << 4) | (ptr[22] >> 4);
+	padding = ((ptr[22] & 0x0f) << 8) | ptr[23];
+
+	/* the decoder delay shifts the audio, the last few padding
+	** samples never come out of libmad.
+	*/
+	priv->skip = delay + MAD_DECODER_DELAY;
+
+	samples_per_frame = 32 * MAD_NSBSAMPLES(header);
+	if ( (frames > 0) && ((u64_t) frames * samples_per_frame > delay + padding) ) {
+		priv->samples_left = (u64_t) frames * samples_per_frame - delay - padding;
+		priv->trim_end = true;
+	}
+
+	DEBUGF("mad: %4.4s delay:%u padding:%u skip:%u samples:%llu\n",
+		ptr, delay, padding, priv->skip, priv->samples_left);
+
+	return true;
+}
+
+/*
+ * Called after each frame is decoded, before it is synthesized.  The
+ * first frame may be a Xing/Info frame which is silence, so it is dropped.
+ */
+
+static
+enum mad_flow mad_filter(void *data,
+		     struct mad_stream const *stream,
+		     struct mad_frame *frame)
+{
+	slimaudio_t *audio = (slimaudio_t *) data;
+	mad_priv_t *priv = (mad_priv_t *) audio->decoder_priv;
+
+	if (priv->first_frame) {
+		priv->first_frame = false;
+
+		if (mad_parse_xing(priv, stream, &frame->header))
+			return MAD_FLOW_IGNORE;
+	}
+
+	return MAD_FLOW_CONTINUE;
+}
+
 /*
  * The following utility routine performs simple rounding, clipping, and
  * scaling of MAD's high-resolution samples down to 16 bits. It does not
@@ -188,6 +342,7 @@ enum mad_flow mad_output(void *data,
 	enum mad_flow retcode;
 
 	slimaudio_t *audio = (slimaudio_t *) data;
+	mad_priv_t *priv = (mad_priv_t *) audio->decoder_priv;
 	retcode = MAD_FLOW_CONTINUE;
 
 	/* pcm->samplerate contains the sampling frequency */
@@ -199,6 +354,32 @@ enum mad_flow mad_output(void *data,
 	VDEBUGF("decode_output state=%i nfrequency=%i nchannels=%i nsamples=%i\n",
 			audio->decoder_state, pcm->samplerate, nchannels, nsamples);
 
+	/* before any audio of the stream is written */
+	if (!priv->rate_set) {
+		if (slimaudio_output_set_rate(audio, pcm->samplerate) < 0)
+			fprintf(stderr, "mad: %u Hz stream played at %u Hz\n", pcm->samplerate, OUTPUT_RATE);
+		priv->rate_set = true;
+	}
+
+	/* drop the encoder and decoder delay */
+	if (priv->skip > 0) {
+		i = (priv->skip < nsamples) ? priv->skip : nsamples;
+		priv->skip -= i;
+		nsamples -= i;
+		left_ch += i;
+		right_ch += i;
+	}
+
+	/* and the encoder padding */
+	if (priv->trim_end) {
+		if (nsamples > priv->samples_left)
+			nsamples = priv->samples_left;
+		priv->samples_left -= nsamples;
+	}
+
+	if (nsamples == 0)
+		return retcode;
+
 	buf = (char *) malloc(nsamples * 2 * 2 ); /* always stereo output */
 	ptr = buf;
 
@@ -208,13 +389,13 @@ enum mad_flow mad_output(void *data,
 		signed int sample;
 
 		/* left */
-		sample = audio_linear_dither(16, *left_ch++, &left_dither, &stats);
+		sample = audio_linear_dither(16, *left_ch++, &priv->left_dither, &priv->stats);
 		*ptr++ = (sample >> 8) & 0xff;
 		*ptr++ = (sample >> 0) & 0xff;
     
 		/* right */
 		if (nchannels == 2) {
-			sample = audio_linear_dither(16, *right_ch++, &right_dither, &stats);
+			sample = audio_linear_dither(16, *right_ch++, &priv->right_dither, &priv->stats);
 		}
 		*ptr++ = (sample >> 8) & 0xff;
 		*ptr++ = (sample >> 0) & 0xff;
@@ -225,19 +406,19 @@ enum mad_flow mad_output(void *data,
 		signed int sample;
 
 		/* left */
-		sample = audio_linear_dither(16, *left_ch++, &left_dither, &stats);
+		sample = audio_linear_dither(16, *left_ch++, &priv->left_dither, &priv->stats);
 		*ptr++ = (sample >> 0) & 0xff;
 		*ptr++ = (sample >> 8) & 0xff;
 
 		/* right */
 		if (nchannels == 2) {
-			sample = audio_linear_dither(16, *right_ch++, &right_dither, &stats);
+			sample = audio_linear_dither(16, *right_ch++, &priv->right_dither, &priv->stats);
 		}
 		*ptr++ = (sample >> 0) & 0xff;
 		*ptr++ = (sample >> 8) & 0xff;
 	}
 #endif
-	slimaudio_buffer_write(audio->output_buffer, buf, nsamples * 2 * 2);
+	slimaudio_decoder_output(audio, buf, nsamples * 2 * 2);
 
 	if ( buf != NULL )
 		free(buf);
@@ -0,0 +1,165 @@
+/*
+ *   SlimProtoLib Copyright (c) 2004,2006 Richard Titmuss
+ *
+ *   This file is part of SlimProtoLib.
+ *
+ *   SlimProtoLib is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SlimProtoLib is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with SlimProtoLib; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Ogg Opus decoder using libopusfile.
+**
+** Opus always decodes at 48kHz, so the output stream is switched to
+** 48kHz for the track instead of resampling.
+*/
+
+#ifdef OPUS_DECODER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <opusfile.h>
+
+#include "slimproto/slimproto.h"
+#include "slimaudio/slimaudio.h"
+
+#ifdef SLIMPROTO_DEBUG
+  #define DEBUGF(...) if (slimaudio_decoder_debug) fprintf(stderr, __VA_ARGS__)
+  #define RDEBUGF(...) if (slimaudio_decoder_debug_r) fprintf(stderr, __VA_ARGS__)
+  #define VDEBUGF(...) if (slimaudio_decoder_debug_v) fprintf(stderr, __VA_ARGS__)
+#else
+  #define DEBUGF(...)
+  #define RDEBUGF(...)
+  #define VDEBUGF(...)
+#endif
+
+#define OPUS_RATE	(48000)
+
+static int opus_read_func(void *datasource, unsigned char *ptr, int nbytes);
+
+static const OpusFileCallbacks opus_callbacks = {
+	opus_read_func,
+	NULL,		/* stream is not seekable */
+	NULL,
+	NULL
+};
+
+static int opus_init(slimaudio_t *audio) {
+	return 0;
+}
+
+static void opus_free(slimaudio_t *audio) {
+}
+
+static bool opus_probe(slimaudio_t *audio) {
+	if ( (audio->output_device_max_rate > 0) && (audio->output_device_max_rate < OPUS_RATE) ) {
+		fprintf(stderr, "opus: output device cannot play %u Hz\n", OPUS_RATE);
+		return false;
+	}
+
+	return true;
+}
+
+static int opus_process(slimaudio_t *audio) {
+	OggOpusFile *opus_file;
+	int err;
+	int samples;
+	bool opus_continue = true;
+	opus_int16 buffer[AUDIO_CHUNK_SIZE / sizeof(opus_int16)];
+
+	assert(audio != NULL);
+
+	DEBUGF("slimaudio_decoder_opus_process: start\n");
+
+	audio->decoder_end_of_stream = false;
+
+	if (slimaudio_output_set_rate(audio, OPUS_RATE) < 0)
+		return -1;
+
+	opus_file = op_open_callbacks(audio, &opus_callbacks, NULL, 0, &err);
+	if (opus_file == NULL)
+	{
+		DEBUGF("libopusfile: op_open_callbacks failed (%i)\n", err);
+		return -1;
+	}
+
+	do {
+		/* downmixes to stereo, native endian 48kHz */
+		samples = op_read_stereo(opus_file, buffer, sizeof(buffer) / sizeof(opus_int16));
+
+		switch (samples) {
+
+		case OP_HOLE: /* Recoverable error in stream */
+			RDEBUGF("libopusfile: decoding error OP_HOLE (%i)\n", samples);
+			break;
+
+		case 0: /* End of file */
+			opus_continue = false;
+			break;
+
+		default:
+			if (samples < 0) {
+				DEBUGF("libopusfile: decoding error (%i)\n", samples);
+				opus_continue = false;
+				break;
+			}
+
+			slimaudio_decoder_output(audio, (char *) buffer,
+				samples * 2 * sizeof(opus_int16));
+		}
+
+	} while ( opus_continue );
+
+	op_free(opus_file);
+
+	DEBUGF("slimaudio_decoder_opus_process: end\n");
+
+	return 0;
+}
+
+const slimaudio_decoder_t slimaudio_decoder_opus = {
+	'u', "ops",
+	opus_init, opus_probe, opus_process, NULL, opus_free
+};
+
+
+static int opus_read_func(void *datasource, unsigned char *ptr, int nbytes) {
+	slimaudio_t *audio = (slimaudio_t *) datasource;
+	int data_len;
+	slimaudio_buffer_status ok;
+	pthread_mutex_lock(&audio->decoder_mutex);
+
+	if (audio->decoder_state != STREAM_PLAYING) {
+		pthread_mutex_unlock(&audio->decoder_mutex);
+		return 0;
+	}
+
+	pthread_mutex_unlock(&audio->decoder_mutex);
+
+	if (audio->decoder_end_of_stream)
+		return 0;
+
+	data_len = nbytes;
+	ok = slimaudio_buffer_read(audio->decoder_buffer, (char *) ptr, &data_len);
+	if (ok == SLIMAUDIO_BUFFER_STREAM_END) {
+		audio->decoder_end_of_stream = true;
+	}
+
+	return data_len;
+}
+
+#endif /* OPUS_DECODER */
@@ -37,86 +37,314 @@
   #define VDEBUGF(...)
 #endif
 
-int slimaudio_decoder_pcm_init(slimaudio_t *audio) {
+#define PCM_HEADER_SCAN	(64)	/* largest fmt/COMM chunk body we look at */
+
+typedef struct {
+	u32_t sample_rate;	/* Hz */
+	int channels;
+	int sample_size;	/* bits per sample */
+	bool big_endian;
+	bool is_unsigned;	/* 8-bit WAV data is unsigned */
+	u32_t data_length;	/* bytes of audio in the stream, 0 if unknown */
+} pcm_format_t;
+
+#define unpackL2(ptr, off) ((ptr[off+1] << 8) | ptr[off])
+#define unpackL4(ptr, off) (((u32_t)ptr[off+3] << 24) | (ptr[off+2] << 16) | (ptr[off+1] << 8) | ptr[off])
+#define unpackB2(ptr, off) ((ptr[off] << 8) | ptr[off+1])
+#define unpackB4(ptr, off) (((u32_t)ptr[off] << 24) | (ptr[off+1] << 16) | (ptr[off+2] << 8) | ptr[off+3])
+
+static int pcm_init(slimaudio_t *audio) {
 	return 0;
 }
 
-void slimaudio_decoder_pcm_free(slimaudio_t *audio) {
+static void pcm_free(slimaudio_t *audio) {
 }
 
-int slimaudio_decoder_pcm_process(slimaudio_t *audio) {
-	unsigned char data[AUDIO_CHUNK_SIZE];
-	int buffer[AUDIO_CHUNK_SIZE/2];
-	int i;
-	
-	int data_len = 0;
-	unsigned char *ptr = data;
-	slimaudio_buffer_status ok = SLIMAUDIO_BUFFER_STREAM_START;
+/* Reads exactly len bytes from the decoder buffer unless the stream ends
+** first.  Returns the number of bytes read.
+*/
+static int pcm_read(slimaudio_t *audio, unsigned char *data, int len, slimaudio_buffer_status *ok) {
+	int n, got = 0;
 
-	DEBUGF("pcm: decoder_endianness: %c\n", audio->decoder_endianness );
+	while ( (got < len) && (*ok != SLIMAUDIO_BUFFER_STREAM_END) )
+	{
+		n = len - got;
+		*ok = slimaudio_buffer_read(audio->decoder_buffer, (char*)(data + got), &n);
+		got += n;
+	}
+
+	return got;
+}
+
+/* Discards len bytes of the stream, used to step over chunks we don't need. */
+static bool pcm_skip(slimaudio_t *audio, u32_t len, slimaudio_buffer_status *ok) {
+	unsigned char scratch[512];
+	int n;
 
-	while (ok != SLIMAUDIO_BUFFER_STREAM_END)
+	while (len > 0)
 	{
-		/* keep partial samples from last iteration */
-		int nsamples;
-		int remainder = data_len;
-		if (remainder > 0)
-		{
-			memcpy(data, ptr, remainder);
-		}			
-		
-		data_len = AUDIO_CHUNK_SIZE-remainder;
-		ok = slimaudio_buffer_read(audio->decoder_buffer, (char*)(data+remainder), &data_len);
-		nsamples = data_len / 2;
-
-		/* convert buffer into samples */
-		ptr = data;
-		if (audio->decoder_endianness == '1')
-		{
-			for (i=0; i<nsamples; i++)
-			{
-				buffer[i] = *ptr++;
-				buffer[i] |= (*ptr++) << 8;
-			}
+		n = len < sizeof(scratch) ? len : sizeof(scratch);
+		if (pcm_read(audio, scratch, n, ok) != n)
+			return false;
+		len -= n;
+	}
+
+	return true;
+}
+
+/* Converts the 80-bit IEEE 754 extended sample rate used by AIFF. */
+static u32_t pcm_aiff_rate(const unsigned char *ext) {
+	int exponent = ((ext[0] & 0x7f) << 8) | ext[1];
+	u32_t mantissa = unpackB4(ext, 2);
+	int shift = 16383 + 31 - exponent;
+
+	if (shift < 0 || shift > 31)
+		return 0;
+
+	return mantissa >> shift;
+}
+
+/* Format from the strm command fields, used when the stream has no header. */
+static void pcm_strm_format(slimaudio_t *audio, pcm_format_t *fmt) {
+	static const u32_t rates[] = { 11025, 22050, 32000, 44100, 48000, 8000, 12000, 16000, 24000, 96000 };
+
+	memset(fmt, 0, sizeof(pcm_format_t));
+
+	fmt->sample_size = 16;
+	if ( (audio->decoder_sample_size >= '0') && (audio->decoder_sample_size <= '3') )
+		fmt->sample_size = 8 * (audio->decoder_sample_size - '0' + 1);
+
+	fmt->sample_rate = 44100;
+	if ( (audio->decoder_sample_rate >= '0') && (audio->decoder_sample_rate <= '9') )
+		fmt->sample_rate = rates[audio->decoder_sample_rate - '0'];
+
+	fmt->channels = (audio->decoder_channels == '1') ? 1 : 2;
+	fmt->big_endian = (audio->decoder_endianness != '1');
+}
+
+/* Parses the fmt chunk body of a RIFF/WAVE stream. */
+static int pcm_wave_fmt(pcm_format_t *fmt, const unsigned char *body, u32_t len) {
+	int format;
+
+	if (len < 16)
+		return -1;
+
+	format = unpackL2(body, 0);
+	if ( (format == 0xfffe) && (len >= 26) )
+		format = unpackL2(body, 24); /* WAVE_FORMAT_EXTENSIBLE sub format */
+
+	if (format != 1) {
+		fprintf(stderr, "pcm: unsupported wav format tag 0x%04x\n", format);
+		return -1;
+	}
+
+	fmt->channels = unpackL2(body, 2);
+	fmt->sample_rate = unpackL4(body, 4);
+	fmt->sample_size = unpackL2(body, 14);
+	fmt->big_endian = false;
+	fmt->is_unsigned = (fmt->sample_size == 8);
+
+	return 0;
+}
+
+/* Parses the COMM chunk body of a FORM/AIFF or FORM/AIFC stream. */
+static int pcm_aiff_comm(pcm_format_t *fmt, const unsigned char *body, u32_t len, bool aifc) {
+	if (len < 18)
+		return -1;
+
+	fmt->channels = unpackB2(body, 0);
+	fmt->sample_size = unpackB2(body, 6);
+	fmt->sample_rate = pcm_aiff_rate(body + 8);
+	fmt->big_endian = true;
+	fmt->is_unsigned = false;
+
+	if (aifc && len >= 22) {
+		if (memcmp(body + 18, "sowt", 4) == 0) {
+			fmt->big_endian = false;
 		}
-		else
-		{
-			for (i=0; i<nsamples; i++)
-			{
-				buffer[i] = (*ptr++) << 8;
-				buffer[i] |= *ptr++;
-			}			
+		else if ( (memcmp(body + 18, "NONE", 4) != 0) && (memcmp(body + 18, "twos", 4) != 0) ) {
+			fprintf(stderr, "pcm: unsupported aifc compression %4.4s\n", body + 18);
+			return -1;
 		}
+	}
 
-		/* Perform additional processing here */
+	return 0;
+}
 
-#ifdef __BIG_ENDIAN__
-		ptr = data;
-		for (i=0; i<nsamples; i++)
-		{
-			int sample;
+/* Looks for a RIFF/WAVE or FORM/AIFF(-C) header at the start of the stream
+** and steps over it, leaving the stream positioned at the first sample.  If
+** there is no header, the bytes peeked at are left in data for the caller
+** to play as samples.  Returns -1 if the stream cannot be decoded.
+*/
+static int pcm_parse_header(slimaudio_t *audio, pcm_format_t *fmt,
+	unsigned char *data, int *data_len, slimaudio_buffer_status *ok)
+{
+	unsigned char chunk[PCM_HEADER_SCAN];
+	bool wave, aifc = false;
+	bool have_fmt = false;
+	u32_t size, len;
 
-			sample = buffer[i];
-			*ptr++ = (sample >> 8) & 0xff;
-			*ptr++ = (sample >> 0) & 0xff;	    
+	*data_len = pcm_read(audio, data, 12, ok);
+	if (*data_len < 12)
+		return 0;
+
+	if ( (memcmp(data, "RIFF", 4) == 0) && (memcmp(data + 8, "WAVE", 4) == 0) ) {
+		wave = true;
+	}
+	else if ( (memcmp(data, "FORM", 4) == 0) &&
+		  ((memcmp(data + 8, "AIFF", 4) == 0) || (memcmp(data + 8, "AIFC", 4) == 0)) ) {
+		wave = false;
+		aifc = (data[11] == 'C');
+	}
+	else {
+		/* Raw samples, format comes from the strm command */
+		return 0;
+	}
+
+	DEBUGF("pcm: %4.4s/%4.4s header\n", data, data + 8);
+	*data_len = 0;
+
+	while (pcm_read(audio, chunk, 8, ok) == 8) {
+		size = wave ? unpackL4(chunk, 4) : unpackB4(chunk, 4);
+
+		VDEBUGF("pcm: chunk %4.4s size %u\n", chunk, size);
+
+		if (memcmp(chunk, wave ? "fmt " : "COMM", 4) == 0) {
+			len = size < PCM_HEADER_SCAN ? size : PCM_HEADER_SCAN;
+			if (pcm_read(audio, chunk, len, ok) != len)
+				break;
+
+			if (wave ? pcm_wave_fmt(fmt, chunk, len) : pcm_aiff_comm(fmt, chunk, len, aifc))
+				return -1;
+
+			have_fmt = true;
+			size -= len;
+		}
+		else if (wave && (memcmp(chunk, "data", 4) == 0)) {
+			fmt->data_length = (size == 0xffffffff) ? 0 : size;
+			break;
 		}
+		else if (!wave && (memcmp(chunk, "SSND", 4) == 0)) {
+			/* offset and block size precede the sample data */
+			if (pcm_read(audio, chunk, 8, ok) != 8)
+				break;
 
-#else /* __LITTLE_ENDIAN__ */
+			len = unpackB4(chunk, 0);
+			fmt->data_length = (size > len + 8) ? size - len - 8 : 0;
+			if (!pcm_skip(audio, len, ok))
+				break;
+			break;
+		}
 
+		/* chunks are padded to an even length */
+		if (!pcm_skip(audio, size + (size & 1), ok))
+			break;
+	}
+
+	if (!have_fmt) {
+		/* Header without a format chunk, use the strm fields */
+		DEBUGF("pcm: no format chunk in header\n");
+		pcm_strm_format(audio, fmt);
+	}
+
+	return 0;
+}
+
+static int pcm_process(slimaudio_t *audio) {
+	unsigned char data[AUDIO_CHUNK_SIZE];
+	short buffer[AUDIO_CHUNK_SIZE*2];
+	pcm_format_t fmt;
+	int frame_size, sample_bytes, msb;
+	int nframes, i;
+	unsigned char *ptr;
+	short *out;
+
+	int data_len = 0;
+	u32_t data_left;
+	slimaudio_buffer_status ok = SLIMAUDIO_BUFFER_STREAM_START;
+
+	pcm_strm_format(audio, &fmt);
+
+	if (pcm_parse_header(audio, &fmt, data, &data_len, &ok) < 0)
+		return -1;
+
+	DEBUGF("pcm: sample_rate:%u channels:%i sample_size:%i big_endian:%i data_length:%u\n",
+		fmt.sample_rate, fmt.channels, fmt.sample_size, fmt.big_endian, fmt.data_length);
+
+	if ( (fmt.channels < 1) || (fmt.sample_size < 8) || (fmt.sample_size > 32) || (fmt.sample_size % 8) ) {
+		fprintf(stderr, "pcm: unsupported format %i channels %i bits\n", fmt.channels, fmt.sample_size);
+		return -1;
+	}
+
+	if (slimaudio_output_set_rate(audio, fmt.sample_rate) < 0)
+		fprintf(stderr, "pcm: %u Hz stream played at %u Hz\n", fmt.sample_rate, OUTPUT_RATE);
+
+	sample_bytes = fmt.sample_size / 8;
+	frame_size = sample_bytes * fmt.channels;
+	/* offset of the most significant byte of each sample */
+	msb = fmt.big_endian ? 0 : sample_bytes - 1;
+	data_left = fmt.data_length;
+
+	while (true)
+	{
+		int n = AUDIO_CHUNK_SIZE - data_len;
+
+		/* Ignore trailing chunks after the sample data */
+		if ( (fmt.data_length > 0) && (n > data_left) )
+			n = data_left;
+
+		if ( (ok != SLIMAUDIO_BUFFER_STREAM_END) && (n > 0) ) {
+			ok = slimaudio_buffer_read(audio->decoder_buffer, (char*)(data + data_len), &n);
+			data_len += n;
+			data_left -= (fmt.data_length > 0) ? n : 0;
+		}
+
+		nframes = data_len / frame_size;
+
+		/* convert frames into 16 bit stereo samples */
 		ptr = data;
-		for (i=0; i<nsamples; i++)
+		out = buffer;
+		for (i=0; i<nframes; i++, ptr += frame_size)
 		{
-			int sample;
+			short left, right;
+
+			if (sample_bytes == 1) {
+				left = ptr[0] << 8;
+				right = ptr[fmt.channels > 1 ? 1 : 0] << 8;
+				if (fmt.is_unsigned) {
+					left ^= 0x8000;
+					right ^= 0x8000;
+				}
+			}
+			else {
+				left = (ptr[msb] << 8) | ptr[msb + (fmt.big_endian ? 1 : -1)];
+				right = left;
+				if (fmt.channels > 1) {
+					unsigned char *r = ptr + sample_bytes;
+					right = (r[msb] << 8) | r[msb + (fmt.big_endian ? 1 : -1)];
+				}
+			}
 
-			sample = buffer[i];
-			*ptr++ = (sample >> 0) & 0xff;
-			*ptr++ = (sample >> 8) & 0xff;
+			*out++ = left;
+			*out++ = right;
 		}
-#endif
-		slimaudio_buffer_write(audio->output_buffer, (char*)data, nsamples * 2);
 
-		data_len -= nsamples * 2;
+		if (nframes > 0)
+			slimaudio_decoder_output(audio, (char*)buffer, nframes * 4);
+
+		/* keep partial frames for the next iteration */
+		data_len -= nframes * frame_size;
+		if (data_len > 0)
+			memmove(data, data + nframes * frame_size, data_len);
+
+		if ( (ok == SLIMAUDIO_BUFFER_STREAM_END) || ((fmt.data_length > 0) && (data_left == 0)) )
+			break;
 	}
-	
+
 	return 0;
 }
+
+const slimaudio_decoder_t slimaudio_decoder_pcm = {
+	'p', "aif,pcm",
+	pcm_init, NULL, pcm_process, NULL, pcm_free
+};
@@ -50,20 +50,30 @@ static int vorbis_seek_func(void *datasource, ogg_int64_t offset, int whence);
 static int vorbis_close_func(void *datasource);
 static long vorbis_tell_func(void *datasource);
 
-int slimaudio_decoder_vorbis_init(slimaudio_t *audio) {
+static int vorbis_init(slimaudio_t *audio) {
+	audio->decoder_priv = malloc(sizeof(OggVorbis_File));
+	if (audio->decoder_priv == NULL)
+		return -1;
+
 	return 0;
 }
 
-void slimaudio_decoder_vorbis_free(slimaudio_t *audio) {
+static void vorbis_free(slimaudio_t *audio) {
+	if (audio->decoder_priv != NULL) {
+		free(audio->decoder_priv);
+		audio->decoder_priv = NULL;
+	}
 }
 
-int slimaudio_decoder_vorbis_process(slimaudio_t *audio) {
+static int vorbis_process(slimaudio_t *audio) {
+	OggVorbis_File *oggvorbis_file = (OggVorbis_File *) audio->decoder_priv;
 	int err;
 	ov_callbacks callbacks;
 	int bytes_read;
 	int current_bitstream;
 	bool ogg_continue = true;
 	char buffer[AUDIO_CHUNK_SIZE];
+	long rate;
 	
 	assert(audio != NULL);
 
@@ -76,20 +86,24 @@ int slimaudio_decoder_vorbis_process(slimaudio_t *audio) {
 
 	audio->decoder_end_of_stream = false;
 	
-	if ((err = ov_open_callbacks(audio, &audio->oggvorbis_file, NULL, 0, callbacks)) < 0)
+	if ((err = ov_open_callbacks(audio, oggvorbis_file, NULL, 0, callbacks)) < 0)
 	{
 		DEBUGF("libvorbis: (ogg) ov_open_callbacks failed (%i)\n", err);
 		return -1;
 	}
+
+	rate = ov_info(oggvorbis_file, -1)->rate;
+	if (slimaudio_output_set_rate(audio, rate) < 0)
+		fprintf(stderr, "vorbis: %li Hz stream played at %u Hz\n", rate, OUTPUT_RATE);
 	
 	
 	do {
 #if defined(TREMOR_DECODER) /* Use Tremor fixed point vorbis decoder, little endian only */
-		bytes_read = ov_read(&audio->oggvorbis_file, buffer, AUDIO_CHUNK_SIZE, &current_bitstream);
+		bytes_read = ov_read(oggvorbis_file, buffer, AUDIO_CHUNK_SIZE, &current_bitstream);
 #elif defined(__BIG_ENDIAN__)
-		bytes_read = ov_read(&audio->oggvorbis_file, buffer, AUDIO_CHUNK_SIZE, 1, 2, 1, &current_bitstream);
+		bytes_read = ov_read(oggvorbis_file, buffer, AUDIO_CHUNK_SIZE, 1, 2, 1, &current_bitstream);
 #else /* __LITTLE_ENDIAN__ */
-		bytes_read = ov_read(&audio->oggvorbis_file, buffer, AUDIO_CHUNK_SIZE, 0, 2, 1, &current_bitstream);
+		bytes_read = ov_read(oggvorbis_file, buffer, AUDIO_CHUNK_SIZE, 0, 2, 1, &current_bitstream);
 #endif
 		switch (bytes_read) {
 
@@ -112,12 +126,12 @@ int slimaudio_decoder_vorbis_process(slimaudio_t *audio) {
 			break;
 			
 		default:
-			slimaudio_buffer_write(audio->output_buffer, buffer, bytes_read);
+			slimaudio_decoder_output(audio, buffer, bytes_read);
 		}
 
 	} while ( ogg_continue );
 	
-	if ((err = ov_clear(&audio->oggvorbis_file)) < 0)
+	if ((err = ov_clear(oggvorbis_file)) < 0)
 	{
 		DEBUGF("libvorbis: (ogg) ov_clear failed (%i)\n", err);
 		return -1;	
@@ -128,6 +142,11 @@ int slimaudio_decoder_vorbis_process(slimaudio_t *audio) {
 	return 0;
 }
 
+const slimaudio_decoder_t slimaudio_decoder_vorbis = {
+	'o', "ogg",
+	vorbis_init, NULL, vorbis_process, NULL, vorbis_free
+};
+
 
 static size_t vorbis_read_func(void *ptr, size_t size, size_t nmemb, void *datasource) {
 	slimaudio_t *audio = (slimaudio_t *) datasource;
@@ -20,6 +20,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <sched.h>
@@ -43,8 +44,18 @@
 #endif
 
 #include "slimaudio/slimaudio.h"
+#include "slimaudio/slimaudio_trace.h"
+#include "slimproto/slimproto_clock.h"
+#include "slimproto/slimproto_capture.h"
 
 #define HTTP_HEADER_LENGTH 1024
+#define HTTP_REQUEST_LENGTH (sizeof(((slimproto_msg_t *) 0)->strm.http_hdr) + 64)
+
+#define HTTP_RESUME_TRIES	3	/* reconnects for a dropped stream */
+#define HTTP_RESUME_DELAY	1000	/* msec before each */
+
+#define ADAPT_INTERVAL_MSEC	1000	/* how often the buffers are sized */
+#define ADAPT_COVER_MSEC	8000	/* network stall the decoder buffer rides out */
 
 extern bool threshold_override;
 extern unsigned int output_threshold;
@@ -61,11 +72,14 @@ extern unsigned int output_threshold;
 
 static void *http_thread(void *ptr);
 static void http_recv(slimaudio_t *a);
-static void http_close(slimaudio_t *a);
+static void http_close(slimaudio_t *a, bool reuse);
+static void http_idle_close(slimaudio_t *audio);
+static void http_wait_connecting(slimaudio_t *audio);
+static void http_stream_connect(slimaudio_t *audio, slimproto_msg_t *msg, bool append, u32_t track);
 
 int slimaudio_http_open(slimaudio_t *audio) {
 	pthread_mutex_init(&(audio->http_mutex), NULL);
-	pthread_cond_init(&(audio->http_cond), NULL);
+	slimproto_cond_init(&(audio->http_cond));
 	/* 
 	 * We lock the mutex right here, knowing that http_thread will
 	 * release it once it enters pthread_cond_wait inside its STOPPED
@@ -98,6 +112,8 @@ int slimaudio_http_close(slimaudio_t *audio) {
 	
 	pthread_join(audio->http_thread, NULL);	
 
+	http_idle_close(audio);
+
 	pthread_mutex_destroy(&(audio->http_mutex));
 	pthread_cond_destroy(&(audio->http_cond));
 	return 0;
@@ -106,6 +122,7 @@ int slimaudio_http_close(slimaudio_t *audio) {
 
 static void *http_thread(void *ptr) {
 	slimaudio_t *audio = (slimaudio_t *) ptr;
+	bool append;
 #ifdef SLIMPROTO_DEBUG				
 	int last_state = 0;
 #endif
@@ -134,15 +151,60 @@ static void *http_thread(void *ptr) {
 
 		switch (audio->http_state) {
 			case STREAM_STOP:
-				CLOSESOCKET(audio->streamfd);
+				if (audio->http_reuse) {
+					/* the response is complete, keep the
+					** connection for the next request.
+					*/
+					http_idle_close(audio);
+
+					audio->http_idle = true;
+					audio->http_idle_fd = audio->streamfd;
+					audio->http_idle_addr = audio->http_addr;
+					audio->http_reuse = false;
+
+					DEBUGF("http_thread: keeping connection %i\n", audio->http_idle_fd);
+				}
+				else
+					CLOSESOCKET(audio->streamfd);
+
 				slimproto_dsco(audio->proto, DSCO_CLOSED);
 
-				slimaudio_buffer_close(audio->decoder_buffer);
+				/* without restarting the decoder, the next stream
+				** carries on where this one ended.
+				*/
+				append = audio->http_next_pending &&
+					(audio->http_next_msg.strm.flags & STRM_FLAG_NO_RESTART);
+
+				if (!append)
+					slimaudio_buffer_close(audio->decoder_buffer);
 				
 				audio->http_state = STREAM_STOPPED;
 
 				pthread_cond_broadcast(&audio->http_cond);
 
+				if (audio->http_next_pending) {
+					slimproto_msg_t msg = audio->http_next_msg;
+					u32_t track = audio->http_next_trace;
+
+					DEBUGF("http_thread: connecting next stream append:%i\n", append);
+
+					audio->http_next_pending = false;
+					audio->http_connecting = true;
+
+					pthread_mutex_unlock(&audio->http_mutex);
+
+					http_stream_connect(audio, &msg, append, track);
+
+					pthread_mutex_lock(&audio->http_mutex);
+
+					audio->http_connecting = false;
+					pthread_cond_broadcast(&audio->http_cond);
+
+					/* the decoder must not wait for data that won't come */
+					if ( append && (audio->http_state != STREAM_PLAYING) )
+						slimaudio_buffer_close(audio->decoder_buffer);
+				}
+
 				break;
 				
 			case STREAM_STOPPED:
@@ -169,69 +231,184 @@ static void *http_thread(void *ptr) {
 }
 
 
+/* Waits for the http thread to connect the next stream, so that a strm
+** does not start a second connection alongside it.  Called with the http
+** mutex held.
+*/
+static void http_wait_connecting(slimaudio_t *audio) {
+	while (audio->http_connecting)
+		pthread_cond_wait(&audio->http_cond, &audio->http_mutex);
+}
+
 void slimaudio_http_connect(slimaudio_t *audio, slimproto_msg_t *msg) {
-	int n;
-	struct sockaddr_in serv_addr = audio->proto->serv_addr;
-	const socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+	pthread_mutex_lock(&audio->http_mutex);
 
-	char http_hdr[HTTP_HEADER_LENGTH];
-	int pos = 0;
-	int crlf = 0;
+	http_wait_connecting(audio);
+
+	if ( (audio->http_state == STREAM_PLAYING) && slimaudio_strm_next(msg) ) {
+		/* The http thread connects once the current stream has been
+		** fetched, so the next track follows it in the decoder buffer.
+		*/
+		DEBUGF("slimaudio_http_connect: next stream queued autostart=%c flags=%02x\n",
+			msg->strm.autostart, msg->strm.flags);
+
+		audio->http_next_msg = *msg;
+		audio->http_next_trace = audio->trace_track;
+		audio->http_next_pending = true;
+
+		pthread_mutex_unlock(&audio->http_mutex);
+		return;
+	}
+
+	pthread_mutex_unlock(&audio->http_mutex);
 
 	slimaudio_http_disconnect(audio);
-	
-	if (msg->strm.server_ip != 0) {
-		serv_addr.sin_addr.s_addr = htonl(msg->strm.server_ip);
+
+	http_stream_connect(audio, msg, false, audio->trace_track);
+}
+
+/* Closes the connection kept for reuse, if any. */
+static void http_idle_close(slimaudio_t *audio) {
+	if (audio->http_idle) {
+		DEBUGF("http_idle_close: %i\n", audio->http_idle_fd);
+
+		CLOSESOCKET(audio->http_idle_fd);
+		audio->http_idle = false;
 	}
-	if (msg->strm.server_port != 0) {
-		serv_addr.sin_port = htons(msg->strm.server_port);
+}
+
+/* Takes the kept connection if it goes to serv_addr and the server has
+** not closed it.  Any other kept connection is closed.
+*/
+static bool http_idle_take(slimaudio_t *audio, struct sockaddr_in *serv_addr, socket_t *fd) {
+	struct timeval timeout = { 0, 0 };
+	fd_set fdread;
+	bool taken = false;
+
+	pthread_mutex_lock(&audio->http_mutex);
+
+	if ( audio->http_idle &&
+	     (audio->http_idle_addr.sin_addr.s_addr == serv_addr->sin_addr.s_addr) &&
+	     (audio->http_idle_addr.sin_port == serv_addr->sin_port) ) {
+		/* an idle connection has nothing to read, unless it closed */
+		FD_ZERO(&fdread);
+		FD_SET(audio->http_idle_fd, &fdread);
+
+		if (select(audio->http_idle_fd + 1, &fdread, NULL, NULL, &timeout) == 0) {
+			*fd = audio->http_idle_fd;
+			audio->http_idle = false;
+			taken = true;
+		}
 	}
-	
-	DEBUGF("slimaudio_http_connect: http connect %s:%i\n", 
-	       inet_ntoa(serv_addr.sin_addr), msg->strm.server_port);
-	
-	if (fd < 0) {
-		perror("slimaudio_http_connect: Error opening socket");
+
+	http_idle_close(audio);
+
+	pthread_mutex_unlock(&audio->http_mutex);
+
+	return taken;
+}
+
+/* Copies the request, asking an HTTP/1.0 server to keep the connection
+** open unless the request says otherwise.  HTTP/1.1 keeps it by default.
+*/
+static void http_request(const char *request, char *buf, int size) {
+	const char *line_end = strstr(request, "\r\n");
+	const char *end = strstr(request, "\r\n\r\n");
+	const char *line;
+	static const char keepalive[] = "Connection: keep-alive\r\n";
+
+	if ( (line_end == NULL) || (end == NULL) || (line_end - request < 8) ||
+	     (strncmp(line_end - 8, "HTTP/1.0", 8) != 0) ||
+	     (strlen(request) + sizeof(keepalive) > (size_t) size) ) {
+		strncpy(buf, request, size - 1);
+		buf[size - 1] = '\0';
 		return;
 	}
 
-        if ( slimproto_configure_socket (fd, 0) != 0 )
-        {
-		perror("slimaudio_http_connect: error configuring socket");
-                CLOSESOCKET(fd);
-                return;
-        }
+	for (line = line_end + 2; line < end + 2; line = strstr(line, "\r\n") + 2) {
+		if (strncasecmp(line, "Connection:", 11) == 0) {
+			strcpy(buf, request);
+			return;
+		}
+	}
 
-	if (connect(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != 0) {
-		perror("slimaudio_http_connect: error connecting to server");
-		CLOSESOCKET(fd);
-		return;
+	/* headers, our header, then the blank line */
+	memcpy(buf, request, end + 2 - request);
+	strcpy(buf + (end + 2 - request), keepalive);
+	strcat(buf, end + 2);
+}
+
+/* True if the header value holds token, ignoring case. */
+static bool http_header_has(const char *value, const char *token) {
+	int len = strlen(token);
+
+	for ( ; (*value != '\0') && (*value != '\r') && (*value != '\n'); value++) {
+		if (strncasecmp(value, token, len) == 0)
+			return true;
 	}
 
-	slimaudio_stat(audio, "STMe", (u32_t) 0); /* Stream connection established */
+	return false;
+}
 
-	/* send http request to server */
-	DEBUGF("slimaudio_http_connect: http request %s\n", msg->strm.http_hdr);
+/* Finds from the response header if the body has a known length and the
+** server keeps the connection after it, so it can be reused.
+*/
+static void http_parse_response(slimaudio_t *audio, const char *hdr) {
+	const char *line;
+	bool keepalive, chunked = false;
 
-	n = send_message(fd, msg->strm.http_hdr, strlen((const char *)msg->strm.http_hdr),
-		slimproto_get_socketsendflags());
+	audio->http_content_known = false;
+	audio->http_content_left = 0;
 
-	if (n < 0)
-	{
-		DEBUGF("http_send: (1) n=%i  msg=%s(%i)\n", n, strerror(SOCKETERROR), SOCKETERROR);
-		CLOSESOCKET(fd);
+	if (strncmp(hdr, "HTTP/1.", 7) != 0) {
+		/* ICY and the like */
+		audio->http_keepalive = false;
 		return;
 	}
 
-	/* read http header */
-	
+	keepalive = (hdr[7] == '1');
+
+	for (line = strchr(hdr, '\n'); line != NULL; line = strchr(line, '\n')) {
+		line++;
+
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			audio->http_content_left = strtoull(line + 15, NULL, 10);
+			audio->http_content_known = true;
+		}
+		else if (strncasecmp(line, "Connection:", 11) == 0) {
+			if (http_header_has(line + 11, "close"))
+				keepalive = false;
+			else if (http_header_has(line + 11, "keep-alive"))
+				keepalive = true;
+		}
+		else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+			chunked = true;
+		}
+	}
+
+	if (chunked)
+		audio->http_content_known = false;
+
+	audio->http_keepalive = keepalive && audio->http_content_known;
+
+	DEBUGF("http_parse_response: keepalive:%i content_length:%llu\n",
+		audio->http_keepalive, audio->http_content_known ? audio->http_content_left : 0);
+}
+
+/* Reads the response header into http_hdr, one byte at a time so none
+** of the body is taken.  Returns -1 if the connection failed.
+*/
+static int http_read_header(socket_t fd, char *http_hdr) {
+	int n;
+	int pos = 0;
+	int crlf = 0;
+
 	do {
 		n = recv(fd, http_hdr+pos, 1, 0);
-		if (n < 0)
+		if (n <= 0)
 		{
 			DEBUGF("http_recv: (1) n=%i  msg=%s(%i)\n", n, strerror(SOCKETERROR), SOCKETERROR);
-			CLOSESOCKET(fd);
-			return;
+			return -1;
 		}
 
 		switch (crlf) {
@@ -260,20 +437,159 @@ void slimaudio_http_connect(slimaudio_t *audio, slimproto_msg_t *msg) {
 		
 		pos++;
 	} while (crlf < 4 && pos < HTTP_HEADER_LENGTH -1);
-	http_hdr[pos+1] = '\0';
-		
+	http_hdr[pos] = '\0';
+
+	return pos;
+}
+
+/* Sends request to serv_addr and reads the response header into
+** http_hdr, on the kept connection fd if reused.  Returns false, with the
+** socket closed, if that failed.
+*/
+static bool http_open(struct sockaddr_in *serv_addr, bool reused, const char *request,
+	char *http_hdr, socket_t *fd, u32_t track) {
+	int n;
+
+	if (reused) {
+		DEBUGF("slimaudio_http_connect: http reuse %s:%i\n",
+		       inet_ntoa(serv_addr->sin_addr), ntohs(serv_addr->sin_port));
+	}
+	else {
+		DEBUGF("slimaudio_http_connect: http connect %s:%i\n", 
+		       inet_ntoa(serv_addr->sin_addr), ntohs(serv_addr->sin_port));
+
+		if (slimproto_replaying()) {
+			/* a replay stands in for the server */
+			*fd = slimproto_replay_connect(CAPTURE_HTTP_OPEN);
+			if (*fd < 0)
+				return false;
+		}
+		else {
+			*fd = socket(AF_INET, SOCK_STREAM, 0);
+			if (*fd < 0) {
+				perror("slimaudio_http_connect: Error opening socket");
+				return false;
+			}
+
+			if ( slimproto_configure_socket (*fd, 0) != 0 )
+			{
+				perror("slimaudio_http_connect: error configuring socket");
+				CLOSESOCKET(*fd);
+				return false;
+			}
+
+			if (connect(*fd, (struct sockaddr *)serv_addr, sizeof(*serv_addr)) != 0) {
+				perror("slimaudio_http_connect: error connecting to server");
+				CLOSESOCKET(*fd);
+				return false;
+			}
+		}
+
+		slimproto_capture(CAPTURE_HTTP_OPEN, NULL, 0);
+	}
+
+	slimaudio_trace(TRACE_CONNECTED, track);
+
+	/* send http request to server */
+	DEBUGF("slimaudio_http_connect: http request %s\n", request);
+
+	n = send_message(*fd, (unsigned char *) request, strlen(request),
+		slimproto_get_socketsendflags());
+
+	if (n < 0)
+	{
+		DEBUGF("http_send: (1) n=%i  msg=%s(%i)\n", n, strerror(SOCKETERROR), SOCKETERROR);
+		CLOSESOCKET(*fd);
+		return false;
+	}
+
+	slimproto_capture(CAPTURE_HTTP_OUT, request, n);
+
+	/* read http header */
+	n = http_read_header(*fd, http_hdr);
+	if (n < 0) {
+		CLOSESOCKET(*fd);
+		return false;
+	}
+
+	slimproto_capture(CAPTURE_HTTP_IN, http_hdr, n);
+
+	return true;
+}
+
+/* Connects to the stream in msg, for the track numbered by slimaudio_trace.
+** With append the data is added to the stream still open in the decoder
+** buffer instead of starting a new one.
+**
+** A connection kept from the last stream to the same server is used if
+** there is one.  Should the request fail on it, a new connection is made.
+*/
+static void http_stream_connect(slimaudio_t *audio, slimproto_msg_t *msg, bool append, u32_t track) {
+	struct sockaddr_in serv_addr = audio->proto->serv_addr;
+	socket_t fd;
+	bool reused;
+
+	char http_hdr[HTTP_HEADER_LENGTH];
+	char request[HTTP_REQUEST_LENGTH];
+
+	if (msg->strm.server_ip != 0) {
+		serv_addr.sin_addr.s_addr = htonl(msg->strm.server_ip);
+	}
+	if (msg->strm.server_port != 0) {
+		serv_addr.sin_port = htons(msg->strm.server_port);
+	}
+
+	http_request((const char *) msg->strm.http_hdr, request, sizeof(request));
+
+	reused = http_idle_take(audio, &serv_addr, &fd);
+
+	while (!http_open(&serv_addr, reused, request, http_hdr, &fd, track)) {
+		/* the server may have closed the kept connection meanwhile */
+		if (!reused)
+			return;
+
+		DEBUGF("slimaudio_http_connect: kept connection failed, reconnecting\n");
+		reused = false;
+	}
+
+	slimaudio_stat(audio, "STMe", (u32_t) 0); /* Stream connection established */
+
 	DEBUGF("slimaudio_http_connect: http connected hdr %s\n", http_hdr);
 	
 	pthread_mutex_lock(&audio->http_mutex);
+
+	http_parse_response(audio, http_hdr);
+	audio->http_content_length = audio->http_content_left;
+	audio->http_addr = serv_addr;
+	audio->http_msg = *msg;
+	audio->http_reuse = false;
+
+	if (audio->http_state == STREAM_STOP) {
+		/* stopped while the http thread connected the next stream */
+		DEBUGF("slimaudio_http_connect: stopped while connecting\n");
+
+		CLOSESOCKET(fd);
+		audio->http_state = STREAM_STOPPED;
+
+		pthread_mutex_unlock(&audio->http_mutex);
+		pthread_cond_broadcast(&audio->http_cond);
+		return;
+	}
+
 	slimaudio_stat(audio, "STMh", (u32_t) 0); /* acknowledge HTTP headers have been received */
+	slimaudio_trace(TRACE_HEADER, track);
 
-	slimaudio_buffer_open(audio->decoder_buffer, NULL);	
+	if (!append)
+		slimaudio_buffer_open(audio->decoder_buffer, NULL);	
 	
 	audio->streamfd = fd;
+	audio->http_trace = track;
 	audio->http_stream_bytes = 0;
+	audio->http_rate_time = 0;
 	audio->autostart_mode = msg->strm.autostart ;
 	audio->autostart_threshold_reached = false;
 	audio->autostart_threshold = (msg->strm.threshold & 0xFF) * 1024;
+	audio->autostart_threshold_msec = AUTOSTART_THRESHOLD_MSEC;
 
 #ifdef AAC_DECODER
 	/* AAC container type and bitstream format */
@@ -291,25 +607,19 @@ void slimaudio_http_connect(slimaudio_t *audio, slimproto_msg_t *msg) {
 		msg->strm.pcm_sample_rate, msg->strm.pcm_sample_rate,
 		msg->strm.pcm_channels, msg->strm.pcm_channels);
 
-	/* XXX FIXME Hard coded sample rate calculation */
-	/* (Sample Rate * Sample Size * Channels / 8 bits/byte) / tenths of a second) */
-	/* If the server sends 0 for strm.output_threshold, we use OUTPUT_THRESHOLD, stored in bytes. */
-	if ( msg->strm.output_threshold > 0 )
-	{
-		/* Stored in bytes */
-		audio->output_threshold = (((44100*16*2)/8)/10) * msg->strm.output_threshold;
-	}
+	/* The server sends strm.output_threshold in tenths of a second, or 0
+	** for our default.  The command line overrides both.
+	*/
+	if ( output_threshold > 0 )
+		audio->output_threshold_msec = output_threshold;
+	else if ( msg->strm.output_threshold > 0 )
+		audio->output_threshold_msec = msg->strm.output_threshold * 100;
 	else
-	{
-		audio->output_threshold = OUTPUT_THRESHOLD;
-	}
-
-	/* Over ride Output threshold */
-	if ( output_threshold != OUTPUT_THRESHOLD )
-		audio->output_threshold = output_threshold;
+		audio->output_threshold_msec = OUTPUT_THRESHOLD_MSEC;
 
-	DEBUGF("slimaudio_http_connect: autostart_mode=%c autostart_threshold=%i output_threshold=%i replay_gain=%f\n",
-		audio->autostart_mode, audio->autostart_threshold, audio->output_threshold, audio->replay_gain);
+	DEBUGF("slimaudio_http_connect: autostart_mode=%c autostart_threshold=%u (%u ms) output_threshold=%u ms replay_gain=%f\n",
+		audio->autostart_mode, audio->autostart_threshold, audio->autostart_threshold_msec,
+		audio->output_threshold_msec, audio->replay_gain);
 	
 	audio->http_state = STREAM_PLAYING;
 
@@ -321,11 +631,14 @@ void slimaudio_http_connect(slimaudio_t *audio, slimproto_msg_t *msg) {
 void slimaudio_http_disconnect(slimaudio_t *audio) {
 	pthread_mutex_lock(&audio->http_mutex);
 
+	http_wait_connecting(audio);
+
 	if (audio->http_state == STREAM_PLAYING)
 	{
 		DEBUGF("slimaudio_http_disconnect: state=%i\n", audio->http_state);
 
 		audio->http_state = STREAM_STOP;
+		audio->http_next_pending = false;
 
 		/* closing socket and buffer will wake the http thread */
 		CLOSESOCKET(audio->streamfd);
@@ -342,14 +655,259 @@ void slimaudio_http_disconnect(slimaudio_t *audio) {
 	pthread_mutex_unlock(&audio->http_mutex);
 }
 
+/* Returns the bitrate of the stream in bytes/s, measured as the data the
+** decoder consumed against the audio it produced, or 0 until it produced
+** some.  Sets pending to the stream data still in the decoder buffer and
+** output to the decoded audio of the stream still in the output buffer.
+*/
+static u32_t http_stream_byterate(slimaudio_t *audio, int *pending, int *output) {
+	int written, decoded;
+	u32_t consumed, decoded_msec;
+
+	slimaudio_buffer_stream_stats(audio->decoder_buffer, &written, pending);
+	slimaudio_buffer_stream_stats(audio->output_buffer, &decoded, output);
+
+	consumed = audio->http_stream_bytes - *pending;
+	decoded_msec = slimaudio_output_msec(audio, decoded);
+	if ( (consumed == 0) || (decoded_msec == 0) )
+		return 0;
+
+	return (u32_t) ((u64_t) consumed * 1000 / decoded_msec);
+}
+
+/* Returns true once enough audio is buffered to autostart.
+**
+** The buffered time is the decoded audio in the output buffer plus the
+** compressed data still in the decoder buffer at the bitrate observed so
+** far, so streams of any bitrate start after the same buffering time.
+** Until the decoder has produced audio the server's byte threshold is
+** used instead.
+*/
+static bool http_autostart_ready(slimaudio_t *audio, u32_t threshold_msec) {
+	int pending, output;
+	u32_t byterate, msec, capacity;
+
+	byterate = http_stream_byterate(audio, &pending, &output);
+
+	/* the decoder buffer cannot take much more, so wait no longer */
+	if (pending >= slimaudio_buffer_size(audio->decoder_buffer) / 4 * 3)
+		return true;
+
+	if (byterate == 0)
+		return audio->http_stream_bytes >= audio->autostart_threshold;
+
+	/* nor wait for more than the output buffer can hold */
+	capacity = slimaudio_output_msec(audio, slimaudio_buffer_size(audio->output_buffer)) / 2;
+	if (threshold_msec > capacity)
+		threshold_msec = capacity;
+
+	msec = slimaudio_output_msec(audio, output) + (u32_t) ((u64_t) pending * 1000 / byterate);
+
+	VDEBUGF("http_autostart_ready: %u ms buffered at %u kbps\n", msec, byterate * 8 / 1000);
+
+	return msec >= threshold_msec;
+}
+
+/* Resizes buf if size differs from it by more than an eighth. */
+static void http_resize_buffer(slimaudio_buffer_t *buf, int size, const char *name) {
+	int current = slimaudio_buffer_size(buf);
+
+	if ( (size > current + current / 8) || (size < current - current / 8) ) {
+		DEBUGF("http_adapt_buffers: %s buffer %i -> %i bytes\n", name, current, size);
+		slimaudio_buffer_resize(buf, size);
+	}
+}
+
+/* Sizes the buffers between their limits, once a second.
+**
+** The decoder buffer should ride out a network stall of ADAPT_COVER_MSEC
+** at the stream bitrate.  The time grows with the jitter of the receive
+** rate (its mean deviation against its mean), and both buffers grow by
+** buffer_boost after output underruns, which decays while playback runs
+** clean.
+*/
+static void http_adapt_buffers(slimaudio_t *audio, int n) {
+	u64_t now;
+	int pending, output, size;
+	u32_t msec, byterate;
+	double rate, delta, cover;
+
+	if ( (audio->decoder_buffer_min == audio->decoder_buffer_max) &&
+	     (audio->output_buffer_min == audio->output_buffer_max) )
+		return;
+
+	now = slimproto_clock_usec();
+	audio->http_rate_bytes += n;
+
+	if (audio->http_rate_time == 0) {
+		audio->http_rate_time = now;
+		return;
+	}
+
+	msec = (u32_t) ((now - audio->http_rate_time) / 1000);
+	if (msec < ADAPT_INTERVAL_MSEC)
+		return;
+
+	rate = audio->http_rate_bytes * 1000.0 / msec;
+	audio->http_rate_time = now;
+	audio->http_rate_bytes = 0;
+
+	delta = rate - audio->http_rate_mean;
+	audio->http_rate_mean += delta / 4;
+	audio->http_rate_dev += ((delta < 0 ? -delta : delta) - audio->http_rate_dev) / 4;
+
+	if (audio->output_underruns != audio->buffer_underruns) {
+		audio->buffer_underruns = audio->output_underruns;
+		audio->buffer_boost *= 1.5;
+		if (audio->buffer_boost > 4.0)
+			audio->buffer_boost = 4.0;
+	}
+	else if (audio->buffer_boost > 1.0) {
+		audio->buffer_boost *= 0.98;
+		if (audio->buffer_boost < 1.0)
+			audio->buffer_boost = 1.0;
+	}
+
+	byterate = http_stream_byterate(audio, &pending, &output);
+	if ( (byterate == 0) || (audio->http_rate_mean < 1.0) )
+		return;
+
+	cover = ADAPT_COVER_MSEC / 1000.0 * (1.0 + 2.0 * audio->http_rate_dev / audio->http_rate_mean) *
+		audio->buffer_boost;
+
+	size = (int) (byterate * cover);
+	if (size < audio->decoder_buffer_min)
+		size = audio->decoder_buffer_min;
+	if (size > audio->decoder_buffer_max)
+		size = audio->decoder_buffer_max;
+	http_resize_buffer(audio->decoder_buffer, size, "decoder");
+
+	size = (int) (audio->output_buffer_min * audio->buffer_boost);
+	if (size > audio->output_buffer_max)
+		size = audio->output_buffer_max;
+	http_resize_buffer(audio->output_buffer, size, "output");
+
+	VDEBUGF("http_adapt_buffers: %.0f +/- %.0f bytes/s, stream %u bytes/s, boost %.2f\n",
+		audio->http_rate_mean, audio->http_rate_dev, byterate, audio->buffer_boost);
+}
+
+/* Copies request adding a Range header for the body from offset on.
+** Returns false if the request has a range of its own.
+*/
+static bool http_range_request(const char *request, u64_t offset, char *buf, int size) {
+	const char *end = strstr(request, "\r\n\r\n");
+	const char *line;
+	char range[64];
+
+	if ( (end == NULL) || (strlen(request) + 64 > (size_t) size) )
+		return false;
+
+	for (line = strstr(request, "\r\n") + 2; line < end + 2; line = strstr(line, "\r\n") + 2) {
+		if (strncasecmp(line, "Range:", 6) == 0)
+			return false;
+	}
+
+	sprintf(range, "Range: bytes=%llu-\r\n", offset);
+
+	memcpy(buf, request, end + 2 - request);
+	strcpy(buf + (end + 2 - request), range);
+	strcat(buf, end + 2);
+
+	return true;
+}
+
+/* Reconnects a stream that dropped before the end of its response and
+** asks for the rest with a Range request, so the data carries on in the
+** decoder buffer as if nothing happened.  Returns false if the stream
+** could not be resumed.
+*/
+static bool http_resume(slimaudio_t *audio) {
+	u64_t offset = audio->http_content_length - audio->http_content_left;
+	struct sockaddr_in serv_addr = audio->http_addr;
+	char request[HTTP_REQUEST_LENGTH];
+	char base[HTTP_REQUEST_LENGTH];
+	char http_hdr[HTTP_HEADER_LENGTH];
+	const char *range;
+	struct timespec timeout;
+	socket_t fd;
+	int tries, err;
+
+	http_request((const char *) audio->http_msg.strm.http_hdr, base, sizeof(base));
+
+	if (!http_range_request(base, offset, request, sizeof(request)))
+		return false;
+
+	for (tries = 0; tries < HTTP_RESUME_TRIES; tries++) {
+		/* wait between tries, but give up as soon as a strm q or f
+		** stops the stream, slimaudio_http_disconnect waits on it.
+		*/
+		pthread_mutex_lock(&audio->http_mutex);
+
+		slimproto_cond_timeout(&timeout, HTTP_RESUME_DELAY);
+		err = 0;
+		while ( (audio->http_state == STREAM_PLAYING) && (err == 0) )
+			err = pthread_cond_timedwait(&audio->http_cond, &audio->http_mutex, &timeout);
+
+		if (audio->http_state != STREAM_PLAYING) {
+			pthread_mutex_unlock(&audio->http_mutex);
+			DEBUGF("http_resume: stopped\n");
+			return false;
+		}
+		pthread_mutex_unlock(&audio->http_mutex);
+
+		DEBUGF("http_resume: try %i at %llu of %llu bytes\n", tries + 1,
+			offset, audio->http_content_length);
+
+		if (!http_open(&serv_addr, false, request, http_hdr, &fd, audio->http_trace))
+			continue;
+
+		/* the server must send just the rest */
+		range = strstr(http_hdr, "Content-Range: bytes ");
+		if ( (strncmp(http_hdr + 8, " 206", 4) != 0) || (range == NULL) ||
+		     (strtoull(range + 21, NULL, 10) != offset) ) {
+			DEBUGF("http_resume: no range response %s\n", http_hdr);
+			CLOSESOCKET(fd);
+			return false;
+		}
+
+		pthread_mutex_lock(&audio->http_mutex);
+
+		if (audio->http_state != STREAM_PLAYING) {
+			pthread_mutex_unlock(&audio->http_mutex);
+			CLOSESOCKET(fd);
+			return false;
+		}
+
+		http_parse_response(audio, http_hdr);
+
+		if ( !audio->http_content_known ||
+		     (audio->http_content_left != audio->http_content_length - offset) ) {
+			pthread_mutex_unlock(&audio->http_mutex);
+			CLOSESOCKET(fd);
+			return false;
+		}
+
+		CLOSESOCKET(audio->streamfd);
+		audio->streamfd = fd;
+
+		pthread_mutex_unlock(&audio->http_mutex);
+
+		DEBUGF("http_resume: resumed at %llu\n", offset);
+		return true;
+	}
+
+	return false;
+}
+
 static void http_recv(slimaudio_t *audio) {
 	char buf[AUDIO_CHUNK_SIZE];
 	struct timeval timeOut; 
 	int n;
 	
 	fd_set fdread;
+	int len;
 	u32_t decode_num_tracks_started;
-	u32_t autostart_threshold;
+	u32_t autostart_threshold_msec;
 
 	timeOut.tv_sec  = 0; 
 	timeOut.tv_usec = 100*1000; /* wait for up to 100ms */
@@ -372,16 +930,35 @@ static void http_recv(slimaudio_t *audio) {
 		sched_yield();
 	}
 
-	n = recv(audio->streamfd, buf, AUDIO_CHUNK_SIZE, 0);
+	/* don't read past the response, the connection may carry the next */
+	len = AUDIO_CHUNK_SIZE;
+	if ( audio->http_content_known && (audio->http_content_left < (u64_t) len) )
+		len = (int) audio->http_content_left;
+
+	n = recv(audio->streamfd, buf, len, 0);
 
 	/* n == 0 http stream closed by server */
 	if (n <= 0)
 	{
 		DEBUGF("http_recv: (2) n=%i msg=%s(%i)\n", n, strerror(SOCKETERROR), SOCKETERROR);
-		http_close(audio);
+
+		slimproto_capture(CAPTURE_HTTP_CLOSE, NULL, 0);
+
+		/* dropped before the end, the output buffer plays on meanwhile */
+		if ( audio->http_content_known && (audio->http_content_left > 0) && http_resume(audio) )
+			return;
+
+		http_close(audio, false);
 		return;
 	}
 
+	slimproto_capture(CAPTURE_HTTP_IN, buf, n);
+
+	if (audio->http_stream_bytes == 0)
+		slimaudio_trace(TRACE_BODY, audio->http_trace);
+
+	audio->http_content_left -= n;
+
 	VDEBUGF("http_recv: audio n=%i\n", n);
 
 	slimaudio_buffer_write(audio->decoder_buffer, buf, n);
@@ -395,7 +972,9 @@ static void http_recv(slimaudio_t *audio) {
 	audio->http_total_bytes += n;
 	audio->http_stream_bytes += n;
 
-	autostart_threshold = audio->autostart_threshold;
+	http_adapt_buffers(audio, n);
+
+	autostart_threshold_msec = audio->autostart_threshold_msec;
 
 	if ( !decode_num_tracks_started )
 	{
@@ -408,7 +987,7 @@ static void http_recv(slimaudio_t *audio) {
 					case 'o':
 					case 'm':
 						if (threshold_override)
-							autostart_threshold = 40000L;
+							autostart_threshold_msec = THRESHOLD_OVERRIDE_MSEC;
 						break;
 					default:
 						break;
@@ -422,7 +1001,7 @@ static void http_recv(slimaudio_t *audio) {
 	VDEBUGF("http_recv: decode_num_tracks_started %u decode_bytes_available %u\n",
 		decode_num_tracks_started, audio->http_stream_bytes );
 
-	if ( ( !audio->autostart_threshold_reached ) && ( audio->http_stream_bytes >= autostart_threshold ) )
+	if ( ( !audio->autostart_threshold_reached ) && http_autostart_ready(audio, autostart_threshold_msec) )
 	{
 		audio->autostart_threshold_reached = true;
 
@@ -430,8 +1009,8 @@ static void http_recv(slimaudio_t *audio) {
 		{
 			case '0':
 			case '2':
-				DEBUGF("http_recv: AUTOSTART mode %c at %u threshold %u\n",
-					audio->autostart_mode, audio->http_stream_bytes, autostart_threshold);
+				DEBUGF("http_recv: AUTOSTART mode %c at %u bytes threshold %u ms\n",
+					audio->autostart_mode, audio->http_stream_bytes, autostart_threshold_msec);
 
 				slimaudio_stat(audio, "STMl", (u32_t) 0);
 
@@ -442,8 +1021,8 @@ static void http_recv(slimaudio_t *audio) {
 
 			case '1':
 			case '3':
-				DEBUGF("http_recv: AUTOSTART mode %c at %u threshold %u\n",
-					audio->autostart_mode, audio->http_stream_bytes, autostart_threshold);
+				DEBUGF("http_recv: AUTOSTART mode %c at %u bytes threshold %u ms\n",
+					audio->autostart_mode, audio->http_stream_bytes, autostart_threshold_msec);
 
 				pthread_mutex_unlock(&audio->http_mutex);
 				pthread_cond_broadcast(&audio->http_cond);
@@ -462,11 +1041,24 @@ static void http_recv(slimaudio_t *audio) {
 		pthread_mutex_unlock(&audio->http_mutex);
 		pthread_cond_broadcast(&audio->http_cond);
 	}
+
+	/* the whole response was received */
+	if ( audio->http_content_known && (audio->http_content_left == 0) )
+	{
+		DEBUGF("http_recv: response complete, keepalive:%i\n", audio->http_keepalive);
+		http_close(audio, audio->http_keepalive);
+	}
 }
 
-static void http_close(slimaudio_t *audio) {
+/* Stops the stream.  With reuse the connection is kept for the next
+** request, unless the stream was disconnected meanwhile.
+*/
+static void http_close(slimaudio_t *audio, bool reuse) {
 	pthread_mutex_lock(&audio->http_mutex);
 	
+	if (audio->http_state == STREAM_PLAYING)
+		audio->http_reuse = reuse;
+
 	audio->http_state = STREAM_STOP;		
 	
 	pthread_mutex_unlock(&audio->http_mutex);
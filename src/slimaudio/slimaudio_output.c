@@ -33,6 +33,8 @@
 
 #include "slimproto/slimproto.h"
 #include "slimaudio/slimaudio.h"
+#include "slimaudio/slimaudio_trace.h"
+#include "slimproto/slimproto_clock.h"
 
 #ifdef SLIMPROTO_DEBUG
   bool slimaudio_output_debug;
@@ -67,6 +69,9 @@ static int pa_callback(  void *inputBuffer, void *outputBuffer,
 
 static int audg_callback(slimproto_t *p, const unsigned char *buf, int buf_len, void *user_data);
 
+bool slimaudio_output_null = false;
+unsigned int slimaudio_output_null_speed = 1;
+
 /* Find audio devices which support stereo */
 PaDeviceIndex GetAudioDevices(PaDeviceIndex default_device, char *default_device_name,
 	char *default_hostapi, bool output_change, bool show_list)
@@ -211,17 +216,105 @@ PaDeviceIndex GetAudioDevices(PaDeviceIndex default_device, char *default_device
 	return (DefaultDevice) ;
 }
 
+/* Sample rates the server may send, highest first */
+static const unsigned int probe_rates[] = { 192000, 176400, 96000, 88200, 48000, 44100, 0 };
+
+/* DoP rates for DSD64 and DSD128 */
+static const unsigned int dop_rates[] = { 352800, 176400, 0 };
+
+/* Returns the first of rates the device plays in stereo at format. */
+static unsigned int probe_format_rate(PaDeviceIndex device, PaSampleFormat format, const unsigned int *rates)
+{
+	const PaDeviceInfo *pdi;
+	unsigned int max_rate = 0;
+	int i;
+#ifdef PORTAUDIO_DEV
+	PaStreamParameters outputParameters;
+#endif
+
+	if (Pa_Initialize() != paNoError)
+		return 0;
+
+	pdi = Pa_GetDeviceInfo(device);
+	if (pdi == NULL)
+		goto done;
+
+#ifdef PORTAUDIO_DEV
+	outputParameters.device = device;
+	outputParameters.channelCount = 2;
+	outputParameters.sampleFormat = format;
+	outputParameters.suggestedLatency = pdi->defaultHighOutputLatency;
+	outputParameters.hostApiSpecificStreamInfo = NULL;
+
+	for (i=0; rates[i] != 0; i++) {
+		if (Pa_IsFormatSupported(NULL, &outputParameters, (double) rates[i]) == paFormatIsSupported) {
+			max_rate = rates[i];
+			break;
+		}
+	}
+#else
+	/* v18 lists discrete rates, or a range when numSampleRates is -1 */
+	if ( (pdi->nativeSampleFormats & format) && (pdi->maxOutputChannels >= 2) ) {
+		for (i=0; rates[i] != 0; i++) {
+			if (pdi->numSampleRates == -1) {
+				if ( (rates[i] >= pdi->sampleRates[0]) && (rates[i] <= pdi->sampleRates[1]) ) {
+					max_rate = rates[i];
+					break;
+				}
+			}
+			else {
+				int j;
+
+				for (j=0; j < pdi->numSampleRates; j++) {
+					if ( (unsigned int) pdi->sampleRates[j] == rates[i] )
+						max_rate = rates[i];
+				}
+				if (max_rate != 0)
+					break;
+			}
+		}
+	}
+#endif
+
+done:
+	Pa_Terminate();
+
+	DEBUGF("probe_format_rate: device %d format 0x%lx rate %u\n", device, (unsigned long) format, max_rate);
+
+	return max_rate;
+}
+
+unsigned int slimaudio_output_probe_rate(PaDeviceIndex device)
+{
+	return probe_format_rate(device, paInt16, probe_rates);
+}
+
 int slimaudio_output_init(slimaudio_t *audio, PaDeviceIndex output_device_id,
 	char *output_device_name, char *hostapi_name, bool output_change)
 {
-	audio->output_device_id = GetAudioDevices(output_device_id, output_device_name, hostapi_name, output_change, false);
+	if (slimaudio_output_null) {
+		/* plays any rate, DoP too */
+		audio->output_device_id = paNoDevice;
+		audio->output_device_max_rate = 0;
+		audio->output_device_dop_rate = dop_rates[0];
+	}
+	else {
+		audio->output_device_id = GetAudioDevices(output_device_id, output_device_name, hostapi_name, output_change, false);
 
-	if ( audio->output_device_id == paNoDevice )
-	{
-		printf("PortAudio error7: No output devices found.\n" );
-		exit(-1);
+		if ( audio->output_device_id == paNoDevice )
+		{
+			printf("PortAudio error7: No output devices found.\n" );
+			exit(-1);
+		}
+
+		audio->output_device_max_rate = slimaudio_output_probe_rate(audio->output_device_id);
+		audio->output_device_dop_rate = probe_format_rate(audio->output_device_id, paInt32, dop_rates);
 	}
 
+	audio->output_rate = OUTPUT_RATE;
+	audio->output_dop = false;
+	audio->decoder_format = OUTPUT_FORMAT(OUTPUT_RATE, false);
+
 #ifndef PORTAUDIO_DEV
 	audio->px_mixer = NULL;
 #endif
@@ -242,17 +335,17 @@ int slimaudio_output_init(slimaudio_t *audio, PaDeviceIndex output_device_id,
 	slimproto_add_command_callback(audio->proto, "audg", &audg_callback, audio);
 	
 	pthread_mutex_init(&(audio->output_mutex), NULL);
-	pthread_cond_init(&(audio->output_cond), NULL);
+	slimproto_cond_init(&(audio->output_cond));
 
 	return 0;
 }
 
 void slimaudio_output_destroy(slimaudio_t *audio) {
+	/* before the mutex goes, audg_callback takes it */
+	slimproto_remove_command_callback(audio->proto, "audg", &audg_callback, audio);
 
 	pthread_mutex_destroy(&(audio->output_mutex));
 	pthread_cond_destroy(&(audio->output_cond));
-
-	/* FIXME remove slimproto callback */
 }
 
 int slimaudio_output_open(slimaudio_t *audio) {
@@ -337,30 +430,13 @@ static void output_thread_stat(slimaudio_t* audio, char* code) {
 	pthread_mutex_lock(&audio->output_mutex);
 }
 
-static void *output_thread(void *ptr) {
+/* Opens the PortAudio stream at audio->output_rate. */
+static int output_open_stream(slimaudio_t *audio) {
 	int err;
-	int output_buffer_size;
-#ifndef PORTAUDIO_DEV
-	int num_mixers, nbVolumes, volumeIdx;
-#endif
-	struct timeval  now;
-	struct timespec timeout;
-	
-	slimaudio_t *audio = (slimaudio_t *) ptr;
-	audio->output_STMs = false;
-	audio->output_STMu = false;
 
-        err = Pa_Initialize();
-        if (err != paNoError) {
-                printf("PortAudio error4: %s Could not open any audio devices.\n", Pa_GetErrorText(err) );
-                exit(-1);
-        }
-
-#ifdef RENICE
-	if ( renice )
-		if ( renice_thread (-5) ) /* Increase priority */
-			fprintf(stderr, "output_thread: renice failed. Got Root?\n");
-#endif
+	/* the null output has nothing to open */
+	if (slimaudio_output_null)
+		return paNoError;
 
 #ifndef PORTAUDIO_DEV
 	DEBUGF("output_thread: output_device_id  : %i\n", audio->output_device_id );
@@ -374,12 +450,12 @@ static void *output_thread(void *ptr) {
 				NULL,			/* input driver info */
 				audio->output_device_id,/* output device */
 				2,			/* output channels */
-				paInt16,		/* output sample format */
+				audio->output_dop ? paInt32 : paInt16,	/* output sample format */
 				NULL,			/* output driver info */
-				44100.0,		/* sample rate */
+				(double) audio->output_rate,	/* sample rate */
 				pa_framesPerBuffer,	/* frames per buffer */
 				pa_numberOfBuffers,	/* number of buffers */
-				paNoFlag,		/* stream flags */
+				audio->output_dop ? paClipOff | paDitherOff : paNoFlag,	/* stream flags */
 				pa_callback,		/* callback */
 				audio);			/* user data */
 #else
@@ -407,7 +483,8 @@ static void *output_thread(void *ptr) {
 #else
 	outputParameters.channelCount = 2;
 #endif
-	outputParameters.sampleFormat = paInt16;
+	/* DoP frames must reach the DAC untouched */
+	outputParameters.sampleFormat = audio->output_dop ? paInt32 : paInt16;
 	outputParameters.suggestedLatency = paDeviceInfo->defaultHighOutputLatency;
 
 	if ( modify_latency )
@@ -463,13 +540,205 @@ static void *output_thread(void *ptr) {
 	err = Pa_OpenStream (	&audio->pa_stream,				/* stream */
 				NULL,						/* inputParameters */
 				&outputParameters,				/* outputParameters */
-				44100.0,					/* sample rate */
+				(double) audio->output_rate,			/* sample rate */
 				paFramesPerBufferUnspecified,			/* framesPerBuffer */
-				paPrimeOutputBuffersUsingStreamCallback,	/* streamFlags */
+				paPrimeOutputBuffersUsingStreamCallback |
+				(audio->output_dop ? paClipOff | paDitherOff : paNoFlag),	/* streamFlags */
 				pa_callback,					/* streamCallback */
 				audio);						/* userData */
 #endif
 
+
+	return err;
+}
+
+/* The null output calls pa_callback from this thread, as PortAudio would,
+** for NULL_FRAMES at a time and at the pace of the stream rate, and throws
+** the audio away.
+*/
+#define NULL_FRAMES	1024
+
+static void *output_null_thread(void *ptr) {
+	slimaudio_t *audio = (slimaudio_t *) ptr;
+#ifdef ZONES
+	char buf[NULL_FRAMES * 2 * 4 * MAX_ZONES];	/* DoP frames in every zone */
+#else
+	char buf[NULL_FRAMES * 2 * 4];			/* DoP frames */
+#endif
+	unsigned int speed = (slimaudio_output_null_speed > 0) ? slimaudio_output_null_speed : 1;
+	u64_t next = slimproto_clock_usec(), now;
+
+	while (audio->output_null_running) {
+#ifdef PORTAUDIO_DEV
+		pa_callback(NULL, buf, NULL_FRAMES, NULL, 0, audio);
+#else
+		pa_callback(NULL, buf, NULL_FRAMES, 0, audio);
+#endif
+
+		next += (u64_t) NULL_FRAMES * 1000000 / audio->output_rate / speed;
+
+		now = slimproto_clock_usec();
+		if (next > now)
+			Pa_Sleep((long) ((next - now) / 1000));
+		else if (now - next > 1000000)
+			next = now;	/* too far behind to catch up */
+	}
+
+	return NULL;
+}
+
+/* The stream calls, on the PortAudio stream or the null output. */
+static int output_stream_start(slimaudio_t *audio) {
+	if (slimaudio_output_null) {
+		audio->output_null_running = true;
+
+		if (pthread_create(&audio->output_null_thread, NULL, output_null_thread, (void *) audio) != 0) {
+			audio->output_null_running = false;
+			return paInternalError;
+		}
+		return paNoError;
+	}
+
+	return Pa_StartStream(audio->pa_stream);
+}
+
+static int output_stream_stop(slimaudio_t *audio) {
+	if (slimaudio_output_null) {
+		audio->output_null_running = false;
+		pthread_join(audio->output_null_thread, NULL);
+		return paNoError;
+	}
+
+	return Pa_StopStream(audio->pa_stream);
+}
+
+static int output_stream_active(slimaudio_t *audio) {
+	if (slimaudio_output_null)
+		return audio->output_null_running ? 1 : 0;
+
+#ifndef PORTAUDIO_DEV
+	return Pa_StreamActive(audio->pa_stream);
+#else
+	return Pa_IsStreamActive(audio->pa_stream);
+#endif
+}
+
+static int output_stream_close(slimaudio_t *audio) {
+	if (slimaudio_output_null) {
+		if (audio->output_null_running)
+			output_stream_stop(audio);
+		return paNoError;
+	}
+
+	return Pa_CloseStream(audio->pa_stream);
+}
+
+/* Returns the format of the stream the next read comes from if the output
+** stream is not running at it, 0 otherwise.
+*/
+static unsigned int output_format_pending(slimaudio_t *audio) {
+	unsigned int format = slimaudio_buffer_read_format(audio->output_buffer);
+
+	if ( (format == 0) || (format == OUTPUT_FORMAT(audio->output_rate, audio->output_dop)) )
+		return 0;
+
+	return format;
+}
+
+/* Reopens the output stream when the stream to play next was decoded at
+** a different sample rate or format.  Called from the output thread with
+** the output mutex held.
+*/
+static void output_set_stream_format(slimaudio_t *audio) {
+	unsigned int format;
+	int active, err;
+
+	audio->output_format_change = false;
+
+	format = output_format_pending(audio);
+	if (format == 0)
+		return;
+
+	DEBUGF("output_set_stream_format: %u%s -> %u%s\n",
+		audio->output_rate, audio->output_dop ? " DoP" : "",
+		OUTPUT_FORMAT_RATE(format), (format & OUTPUT_FORMAT_DOP) ? " DoP" : "");
+
+	active = output_stream_active(audio);
+	if (active > 0) {
+		err = output_stream_stop(audio);
+		if (err != paNoError) {
+			printf("output_thread[RATE]: PortAudio error3: %s\n", Pa_GetErrorText(err) );
+			exit(-1);
+		}
+	}
+
+#ifndef PORTAUDIO_DEV
+	/* the mixer belongs to the stream */
+	if (audio->px_mixer != NULL) {
+		Px_CloseMixer(audio->px_mixer);
+		audio->px_mixer = NULL;
+	}
+#endif
+
+	output_stream_close(audio);
+
+	audio->output_rate = OUTPUT_FORMAT_RATE(format);
+	audio->output_dop = (format & OUTPUT_FORMAT_DOP) != 0;
+
+	/* the watermarks are kept in time, not bytes */
+	slimaudio_output_set_watermarks(audio);
+
+	err = output_open_stream(audio);
+	if (err != paNoError) {
+		printf("output_thread[RATE]: PortAudio error1: %s\n", Pa_GetErrorText(err) );
+		exit(-1);
+	}
+
+#ifndef PORTAUDIO_DEV
+	if ( (audio->volume_control == VOLUME_DRIVER) && !slimaudio_output_null ) {
+		audio->px_mixer = Px_OpenMixer(audio->pa_stream, 0);
+		slimaudio_output_vol_adjust(audio);
+	}
+#endif
+
+	if (active > 0) {
+		err = output_stream_start(audio);
+		if (err != paNoError) {
+			printf("output_thread[RATE]: PortAudio error2: %s\n", Pa_GetErrorText(err));
+			exit(-1);
+		}
+	}
+}
+
+static void *output_thread(void *ptr) {
+	int err;
+	int output_buffer_size;
+	u32_t output_buffer_msec;
+#ifndef PORTAUDIO_DEV
+	int num_mixers, nbVolumes, volumeIdx;
+#endif
+	struct timespec timeout;
+	
+	slimaudio_t *audio = (slimaudio_t *) ptr;
+	audio->output_STMs = false;
+	audio->output_STMu = false;
+
+	if (!slimaudio_output_null) {
+		err = Pa_Initialize();
+		if (err != paNoError) {
+			printf("PortAudio error4: %s Could not open any audio devices.\n", Pa_GetErrorText(err) );
+			exit(-1);
+		}
+	}
+
+#ifdef RENICE
+	if ( renice )
+		if ( renice_thread (-5) ) /* Increase priority */
+			fprintf(stderr, "output_thread: renice failed. Got Root?\n");
+#endif
+
+	err = output_open_stream(audio);
+
 #ifdef BSD_THREAD_LOCKING
 	pthread_mutex_lock(&audio->output_mutex);
 #endif
@@ -480,12 +749,12 @@ static void *output_thread(void *ptr) {
 	}
 
 #ifndef PORTAUDIO_DEV
-	num_mixers = Px_GetNumMixers(audio->pa_stream);
+	num_mixers = slimaudio_output_null ? 0 : Px_GetNumMixers(audio->pa_stream);
 	while (--num_mixers >= 0) {
 		DEBUGF("Mixer: %s\n", Px_GetMixerName(audio->pa_stream, num_mixers));
 	}
 	
-	if (audio->volume_control == VOLUME_DRIVER) {
+	if ( (audio->volume_control == VOLUME_DRIVER) && !slimaudio_output_null ) {
 		DEBUGF("Opening mixer.\n" );
 		audio->px_mixer = Px_OpenMixer(audio->pa_stream, 0);
 	}
@@ -533,9 +802,7 @@ static void *output_thread(void *ptr) {
 					pthread_cond_wait(&audio->output_cond, &audio->output_mutex);
 				}
 				else {
-					gettimeofday(&now, NULL);
-					timeout.tv_sec = now.tv_sec + audio->keepalive_interval;
-					timeout.tv_nsec = now.tv_usec * 1000;				
+					slimproto_cond_timeout(&timeout, audio->keepalive_interval * 1000);
 					err = pthread_cond_timedwait(&audio->output_cond,
 								     &audio->output_mutex, &timeout);
 					if (err == ETIMEDOUT) {
@@ -547,18 +814,15 @@ static void *output_thread(void *ptr) {
 				break;
 
 			case PLAY:
-				audio->output_predelay_frames = audio->output_predelay_msec * 44.100;
-
-				DEBUGF("output_thread PLAY: output_predelay_frames: %i\n",
-					audio->output_predelay_frames);
-
 				output_buffer_size = slimaudio_buffer_available(audio->output_buffer);
 
-				DEBUGF("output_thread BUFFERING: output_buffer_size: %i output_threshold: %i",
-					output_buffer_size, audio->output_threshold);
+				output_buffer_msec = slimaudio_output_msec(audio, output_buffer_size);
+
+				DEBUGF("output_thread BUFFERING: output_buffer_size: %i (%u ms) output_threshold: %u ms",
+					output_buffer_size, output_buffer_msec, audio->output_threshold_msec);
 				DEBUGF(" buffering_timeout: %i\n", audio->buffering_timeout);
 
-				if ( (output_buffer_size < audio->output_threshold) && (audio->buffering_timeout > 0) )
+				if ( (output_buffer_msec < audio->output_threshold_msec) && (audio->buffering_timeout > 0) )
 				{
 					pthread_mutex_unlock(&audio->output_mutex);
 					pthread_cond_broadcast(&audio->output_cond);
@@ -575,7 +839,16 @@ static void *output_thread(void *ptr) {
 
 					audio->buffering_timeout = BUFFERING_TIMEOUT;
 
-					err = Pa_StartStream(audio->pa_stream);
+					slimaudio_trace(TRACE_THRESHOLD, slimaudio_buffer_read_tag(audio->output_buffer));
+
+					output_set_stream_format(audio);
+
+					audio->output_predelay_frames = audio->output_predelay_msec * (audio->output_rate / 1000.0);
+
+					DEBUGF("output_thread PLAY: output_predelay_frames: %i\n",
+						audio->output_predelay_frames);
+
+					err = output_stream_start(audio);
 					if (err != paNoError)
 					{
 						printf("output_thread: PortAudio error2: %s\n", Pa_GetErrorText(err));
@@ -593,9 +866,7 @@ static void *output_thread(void *ptr) {
 				DEBUGF("output_thread BUFFERING: %llu\n",audio->pa_streamtime_offset);
 
 			case PLAYING:			
-				gettimeofday(&now, NULL);
-				timeout.tv_sec = now.tv_sec + 1;
-				timeout.tv_nsec = now.tv_usec * 1000;
+				slimproto_cond_timeout(&timeout, 1000);
 				err = pthread_cond_timedwait(&audio->output_cond, &audio->output_mutex, &timeout);
 
 				if (err == ETIMEDOUT)
@@ -604,6 +875,12 @@ static void *output_thread(void *ptr) {
 					output_thread_stat(audio, "STMt");
 				}
 
+				/* Next track needs another rate or format, the
+				** callback is playing silence until we reopen.
+				*/
+				if (audio->output_format_change)
+					output_set_stream_format(audio);
+
 				/* Track started */				
 				if (audio->output_STMs)
 				{
@@ -617,6 +894,7 @@ static void *output_thread(void *ptr) {
 
 					DEBUGF("output_thread STMs-PLAYING: %llu\n",audio->pa_streamtime_offset);
 					output_thread_stat(audio, "STMs");
+					slimaudio_trace(TRACE_STMS, audio->output_trace);
 				}
 
 				/* Data underrun
@@ -627,6 +905,7 @@ static void *output_thread(void *ptr) {
 					audio->output_STMu = false;
 
 					audio->output_state = STOP;
+					audio->output_STMu_count++;
 
 					DEBUGF("output_thread STMu-PLAYING: %llu\n",audio->pa_streamtime_offset);
 					output_thread_stat(audio, "STMu");
@@ -637,28 +916,8 @@ static void *output_thread(void *ptr) {
 				break;
 		
 			case STOP:
-#ifndef PORTAUDIO_DEV
-				if ( (err = Pa_StreamActive(audio->pa_stream) ) > 0)
-				{
-					err = Pa_StopStream(audio->pa_stream);
-					if (err != paNoError)
-					{
-						printf("output_thread: PortAudio error3: %s\n", Pa_GetErrorText(err) );	
-						exit(-1);
-					}
-				}
-				else
-				{
-					if ( err != paNoError)
-					{
-						printf("output_thread: PortAudio error9: %s\n",
-						Pa_GetErrorText(err) );
-						exit(-1);
-					}
-				}
-#else
-				if ( (err = Pa_IsStreamActive(audio->pa_stream)) > 0) {
-					err = Pa_StopStream(audio->pa_stream);
+				if ( (err = output_stream_active(audio)) > 0) {
+					err = output_stream_stop(audio);
 					if (err != paNoError) {
 						printf("output_thread[STOP]: PortAudio error3: %s\n",
 									Pa_GetErrorText(err) );
@@ -669,7 +928,6 @@ static void *output_thread(void *ptr) {
 									Pa_GetErrorText(err) );
 					exit(-1);
 				}
-#endif
 				audio->output_state = STOPPED;
 
 				DEBUGF("output_thread STOP: %llu\n",audio->pa_streamtime_offset);
@@ -678,28 +936,8 @@ static void *output_thread(void *ptr) {
 				break;
 				
 			case PAUSE:
-#ifndef PORTAUDIO_DEV
-				if ( (err = Pa_StreamActive(audio->pa_stream) ) > 0)
-				{
-					err = Pa_StopStream(audio->pa_stream);
-					if (err != paNoError)
-					{
-						printf("output_thread: PortAudio error10: %s\n", Pa_GetErrorText(err));	
-						exit(-1);
-					}
-				}
-				else
-				{
-					if ( err != paNoError)
-					{
-						printf("output_thread: PortAudio error11: %s\n",
-						Pa_GetErrorText(err) );
-						exit(-1);
-					}
-				}
-#else
-				if ( (err = Pa_IsStreamActive(audio->pa_stream)) > 0) {
-					err = Pa_StopStream(audio->pa_stream);
+				if ( (err = output_stream_active(audio)) > 0) {
+					err = output_stream_stop(audio);
 					if (err != paNoError) {
 						printf("output_thread[PAUSE]: PortAudio error3: %s\n",
 								Pa_GetErrorText(err) );
@@ -710,7 +948,6 @@ static void *output_thread(void *ptr) {
 							Pa_GetErrorText(err) );
 					exit(-1);
 				}
-#endif
 				audio->output_state = PAUSED;
 
 				DEBUGF("output_thread PAUSE: %llu\n",audio->pa_streamtime_offset);
@@ -733,7 +970,7 @@ static void *output_thread(void *ptr) {
 	}
 #endif
 
-	err = Pa_CloseStream(audio->pa_stream);
+	err = output_stream_close(audio);
 
 	if (err != paNoError) {
 		printf("output_thread[exit]: PortAudio error3: %s\n", Pa_GetErrorText(err) );
@@ -741,7 +978,8 @@ static void *output_thread(void *ptr) {
 	}
 
 	audio->pa_stream = NULL;
-	Pa_Terminate();
+	if (!slimaudio_output_null)
+		Pa_Terminate();
 
 	DEBUGF("output_thread: PortAudio terminated\n");
 
@@ -770,6 +1008,57 @@ static int audg_callback(slimproto_t *proto, const unsigned char *buf, int buf_l
 	return 0;
 }
 
+int slimaudio_output_set_rate(slimaudio_t *audio, unsigned int rate) {
+	if ( (audio->output_device_max_rate > 0) && (rate > audio->output_device_max_rate) ) {
+		DEBUGF("slimaudio_output_set_rate: %u above device max %u\n", rate, audio->output_device_max_rate);
+		return -1;
+	}
+
+	/* the stream plays at it once the output reaches it */
+	audio->decoder_format = OUTPUT_FORMAT(rate, false);
+	slimaudio_buffer_set_format(audio->output_buffer, audio->decoder_format);
+
+	return 0;
+}
+
+u32_t slimaudio_output_msec(slimaudio_t *audio, int bytes) {
+	return (u32_t) (slimaudio_output_usec(audio, bytes) / 1000);
+}
+
+u64_t slimaudio_output_usec(slimaudio_t *audio, int bytes) {
+	unsigned int format = slimaudio_buffer_read_format(audio->output_buffer);
+
+	if (format == 0)
+		format = OUTPUT_FORMAT(audio->output_rate, audio->output_dop);
+
+	return slimaudio_output_format_usec(format, bytes);
+}
+
+u64_t slimaudio_output_format_usec(unsigned int format, int bytes) {
+	return (u64_t) bytes / OUTPUT_FORMAT_FRAME(format) * 1000000 / OUTPUT_FORMAT_RATE(format);
+}
+
+void slimaudio_output_set_watermarks(slimaudio_t *audio) {
+	/* 16-bit or DoP stereo frames */
+	const int frame_size = audio->output_dop ? 2 * 4 : 2 * 2;
+
+	slimaudio_buffer_set_watermarks(audio->output_buffer,
+		(int) ((u64_t) audio->output_low_watermark_msec * audio->output_rate / 1000) * frame_size,
+		(int) ((u64_t) audio->output_high_watermark_msec * audio->output_rate / 1000) * frame_size);
+}
+
+int slimaudio_output_set_dop(slimaudio_t *audio, unsigned int rate) {
+	if (rate > audio->output_device_dop_rate) {
+		DEBUGF("slimaudio_output_set_dop: %u above device DoP max %u\n", rate, audio->output_device_dop_rate);
+		return -1;
+	}
+
+	audio->decoder_format = OUTPUT_FORMAT(rate, true);
+	slimaudio_buffer_set_format(audio->output_buffer, audio->decoder_format);
+
+	return 0;
+}
+
 void slimaudio_output_connect(slimaudio_t *audio, slimproto_msg_t *msg) {
 	pthread_mutex_lock(&audio->output_mutex);
 
@@ -914,8 +1203,8 @@ static int produce_predelay_frames(slimaudio_t* audio, void* outputBuffer, unsig
 {
 	int i;
 	unsigned int predelayBytes;
-	/* FIXME: Asuming 2 channels, 16 bit samples (i.e. 2 bytes) */
-	const int frameSize = 2 * 2;
+	/* FIXME: Asuming 2 channels, 16 bit samples (i.e. 2 bytes) or DoP */
+	const int frameSize = audio->output_dop ? 2 * 4 : 2 * 2;
 	unsigned int predelayFrames = audio->output_predelay_frames;
 	const unsigned int maxFrames = nbBytes / frameSize;
 		
@@ -927,7 +1216,7 @@ static int produce_predelay_frames(slimaudio_t* audio, void* outputBuffer, unsig
 	       predelayFrames);
 	
 	predelayBytes = predelayFrames * frameSize;
-	if (audio->output_predelay_amplitude == 0) {
+	if ( (audio->output_predelay_amplitude == 0) || audio->output_dop ) {
 		memset((char*)outputBuffer, 0, predelayBytes);
 	}
 	else {
@@ -970,13 +1259,19 @@ static int pa_callback(  const void *inputBuffer, void *outputBuffer,
 	slimaudio_t * const audio = (slimaudio_t *) userData;
 	slimaudio_buffer_status ok = SLIMAUDIO_BUFFER_STREAM_CONTINUE ;
 
-	/* FIXME: Asuming 2 channels, 16 bit samples (i.e. 2 bytes) */
-	const int frameSize = 2 * 2;
+	/* FIXME: Asuming 2 channels, 16 bit samples (i.e. 2 bytes) or DoP */
+	const int frameSize = audio->output_dop ? 2 * 4 : 2 * 2;
 	const int len = framesPerBuffer * frameSize; 
 	
 	int off = 0, uninitSize, data_len;
 
-	while ( (audio->output_state == PLAYING) && ((len - off) > 0) )
+#ifdef PORTAUDIO_DEV
+	/* counted for the metrics, which only read it */
+	if (statusFlags & paOutputUnderflow)
+		audio->output_underflows++;
+#endif
+
+	while ( (audio->output_state == PLAYING) && !audio->output_format_change && ((len - off) > 0) )
 	{
 		if (audio->output_predelay_frames > 0) {
 			off += produce_predelay_frames(audio, (char*)outputBuffer + off, len - off);
@@ -988,11 +1283,17 @@ static int pa_callback(  const void *inputBuffer, void *outputBuffer,
 		if (slimaudio_buffer_available(audio->output_buffer) > 0)
 		{
 			ok = slimaudio_buffer_read( audio->output_buffer, (char *) outputBuffer+off, &data_len);
+			audio->output_underrun = false;
 		}
 		else
 		{
 			ok = SLIMAUDIO_BUFFER_STREAM_UNDERRUN;
 			DEBUGF("pa_callback: SLIMAUDIO_BUFFER_STREAM_UNDERRUN\n");
+
+			if (!audio->output_underrun) {
+				audio->output_underrun = true;
+				audio->output_underruns++;
+			}
 			break; /* Added so playback would be silent on underrun */
 		}
 
@@ -1006,8 +1307,23 @@ static int pa_callback(  const void *inputBuffer, void *outputBuffer,
 				*/
 				audio->output_STMu = true;
 
+				/* the buffer ran out at the end of the playlist,
+				** the reads after this are not an underrun
+				*/
+				audio->output_underrun = true;
+
 				DEBUGF("pa_callback: STREAM_END:output_STMu:%i\n",audio->output_STMu);
 
+				pthread_cond_broadcast(&audio->output_cond);
+			}
+			else if (output_format_pending(audio)) {
+				/* Don't read the next track in the wrong format,
+				** the output thread reopens the stream first.
+				*/
+				audio->output_format_change = true;
+
+				DEBUGF("pa_callback: STREAM_END:output_format_change\n");
+
 				pthread_cond_broadcast(&audio->output_cond);
 			}
 		}
@@ -1015,6 +1331,9 @@ static int pa_callback(  const void *inputBuffer, void *outputBuffer,
 			/* Send track start to Squeezebox Server. During normal play
 			** this advances the playlist.
 			*/
+			audio->output_trace = slimaudio_buffer_read_tag(audio->output_buffer);
+			slimaudio_trace(TRACE_PLAYED, audio->output_trace);
+
 			audio->output_STMs = true;
 
 			DEBUGF("pa_callback: STREAM_START:output_STMs:%i tracks:%i\n",
@@ -1024,12 +1343,15 @@ static int pa_callback(  const void *inputBuffer, void *outputBuffer,
 
 		}
 
-		audio->stream_samples += framesPerBuffer;
+		/* count what was played, a buffer may span a track boundary */
+		audio->stream_samples += data_len / frameSize;
 
 		off += data_len;
 
-		/* if we have underrun fill remaining buffer with silence */
-		if (data_len == 0) {
+		/* if we have underrun fill remaining buffer with silence, an
+		** empty read at the end of a track just moves on to the next.
+		*/
+		if ( (data_len == 0) && (ok != SLIMAUDIO_BUFFER_STREAM_END) ) {
 			DEBUGF("pa_callback: DATA_LEN0:off=len\n");
 
 			/* Clear any remaining buffer so we don't hear it played out */
@@ -1046,14 +1368,15 @@ static int pa_callback(  const void *inputBuffer, void *outputBuffer,
 		memset((char *)outputBuffer+off, 0, uninitSize);
 	}
 
-	if (audio->volume_control == VOLUME_SOFTWARE) {
+	/* DoP frames are DSD data, scaling them would destroy it */
+	if ( (audio->volume_control == VOLUME_SOFTWARE) && !audio->output_dop ) {
 		apply_software_volume(audio, outputBuffer, framesPerBuffer);
 	}
 #ifdef ZONES	
 	if (audio->output_num_zones > 1)
 	{
-		/* FIXME: Asuming 2 channels, 16 bit samples (i.e. 2 bytes) */
-		char frame[2*MAX_ZONES] = {0};
+		/* FIXME: Asuming 2 channels, 16 bit samples (i.e. 2 bytes) or DoP */
+		char frame[2*4*MAX_ZONES] = {0};
 		int zonedFrameSize = frameSize*audio->output_num_zones;
 		int zonedLen = framesPerBuffer*zonedFrameSize;
 		int writePos, readPos;
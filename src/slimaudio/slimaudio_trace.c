@@ -0,0 +1,237 @@
+/*
+ *   SlimProtoLib Copyright (c) 2004,2006 Richard Titmuss
+ *
+ *   This file is part of SlimProtoLib.
+ *
+ *   SlimProtoLib is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SlimProtoLib is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with SlimProtoLib; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "slimproto/slimproto_clock.h"
+#include "slimaudio/slimaudio_trace.h"
+
+struct trace_event {
+	u64_t usec;			/* slimproto_clock_usec */
+	u32_t track;
+	u8_t point;
+	u8_t ring;			/* of the thread, for dumps */
+};
+
+struct trace_ring {
+	bool owned;			/* by a running thread, under trace_mutex */
+	volatile u32_t head;		/* points recorded, ever */
+	struct trace_event events[TRACE_RING_SIZE];
+};
+
+static const char *trace_names[TRACE_POINTS] = {
+	"strm", "connected", "header", "body", "decoded", "threshold", "played", "STMs"
+};
+
+/* Ring 0 is kept for the stream callback, which must not lock to take
+** one.  Only one callback plays at a time, PortAudio or the null output.
+*/
+#define TRACE_RING_PLAYED	(0)
+
+static struct trace_ring trace_rings[TRACE_RINGS];
+static u32_t trace_tracks;			/* under trace_mutex */
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+/* Frees the ring of a thread that exits.  Its points stay for dumps until
+** the next thread that takes the ring writes over them.
+*/
+static void trace_release(void *ring) {
+	pthread_mutex_lock(&trace_mutex);
+	((struct trace_ring *) ring)->owned = false;
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+static void trace_init(void) {
+	pthread_key_create(&trace_key, trace_release);
+}
+
+/* Returns the ring of this thread, taking a free one on the first call.
+** NULL if all are taken.
+*/
+static struct trace_ring *trace_ring(void) {
+	struct trace_ring *ring;
+	int i;
+
+	pthread_once(&trace_once, trace_init);
+
+	ring = (struct trace_ring *) pthread_getspecific(trace_key);
+	if (ring != NULL)
+		return ring;
+
+	pthread_mutex_lock(&trace_mutex);
+
+	for (i = TRACE_RING_PLAYED + 1; i < TRACE_RINGS; i++) {
+		if (!trace_rings[i].owned) {
+			trace_rings[i].owned = true;
+			ring = &trace_rings[i];
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&trace_mutex);
+
+	if (ring != NULL)
+		pthread_setspecific(trace_key, ring);
+
+	return ring;
+}
+
+u32_t slimaudio_trace_track(void) {
+	u32_t track;
+
+	pthread_mutex_lock(&trace_mutex);
+
+	if (++trace_tracks == 0)
+		trace_tracks++;
+	track = trace_tracks;
+
+	pthread_mutex_unlock(&trace_mutex);
+
+	return track;
+}
+
+/* Each ring has one writer, so recording needs no lock.  A dump racing
+** the writer may show the newest point of a ring half written.
+*/
+void slimaudio_trace(slimaudio_trace_point_t point, u32_t track) {
+	struct trace_ring *ring;
+	struct trace_event *event;
+	u32_t head;
+
+	if (point == TRACE_PLAYED)
+		ring = &trace_rings[TRACE_RING_PLAYED];
+	else
+		ring = trace_ring();
+
+	if (ring == NULL)
+		return;
+
+	head = ring->head;
+
+	event = &ring->events[head % TRACE_RING_SIZE];
+	event->usec = slimproto_clock_usec();
+	event->track = track;
+	event->point = point;
+	event->ring = ring - trace_rings;
+
+	ring->head = head + 1;
+}
+
+static int trace_compare(const void *a, const void *b) {
+	const struct trace_event *x = a, *y = b;
+
+	if (x->usec == y->usec)
+		return 0;
+	return (x->usec < y->usec) ? -1 : 1;
+}
+
+/* Writes the time each stage took for track, from the point before it
+** that was recorded.  A track queued to follow another decodes ahead of
+** playing, and starts without reaching the output threshold.
+*/
+static void trace_summary(FILE *fp, struct trace_event *events, int count, u32_t track) {
+	u64_t first[TRACE_POINTS];
+	u64_t last = 0, start = 0;
+	int i;
+
+	memset(first, 0, sizeof(first));
+
+	for (i = 0; i < count; i++) {
+		if ( (events[i].track == track) && (first[events[i].point] == 0) )
+			first[events[i].point] = events[i].usec;
+	}
+
+	fprintf(fp, "trace: track %u:", track);
+
+	for (i = 0; i < TRACE_POINTS; i++) {
+		if (first[i] == 0)
+			continue;
+
+		if (last == 0)
+			start = first[i];
+		else
+			fprintf(fp, " %s %.1f ms", trace_names[i], (first[i] - last) / 1000.0);
+
+		last = first[i];
+	}
+
+	fprintf(fp, ", total %.1f ms%s\n", (last - start) / 1000.0,
+		(first[TRACE_STRM] == 0) ? " (strm lost)" : "");
+}
+
+void slimaudio_trace_dump(FILE *fp) {
+	struct trace_event *events;
+	u32_t head, n, j, *tracks;
+	int i, k, count = 0, num_tracks = 0;
+
+	events = (struct trace_event *) malloc(TRACE_RINGS * TRACE_RING_SIZE * sizeof(struct trace_event));
+	tracks = (u32_t *) malloc(TRACE_RINGS * TRACE_RING_SIZE * sizeof(u32_t));
+	if ( (events == NULL) || (tracks == NULL) ) {
+		free(events);
+		free(tracks);
+		return;
+	}
+
+	/* A thread may record while this copies.  The ring would have to
+	** wrap for it to change a point copied here.
+	*/
+	for (i = 0; i < TRACE_RINGS; i++) {
+		head = trace_rings[i].head;
+
+		n = (head < TRACE_RING_SIZE) ? head : TRACE_RING_SIZE;
+		for (j = head - n; j != head; j++)
+			events[count++] = trace_rings[i].events[j % TRACE_RING_SIZE];
+	}
+
+	qsort(events, count, sizeof(struct trace_event), trace_compare);
+
+	fprintf(fp, "trace: %i points\n", count);
+
+	for (i = 0; i < count; i++) {
+		fprintf(fp, "trace: %10.3f ms thread %u track %u %s\n",
+			(events[i].usec - events[0].usec) / 1000.0, events[i].ring,
+			events[i].track, trace_names[events[i].point]);
+
+		if (events[i].track == 0)
+			continue;
+
+		for (k = 0; k < num_tracks; k++) {
+			if (tracks[k] == events[i].track)
+				break;
+		}
+		if (k == num_tracks)
+			tracks[num_tracks++] = events[i].track;
+	}
+
+	for (k = 0; k < num_tracks; k++)
+		trace_summary(fp, events, count, tracks[k]);
+
+	fflush(fp);
+
+	free(events);
+	free(tracks);
+}
@@ -0,0 +1,62 @@
+/*
+ *   SlimProtoLib Copyright (c) 2004,2006 Richard Titmuss
+ *
+ *   This file is part of SlimProtoLib.
+ *
+ *   SlimProtoLib is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SlimProtoLib is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with SlimProtoLib; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Latency tracepoints from strm s to the first audio played.
+**
+** Each track started with strm s gets a number, which follows it through
+** http, decoder and output.  Each thread records the points it passes in
+** a ring of its own, taken under a lock the first time, so recording takes
+** no lock after that, and none at all in the stream callback.  A dump
+** merges the rings and sums up the time each stage took per track.
+*/
+
+#ifndef _SLIMAUDIO_TRACE_H_
+#define _SLIMAUDIO_TRACE_H_
+
+#include <stdio.h>
+
+#include "slimproto/slimproto.h"
+
+#define TRACE_RINGS		(8)	/* threads tracing at once */
+#define TRACE_RING_SIZE		(256)	/* points kept per thread */
+
+typedef enum {
+	TRACE_STRM = 0,		/* strm s received */
+	TRACE_CONNECTED,	/* stream connection made, or one kept reused */
+	TRACE_HEADER,		/* response header parsed, STMh */
+	TRACE_BODY,		/* first stream data received */
+	TRACE_DECODED,		/* first audio decoded */
+	TRACE_THRESHOLD,	/* output threshold reached */
+	TRACE_PLAYED,		/* first audio taken by the callback */
+	TRACE_STMS,		/* STMs sent */
+	TRACE_POINTS
+} slimaudio_trace_point_t;
+
+/* Returns the number for a new track, never 0. */
+u32_t slimaudio_trace_track(void);
+
+/* Records the point for track, with the time now. */
+void slimaudio_trace(slimaudio_trace_point_t point, u32_t track);
+
+/* Writes the points recorded, then the latency of each stage per track. */
+void slimaudio_trace_dump(FILE *fp);
+
+#endif /*_SLIMAUDIO_TRACE_H_ */
@@ -33,6 +33,7 @@
   #include <ws2tcpip.h>
   #include "poll.h"
   #define CLOSESOCKET(s) closesocket(s)
+  #define SHUT_RDWR SD_BOTH
   #define MSG_DONTWAIT (0)
 #else
   #include <sys/poll.h>
@@ -49,6 +50,8 @@
 #endif
 
 #include "slimproto/slimproto.h"
+#include "slimproto/slimproto_clock.h"
+#include "slimproto/slimproto_capture.h"
 
 #define BUF_LENGTH 4096
 
@@ -73,8 +76,14 @@
 static void *proto_thread(void *ptr);
 static int proto_connect(slimproto_t *p);
 static int proto_recv(slimproto_t *p);
+static void proto_connect_callbacks(slimproto_t *p, bool isConnected);
+static void *proto_send_thread(void *ptr);
+static void proto_send_stop(slimproto_t *p, int fd);
+static int proto_send_drain(slimproto_t *p, int msec);
 
 int slimproto_init(slimproto_t *p) {
+	int i;
+
 	memset(p, 0, sizeof(slimproto_t));
 #ifdef __WIN32__
 	WSADATA info; 
@@ -84,21 +93,46 @@ int slimproto_init(slimproto_t *p) {
 	}
 #endif
 
-	gettimeofday(&p->epoch, NULL);
+	p->epoch = slimproto_clock_usec();
 
 	pthread_mutex_init(&(p->slimproto_mutex), NULL);
 	pthread_cond_init(&(p->slimproto_cond), NULL);
 	p->state = PROTO_CLOSED;
+
+	p->send_queue = (slimproto_frame_t *) calloc(SLIMPROTO_SEND_QUEUE, sizeof(slimproto_frame_t));
+	if (p->send_queue == NULL) {
+		fprintf(stderr, "Error allocating send queue\n");
+		return -1;
+	}
+
+	for (i = 0; i < SLIMPROTO_SEND_QUEUE; i++) {
+		p->send_queue[i].msg = (unsigned char *) malloc(SLIMPROTO_MSG_SIZE);
+		if (p->send_queue[i].msg == NULL) {
+			fprintf(stderr, "Error allocating send queue\n");
+			return -1;
+		}
+	}
+
+	p->send_fd = -1;
+	pthread_mutex_init(&(p->send_mutex), NULL);
+	slimproto_cond_init(&(p->send_cond));
 	
 	if (pthread_create( &p->slimproto_thread, NULL, proto_thread, (void*) p) != 0) {
 		fprintf(stderr, "Error creating proto thread\n");
 		return -1;
 	}	
+
+	if (pthread_create( &p->send_thread, NULL, proto_send_thread, (void*) p) != 0) {
+		fprintf(stderr, "Error creating proto send thread\n");
+		return -1;
+	}	
 	
 	return 0;
 }
 
 void slimproto_destroy(slimproto_t *p) {
+	int i;
+
 	pthread_mutex_lock(&p->slimproto_mutex);
 
 	p->state = PROTO_QUIT;
@@ -112,10 +146,51 @@ void slimproto_destroy(slimproto_t *p) {
 #endif
 	pthread_join(p->slimproto_thread, NULL);
 
+	pthread_mutex_lock(&p->send_mutex);
+	p->send_quit = true;
+	pthread_mutex_unlock(&p->send_mutex);
+
+	pthread_cond_broadcast(&p->send_cond);
+	pthread_join(p->send_thread, NULL);
+
 	p->sockfd = -1;
+
+	DEBUGF("slimproto_destroy: sent %lu frames, %lu coalesced, %lu dropped, queue max %i, "
+		"latency avg %llu max %llu usec\n",
+		p->send_stats.frames, p->send_stats.coalesced, p->send_stats.dropped,
+		p->send_stats.max_depth,
+		p->send_stats.frames ? p->send_stats.usec / p->send_stats.frames : 0,
+		p->send_stats.max_usec);
+
+	for (i = 0; i < SLIMPROTO_SEND_QUEUE; i++)
+		free(p->send_queue[i].msg);
+	free(p->send_queue);
+	p->send_queue = NULL;
+
+	pthread_mutex_destroy(&(p->send_mutex));
+	pthread_cond_destroy(&(p->send_cond));
 	
+#ifdef SLIMPROTO_DEBUG
+	for (i = 0; i < p->commands_size; i++) {
+		if (p->commands[i].count > 0)
+			DEBUGF("slimproto_destroy: %4.4s %lu messages %llu usec\n",
+				(char *) &p->commands[i].opcode, p->commands[i].count, p->commands[i].usec);
+	}
+#endif
+
+	for (i = 0; i < p->commands_size; i++)
+		free(p->commands[i].handlers);
+	free(p->commands);
+	p->commands = NULL;
+	p->commands_size = p->num_commands = 0;
+
+	free(p->connect_callbacks);
+	p->connect_callbacks = NULL;
 	p->num_connect_callbacks = 0;
-	p->num_command_callbacks = 0;
+
+	free(p->recv_buf);
+	p->recv_buf = NULL;
+	p->recv_size = p->recv_len = 0;
 	
 	pthread_mutex_destroy(&(p->slimproto_mutex));
 	pthread_cond_destroy(&(p->slimproto_cond));
@@ -124,7 +199,7 @@ void slimproto_destroy(slimproto_t *p) {
 /* PROTO_QUIT=0, PROTO_CLOSED=1, PROTO_CONNECT=2, PROTO_CONNECTED=3, PROTO_CLOSE=4 */
 
 static void *proto_thread(void *ptr) {
-	int r, i;
+	int r;
 	bool disconnected;
 	
 	slimproto_t *p = (slimproto_t *) ptr;
@@ -143,9 +218,7 @@ static void *proto_thread(void *ptr) {
 				
 			case PROTO_CONNECTED:
 				pthread_mutex_unlock(&p->slimproto_mutex);
-				for (i=0; i<p->num_connect_callbacks; i++) {
-					(p->connect_callbacks[i].callback)(p, true, p->connect_callbacks[i].user_data);
-				}
+				proto_connect_callbacks(p, true);
 
 				while (proto_recv(p) >= 0) {
 					pthread_mutex_lock(&p->slimproto_mutex);
@@ -159,9 +232,7 @@ static void *proto_thread(void *ptr) {
 
 				slimproto_close(p);
 
-				for (i=0; i<p->num_connect_callbacks; i++) {
-					(p->connect_callbacks[i].callback)(p, false, p->connect_callbacks[i].user_data);
-				}
+				proto_connect_callbacks(p, false);
 				pthread_mutex_lock(&p->slimproto_mutex);				
 				break;	
 				
@@ -181,31 +252,225 @@ static void *proto_thread(void *ptr) {
 	return 0;			
 }
 
-void slimproto_add_command_callback(slimproto_t *p, const char *cmd, slimproto_command_callback_t *callback, void *user_data) {
+/* The opcode of a 4 byte command, as it is on the wire. */
+static u32_t proto_opcode(const unsigned char *cmd) {
+	return ((u32_t) cmd[0] << 24) | ((u32_t) cmd[1] << 16) | ((u32_t) cmd[2] << 8) | cmd[3];
+}
+
+/* Returns the slot of opcode, or the free slot it would take. */
+static slimproto_command_t *proto_command_slot(slimproto_t *p, u32_t opcode) {
+	unsigned int mask = p->commands_size - 1;
+	unsigned int i = (opcode * 2654435761U) & mask;
+
+	while ( (p->commands[i].opcode != 0) && (p->commands[i].opcode != opcode) )
+		i = (i + 1) & mask;
+
+	return &p->commands[i];
+}
+
+/* Returns the slot of opcode, or NULL if it has none. */
+static slimproto_command_t *proto_command_find(slimproto_t *p, u32_t opcode) {
+	slimproto_command_t *cmd;
+
+	if (p->commands_size == 0)
+		return NULL;
+
+	cmd = proto_command_slot(p, opcode);
+
+	return (cmd->opcode == opcode) ? cmd : NULL;
+}
+
+/* Doubles the command table once it is half full, to keep probes short. */
+static int proto_command_grow(slimproto_t *p) {
+	slimproto_command_t *old = p->commands;
+	int i, old_size = p->commands_size;
+
+	if ( (p->num_commands + 1) * 2 <= p->commands_size )
+		return 0;
+
+	p->commands_size = old_size ? old_size * 2 : 16;
+	p->commands = (slimproto_command_t *) calloc(p->commands_size, sizeof(slimproto_command_t));
+	if (p->commands == NULL) {
+		p->commands = old;
+		p->commands_size = old_size;
+		return -1;
+	}
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].opcode != 0)
+			*proto_command_slot(p, old[i].opcode) = old[i];
+	}
+
+	free(old);
+
+	return 0;
+}
+
+/* Adds a callback to an array of them. */
+static int proto_callback_add(slimproto_callback_t **callbacks, int *num, void *callback, void *user_data) {
+	slimproto_callback_t *c;
+
+	c = (slimproto_callback_t *) realloc(*callbacks, (*num + 1) * sizeof(slimproto_callback_t));
+	if (c == NULL)
+		return -1;
+
+	c[*num].callback = callback;
+	c[*num].user_data = user_data;
+
+	*callbacks = c;
+	(*num)++;
+
+	return 0;
+}
+
+/* Removes a callback from an array of them, keeping the order. */
+static void proto_callback_remove(slimproto_callback_t *callbacks, int *num, void *callback, void *user_data) {
 	int i;
+
+	for (i = 0; i < *num; i++) {
+		if ( (callbacks[i].callback == callback) && (callbacks[i].user_data == user_data) ) {
+			memmove(&callbacks[i], &callbacks[i + 1], (*num - i - 1) * sizeof(slimproto_callback_t));
+			(*num)--;
+			return;
+		}
+	}
+}
+
+/* Waits for callbacks being called to return, unless we are one of them. */
+static void proto_callback_wait(slimproto_t *p) {
+	while ( (p->dispatching > 0) && !pthread_equal(pthread_self(), p->slimproto_thread)
+		&& !pthread_equal(pthread_self(), p->send_thread) )
+		pthread_cond_wait(&p->slimproto_cond, &p->slimproto_mutex);
+}
+
+/* Copies callbacks so they can be called without the mutex.  Returns the
+** copy, in local if it fits, or NULL if there are none.
+*/
+static slimproto_callback_t *proto_callback_copy(slimproto_t *p, slimproto_callback_t *callbacks, int num,
+	slimproto_callback_t *local, int local_num) {
+	slimproto_callback_t *copy = local;
+
+	if (num == 0)
+		return NULL;
+
+	if (num > local_num) {
+		copy = (slimproto_callback_t *) malloc(num * sizeof(slimproto_callback_t));
+		if (copy == NULL)
+			return NULL;
+	}
+
+	memcpy(copy, callbacks, num * sizeof(slimproto_callback_t));
+	p->dispatching++;
+
+	return copy;
+}
+
+/* Ends a dispatch started by proto_callback_copy. */
+static void proto_callback_done(slimproto_t *p, slimproto_callback_t *copy, slimproto_callback_t *local) {
+	if (copy != local)
+		free(copy);
+
+	pthread_mutex_lock(&p->slimproto_mutex);
+	p->dispatching--;
+	pthread_mutex_unlock(&p->slimproto_mutex);
+
+	pthread_cond_broadcast(&p->slimproto_cond);
+}
+
+void slimproto_add_command_callback(slimproto_t *p, const char *cmd, slimproto_command_callback_t *callback, void *user_data) {
+	slimproto_command_t *slot;
+	u32_t opcode = proto_opcode((const unsigned char *) cmd);
+
 	pthread_mutex_lock(&p->slimproto_mutex);				
 
-	i = p->num_command_callbacks;
-	p->command_callbacks[i].cmd = strdup(cmd);
-	p->command_callbacks[i].callback = (void *) callback; /* FIXME */
-	p->command_callbacks[i].user_data = user_data;
-	p->num_command_callbacks++;
+	if (proto_command_grow(p) < 0) {
+		fprintf(stderr, "slimproto_add_command_callback: out of memory\n");
+		pthread_mutex_unlock(&p->slimproto_mutex);
+		return;
+	}
+
+	slot = proto_command_slot(p, opcode);
+	if (slot->opcode == 0) {
+		slot->opcode = opcode;
+		p->num_commands++;
+	}
+
+	if (proto_callback_add(&slot->handlers, &slot->num_handlers, (void *) callback, user_data) < 0)
+		fprintf(stderr, "slimproto_add_command_callback: out of memory\n");
+
+	pthread_mutex_unlock(&p->slimproto_mutex);
+}
+
+void slimproto_remove_command_callback(slimproto_t *p, const char *cmd, slimproto_command_callback_t *callback, void *user_data) {
+	slimproto_command_t *slot;
+
+	pthread_mutex_lock(&p->slimproto_mutex);
+
+	proto_callback_wait(p);
+
+	/* the slot stays, with its counters, so probing needs no tombstones */
+	slot = proto_command_find(p, proto_opcode((const unsigned char *) cmd));
+	if (slot != NULL)
+		proto_callback_remove(slot->handlers, &slot->num_handlers, (void *) callback, user_data);
 
 	pthread_mutex_unlock(&p->slimproto_mutex);
 }
 
 void slimproto_add_connect_callback(slimproto_t *p, slimproto_connect_callback_t *callback, void *user_data) {
-	int i;
 	pthread_mutex_lock(&p->slimproto_mutex);				
 
-	i = p->num_connect_callbacks;
-	p->connect_callbacks[i].callback = (void *) callback; /* FIXME */
-	p->connect_callbacks[i].user_data = user_data;
-	p->num_connect_callbacks++;
+	if (proto_callback_add(&p->connect_callbacks, &p->num_connect_callbacks, (void *) callback, user_data) < 0)
+		fprintf(stderr, "slimproto_add_connect_callback: out of memory\n");
 
 	pthread_mutex_unlock(&p->slimproto_mutex);	
 }
 
+void slimproto_remove_connect_callback(slimproto_t *p, slimproto_connect_callback_t *callback, void *user_data) {
+	pthread_mutex_lock(&p->slimproto_mutex);
+
+	proto_callback_wait(p);
+	proto_callback_remove(p->connect_callbacks, &p->num_connect_callbacks, (void *) callback, user_data);
+
+	pthread_mutex_unlock(&p->slimproto_mutex);
+}
+
+int slimproto_command_stats(slimproto_t *p, const char *cmd, unsigned long *count, u64_t *usec) {
+	slimproto_command_t *slot;
+	int ok = -1;
+
+	pthread_mutex_lock(&p->slimproto_mutex);
+
+	slot = proto_command_find(p, proto_opcode((const unsigned char *) cmd));
+	if (slot != NULL) {
+		*count = slot->count;
+		*usec = slot->usec;
+		ok = 0;
+	}
+
+	pthread_mutex_unlock(&p->slimproto_mutex);
+
+	return ok;
+}
+
+static void proto_connect_callbacks(slimproto_t *p, bool isConnected) {
+	slimproto_callback_t local[4], *callbacks;
+	int i, num;
+
+	pthread_mutex_lock(&p->slimproto_mutex);
+	num = p->num_connect_callbacks;
+	callbacks = proto_callback_copy(p, p->connect_callbacks, num, local, 4);
+	pthread_mutex_unlock(&p->slimproto_mutex);
+
+	if (callbacks == NULL)
+		return;
+
+	for (i = 0; i < num; i++) {
+		((slimproto_connect_callback_t *) callbacks[i].callback)(p, isConnected, callbacks[i].user_data);
+	}
+
+	proto_callback_done(p, callbacks, local);
+}
+
 int slimproto_configure_socket(int sockfd, int socktimeout)
 {
 	int retcode = 0;
@@ -448,21 +713,29 @@ size_t size;
 #define DISCOVERY_PKTSIZE	1516
 #define SLIMPROTO_DISCOVERY	"eNAME\0JSON\0"
 
-int slimproto_discover(char *server_addr, int server_addr_len, int port, unsigned int *jsonport, bool scan)
+/* Broadcasts for servers, and with cached_addr also asks that server
+** directly, in parallel.  The first to answer wins, which for a cached
+** server on the local network takes a few ms instead of waiting on the
+** broadcast.
+*/
+int slimproto_discover(char *server_addr, int server_addr_len, int port, unsigned int *jsonport, bool scan,
+	const char *cached_addr)
 {
 	int sockfd;
 	int try;
-	char *packet;
+	char packet[DISCOVERY_PKTSIZE];
 	int pktlen;
 	int pktidx;
-	char *t;
+	char t[5];
 	unsigned int l;
-	char *v;
-	char *server_name;
-	char *server_json;
+	char v[256];
+	char server_name[256];
+	char server_json[256];
 	struct pollfd pollfd;
 	struct sockaddr_in sendaddr;
 	struct sockaddr_in recvaddr;
+	struct sockaddr_in cacheaddr;
+	bool cached = false;
 #ifdef __WIN32__
         WSADATA info;
 #endif
@@ -496,6 +769,7 @@ int slimproto_discover(char *server_addr, int server_addr_len, int port, unsigne
        if((setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, (const  void*) &broadcast, sizeof broadcast)) == -1)
 	{
 		perror("setsockopt - SO_BROADCAST");
+		CLOSESOCKET(sockfd);
                 return -1;
         }
 
@@ -507,6 +781,7 @@ int slimproto_discover(char *server_addr, int server_addr_len, int port, unsigne
         if(bind(sockfd, (struct sockaddr*) &sendaddr, sizeof sendaddr) == -1)
 	{
 		perror("bind");
+		CLOSESOCKET(sockfd);
 		return -1;
         }
 
@@ -516,19 +791,11 @@ int slimproto_discover(char *server_addr, int server_addr_len, int port, unsigne
 
 	memset(recvaddr.sin_zero,'\0',sizeof recvaddr.sin_zero);
 
-	packet = malloc ( sizeof ( char ) * DISCOVERY_PKTSIZE );
-	v = malloc ( sizeof ( char ) * 256 );
-	t = malloc ( sizeof ( char ) * 256 );
-	server_name = malloc ( sizeof ( char ) * 256 );
-	server_json = malloc ( sizeof ( char ) * 256 );
-	if ( (packet == NULL) ||
-		(v == NULL) ||
-		(t == NULL) ||
-		(server_name == NULL) ||
-		(server_json == NULL) )
+	if ( (cached_addr != NULL) && (cached_addr[0] != '\0') )
 	{
-		perror("malloc");
-		return -1;
+		cacheaddr = recvaddr;
+		cacheaddr.sin_addr.s_addr = inet_addr(cached_addr);
+		cached = cacheaddr.sin_addr.s_addr != INADDR_NONE;
 	}
 
 	for (try = 0; try < 5; try ++)
@@ -541,48 +808,50 @@ int slimproto_discover(char *server_addr, int server_addr_len, int port, unsigne
 			return -1;
 		}
 
+		/* no broadcast route is no reason to skip the cached server */
+		if ( cached && (sendto(sockfd, SLIMPROTO_DISCOVERY, sizeof(SLIMPROTO_DISCOVERY), 0,
+			(struct sockaddr *)&cacheaddr, sizeof(cacheaddr)) == -1) )
+		{
+			DEBUGF("slimproto_discover: cannot probe %s\n", cached_addr);
+		}
+
 		DEBUGF("slimproto_discover: discovery packet sent\n");
 
 		/* Wait up to 1 second for response */
 		while (poll(&pollfd, 1, 1000))
 		{
-			memset(packet,0,sizeof(packet));
-
+			sockaddr_len = sizeof(sendaddr);
 			pktlen = recvfrom(sockfd, packet, DISCOVERY_PKTSIZE, MSG_DONTWAIT,
 				(struct sockaddr *)&sendaddr, &sockaddr_len);
 
 			if ( pktlen == -1 ) continue;
 
 			/* Invalid response packet, try again */
-			if ( packet[0] != 'E') continue;
+			if ( (pktlen < 1) || (packet[0] != 'E') ) continue;
 
-			memset(server_name,0,sizeof(server_name));
-			memset(server_json,0,sizeof(server_json));
+			server_name[0] = '\0';
+			server_json[0] = '\0';
 
 			VDEBUGF("slimproto_discover: pktlen:%d\n",pktlen);
 
-			/* Skip the E */
+			/* Skip the E, then 4 byte tags each with a length and value */
 			pktidx = 1;
 
-			while ( pktidx < (pktlen - 5) )
+			while ( pktidx + 5 <= pktlen )
 			{
-				strncpy ( t, &packet[pktidx], pktidx + 3 );
+				memcpy ( t, &packet[pktidx], 4 );
 				t[4] = '\0';
-				l = (unsigned int) ( packet[pktidx + 4] );
-				strncpy ( v, &packet[pktidx + 5], pktidx + 4 + l);
+				l = (unsigned char) packet[pktidx + 4];
+				if ( pktidx + 5 + (int) l > pktlen )
+					break;
+				memcpy ( v, &packet[pktidx + 5], l );
 				v[l] = '\0';
 				pktidx = pktidx + 5 + l;
 
 				if ( memcmp ( t, "NAME", 4 ) == 0 )
-				{
-					strncpy ( server_name, v, l );
-					server_name[l] = '\0';
-				}
+					strcpy ( server_name, v );
 				else if ( memcmp ( t, "JSON", 4 ) == 0 )
-				{
-					strncpy ( server_json, v, l );
-					server_json[l] = '\0';
-				}
+					strcpy ( server_json, v );
 
 				VDEBUGF("slimproto_discover: key: %s len: %d value: %s pktidx: %d\n",
 					t, l, v, pktidx);
@@ -592,8 +861,9 @@ int slimproto_discover(char *server_addr, int server_addr_len, int port, unsigne
 
 			*jsonport = (unsigned int) strtoul(server_json, NULL, 10);
 
-			DEBUGF("slimproto_discover: discovered %s:%u (%s)\n",
-				server_name, *jsonport, server_addr);
+			DEBUGF("slimproto_discover: discovered %s:%u (%s)%s\n",
+				server_name, *jsonport, server_addr,
+				(cached && sendaddr.sin_addr.s_addr == cacheaddr.sin_addr.s_addr) ? " cached" : "");
 
 			serveraddr_len = strlen(server_addr);
 
@@ -619,21 +889,6 @@ int slimproto_discover(char *server_addr, int server_addr_len, int port, unsigne
 #endif
 	}
 
-	if ( server_json != NULL )
-		free (server_json);
-
-	if ( server_name != NULL )
-		free (server_name);
-
-	if ( t != NULL )
-		free (t);
-
-	if ( v != NULL )
-		free (v);
-
-	if ( packet != NULL )
-		free (packet);
-
 	DEBUGF("slimproto_discover: end\n");
 	
 	return serveraddr_len ;
@@ -686,6 +941,14 @@ int slimproto_connect(slimproto_t *p, const char *server_addr, int port) {
 static int proto_connect(slimproto_t *p) {
 	pthread_mutex_lock(&p->slimproto_mutex);					
 
+	/* a replay stands in for the server */
+	if (slimproto_replaying()) {
+		p->sockfd = slimproto_replay_connect(CAPTURE_PROTO_OPEN);
+		if (p->sockfd < 0)
+			goto proto_connect_err;
+		goto proto_connect_ok;
+	}
+
 	p->sockfd = socket(AF_INET, SOCK_STREAM, 0);
 	if (p->sockfd < 0)
 	{
@@ -707,8 +970,18 @@ static int proto_connect(slimproto_t *p) {
 		goto proto_connect_err;
 	}
 	
+proto_connect_ok:
 	DEBUGF("proto_connect: connected to %s\n", inet_ntoa(p->serv_addr.sin_addr));
 
+	slimproto_capture(CAPTURE_PROTO_OPEN, NULL, 0);
+
+	/* nothing left over from the last connection */
+	p->recv_len = 0;
+
+	pthread_mutex_lock(&p->send_mutex);
+	p->send_fd = p->sockfd;
+	pthread_mutex_unlock(&p->send_mutex);
+
 	p->state = PROTO_CONNECTED;
 
 	pthread_mutex_unlock(&p->slimproto_mutex);						
@@ -738,6 +1011,8 @@ int slimproto_close(slimproto_t *p) {
 		return 0;
 	}
 	
+	proto_send_stop(p, p->sockfd);
+
 	CLOSESOCKET(p->sockfd);
 
 	p->sockfd = -1;
@@ -750,15 +1025,101 @@ int slimproto_close(slimproto_t *p) {
 	return 0;
 }
 
+/* Grows the receive buffer to hold size bytes, and one more for the nul
+** callbacks get after each frame.
+*/
+static int proto_recv_reserve(slimproto_t *p, int size) {
+	unsigned char *buf;
+
+	if (size + 1 <= p->recv_size)
+		return 0;
+
+	/* frames are at most 64k, so this is bounded */
+	size = (size + 1 + BUF_LENGTH - 1) / BUF_LENGTH * BUF_LENGTH;
+
+	buf = (unsigned char *) realloc(p->recv_buf, size);
+	if (buf == NULL) {
+		fprintf(stderr, "proto_recv: cannot grow receive buffer to %i bytes\n", size);
+		return -1;
+	}
+
+	DEBUGF("proto_recv: receive buffer %i -> %i bytes\n", p->recv_size, size);
+
+	p->recv_buf = buf;
+	p->recv_size = size;
+
+	return 0;
+}
+
+/* Calls every callback of the command in buf, timing them. */
+static int proto_dispatch(slimproto_t *p, unsigned char *buf, int len) {
+	slimproto_callback_t local[4], *callbacks = NULL;
+	slimproto_command_t *slot;
+	u64_t start, end;
+	u32_t opcode = proto_opcode(buf + 2);
+	unsigned char next;
+	int i, num = 0, ok = 0;
+
+	DEBUGF("proto_recv: cmd=%4.4s len=%i\n", buf+2, len);
+
+	pthread_mutex_lock(&p->slimproto_mutex);
+	slot = proto_command_find(p, opcode);
+	if (slot != NULL) {
+		num = slot->num_handlers;
+		callbacks = proto_callback_copy(p, slot->handlers, num, local, 4);
+	}
+	pthread_mutex_unlock(&p->slimproto_mutex);
+
+	if (callbacks == NULL)
+		return 0;
+
+	/* callbacks may treat the frame as a string */
+	next = buf[len];
+	buf[len] = 0;
+
+	start = slimproto_clock_usec();
+
+	for (i = 0; i < num; i++) {
+		ok = ((slimproto_command_callback_t *) callbacks[i].callback)(p, buf, len, callbacks[i].user_data);
+		if (ok < 0) {
+			fprintf(stderr, "Error in callback");
+			break;
+		}
+	}
+
+	end = slimproto_clock_usec();
+
+	buf[len] = next;
+
+	/* the table may have grown meanwhile */
+	pthread_mutex_lock(&p->slimproto_mutex);
+	slot = proto_command_find(p, opcode);
+	if (slot != NULL) {
+		slot->count++;
+		slot->usec += end - start;
+	}
+	pthread_mutex_unlock(&p->slimproto_mutex);
+
+	proto_callback_done(p, callbacks, local);
+
+	return ok;
+}
+
+/* Receives what the server has sent and dispatches every complete frame
+** in it, a 2 byte length then the command and its data.  A partial frame
+** stays in the buffer for the next call, which grows the buffer if the
+** frame is larger.
+*/
 static int proto_recv(slimproto_t *p) {
-	short len;
-	unsigned char buf[BUF_LENGTH];
-	int r, n, i;
+	int n, len, pos;
 
         /* Fix receive error on quiting */
 	if (p->state != PROTO_CONNECTED) return -1;
 
-	n = recv(p->sockfd, buf, 2, 0);
+	if (proto_recv_reserve(p, p->recv_len + BUF_LENGTH) < 0)
+		return -1;
+
+	n = recv(p->sockfd, p->recv_buf + p->recv_len, p->recv_size - p->recv_len - 1, 0);
 
 	if (n <= 0)
 	{
@@ -768,44 +1129,36 @@ static int proto_recv(slimproto_t *p) {
 #else
 		DEBUGF("proto_recv: (1) n=%i msg=%s(%i)\n", n, strerror(errno), errno);
 #endif
+		slimproto_capture(CAPTURE_PROTO_CLOSE, NULL, 0);
 		return -1;	
 	}
 
-	len = ntohs(*((u16_t *)buf)) + 2;
+	slimproto_capture(CAPTURE_PROTO_IN, p->recv_buf + p->recv_len, n);
 
-        /* Fix receive error on quiting */
-	if (p->state != PROTO_CONNECTED) return -1;
+	p->recv_len += n;
 
-	r = 2;
-	while (r < len)
-	{
-		n = recv(p->sockfd, buf+r, len-r, 0);
-		if (n <= 0)
-		{
-#ifdef __WIN32__
-			/* Use WSAGetLastError instead of errno for WIN32 */
-			DEBUGF("proto_recv: (2) n=%i WSAGetLastError=(%i)\n", n, WSAGetLastError());
-#else
-			DEBUGF("proto_recv: (2) n=%i  msg=%s(%i)\n", n, strerror(errno), errno);
-#endif
-			return -1;	
-		}	
-		r += n;
+	for (pos = 0; p->recv_len - pos >= 2; pos += len) {
+		len = ((p->recv_buf[pos] << 8) | p->recv_buf[pos + 1]) + 2;
+
+		if (p->recv_len - pos < len)
+			break;
+
+	        /* Fix receive error on quiting */
+		if (p->state != PROTO_CONNECTED) return -1;
+
+		if (proto_dispatch(p, p->recv_buf + pos, len) < 0)
+			return -1;
 	}
-	
-	DEBUGF("proto_recv: cmd=%4.4s len=%i\n", buf+2, len);
 
-	buf[len]=0;
-	for (i=0; i<p->num_command_callbacks; i++) {
-		if (strncmp(p->command_callbacks[i].cmd, (char*)(buf+2), 4) == 0) {
-			int ok = (p->command_callbacks[i].callback)(p, buf, len, p->command_callbacks[i].user_data);
-			if (ok < 0) {
-				fprintf(stderr, "Error in callback");
-				return ok;	
-			}
-			
-			break;	
-		}
+	/* keep the partial frame */
+	p->recv_len -= pos;
+	if ( (pos > 0) && (p->recv_len > 0) )
+		memmove(p->recv_buf, p->recv_buf + pos, p->recv_len);
+
+	if (p->recv_len >= 2) {
+		len = ((p->recv_buf[0] << 8) | p->recv_buf[1]) + 2;
+		if (proto_recv_reserve(p, len) < 0)
+			return -1;
 	}
 
 	return 0;
@@ -921,15 +1274,15 @@ int slimproto_goodbye(slimproto_t *p, u8_t upgrade) {
         packN4(msg, 4, 1);
         packC(msg, 8, upgrade);
 
-	return slimproto_send(p, msg);
+	if (slimproto_send(p, msg) < 0)
+		return -1;
+
+	/* the connection is closed next, let the frame go out first */
+	return proto_send_drain(p, SLIMPROTO_DRAIN_MSEC);
 }
 
-int slimproto_helo(slimproto_t *p, char device_id, char revision, const char *macaddress, char isGraphics, char isReconnect) {	
+int slimproto_helo(slimproto_t *p, char device_id, char revision, const char *macaddress, char isGraphics, char isReconnect, u64_t bytes_rx, const char *capabilities) {	
 	unsigned char msg[SLIMPROTO_MSG_SIZE];
-#if 0
-	const char *capabilites = \
-		 "Model=squeezeslave,ModelName=SqueezeSlave,Firmware=7,ogg,flc,pcm,mp3,SampleRate=44100,HasPreAmp";
-#endif
 	int caplen = 0;
 	int channelList = 0;
 
@@ -938,9 +1291,13 @@ int slimproto_helo(slimproto_t *p, char device_id, char revision, const char *ma
 
 	if (isReconnect)
 		channelList |= 0x4000;
-#if 0
-	caplen = strlen(capabilites);
-#endif
+
+	if (capabilities != NULL) {
+		caplen = strlen(capabilities);
+		if (caplen > SLIMPROTO_MSG_SIZE - 44)
+			caplen = SLIMPROTO_MSG_SIZE - 44;
+	}
+
 	memset(&msg, 0, SLIMPROTO_MSG_SIZE);
 
 	packA4(msg, 0, "HELO");
@@ -950,13 +1307,13 @@ int slimproto_helo(slimproto_t *p, char device_id, char revision, const char *ma
 	memcpy(msg+10, macaddress, 6);	/* MAC */
 	memcpy(msg+26, macaddress, 6);	/* UID */
 	packN2(msg, 32, channelList);	/* WLan Channel List */
-	packN4(msg, 34, 0);		/* Bytes Received H */
-	packN4(msg, 38, 0);		/* Bytes Received L */
+	packN4(msg, 34, (u32_t) (bytes_rx >> 32));	/* Bytes Received H */
+	packN4(msg, 38, (u32_t) bytes_rx);		/* Bytes Received L */
 	packC(msg, 42, 'E');		/* Language */
 	packC(msg, 43, 'N');
-#if 0
-	memcpy(msg+44,capabilites,caplen);
-#endif
+	if (caplen > 0)
+		memcpy(msg+44, capabilities, caplen);	/* Capabilities */
+
 	return slimproto_send(p, msg);
 }
 
@@ -976,7 +1333,6 @@ int slimproto_ir(slimproto_t *p, int format, int noBits, int irCode) {
 
 int slimproto_stat(slimproto_t *p, const char *code, int decoder_buffer_size, int decoder_buffer_fullness, u64_t bytes_rx, int output_buffer_size, int output_buffer_fullness, u32_t elapsed_milliseconds, u32_t server_timestamp)
 {
-	u32_t client_timestamp;
 	u32_t rbytes_low, rbytes_high;
 	unsigned char msg[SLIMPROTO_MSG_SIZE];
 
@@ -1017,7 +1373,7 @@ u16_t error_code;
 	packN4(msg, 23, rbytes_high );
 	packN4(msg, 27, rbytes_low );
 	packN2(msg, 31, 65534); 				/* signal strength */
-	client_timestamp = slimproto_set_jiffies(p, msg, 33);	/* Keep both values close, not used */
+	slimproto_set_jiffies(p, msg, 33);	/* Keep both values close, not used */
 	packN4(msg, 37, output_buffer_size);
 	packN4(msg, 41, output_buffer_fullness);
 	packN4(msg, 45, elapsed_seconds);
@@ -1039,24 +1395,17 @@ u16_t error_code;
 }
 
 u32_t slimproto_set_jiffies(slimproto_t *p, unsigned char *buf, int jiffies_ptr) {
-	struct timeval tnow;
-	u32_t jiffies;
-	u32_t timestamp;
-
-	gettimeofday(&tnow, NULL);
-
-	timestamp = tnow.tv_sec * 1000 + tnow.tv_usec / 1000;
-	jiffies = timestamp- p->epoch.tv_sec * 1000 + p->epoch.tv_usec / 1000;
+	u32_t jiffies = (u32_t) ((slimproto_clock_usec() - p->epoch) / 1000);
 
 	packN4(buf, jiffies_ptr, jiffies);
 
-	return timestamp;
+	return jiffies;
 }
 
 /* send a complete message or fail */
 int send_message(int sockfd, unsigned char* msg, size_t msglen, int msgflags) {
 	size_t nsent = 0;
-	size_t n;
+	int n;
 
 	do {
 		n = send(sockfd, &msg[nsent], msglen - nsent, msgflags);
@@ -1068,44 +1417,183 @@ int send_message(int sockfd, unsigned char* msg, size_t msglen, int msgflags) {
 	return nsent;
 }
 
+static bool proto_frame_is_stmt(const unsigned char *msg) {
+	return (memcmp(msg, "STAT", 4) == 0) && (memcmp(msg + 8, "STMt", 4) == 0);
+}
+
+/* Queues a frame for the send thread and returns without waiting for the
+** socket, so a congested connection cannot stall the audio threads.  A
+** STMt at the end of the queue is out of date, it is replaced by the new
+** one; behind other frames it stays, so the order is kept.
+*/
 int slimproto_send(slimproto_t *p, unsigned char *msg) {
-	int n;
+	slimproto_frame_t *frame = NULL;
+	int len = unpackN4(msg, 4) + 8;
 
 	DEBUGF("proto_send: cmd=%4.4s len=%i\n", msg, unpackN4(msg, 4));
 
-	pthread_mutex_lock(&p->slimproto_mutex);
+	if (len > SLIMPROTO_MSG_SIZE)
+		return -1;
 
-	if (p->state != PROTO_CONNECTED) {
-		pthread_mutex_unlock(&p->slimproto_mutex);
+	pthread_mutex_lock(&p->send_mutex);
+
+	if (p->send_fd < 0) {
+		pthread_mutex_unlock(&p->send_mutex);
 		return -1;		
 	}
 
-	n = send_message(p->sockfd, msg, unpackN4(msg, 4) + 8, slimproto_get_socketsendflags());
+	if (proto_frame_is_stmt(msg) && (p->send_depth > 0)) {
+		frame = &p->send_queue[(p->send_head + p->send_depth - 1) % SLIMPROTO_SEND_QUEUE];
+		if (proto_frame_is_stmt(frame->msg))
+			p->send_stats.coalesced++;
+		else
+			frame = NULL;
+	}
 
-	if (n < 0)
-	{
-		int i;
+	if (frame == NULL) {
+		if (p->send_depth == SLIMPROTO_SEND_QUEUE) {
+			p->send_stats.dropped++;
+			pthread_mutex_unlock(&p->send_mutex);
+			DEBUGF("proto_send: queue full, %4.4s dropped\n", msg);
+			return -1;
+		}
+
+		frame = &p->send_queue[(p->send_head + p->send_depth) % SLIMPROTO_SEND_QUEUE];
+		frame->queued = slimproto_clock_usec();
+
+		p->send_depth++;
+		if (p->send_depth > p->send_stats.max_depth)
+			p->send_stats.max_depth = p->send_depth;
+	}
+
+	memcpy(frame->msg, msg, len);
+	frame->len = len;
+
+	pthread_mutex_unlock(&p->send_mutex);
+	pthread_cond_broadcast(&p->send_cond);
+
+	return 0;
+}
+
+/* Writes the queued frames, in order.  A write error closes the
+** connection, as a receive error does in proto_thread.
+*/
+static void *proto_send_thread(void *ptr) {
+	slimproto_t *p = (slimproto_t *) ptr;
+	unsigned char msg[SLIMPROTO_MSG_SIZE];
+	u64_t queued, now, usec;
+	int fd, len, n;
+
+	pthread_mutex_lock(&p->send_mutex);
+
+	while (!p->send_quit) {
+		if ( (p->send_depth == 0) || (p->send_fd < 0) ) {
+			pthread_cond_wait(&p->send_cond, &p->send_mutex);
+			continue;
+		}
+
+		/* take the frame out, so it is not coalesced while being sent */
+		len = p->send_queue[p->send_head].len;
+		memcpy(msg, p->send_queue[p->send_head].msg, len);
+		queued = p->send_queue[p->send_head].queued;
+
+		p->send_head = (p->send_head + 1) % SLIMPROTO_SEND_QUEUE;
+		p->send_depth--;
+
+		fd = p->send_fd;
+		p->send_busy = true;
+
+		pthread_mutex_unlock(&p->send_mutex);
+
+		n = send_message(fd, msg, len, slimproto_get_socketsendflags());
+
+		now = slimproto_clock_usec();
+
+		if (n >= 0)
+			slimproto_capture(CAPTURE_PROTO_OUT, msg, len);
+
+		pthread_mutex_lock(&p->send_mutex);
+
+		p->send_busy = false;
+		pthread_cond_broadcast(&p->send_cond);
+
+		if (n < 0) {
 #ifdef __WIN32__
-                /* Use WSAGetLastError instead of errno for WIN32 */
-                DEBUGF("proto_send: (1) n=%i WSAGetLastError=(%i)\n", n, WSAGetLastError());
+			/* Use WSAGetLastError instead of errno for WIN32 */
+			DEBUGF("proto_send: (1) n=%i WSAGetLastError=(%i)\n", n, WSAGetLastError());
 #else
-                DEBUGF("proto_send: (1) n=%i msg=%s(%i)\n", n, strerror(errno), errno);
+			DEBUGF("proto_send: (1) n=%i msg=%s(%i)\n", n, strerror(errno), errno);
 #endif
+			/* unless slimproto_close got here first */
+			if (p->send_fd == fd) {
+				pthread_mutex_unlock(&p->send_mutex);
 
-		pthread_mutex_unlock(&p->slimproto_mutex);
-		slimproto_close(p);
+				slimproto_close(p);
+				proto_connect_callbacks(p, false);
 
-		for (i=0; i<p->num_connect_callbacks; ++i) {
-			(p->connect_callbacks[i].callback)(p, false, p->connect_callbacks[i].user_data);
+				pthread_mutex_lock(&p->send_mutex);
+			}
+			continue;
 		}
 
-		return -1;
+		usec = now - queued;
+
+		p->send_stats.frames++;
+		p->send_stats.usec += usec;
+		if (usec > p->send_stats.max_usec)
+			p->send_stats.max_usec = usec;
+
+		VDEBUGF("proto_send: sent %4.4s after %llu usec\n", msg, usec);
 	}
 
-	pthread_mutex_unlock(&p->slimproto_mutex);
+	pthread_mutex_unlock(&p->send_mutex);
+
 	return 0;
 }
 
+/* Discards the queue and waits for a frame being written to fd. */
+static void proto_send_stop(slimproto_t *p, int fd) {
+	pthread_mutex_lock(&p->send_mutex);
+
+	p->send_fd = -1;
+	p->send_head = p->send_depth = 0;
+
+	/* a congested socket would hold the write for the send timeout */
+	if (p->send_busy)
+		shutdown(fd, SHUT_RDWR);
+
+	while (p->send_busy)
+		pthread_cond_wait(&p->send_cond, &p->send_mutex);
+
+	pthread_mutex_unlock(&p->send_mutex);
+}
+
+/* Waits up to msec for the queued frames to be written. */
+static int proto_send_drain(slimproto_t *p, int msec) {
+	struct timespec timeout;
+	int ok = 0;
+
+	slimproto_cond_timeout(&timeout, msec);
+
+	pthread_mutex_lock(&p->send_mutex);
+
+	while ( (p->send_depth > 0 || p->send_busy) && (p->send_fd >= 0) && (ok == 0) )
+		ok = pthread_cond_timedwait(&p->send_cond, &p->send_mutex, &timeout);
+
+	pthread_mutex_unlock(&p->send_mutex);
+
+	return (ok == 0) ? 0 : -1;
+}
+
+void slimproto_send_stats(slimproto_t *p, slimproto_send_stats_t *stats) {
+	pthread_mutex_lock(&p->send_mutex);
+
+	*stats = p->send_stats;
+	stats->depth = p->send_depth;
+
+	pthread_mutex_unlock(&p->send_mutex);
+}
+
 int slimproto_configure_socket_sigpipe(int fd) {
 #if defined(MSG_NOSIGNAL)
 	/* This platform has MSG_NOSIGNAL (Linux has it for sure, not sure about
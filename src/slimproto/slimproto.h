@@ -98,6 +98,37 @@ typedef struct slimproto slimproto_t;
 typedef int (slimproto_command_callback_t)(slimproto_t *p, const unsigned char *buf, int buf_len, void *user_data);
 typedef int (slimproto_connect_callback_t)(slimproto_t *p, bool isConnected, void *user_data);
 
+typedef struct {
+	void *callback;
+	void *user_data;
+} slimproto_callback_t;
+
+/* Slot of the command table, which is open addressed by opcode. */
+typedef struct {
+	u32_t opcode;				/* the 4 command bytes, 0 for a free slot */
+	slimproto_callback_t *handlers;		/* called in the order added */
+	int num_handlers;
+	unsigned long count;			/* messages dispatched */
+	u64_t usec;				/* time spent in the handlers */
+} slimproto_command_t;
+
+/* Frame waiting for the send thread. */
+typedef struct {
+	unsigned char *msg;			/* SLIMPROTO_MSG_SIZE bytes */
+	int len;
+	u64_t queued;				/* slimproto_clock_usec */
+} slimproto_frame_t;
+
+typedef struct {
+	unsigned long frames;			/* frames sent */
+	unsigned long coalesced;		/* STMt replaced by a newer one while queued */
+	unsigned long dropped;			/* frames refused with the queue full */
+	int depth;				/* frames queued now */
+	int max_depth;
+	u64_t usec;				/* total time from queued to sent */
+	u64_t max_usec;
+} slimproto_send_stats_t;
+
 
 struct slimproto {
 	slimproto_state_t state;
@@ -105,25 +136,35 @@ struct slimproto {
 	int sockfd; 				/* Squeezebox Server socket */
 	struct sockaddr_in serv_addr;		/* Squeezebox Server address */
 	
-	struct timeval epoch;
+	u64_t epoch;				/* clock usec jiffies count from */
+
+	unsigned char *recv_buf;		/* received data, frames not yet dispatched */
+	int recv_size;				/* bytes allocated */
+	int recv_len;				/* bytes received */
 	
-	int num_connect_callbacks;		/* cmd callbacks */
-	struct {
-		char *cmd;
-		slimproto_connect_callback_t *callback;
-		void *user_data;
-	} connect_callbacks[20];
+	int num_connect_callbacks;		/* connect callbacks */
+	slimproto_callback_t *connect_callbacks;
 	
-	int num_command_callbacks;		/* cmd callbacks */
-	struct {
-		char *cmd;
-		slimproto_command_callback_t *callback;
-		void *user_data;
-	} command_callbacks[20];
+	slimproto_command_t *commands;		/* cmd callbacks, a power of 2 slots */
+	int commands_size;
+	int num_commands;
+	int dispatching;			/* callbacks being called */
 	
 	pthread_t slimproto_thread;
 	pthread_mutex_t slimproto_mutex;
 	pthread_cond_t slimproto_cond;
+
+	slimproto_frame_t *send_queue;		/* ring of SLIMPROTO_SEND_QUEUE frames */
+	int send_head;
+	int send_depth;
+	int send_fd;				/* socket being written, -1 when closed */
+	bool send_busy;				/* a frame is being written */
+	bool send_quit;
+	slimproto_send_stats_t send_stats;
+
+	pthread_t send_thread;			/* writes queued frames, see slimproto_send */
+	pthread_mutex_t send_mutex;		/* send_* fields, never held while writing */
+	pthread_cond_t send_cond;
 };
 
 
@@ -139,11 +180,32 @@ void slimproto_add_command_callback(slimproto_t *p, const char *cmd, slimproto_c
 
 void slimproto_add_connect_callback(slimproto_t *p, slimproto_connect_callback_t *callback, void *user_data);
 
+/* Remove a callback added with the same arguments.  Once these return,
+** the callback is not running and will not be called again, unless they
+** are called from a callback.
+*/
+void slimproto_remove_command_callback(slimproto_t *p, const char *cmd, slimproto_command_callback_t *callback, void *user_data);
+
+void slimproto_remove_connect_callback(slimproto_t *p, slimproto_connect_callback_t *callback, void *user_data);
+
+/* Gets the number of cmd messages received and the time their callbacks
+** took.  Returns -1 if no callback was ever added for cmd.
+*/
+int slimproto_command_stats(slimproto_t *p, const char *cmd, unsigned long *count, u64_t *usec);
+
+/* Gets the send queue counters. */
+void slimproto_send_stats(slimproto_t *p, slimproto_send_stats_t *stats);
+
 #ifdef __WIN32__
 const char * inet_ntop(int, const void *, char *, size_t);
 #endif
 
-int slimproto_discover(char *server_addr, int server_addr_len, int port, unsigned int *jsonport, bool scan);
+/* Finds a server and puts its address in server_addr, returning its
+** length or -1.  cached_addr, if not NULL, is probed alongside the
+** broadcast.  scan lists every server that answers instead.
+*/
+int slimproto_discover(char *server_addr, int server_addr_len, int port, unsigned int *jsonport, bool scan,
+	const char *cached_addr);
 
 int slimproto_connect(slimproto_t *p, const char *server_addr, int port);
 
@@ -153,12 +215,21 @@ int slimproto_send(slimproto_t *p, unsigned char *msg);
 
 void slimproto_parse_command(const unsigned char *buf, int buf_len, slimproto_msg_t *msg);
 
+/* Packs the milliseconds since slimproto_init at buf[jiffies_ptr] and
+** returns them.
+*/
 u32_t slimproto_set_jiffies(slimproto_t *p, unsigned char *buf, int jiffies_ptr);
 
 /*
  * The following functions are used to send slimproto messages
  */
-int slimproto_helo(slimproto_t *p, char device_id, char revision, const char *macaddress, char isGraphics, char isReconnect);
+/* capabilities is the comma separated list of player capabilities
+** (Model, formats, MaxSampleRate, ...), or NULL to send none.
+*/
+/* With isReconnect set, bytes_rx tells the server how much of the stream
+** we have, so it can carry on with the session.
+*/
+int slimproto_helo(slimproto_t *p, char device_id, char revision, const char *macaddress, char isGraphics, char isReconnect, u64_t bytes_rx, const char *capabilities);
 
 int slimproto_dsco(slimproto_t *, int);
 
@@ -192,6 +263,8 @@ int slimproto_configure_socket_sigpipe(int sockfd);
 int slimproto_get_socketsendflags();
 
 #define SLIMPROTO_MSG_SIZE	4096
+#define SLIMPROTO_SEND_QUEUE	32	/* frames, beyond this slimproto_send fails */
+#define SLIMPROTO_DRAIN_MSEC	2000	/* slimproto_goodbye waits this long for the queue */
 
 #define DSCO_CLOSED		 	0
 #define DSCO_RESET_LOCAL 		1
@@ -199,4 +272,9 @@ int slimproto_get_socketsendflags();
 #define DSCO_UNREACHABLE 		3
 #define DSCO_TIMEOUT 			4
 
+#define STRM_FLAG_LOOP			0x80
+#define STRM_FLAG_NO_RESTART		0x40
+#define STRM_FLAG_INVERT_LEFT		0x01
+#define STRM_FLAG_INVERT_RIGHT		0x02
+
 #endif /*_SLIMPROTO_H_ */
@@ -0,0 +1,494 @@
+/*
+ *   SlimProtoLib Copyright (c) 2004,2006 Richard Titmuss
+ *
+ *   This file is part of SlimProtoLib.
+ *
+ *   SlimProtoLib is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SlimProtoLib is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with SlimProtoLib; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifndef __WIN32__
+  #include <sys/types.h>
+  #include <sys/socket.h>
+  #include <sys/poll.h>
+  #include <unistd.h>
+  #include <errno.h>
+#endif
+
+#include "slimproto/slimproto_capture.h"
+#include "slimproto/slimproto_clock.h"
+
+#ifdef SLIMPROTO_DEBUG
+  #define DEBUGF(...) if (slimproto_debug) fprintf(stderr, __VA_ARGS__)
+#else
+  #define DEBUGF(...)
+#endif
+
+#define CAPTURE_MAGIC_LEN	(sizeof(SLIMPROTO_CAPTURE_MAGIC) - 1)
+
+static FILE *capture_file;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static u64_t capture_last;		/* time of the last record */
+
+static void capture_pack(unsigned char *ptr, u32_t v) {
+	ptr[0] = (v >> 24) & 0xFF;
+	ptr[1] = (v >> 16) & 0xFF;
+	ptr[2] = (v >> 8) & 0xFF;
+	ptr[3] = v & 0xFF;
+}
+
+static u32_t capture_unpack(const unsigned char *ptr) {
+	return ((u32_t) ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+}
+
+int slimproto_capture_open(const char *path) {
+	FILE *fp;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		perror("slimproto_capture_open: cannot create capture");
+		return -1;
+	}
+
+	fwrite(SLIMPROTO_CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, fp);
+
+	pthread_mutex_lock(&capture_mutex);
+	capture_file = fp;
+	capture_last = slimproto_clock_usec();
+	pthread_mutex_unlock(&capture_mutex);
+
+	DEBUGF("slimproto_capture_open: %s\n", path);
+
+	return 0;
+}
+
+void slimproto_capture_close(void) {
+	pthread_mutex_lock(&capture_mutex);
+
+	if (capture_file != NULL) {
+		fclose(capture_file);
+		capture_file = NULL;
+	}
+
+	pthread_mutex_unlock(&capture_mutex);
+}
+
+void slimproto_capture(slimproto_capture_t type, const void *data, int len) {
+	unsigned char hdr[SLIMPROTO_CAPTURE_HEADER];
+	u64_t now, usec;
+
+	if (capture_file == NULL)
+		return;
+
+	pthread_mutex_lock(&capture_mutex);
+
+	if (capture_file != NULL) {
+		now = slimproto_clock_usec();
+
+		/* a gap of over an hour is cut short */
+		usec = now - capture_last;
+		if (usec > 0xFFFFFFFFUL)
+			usec = 0xFFFFFFFFUL;
+		capture_last = now;
+
+		hdr[0] = (unsigned char) type;
+		capture_pack(hdr + 1, (u32_t) usec);
+		capture_pack(hdr + 5, (u32_t) len);
+
+		fwrite(hdr, 1, sizeof(hdr), capture_file);
+		if (len > 0)
+			fwrite(data, 1, len, capture_file);
+	}
+
+	pthread_mutex_unlock(&capture_mutex);
+}
+
+#ifndef __WIN32__
+
+#define REPLAY_PROTO		0
+#define REPLAY_HTTP		1
+#define REPLAY_WAIT_MSEC	30000	/* for the player to connect or send a request */
+#define REPLAY_POLL_MSEC	10
+
+static FILE *replay_file;
+static unsigned int replay_speed;
+static pthread_t replay_thread;
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool replay_active;
+static bool replay_finished;
+static volatile bool replay_quit;
+
+/* Server ends of the connections, those the player made and the replay
+** has not got to yet, and those being replayed to.  Only the replay
+** thread uses replay_fd.
+*/
+static int replay_waiting[2] = { -1, -1 };
+static int replay_fd[2] = { -1, -1 };
+static int replay_sent[2];			/* bytes the player sent, unanswered */
+
+static const char *replay_name[2] = { "slimproto", "http" };
+
+static void replay_close(int kind) {
+	if (replay_fd[kind] >= 0) {
+		close(replay_fd[kind]);
+		replay_fd[kind] = -1;
+	}
+	replay_sent[kind] = 0;
+}
+
+/* Reads what the player sent, which the replay only counts. */
+static void replay_drain(int kind) {
+	char buf[4096];
+	int n;
+
+	while ( (n = recv(replay_fd[kind], buf, sizeof(buf), MSG_DONTWAIT)) > 0 )
+		replay_sent[kind] += n;
+
+	if ( (n == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) ) {
+		DEBUGF("replay: player closed %s\n", replay_name[kind]);
+		replay_close(kind);
+	}
+}
+
+/* Waits up to msec for something from the player, or with out_kind >= 0
+** for room to write on that connection.
+*/
+static void replay_poll(int out_kind, int msec) {
+	struct pollfd fds[2];
+	int kinds[2];
+	int i, n = 0;
+
+	for (i = 0; i < 2; i++) {
+		if (replay_fd[i] < 0)
+			continue;
+
+		fds[n].fd = replay_fd[i];
+		fds[n].events = POLLIN | (i == out_kind ? POLLOUT : 0);
+		fds[n].revents = 0;
+		kinds[n++] = i;
+	}
+
+	if (poll(fds, n, msec) <= 0)
+		return;
+
+	for (i = 0; i < n; i++) {
+		if ( (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && (replay_fd[kinds[i]] >= 0) )
+			replay_drain(kinds[i]);
+	}
+}
+
+static void replay_sleep_until(u64_t due) {
+	u64_t now;
+
+	while ( !replay_quit && ((now = slimproto_clock_usec()) < due) ) {
+		if (due - now >= 1000 * 100)
+			replay_poll(-1, 100);
+		else
+			replay_poll(-1, (int) ((due - now + 999) / 1000));
+	}
+}
+
+static void replay_write(int kind, const unsigned char *data, int len) {
+	int off = 0, n;
+
+	while ( (off < len) && (replay_fd[kind] >= 0) && !replay_quit ) {
+		n = send(replay_fd[kind], data + off, len - off,
+			slimproto_get_socketsendflags() | MSG_DONTWAIT);
+
+		if (n > 0) {
+			off += n;
+			continue;
+		}
+
+		if ( (n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) ) {
+			DEBUGF("replay: %s write failed %s\n", replay_name[kind], strerror(errno));
+			replay_close(kind);
+			break;
+		}
+
+		/* the player is not reading, as when its buffers are full */
+		replay_poll(kind, 100);
+	}
+}
+
+/* Takes the connection the player made for a captured open.  Returns
+** false if it made none in time.
+*/
+static bool replay_accept(int kind) {
+	u64_t start = slimproto_clock_usec();
+	int fd;
+
+	while (!replay_quit) {
+		pthread_mutex_lock(&replay_mutex);
+		fd = replay_waiting[kind];
+		replay_waiting[kind] = -1;
+		pthread_mutex_unlock(&replay_mutex);
+
+		if (fd >= 0) {
+			DEBUGF("replay: %s connected\n", replay_name[kind]);
+
+			replay_close(kind);
+			replay_fd[kind] = fd;
+			return true;
+		}
+
+		if (slimproto_clock_usec() - start > 1000ULL * REPLAY_WAIT_MSEC)
+			break;
+
+		replay_poll(-1, REPLAY_POLL_MSEC);
+	}
+
+	return false;
+}
+
+/* Waits for the player to send the request a captured response answers,
+** so it does not find the response before it asked.
+*/
+static void replay_request(void) {
+	u64_t start = slimproto_clock_usec();
+
+	while ( !replay_quit && (replay_fd[REPLAY_HTTP] >= 0) && (replay_sent[REPLAY_HTTP] == 0) ) {
+		if (slimproto_clock_usec() - start > 1000ULL * REPLAY_WAIT_MSEC) {
+			fprintf(stderr, "replay: no http request from the player\n");
+			break;
+		}
+
+		replay_poll(-1, REPLAY_POLL_MSEC);
+	}
+
+	replay_sent[REPLAY_HTTP] = 0;
+}
+
+static void *replay_thread_func(void *ptr) {
+	unsigned char hdr[SLIMPROTO_CAPTURE_HEADER];
+	unsigned char *data = NULL, *grown;
+	u32_t size = 0, len;
+	u64_t due, now;
+	unsigned long records = 0;
+	int kind;
+
+	due = slimproto_clock_usec();
+
+	while ( !replay_quit && (fread(hdr, 1, sizeof(hdr), replay_file) == sizeof(hdr)) ) {
+		len = capture_unpack(hdr + 5);
+
+		if (len > size) {
+			grown = (unsigned char *) realloc(data, len);
+			if (grown == NULL) {
+				fprintf(stderr, "replay: cannot read a record of %u bytes\n", len);
+				break;
+			}
+			data = grown;
+			size = len;
+		}
+
+		if ( (len > 0) && (fread(data, 1, len, replay_file) != len) ) {
+			fprintf(stderr, "replay: capture truncated\n");
+			break;
+		}
+
+		due += capture_unpack(hdr + 1) / replay_speed;
+		replay_sleep_until(due);
+
+		switch (hdr[0]) {
+			case CAPTURE_PROTO_OPEN:
+			case CAPTURE_HTTP_OPEN:
+				kind = (hdr[0] == CAPTURE_PROTO_OPEN) ? REPLAY_PROTO : REPLAY_HTTP;
+				if (!replay_accept(kind)) {
+					fprintf(stderr, "replay: no %s connection from the player\n", replay_name[kind]);
+					replay_quit = true;
+				}
+				break;
+
+			case CAPTURE_PROTO_IN:
+				replay_write(REPLAY_PROTO, data, len);
+				break;
+
+			case CAPTURE_HTTP_IN:
+				replay_write(REPLAY_HTTP, data, len);
+				break;
+
+			case CAPTURE_HTTP_OUT:
+				replay_request();
+				break;
+
+			case CAPTURE_PROTO_CLOSE:
+				replay_close(REPLAY_PROTO);
+				break;
+
+			case CAPTURE_HTTP_CLOSE:
+				replay_close(REPLAY_HTTP);
+				break;
+
+			case CAPTURE_PROTO_OUT:
+				/* what the player sends now is read and dropped */
+				break;
+
+			default:
+				fprintf(stderr, "replay: unknown record type %02x\n", hdr[0]);
+				replay_quit = true;
+				break;
+		}
+
+		/* time spent waiting for the player moves the replay along */
+		now = slimproto_clock_usec();
+		if (now > due)
+			due = now;
+
+		records++;
+	}
+
+	DEBUGF("replay: done after %lu records\n", records);
+
+	free(data);
+
+	replay_close(REPLAY_PROTO);
+	replay_close(REPLAY_HTTP);
+
+	pthread_mutex_lock(&replay_mutex);
+
+	replay_finished = true;
+
+	for (kind = 0; kind < 2; kind++) {
+		if (replay_waiting[kind] >= 0) {
+			close(replay_waiting[kind]);
+			replay_waiting[kind] = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&replay_mutex);
+
+	return 0;
+}
+
+int slimproto_replay_open(const char *path, unsigned int speed) {
+	char magic[CAPTURE_MAGIC_LEN];
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		perror("slimproto_replay_open: cannot open capture");
+		return -1;
+	}
+
+	if ( (fread(magic, 1, sizeof(magic), fp) != sizeof(magic)) ||
+	     (memcmp(magic, SLIMPROTO_CAPTURE_MAGIC, sizeof(magic)) != 0) ) {
+		fprintf(stderr, "slimproto_replay_open: %s is not a capture\n", path);
+		fclose(fp);
+		return -1;
+	}
+
+	replay_file = fp;
+	replay_speed = (speed > 0) ? speed : 1;
+	replay_quit = false;
+	replay_finished = false;
+	replay_active = true;
+
+	if (pthread_create(&replay_thread, NULL, replay_thread_func, NULL) != 0) {
+		fprintf(stderr, "Error creating replay thread\n");
+		replay_active = false;
+		fclose(fp);
+		return -1;
+	}
+
+	DEBUGF("slimproto_replay_open: %s at %ux\n", path, replay_speed);
+
+	return 0;
+}
+
+void slimproto_replay_close(void) {
+	if (!replay_active)
+		return;
+
+	replay_quit = true;
+	pthread_join(replay_thread, NULL);
+
+	fclose(replay_file);
+	replay_file = NULL;
+	replay_active = false;
+}
+
+bool slimproto_replaying(void) {
+	return replay_active;
+}
+
+bool slimproto_replay_done(void) {
+	bool done;
+
+	pthread_mutex_lock(&replay_mutex);
+	done = replay_finished;
+	pthread_mutex_unlock(&replay_mutex);
+
+	return done;
+}
+
+int slimproto_replay_connect(slimproto_capture_t type) {
+	int kind = (type == CAPTURE_PROTO_OPEN) ? REPLAY_PROTO : REPLAY_HTTP;
+	int sv[2];
+
+	pthread_mutex_lock(&replay_mutex);
+
+	if (!replay_active || replay_finished) {
+		pthread_mutex_unlock(&replay_mutex);
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		pthread_mutex_unlock(&replay_mutex);
+		perror("slimproto_replay_connect: socketpair");
+		return -1;
+	}
+
+	slimproto_configure_socket_sigpipe(sv[0]);
+	slimproto_configure_socket_sigpipe(sv[1]);
+
+	/* the replay had not got to the last one, it is given up */
+	if (replay_waiting[kind] >= 0)
+		close(replay_waiting[kind]);
+	replay_waiting[kind] = sv[1];
+
+	pthread_mutex_unlock(&replay_mutex);
+
+	return sv[0];
+}
+
+#else
+
+int slimproto_replay_open(const char *path, unsigned int speed) {
+	fprintf(stderr, "slimproto_replay_open: replay is not supported on this platform\n");
+	return -1;
+}
+
+void slimproto_replay_close(void) {
+}
+
+bool slimproto_replaying(void) {
+	return false;
+}
+
+bool slimproto_replay_done(void) {
+	return true;
+}
+
+int slimproto_replay_connect(slimproto_capture_t type) {
+	return -1;
+}
+
+#endif /* __WIN32__ */
@@ -0,0 +1,81 @@
+/*
+ *   SlimProtoLib Copyright (c) 2004,2006 Richard Titmuss
+ *
+ *   This file is part of SlimProtoLib.
+ *
+ *   SlimProtoLib is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SlimProtoLib is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with SlimProtoLib; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Capture and replay of sessions.
+**
+** A capture records what went over the slimproto and the HTTP stream
+** connections, with the time between records from the slimproto clock.
+** A replay plays a capture back in place of the server: the connections
+** the player makes are answered from the file, at the captured pace or
+** a number of times faster.
+**
+** The file starts with SLIMPROTO_CAPTURE_MAGIC, then has one record after
+** another: the type, the usec since the record before and the length of
+** the data, as 1, 4 and 4 bytes in network order, then the data.
+*/
+
+#ifndef _SLIMPROTO_CAPTURE_H_
+#define _SLIMPROTO_CAPTURE_H_
+
+#include "slimproto/slimproto.h"
+
+#define SLIMPROTO_CAPTURE_MAGIC	"SQCAP001"
+#define SLIMPROTO_CAPTURE_HEADER	9	/* bytes before the data of a record */
+
+typedef enum {
+	CAPTURE_PROTO_OPEN = 'P',	/* slimproto connected */
+	CAPTURE_PROTO_IN = 'r',		/* received from the server */
+	CAPTURE_PROTO_OUT = 's',	/* frame sent to the server */
+	CAPTURE_PROTO_CLOSE = 'p',	/* the server closed */
+	CAPTURE_HTTP_OPEN = 'H',	/* new stream connection */
+	CAPTURE_HTTP_IN = 'i',		/* response header and stream data */
+	CAPTURE_HTTP_OUT = 'o',		/* request */
+	CAPTURE_HTTP_CLOSE = 'h'	/* the stream server closed */
+} slimproto_capture_t;
+
+/* Records everything from now on to path.  Returns -1 if it cannot be
+** created.
+*/
+int slimproto_capture_open(const char *path);
+
+void slimproto_capture_close(void);
+
+/* Adds a record, if capturing. */
+void slimproto_capture(slimproto_capture_t type, const void *data, int len);
+
+/* Starts replaying path, speed times faster than captured.  Returns -1
+** if it cannot be read, or replay is not supported here.
+*/
+int slimproto_replay_open(const char *path, unsigned int speed);
+
+void slimproto_replay_close(void);
+
+bool slimproto_replaying(void);
+
+/* True once the whole capture was replayed. */
+bool slimproto_replay_done(void);
+
+/* Returns a socket connected to the replay, for a connection of type
+** CAPTURE_PROTO_OPEN or CAPTURE_HTTP_OPEN, or -1 once the replay is done.
+*/
+int slimproto_replay_connect(slimproto_capture_t type);
+
+#endif /*_SLIMPROTO_CAPTURE_H_ */
@@ -0,0 +1,121 @@
+/*
+ *   SlimProtoLib Copyright (c) 2004,2006 Richard Titmuss
+ *
+ *   This file is part of SlimProtoLib.
+ *
+ *   SlimProtoLib is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SlimProtoLib is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with SlimProtoLib; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifndef __WIN32__
+  #include <unistd.h>
+#endif
+
+#include "slimproto/slimproto_clock.h"
+
+/* CLOCK_MONOTONIC for timestamps, and for timed waits where conditions
+** can be told to use it.  OS X has neither pthread_condattr_setclock nor,
+** before 10.12, clock_gettime.
+*/
+#if defined(CLOCK_MONOTONIC) && !defined(__WIN32__) && !defined(__APPLE__)
+  #define CLOCK_HAVE_MONOTONIC
+  #if defined(_POSIX_CLOCK_SELECTION) && (_POSIX_CLOCK_SELECTION > 0)
+    #define CLOCK_HAVE_CONDATTR
+  #endif
+#endif
+
+static slimproto_clock_func_t *clock_func;
+
+#ifdef CLOCK_HAVE_CONDATTR
+static bool clock_wait_monotonic = true;	/* until a condition refuses it */
+#endif
+
+/* Microseconds on the clock timed waits use. */
+static u64_t clock_wait_usec(void) {
+	struct timeval now;
+#ifdef CLOCK_HAVE_CONDATTR
+	struct timespec mono;
+
+	if (clock_wait_monotonic) {
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+		return (u64_t) mono.tv_sec * 1000000 + mono.tv_nsec / 1000;
+	}
+#endif
+
+	gettimeofday(&now, NULL);
+
+	return (u64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static u64_t clock_system_usec(void) {
+#ifdef CLOCK_HAVE_MONOTONIC
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == 0)
+		return (u64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+	return clock_wait_usec();
+}
+
+u64_t slimproto_clock_usec(void) {
+	if (clock_func != NULL)
+		return clock_func();
+
+	return clock_system_usec();
+}
+
+u32_t slimproto_clock_msec(void) {
+	return (u32_t) (slimproto_clock_usec() / 1000);
+}
+
+void slimproto_clock_set(slimproto_clock_func_t *func) {
+	clock_func = func;
+}
+
+int slimproto_cond_init(pthread_cond_t *cond) {
+#ifdef CLOCK_HAVE_CONDATTR
+	pthread_condattr_t attr;
+	int err = -1;
+
+	if (clock_wait_monotonic) {
+		pthread_condattr_init(&attr);
+
+		err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		if (err == 0)
+			err = pthread_cond_init(cond, &attr);
+
+		pthread_condattr_destroy(&attr);
+
+		if (err == 0)
+			return 0;
+
+		/* timed waits fall back to the time of day, as they were */
+		fprintf(stderr, "slimproto_cond_init: no monotonic condition (%i)\n", err);
+		clock_wait_monotonic = false;
+	}
+#endif
+	return pthread_cond_init(cond, NULL);
+}
+
+void slimproto_cond_timeout(struct timespec *timeout, u32_t msec) {
+	u64_t usec = clock_wait_usec() + (u64_t) msec * 1000;
+
+	timeout->tv_sec = usec / 1000000;
+	timeout->tv_nsec = (usec % 1000000) * 1000;
+}
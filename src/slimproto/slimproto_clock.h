@@ -0,0 +1,56 @@
+/*
+ *   SlimProtoLib Copyright (c) 2004,2006 Richard Titmuss
+ *
+ *   This file is part of SlimProtoLib.
+ *
+ *   SlimProtoLib is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SlimProtoLib is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with SlimProtoLib; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Clock for jiffies, timestamps and timed waits.
+**
+** Where the platform has it this is CLOCK_MONOTONIC, which unlike
+** gettimeofday does not jump when NTP or the user sets the time.
+*/
+
+#ifndef _SLIMPROTO_CLOCK_H_
+#define _SLIMPROTO_CLOCK_H_
+
+#include <pthread.h>
+#include <time.h>
+
+#include "slimproto/slimproto.h"
+
+typedef u64_t (slimproto_clock_func_t)(void);
+
+/* Microseconds from an arbitrary start, never going backwards. */
+u64_t slimproto_clock_usec(void);
+
+u32_t slimproto_clock_msec(void);
+
+/* Replaces the clock, so tests can control time.  NULL restores the
+** system clock.  Timed waits always use the system clock.
+*/
+void slimproto_clock_set(slimproto_clock_func_t *func);
+
+/* Initializes a condition whose timed waits use the clock. */
+int slimproto_cond_init(pthread_cond_t *cond);
+
+/* Sets the deadline msec from now for a timed wait on a condition from
+** slimproto_cond_init.
+*/
+void slimproto_cond_timeout(struct timespec *timeout, u32_t msec);
+
+#endif /*_SLIMPROTO_CLOCK_H_ */
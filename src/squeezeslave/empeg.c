@@ -218,9 +218,8 @@ int empeg_idle(void)
    static unsigned long power_timer = 0, state_timer = 0;
    int bright;
    unsigned int pwr_state;
-   struct timeval tnow;
+   u32_t now = slimproto_clock_msec() / 1000;
 
-   gettimeofday(&tnow, NULL);
    ioctl(power_fd, EMPEG_POWER_READSTATE, &pwr_state);
 
    if (vfd_brt < 0)
@@ -246,11 +245,11 @@ int empeg_idle(void)
       if (!power_flag)
       {
          power_flag = true;
-         power_timer = tnow.tv_sec;
+         power_timer = now;
          fprintf(stderr, "Power state:0x%X\n", pwr_state);
          return -1; /* pause return code */
       }
-      else if (power_timer + 300 < tnow.tv_sec)
+      else if (power_timer + 300 < now)
          return -4; /* power down return code */
       return -2;
    }
@@ -260,9 +259,9 @@ int empeg_idle(void)
       return -3;
    }
 
-   if (state_timer + 60 < tnow.tv_sec)
+   if (state_timer + 60 < now)
    {
-      state_timer = tnow.tv_sec;
+      state_timer = now;
       empeg_writestate();
    }
 
@@ -304,11 +303,9 @@ long empeg_getkey(void)
    int i;
    long key = -1;
    struct pollfd pollfd = { ir_fd, POLLIN, 0 };
-   struct timeval tnow;
    unsigned long timer;
 
-   gettimeofday(&tnow, NULL);
-   timer = tnow.tv_sec * 1000 + tnow.tv_usec / 1000;
+   timer = slimproto_clock_msec();
 
    for (i = 0; i < 5; i ++)
    {
@@ -327,11 +324,9 @@ long empeg_getkey(void)
 long empeg_getircode(long key)
 {
    int i;
-   struct timeval tnow;
    unsigned long timer;
 
-   gettimeofday(&tnow, NULL);
-   timer = tnow.tv_sec * 1000 + tnow.tv_usec / 1000;
+   timer = slimproto_clock_msec();
 
    if (key == IR_KNOB_UP)
       return 0x0001005B;
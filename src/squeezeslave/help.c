@@ -40,6 +40,24 @@ int parse_macaddress(char *macaddress, const char *str) {
 	return -1;
 }
 
+/* Parses "<kbytes>" or "<min:max>" buffer sizes, returned in bytes. */
+int parse_buffer_limits(const char *str, unsigned int *min, unsigned int *max) {
+	char *ptr;
+	unsigned long kmin, kmax;
+
+	kmin = kmax = strtoul(str, &ptr, 0);
+	if (*ptr == ':')
+		kmax = strtoul(ptr + 1, &ptr, 0);
+
+	if ( (*ptr != '\0') || (kmin == 0) || (kmin > kmax) || (kmax > 1024 * 1024) )
+		return -1;
+
+	*min = kmin * 1024;
+	*max = kmax * 1024;
+
+	return 0;
+}
+
 #ifdef RENICE
 bool renice_thread( int priority )
 {
@@ -431,7 +449,7 @@ void print_version(void) {
 
 	fprintf(stdout, "\n");
 
-	fprintf(stdout, "buffer sizes: decoder %u output %u bytes\n",DECODER_BUFFER_SIZE, OUTPUT_BUFFER_SIZE);
+	fprintf(stdout, "default buffer sizes: decoder %u output %u bytes\n",DECODER_BUFFER_SIZE, OUTPUT_BUFFER_SIZE);
 	fprintf(stdout, "\n");
 
 	fprintf(stdout, "Copyright 2004-2015 Richard Titmuss, Duane Paddock.\n");
@@ -467,9 +485,18 @@ void print_help(void) {
 "                            chooses the right value: 10s for a >=6.5.x server\n"
 "                            and 0s for a <6.5.x server, which means no\n"
 "                            keepalive.\n"
-"-T, --threshold_override    Ignore autostart threshold for ogg and mp3.\n"
+"-T, --threshold_override    Autostart ogg and mp3 after %d msec of audio\n"
+"                            is buffered, instead of %d msec.\n"
 "-O,                         Ignore output threshold when buffering and use\n"
-"--output_threshold <bytes>  specified value in bytes.\n"
+"--output_threshold <msec>   specified value in msec (default %d).\n"
+"-b, --decoder_buffer <kbytes|min:max>\n"
+"                            Sets the size of the decoder buffer in kbytes\n"
+"                            (default %d).  Given min:max, the buffer is\n"
+"                            sized between them from the network rate and\n"
+"                            jitter and from output underruns.\n"
+"-B, --output_buffer <kbytes|min:max>\n"
+"                            As above for the output buffer (default %d),\n"
+"                            which grows after underruns.\n"
 #ifdef __WIN32__
 "-H, --highpriority          Change process priority class to high.\n"
 #ifdef PADEV_WASAPI
@@ -567,11 +594,11 @@ void print_help(void) {
 "                            Squeezebox Server until it succeeds or is stopped\n"
 "                            using SIGTERM or keyboard entry.\n"
 "                            If the connection to Squeezebox Server is lost, the\n"
-"                            program will poll it until it restarts.  --retry\n"
-"                            enables retry with a %d second delay between\n"
-"                            attempts.\n"
-"-r <sec>, --intretry <sec>  For a different retry interval use -r and the\n"
-"                            desired interval in seconds. (ie. -r10)\n"
+"                            program reconnects at once, playing on from its\n"
+"                            buffers, then retries with a growing delay of up\n"
+"                            to %d seconds between attempts.\n"
+"-r <sec>, --intretry <sec>  For a different maximum retry interval use -r and\n"
+"                            the desired interval in seconds. (ie. -r10)\n"
 "                            Retry interval range is 1-120 seconds.\n"
 "-V, --version               Prints the squeezeslave version.\n"
 #ifndef PORTAUDIO_DEV
@@ -593,6 +620,21 @@ void print_help(void) {
 #endif
 "                                  sw:  volume changes performed in software.\n"
 "                                  off: volume changes ignored.\n"
+"-W, --watermarks <low:high> Sets the output buffer watermarks in msec.  Once\n"
+"                            the buffer holds <high> msec of audio, decoding\n"
+"                            pauses until playback drains it to <low> msec,\n"
+"                            so the decoder wakes up less often.  Disabled by\n"
+"                            default.\n"
+"-K, --capture <file>        Records everything sent and received on the\n"
+"                            server and stream connections to <file>.\n"
+#ifndef __WIN32__
+"-X, --replay <file[:speed]> Plays a session recorded with --capture back in\n"
+"                            place of the server, <speed> times faster than\n"
+"                            recorded (default 1), on the null output.\n"
+#endif
+"-Z, --nulloutput            Plays into nothing instead of an audio device.\n"
+"-A, --metrics <port>        Serves runtime metrics in the Prometheus text\n"
+"                            format on localhost <port>, at /metrics.\n"
 #ifdef SLIMPROTO_DEBUG
 "-Y, --debuglog <logfile>    Redirect debug output from stderr to <logfile>.\n"
 #endif
@@ -619,6 +661,11 @@ void print_help(void) {
 "                                  slimaudio_http_v\n"
 "                                  slimaudio_output\n"
 "                                  slimaudio_output_v\n",
+THRESHOLD_OVERRIDE_MSEC,
+AUTOSTART_THRESHOLD_MSEC,
+OUTPUT_THRESHOLD_MSEC,
+DECODER_BUFFER_SIZE / 1024,
+OUTPUT_BUFFER_SIZE / 1024,
 #ifndef PORTAUDIO_DEV
 PA_FRAMES_PER_BUFFER,
 PA_NUM_BUFFERS,
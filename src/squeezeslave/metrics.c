@@ -0,0 +1,359 @@
+/*
+ *   SlimProtoLib Copyright (c) 2004,2006 Richard Titmuss
+ *
+ *   This file is part of SlimProtoLib.
+ *
+ *   SlimProtoLib is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   SlimProtoLib is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with SlimProtoLib; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Runtime metrics in the Prometheus text format, served over HTTP on a
+** localhost port for a monitoring agent to scrape.  Everything is read as
+** the threads left it, so the audio path takes no lock for the metrics.
+*/
+
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef __WIN32__
+  #include <winsock2.h>
+  #include <ws2tcpip.h>
+  #define CLOSESOCKET(s) closesocket(s)
+#else
+  #include <unistd.h>
+  #include <sys/types.h>
+  #include <sys/socket.h>
+  #include <sys/time.h>
+  #include <sys/resource.h>
+  #include <netinet/in.h>
+  #include <arpa/inet.h>
+  #define CLOSESOCKET(s) close(s)
+#endif
+
+#include "squeezeslave.h"
+
+#define METRICS_BODY_SIZE	(8192)
+#define METRICS_REQUEST_SIZE	(1024)
+
+typedef struct {
+	char *buf;
+	int len;
+} metrics_body_t;
+
+static pthread_t metrics_thread;
+static volatile bool metrics_quit = false;
+static bool metrics_running = false;
+static int metrics_fd = -1;
+static slimproto_t *metrics_proto;
+static slimaudio_t *metrics_audio;
+
+static void metrics_printf(metrics_body_t *body, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	if (body->len >= METRICS_BODY_SIZE)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(body->buf + body->len, METRICS_BODY_SIZE - body->len, fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		body->len += n;
+}
+
+static void metrics_header(metrics_body_t *body, const char *name, const char *type, const char *help) {
+	metrics_printf(body, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Returns the CPU time thread used so far in seconds, or -1 if the
+** system keeps none per thread.
+*/
+static double metrics_thread_cpu(pthread_t thread) {
+#if defined(_POSIX_THREAD_CPUTIME) && (_POSIX_THREAD_CPUTIME >= 0)
+	clockid_t clock;
+	struct timespec ts;
+
+	if ( (pthread_getcpuclockid(thread, &clock) != 0) || (clock_gettime(clock, &ts) != 0) )
+		return -1;
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+	return -1;
+#endif
+}
+
+static void metrics_collect(metrics_body_t *body) {
+	slimaudio_t *audio = metrics_audio;
+	slimproto_send_stats_t stats;
+	const slimaudio_decoder_t *decoder;
+	double decoder_cpu, decoded;
+	char mode;
+	int i;
+	struct {
+		const char *name;
+		pthread_t thread;
+	} threads[] = {
+		{ "slimproto", metrics_proto->slimproto_thread },
+		{ "send", metrics_proto->send_thread },
+		{ "http", audio->http_thread },
+		{ "decoder", audio->decoder_thread },
+		{ "output", audio->output_thread },
+	};
+
+	metrics_header(body, "squeezeslave_buffer_bytes", "gauge", "Bytes waiting in the buffer.");
+	metrics_printf(body, "squeezeslave_buffer_bytes{buffer=\"decoder\"} %i\n",
+		slimaudio_buffer_available(audio->decoder_buffer));
+	metrics_printf(body, "squeezeslave_buffer_bytes{buffer=\"output\"} %i\n",
+		slimaudio_buffer_available(audio->output_buffer));
+
+	metrics_header(body, "squeezeslave_buffer_size_bytes", "gauge", "Capacity of the buffer.");
+	metrics_printf(body, "squeezeslave_buffer_size_bytes{buffer=\"decoder\"} %i\n",
+		slimaudio_buffer_size(audio->decoder_buffer));
+	metrics_printf(body, "squeezeslave_buffer_size_bytes{buffer=\"output\"} %i\n",
+		slimaudio_buffer_size(audio->output_buffer));
+
+	metrics_header(body, "squeezeslave_output_underruns_total", "counter",
+		"Times the output buffer ran dry while playing.");
+	metrics_printf(body, "squeezeslave_output_underruns_total %u\n", audio->output_underruns);
+
+	metrics_header(body, "squeezeslave_output_stmu_total", "counter",
+		"Times playback stopped with the stream drained, STMu.");
+	metrics_printf(body, "squeezeslave_output_stmu_total %u\n", audio->output_STMu_count);
+
+	metrics_header(body, "squeezeslave_output_underflows_total", "counter",
+		"Callbacks the audio device reported an output underflow for.");
+	metrics_printf(body, "squeezeslave_output_underflows_total %u\n", audio->output_underflows);
+
+	slimaudio_stat_counters(audio);
+
+	metrics_header(body, "squeezeslave_context_switches_total", "counter",
+		"Voluntary and involuntary context switches of the process.");
+	metrics_printf(body, "squeezeslave_context_switches_total %lu\n", audio->context_switches);
+
+	metrics_header(body, "squeezeslave_decoder_wakeups_total", "counter",
+		"Times the decoder woke up waiting for output buffer space.");
+	metrics_printf(body, "squeezeslave_decoder_wakeups_total %lu\n", audio->decoder_wakeups);
+
+	metrics_header(body, "squeezeslave_received_bytes_total", "counter",
+		"Stream bytes received from the server.");
+	metrics_printf(body, "squeezeslave_received_bytes_total %llu\n",
+		slimaudio_get_bytes_received(audio));
+
+	decoded = audio->decoder_audio_usec / 1e6;
+	metrics_header(body, "squeezeslave_decoded_seconds_total", "counter", "Audio decoded, in seconds.");
+	metrics_printf(body, "squeezeslave_decoded_seconds_total %.3f\n", decoded);
+
+	metrics_header(body, "squeezeslave_thread_cpu_seconds_total", "counter", "CPU time used per thread.");
+	for (i = 0; i < (int) (sizeof(threads) / sizeof(threads[0])); i++) {
+		double cpu = metrics_thread_cpu(threads[i].thread);
+
+		if (cpu >= 0)
+			metrics_printf(body, "squeezeslave_thread_cpu_seconds_total{thread=\"%s\"} %.3f\n",
+				threads[i].name, cpu);
+	}
+
+	/* the decoder thread also parses, so this is an upper bound */
+	decoder_cpu = metrics_thread_cpu(audio->decoder_thread);
+	if ( (decoder_cpu >= 0) && (decoded > 0) ) {
+		metrics_header(body, "squeezeslave_decode_seconds_per_audio_second", "gauge",
+			"Decoder CPU time per second of audio decoded.");
+		metrics_printf(body, "squeezeslave_decode_seconds_per_audio_second %.6f\n",
+			decoder_cpu / decoded);
+	}
+
+#ifndef __WIN32__
+	{
+		struct rusage usage;
+
+		if (getrusage(RUSAGE_SELF, &usage) == 0) {
+			metrics_header(body, "process_cpu_seconds_total", "counter",
+				"User and system CPU time of the process.");
+			metrics_printf(body, "process_cpu_seconds_total %.3f\n",
+				usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+				usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+		}
+	}
+#endif
+
+	slimproto_send_stats(metrics_proto, &stats);
+
+	metrics_header(body, "squeezeslave_stat_frames_total", "counter", "Frames sent to the server.");
+	metrics_printf(body, "squeezeslave_stat_frames_total %lu\n", stats.frames);
+
+	metrics_header(body, "squeezeslave_stat_frames_dropped_total", "counter",
+		"Frames refused with the send queue full.");
+	metrics_printf(body, "squeezeslave_stat_frames_dropped_total %lu\n", stats.dropped);
+
+	metrics_header(body, "squeezeslave_stat_frames_coalesced_total", "counter",
+		"STMt replaced by a newer one while queued.");
+	metrics_printf(body, "squeezeslave_stat_frames_coalesced_total %lu\n", stats.coalesced);
+
+	metrics_header(body, "squeezeslave_send_queue_frames", "gauge", "Frames waiting to be sent.");
+	metrics_printf(body, "squeezeslave_send_queue_frames %i\n", stats.depth);
+
+	metrics_header(body, "squeezeslave_reconnects_total", "counter",
+		"Connections made again after losing the server.");
+	metrics_printf(body, "squeezeslave_reconnects_total %lu\n", server_reconnects);
+
+	metrics_header(body, "squeezeslave_output_rate_hz", "gauge", "Sample rate the output runs at.");
+	metrics_printf(body, "squeezeslave_output_rate_hz %u\n", audio->output_rate);
+
+	metrics_header(body, "squeezeslave_output_dop", "gauge", "1 while the output carries DoP.");
+	metrics_printf(body, "squeezeslave_output_dop %i\n", audio->output_dop ? 1 : 0);
+
+	mode = audio->decoder_mode;
+	decoder = slimaudio_decoder_find(mode);
+	if (decoder != NULL) {
+		metrics_header(body, "squeezeslave_stream_info", "gauge", "Format of the last stream.");
+		metrics_printf(body, "squeezeslave_stream_info{mode=\"%c\",format=\"%s\"} 1\n",
+			mode, decoder->formats);
+	}
+}
+
+/* Answers one request, then closes the connection. */
+static void metrics_serve(int fd) {
+	char request[METRICS_REQUEST_SIZE];
+	char header[256];
+	metrics_body_t body;
+	int len = 0, n;
+
+	if (slimproto_configure_socket(fd, 2) != 0)
+		return;
+
+	while (len < METRICS_REQUEST_SIZE - 1) {
+		n = recv(fd, request + len, METRICS_REQUEST_SIZE - 1 - len, 0);
+		if (n <= 0)
+			return;
+
+		len += n;
+		request[len] = '\0';
+
+		if (strstr(request, "\r\n\r\n") != NULL)
+			break;
+	}
+
+	if ( (strncmp(request, "GET /metrics ", 13) != 0) && (strncmp(request, "GET / ", 6) != 0) ) {
+		n = snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\n"
+			"Content-Type: text/plain\r\nContent-Length: 10\r\n\r\nNot found\n");
+		send(fd, header, n, slimproto_get_socketsendflags());
+		return;
+	}
+
+	body.buf = (char *) malloc(METRICS_BODY_SIZE);
+	if (body.buf == NULL)
+		return;
+	body.len = 0;
+
+	metrics_collect(&body);
+	if (body.len > METRICS_BODY_SIZE - 1)
+		body.len = METRICS_BODY_SIZE - 1;
+
+	n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\nContent-Length: %i\r\n\r\n", body.len);
+
+	if (send(fd, header, n, slimproto_get_socketsendflags()) == n)
+		send(fd, body.buf, body.len, slimproto_get_socketsendflags());
+
+	free(body.buf);
+}
+
+static void *metrics_thread_func(void *ptr) {
+	fd_set read_fds;
+	struct timeval timeout;
+	int fd;
+
+	while (!metrics_quit) {
+		FD_ZERO(&read_fds);
+		FD_SET(metrics_fd, &read_fds);
+
+		/* wakes up now and then to see if it should quit */
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 500000;
+
+		if (select(metrics_fd + 1, &read_fds, NULL, NULL, &timeout) <= 0)
+			continue;
+
+		fd = accept(metrics_fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+
+		/* a scraper closing early must not kill the player */
+		if (slimproto_configure_socket_sigpipe(fd) != 0) {
+			CLOSESOCKET(fd);
+			continue;
+		}
+
+		metrics_serve(fd);
+		CLOSESOCKET(fd);
+	}
+
+	return NULL;
+}
+
+int metrics_open(int port, slimproto_t *proto, slimaudio_t *audio) {
+	struct sockaddr_in addr;
+	int on = 1;
+
+	metrics_proto = proto;
+	metrics_audio = audio;
+
+	metrics_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (metrics_fd < 0) {
+		perror("Error creating metrics socket");
+		return -1;
+	}
+
+	setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, (const void *) &on, sizeof(on));
+
+	/* only for agents on this host */
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	if ( (bind(metrics_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) ||
+	     (listen(metrics_fd, 4) != 0) ) {
+		fprintf(stderr, "Cannot serve metrics on port %i.\n", port);
+		CLOSESOCKET(metrics_fd);
+		metrics_fd = -1;
+		return -1;
+	}
+
+	metrics_quit = false;
+
+	if (pthread_create(&metrics_thread, NULL, metrics_thread_func, NULL) != 0) {
+		fprintf(stderr, "Error creating metrics thread\n");
+		CLOSESOCKET(metrics_fd);
+		metrics_fd = -1;
+		return -1;
+	}
+
+	metrics_running = true;
+
+	return 0;
+}
+
+void metrics_close(void) {
+	if (!metrics_running)
+		return;
+
+	metrics_quit = true;
+	pthread_join(metrics_thread, NULL);
+
+	CLOSESOCKET(metrics_fd);
+	metrics_fd = -1;
+	metrics_running = false;
+}
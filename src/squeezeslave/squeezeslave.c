@@ -44,7 +44,7 @@
 bool retry_connection = false;
 bool output_change = false;
 bool threshold_override = false;
-unsigned int output_threshold = OUTPUT_THRESHOLD;
+unsigned int output_threshold = 0;
 
 #ifdef PORTAUDIO_DEV
 /* User suggested latency */
@@ -57,11 +57,16 @@ unsigned long pa_numberOfBuffers = PA_NUM_BUFFERS;
 
 static volatile bool signal_exit_flag = false;
 static volatile bool signal_restart_flag = false;
+static volatile bool signal_trace_flag = false;
 const char* version = "1.4";
 const int revision = 425;
 static int port = SLIMPROTOCOL_PORT;
 static int firmware = FIRMWARE_VERSION;
 static int player_type = PLAYER_TYPE;
+static char capabilities[SLIMPROTO_CAPABILITIES_SIZE];
+static bool reconnect = false;			/* HELO after a lost connection */
+static slimaudio_t *helo_audio = NULL;		/* for the HELO bytes received */
+unsigned long server_reconnects = 0;		/* for the metrics */
 
 #ifdef EMPEG
 extern volatile struct empeg_state_t empeg_state;
@@ -149,6 +154,13 @@ void exit_handler(int signal_number) {
 	signal_exit_flag = true;
 }
 
+/* Handles a signal asking for the latency tracepoints, which the main
+** thread dumps to stderr.
+*/
+void trace_handler(int signal_number) {
+	signal_trace_flag = true;
+}
+
 /* Handles a signal coming from inside this process and that causes a restart
 ** of the Squeezebox Server connection.
 */
@@ -167,10 +179,14 @@ int connect_callback(slimproto_t *p, bool isConnected, void *user_data) {
 #endif
 
 	if (isConnected) {
-		if (slimproto_helo(p, player_type, firmware, (char*) user_data, 0, 0) < 0) {
+		if (slimproto_helo(p, player_type, firmware, (char*) user_data, 0, reconnect,
+			reconnect ? slimaudio_get_bytes_received(helo_audio) : 0, capabilities) < 0) {
 			fprintf(stderr, "Could not send helo to Squeezebox Server.\n");
 			send_restart_signal();
 		}
+		if (reconnect)
+			server_reconnects++;
+		reconnect = true;
 #ifdef INTERACTIVE
 	if ( using_curses || using_lirc || use_lcdd_menu )
 	{
@@ -195,8 +211,66 @@ int connect_callback(slimproto_t *p, bool isConnected, void *user_data) {
 	return 0;
 }
 
+/* The last server connected to after discovery, which the next discovery
+** probes directly.  The empeg keeps it with its state, elsewhere it is
+** in $HOME/SERVER_CACHE_FILE.
+*/
+static void server_cache_load(char *addr, int addr_len) {
+#ifdef EMPEG
+	strncpy(addr, (char *)empeg_state.last_server, addr_len);
+	addr[addr_len - 1] = '\0';
+#else
+	char path[FILENAME_MAX];
+	char *home = getenv("HOME");
+	FILE *fp;
+
+	addr[0] = '\0';
+
+	if (home == NULL)
+		return;
+
+	snprintf(path, sizeof(path), "%s%s", home, SERVER_CACHE_FILE);
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+
+	if (fgets(addr, addr_len, fp) == NULL)
+		addr[0] = '\0';
+	addr[strcspn(addr, "\r\n")] = '\0';
+
+	fclose(fp);
+#endif
+}
+
+static void server_cache_save(const char *addr) {
+#ifdef EMPEG
+	strncpy((char *)empeg_state.last_server, addr, sizeof(empeg_state.last_server));
+	empeg_state.last_server[sizeof(empeg_state.last_server) - 1] = '\0';
+#else
+	char path[FILENAME_MAX];
+	char *home = getenv("HOME");
+	FILE *fp;
+
+	if (home == NULL)
+		return;
+
+	snprintf(path, sizeof(path), "%s%s", home, SERVER_CACHE_FILE);
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot write %s\n", path);
+		return;
+	}
+
+	fprintf(fp, "%s\n", addr);
+	fclose(fp);
+#endif
+}
+
 int main(int argc, char *argv[]) {
 	int exit_code = 0;
+	int len;
 	slimproto_t slimproto;
 	slimaudio_t slimaudio;
 
@@ -206,6 +280,10 @@ int main(int argc, char *argv[]) {
 
 	unsigned int output_predelay = 0;
 	unsigned int output_predelay_amplitude = 0;
+	unsigned int output_low_watermark = 0;
+	unsigned int output_high_watermark = 0;
+	unsigned int decoder_buffer_min = DECODER_BUFFER_SIZE, decoder_buffer_max = DECODER_BUFFER_SIZE;
+	unsigned int output_buffer_min = OUTPUT_BUFFER_SIZE, output_buffer_max = OUTPUT_BUFFER_SIZE;
 #ifdef EMPEG
 	bool power_bypass = false, power_last = false;
 	bool geteq = false;
@@ -217,6 +295,10 @@ int main(int argc, char *argv[]) {
 	slimaudio_volume_t volume_control = VOLUME_SOFTWARE;
 #endif
 	unsigned int retry_interval = RETRY_DEFAULT;
+	unsigned int reconnect_delay = 0;	/* msec, 0 to reconnect at once */
+	u32_t reconnect_start = 0;		/* when the server went away, msec */
+	u32_t connected_time = 0;		/* when the connection came up, msec */
+	bool reconnect_playing = false;		/* playback may go on from before */
 
 	char macaddress[6] = { 0, 0, 0, 0, 0, 1 };
 
@@ -237,16 +319,26 @@ int main(int argc, char *argv[]) {
 	char *logfile = NULL;
 #endif
 	char slimserver_address[INET_FQDNSTRLEN] = "127.0.0.1";
+	char cached_server[INET_FQDNSTRLEN] = "";
+	char *capture_file = NULL;
+	char *replay_file = NULL;
+	unsigned int replay_speed = 1;
+	int metrics_port = 0;
+	char *ptr;
 
-	char getopt_options[OPTLEN] = "a:FId:Y:e:f:hk:Lm:n:o:P:p:Rr:TO:Vv:";
+	char getopt_options[OPTLEN] = "a:A:b:B:FId:Y:e:f:hk:K:Lm:n:o:P:p:Rr:TO:Vv:W:X:Z";
 
 	static struct option long_options[] = {
 		{"predelay_amplitude", required_argument, 0, 'a'},
+		{"metrics",            required_argument, 0, 'A'},
+		{"decoder_buffer",     required_argument, 0, 'b'},
+		{"output_buffer",      required_argument, 0, 'B'},
 		{"discover",           no_argument,       0, 'F'},
 		{"debug",              required_argument, 0, 'd'},
 		{"debuglog",           required_argument, 0, 'Y'},
 		{"help",               no_argument,       0, 'h'},
 		{"keepalive",          required_argument, 0, 'k'},
+		{"capture",            required_argument, 0, 'K'},
 		{"list",               no_argument,       0, 'L'},
 		{"findservers",        no_argument,       0, 'I'},
 		{"mac",	               required_argument, 0, 'm'},
@@ -266,6 +358,9 @@ int main(int argc, char *argv[]) {
 		{"intretry",           required_argument, 0, 'r'},
 		{"version",            no_argument,       0, 'V'},
 		{"volume",             required_argument, 0, 'v'},
+		{"watermarks",         required_argument, 0, 'W'},
+		{"replay",             required_argument, 0, 'X'},
+		{"nulloutput",         no_argument,       0, 'Z'},
 		{"zone",               required_argument, 0, 'z'},
 #ifdef PORTAUDIO_DEV
 		{"latency",            required_argument, 0, 'y'},
@@ -467,15 +562,42 @@ int main(int argc, char *argv[]) {
 		case 'k':
 			keepalive_interval = strtoul(optarg, NULL, 0);
 			break;
+		case 'K':
+			capture_file = optarg;
+			break;
+		case 'X':
+			replay_file = optarg;
+			ptr = strrchr(optarg, ':');
+			if (ptr != NULL) {
+				*ptr = '\0';
+				replay_speed = strtoul(ptr + 1, NULL, 0);
+				if ( (replay_speed < 1) || (replay_speed > 1000) )
+				{
+					fprintf(stderr, "%s: Invalid replay speed, should be 1-1000.\n", argv[0]);
+					exit(-1);
+				}
+			}
+			break;
+		case 'Z':
+			slimaudio_output_null = true;
+			break;
+		case 'A':
+			metrics_port = strtoul(optarg, NULL, 0);
+			if ( (metrics_port < 1) || (metrics_port > 65535) )
+			{
+				fprintf(stderr, "%s: Invalid metrics port, should be 1-65535.\n", argv[0]);
+				exit(-1);
+			}
+			break;
 		case 'T':
 			threshold_override = true;
 			break;
 		case 'O':
 			output_threshold = strtoul(optarg, NULL, 0);
-			if ( (output_threshold < 0) || (output_threshold > 1000000) )
+			if ( output_threshold > 10000 )
 			{
-				output_threshold = OUTPUT_THRESHOLD;
-				fprintf(stderr, "%s: Invalid output threshold, using (%d)\n",
+				output_threshold = OUTPUT_THRESHOLD_MSEC;
+				fprintf(stderr, "%s: Invalid output threshold, using (%d msec)\n",
 					argv[0], output_threshold);
 			}
 			break;
@@ -617,6 +739,28 @@ int main(int argc, char *argv[]) {
 				volume_control = VOLUME_NONE;
 			}
 			break;
+		case 'b':
+			if ( parse_buffer_limits(optarg, &decoder_buffer_min, &decoder_buffer_max) != 0 )
+			{
+				fprintf(stderr, "%s: Invalid decoder buffer size, should be <kbytes> or <min:max>.\n", argv[0]);
+				exit(-1);
+			}
+			break;
+		case 'B':
+			if ( parse_buffer_limits(optarg, &output_buffer_min, &output_buffer_max) != 0 )
+			{
+				fprintf(stderr, "%s: Invalid output buffer size, should be <kbytes> or <min:max>.\n", argv[0]);
+				exit(-1);
+			}
+			break;
+		case 'W':
+			if ( sscanf(optarg, "%u:%u", &output_low_watermark, &output_high_watermark) != 2 ||
+				output_low_watermark >= output_high_watermark )
+			{
+				fprintf(stderr, "%s: Invalid watermarks, should be <low:high> in msec.\n", argv[0]);
+				exit(-1);
+			}
+			break;
 #ifdef PORTAUDIO_DEV
 		case 'y':
 			modify_latency = true;
@@ -686,13 +830,20 @@ int main(int argc, char *argv[]) {
 	}
 
 	if (listservers) {
-		slimproto_discover(slimserver_address, sizeof(slimserver_address), port, &json_port, true);
+		slimproto_discover(slimserver_address, sizeof(slimserver_address), port, &json_port, true, NULL);
 		exit(0);
 	}
 
 	if (optind < argc)
 		strncpy(slimserver_address, argv[optind], sizeof(slimserver_address));
 
+	/* the replay is the server, heard on the null output */
+	if (replay_file != NULL) {
+		slimaudio_output_null = true;
+		slimaudio_output_null_speed = replay_speed;
+		discover_server = false;
+	}
+
 #ifdef DAEMONIZE
 	if ( should_daemonize ) {
 #ifdef INTERACTIVE
@@ -708,6 +859,9 @@ int main(int argc, char *argv[]) {
 #endif
 	signal(SIGTERM, &exit_handler);
 	signal(SIGINT, &exit_handler);
+#ifndef __WIN32__
+	signal(SIGQUIT, &trace_handler);
+#endif
 	install_restart_handler();
 
 #ifdef INTERACTIVE
@@ -729,10 +883,16 @@ int main(int argc, char *argv[]) {
 		fprintf(stderr, "Failed to initialize slimaudio\n");
 		exit(-1);
 	}
+
+	/* Tell the server what we can decode, so it only transcodes the rest */
+	len = snprintf(capabilities, sizeof(capabilities),
+		"Model=squeezeslave,ModelName=SqueezeSlave,Firmware=%d,", firmware);
+	slimaudio_get_capabilities(&slimaudio, capabilities + len, sizeof(capabilities) - len);
 #ifdef ZONES
 	if (default_macaddress)
 		macaddress[5] += zone;
 #endif
+	helo_audio = &slimaudio;
 	slimproto_add_connect_callback(&slimproto, connect_callback, macaddress);
 
 #ifdef INTERACTIVE
@@ -748,6 +908,9 @@ int main(int argc, char *argv[]) {
 
 	slimaudio_set_volume_control(&slimaudio, volume_control);
 	slimaudio_set_output_predelay(&slimaudio, output_predelay, output_predelay_amplitude);
+	slimaudio_set_buffer_limits(&slimaudio, decoder_buffer_min, decoder_buffer_max,
+		output_buffer_min, output_buffer_max);
+	slimaudio_set_output_watermarks(&slimaudio, output_low_watermark, output_high_watermark);
 
 	if (keepalive_interval >= 0) {
 		slimaudio_set_keepalive_interval(&slimaudio, keepalive_interval);
@@ -781,35 +944,81 @@ int main(int argc, char *argv[]) {
 	setlocale(LC_ALL, "");
 	initcurses();
 #endif
+	/* before daemonize changes directory */
+	if ( (capture_file != NULL) && (slimproto_capture_open(capture_file) < 0) ) {
+		exit_code = -1;
+		goto exit;
+	}
+
+	if ( (replay_file != NULL) && (slimproto_replay_open(replay_file, replay_speed) < 0) ) {
+		exit_code = -1;
+		goto exit;
+	}
+
 #ifdef DAEMONIZE
 	if ( should_daemonize ) {
 		daemonize(logfile);
 	}
 #endif
+	if ( (metrics_port != 0) && (metrics_open(metrics_port, &slimproto, &slimaudio) < 0) ) {
+		exit_code = -1;
+		goto exit;
+	}
+
 	/* When retry_connection is true, retry connecting to Squeezebox Server 
 	** until we succeed, unless the signal handler tells us to give up.
 	*/
 	do {
 		if (signal_restart_flag) { 
+			/* the server went with the end of the replay */
+			if ( (replay_file != NULL) && slimproto_replay_done() ) {
+				fprintf(stderr, "Replay done.\n");
+				break;
+			}
+
+			/* a connection that held resets the backoff, one that
+			** dropped at once keeps backing off
+			*/
+			if ( (connected_time != 0) &&
+			     (slimproto_clock_msec() - connected_time > 1000 * RECONNECT_STABLE_SECS) )
+				reconnect_delay = 0;
+			connected_time = 0;
+
+			/* the first attempt after losing the server is at once,
+			** then they back off up to retry_interval
+			*/
+			if (reconnect_delay == 0) {
+				fprintf(stderr,"Reconnecting.\n");
+				reconnect_start = slimproto_clock_msec();
+				reconnect_delay = RECONNECT_MIN_MSEC;
+			}
+			else {
 #ifdef INTERACTIVE
-			exitcurses();
+				exitcurses();
 #endif
-			fprintf(stderr,"Retry in %d seconds.\n", retry_interval);
-			Pa_Sleep(1000 * retry_interval);
+				fprintf(stderr,"Retry in %u ms.\n", reconnect_delay);
+				Pa_Sleep(reconnect_delay);
 #ifdef INTERACTIVE
-	   	        initcurses();
+		   	        initcurses();
 #endif
+				reconnect_delay *= 2;
+				if (reconnect_delay > 1000 * retry_interval)
+					reconnect_delay = 1000 * retry_interval;
+			}
+
+			/* playback went on from the buffers, until now */
+			if ( reconnect_playing &&
+			     (slimproto_clock_msec() - reconnect_start > 1000 * RECONNECT_STOP_SECS) ) {
+				fprintf(stderr,"Squeezebox Server still away, stopping playback.\n");
+				slimaudio_stop(&slimaudio);
+				reconnect_playing = false;
+			}
 		}
-#ifdef EMPEG
-		if (discover_server && empeg_state.last_server[0] != '\0')
-		{
-			strcpy(slimserver_address, (char *)empeg_state.last_server);
-			empeg_state.last_server[0] = '\0';
-		}
-		else
-#endif
+		if (discover_server)
+			server_cache_load(cached_server, sizeof(cached_server));
+
 		if (discover_server && slimproto_discover(slimserver_address,
-			sizeof(slimserver_address), port, &json_port, false) < 0)
+			sizeof(slimserver_address), port, &json_port, false, cached_server) < 0)
 		{
 			fprintf(stderr,"Discover failed.\n");
 			if (!retry_connection) {
@@ -830,10 +1039,14 @@ int main(int argc, char *argv[]) {
 			signal_restart_flag = true;
 			continue;
 		}
+		if (discover_server && (strcmp(slimserver_address, cached_server) != 0))
+			server_cache_save(slimserver_address);
+
 		signal_restart_flag = false;
 		discover_server = false;
+		connected_time = slimproto_clock_msec();
+		reconnect_playing = true;
 #ifdef EMPEG
-		strcpy((char *)empeg_state.last_server, slimserver_address);
 		if (power_last)
 			while (!empeg_state.power_on)
 			{
@@ -842,6 +1055,10 @@ int main(int argc, char *argv[]) {
 			}
 #endif
                 while (!signal_exit_flag && !signal_restart_flag) {
+		   if (signal_trace_flag) {
+		      signal_trace_flag = false;
+		      slimaudio_trace_dump(stderr);
+		   }
 #ifdef EMPEG
 		   int rc = empeg_idle();
 		   if (power_bypass)
@@ -962,6 +1179,8 @@ int main(int argc, char *argv[]) {
         } while (signal_restart_flag && !signal_exit_flag);
 
 exit:
+	metrics_close();
+
 	slimaudio_close(&slimaudio);
 
 	slimproto_goodbye(&slimproto, 0x00);
@@ -971,6 +1190,9 @@ exit:
 
 	slimproto_close(&slimproto);
 
+	slimproto_replay_close();
+	slimproto_capture_close();
+
 #ifdef INTERACTIVE
 	exitcurses();
 	close_lirc();
@@ -68,15 +68,23 @@
 
 #include "slimproto/slimproto.h"
 #include "slimaudio/slimaudio.h"
+#include "slimaudio/slimaudio_trace.h"
+#include "slimproto/slimproto_clock.h"
+#include "slimproto/slimproto_capture.h"
 
 #ifndef INET_FQDNSTRLEN
 #define INET_FQDNSTRLEN (256)
 #endif
 
 #define RETRY_DEFAULT	5
+#define SERVER_CACHE_FILE	"/.squeezeslave_server"	/* in $HOME */
+#define RECONNECT_MIN_MSEC	250	/* first backoff after an immediate reconnect */
+#define RECONNECT_STOP_SECS	30	/* playback stops if the server stays away */
+#define RECONNECT_STABLE_SECS	10	/* connection up this long resets the backoff */
 #define LINE_COUNT	2
 #define OPTLEN		96
 #define SLIMPROTOCOL_PORT	3483
+#define SLIMPROTO_CAPABILITIES_SIZE	256
 #ifdef EMPEG
 #define PLAYER_TYPE	13
 #define FIRMWARE_VERSION	1
@@ -92,10 +100,17 @@
 int connect_callback(slimproto_t *, bool, void *);
 PaDeviceIndex GetAudioDevices(PaDeviceIndex, char*, char*, bool, bool);
 int parse_macaddress(char *, const char *);
+int parse_buffer_limits(const char *, unsigned int *, unsigned int *);
 void print_version(void);
 void print_help(void);
 void exit_handler(int signal_number);
 void restart_handler(int signal_number);
+void trace_handler(int signal_number);
+
+/* Serves runtime metrics on localhost port until metrics_close. */
+int metrics_open(int port, slimproto_t *proto, slimaudio_t *audio);
+void metrics_close(void);
+extern unsigned long server_reconnects;
 
 #ifdef DAEMONIZE
 void init_daemonize();
@@ -0,0 +1,143 @@
+/*
+ * Track handoff test for slimaudio_buffer.
+ *
+ * A writer thread plays the decoder: it writes a number of tracks into the
+ * buffer, opening the next track as soon as the previous one is closed, as
+ * the decoder does when the next stream was queued during playback.  The
+ * reader plays the output callback and takes data at a steady rate.
+ *
+ * Checks every track ends (SLIMAUDIO_BUFFER_STREAM_END) before any data of
+ * the next track is read, and reports the gap at each handoff: the time
+ * between the last byte of a track and the first byte of the next, and how
+ * many reads found the buffer empty in between.
+ *
+ * compile with: gcc -I../src -o buffer_handoff buffer_handoff.c ../src/slimaudio/slimaudio_buffer.c -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "slimaudio/slimaudio_buffer.h"
+
+#define TRACKS		5
+#define TRACK_BYTES	(64 * 1024)
+#define CHUNK		1024
+#define BUFFER_SIZE	(16 * 1024)
+#define READ_USEC	200		/* reader takes CHUNK bytes this often */
+#define CONNECT_USEC	2000		/* writer delay before the next track */
+
+#ifdef SLIMPROTO_DEBUG
+  bool slimaudio_buffer_debug;
+  bool slimaudio_buffer_debug_v;
+#endif
+
+static slimaudio_buffer_t *buf;
+static int connect_usec = CONNECT_USEC;
+
+static double now_ms(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static void *writer(void *arg) {
+	char data[CHUNK];
+	int track, n;
+
+	for (track = 0; track < TRACKS; track++) {
+		/* stream connect and decoder start up */
+		if (track > 0)
+			usleep(connect_usec);
+
+		slimaudio_buffer_open(buf, NULL);
+
+		memset(data, track + 1, sizeof(data));
+		for (n = 0; n < TRACK_BYTES; n += CHUNK)
+			slimaudio_buffer_write(buf, data, CHUNK);
+
+		slimaudio_buffer_close(buf);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	pthread_t thread;
+	char data[CHUNK];
+	int track = 0, got = 0, ends = 0, empty = 0, errors = 0;
+	int len, i;
+	double last_byte = 0.0;
+	slimaudio_buffer_status status;
+
+	if (argc > 1)
+		connect_usec = atoi(argv[1]);
+
+	buf = slimaudio_buffer_init(BUFFER_SIZE);
+	slimaudio_buffer_set_readopt(buf, BUFFER_NONBLOCKING);
+
+	pthread_create(&thread, NULL, writer, NULL);
+
+	/* let the writer fill the buffer before "playback" starts */
+	usleep(10000);
+
+	while (ends < TRACKS) {
+		usleep(READ_USEC);
+
+		len = sizeof(data);
+		status = slimaudio_buffer_read(buf, data, &len);
+
+		if (len == 0) {
+			if (status == SLIMAUDIO_BUFFER_STREAM_END) {
+				if (got != TRACK_BYTES) {
+					printf("track %i: end after %i bytes\n", track + 1, got);
+					errors++;
+				}
+				ends++;
+				track++;
+				got = 0;
+			}
+			else if (track > 0 || got > 0) {
+				empty++;
+			}
+			continue;
+		}
+
+		for (i = 0; i < len; i++) {
+			if (data[i] != track + 1) {
+				printf("track %i: read data of track %i\n", track + 1, data[i]);
+				errors++;
+				break;
+			}
+		}
+
+		if ( (got == 0) && (track > 0) ) {
+			printf("handoff %i -> %i: gap %.2f ms, %i empty reads\n",
+				track, track + 1, now_ms() - last_byte, empty);
+			empty = 0;
+		}
+
+		got += len;
+		last_byte = now_ms();
+
+		if (status == SLIMAUDIO_BUFFER_STREAM_END) {
+			if (got != TRACK_BYTES) {
+				printf("track %i: end after %i bytes\n", track + 1, got);
+				errors++;
+			}
+			ends++;
+			track++;
+			got = 0;
+		}
+	}
+
+	pthread_join(thread, NULL);
+	slimaudio_buffer_free(buf);
+
+	printf("%s: %i tracks, %i errors\n", errors ? "FAIL" : "PASS", ends, errors);
+
+	return errors ? 1 : 0;
+}
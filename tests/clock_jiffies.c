@@ -0,0 +1,84 @@
+/*
+ * Jiffies test for the slimproto clock.
+ *
+ * Replaces the clock with a mock, so the jiffies packed into IR and STAT
+ * frames can be checked exactly: they count milliseconds from
+ * slimproto_init, whatever the clock read then, and do not move unless
+ * the clock does.  Also checks a timed wait on a condition from
+ * slimproto_cond_init lasts as long as asked.
+ *
+ * compile with: gcc -I../src -o clock_jiffies clock_jiffies.c ../src/slimproto/slimproto.c ../src/slimproto/slimproto_clock.c ../src/slimproto/slimproto_capture.c -lpthread
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "slimproto/slimproto.h"
+#include "slimproto/slimproto_clock.h"
+
+#ifdef SLIMPROTO_DEBUG
+  bool slimproto_debug;
+#endif
+
+static u64_t mock_usec;
+
+static u64_t mock_clock(void) {
+	return mock_usec;
+}
+
+static int check(const char *what, u32_t got, u32_t expect) {
+	printf("%s: %u (expect %u)\n", what, got, expect);
+	return got != expect;
+}
+
+int main(int argc, char *argv[]) {
+	slimproto_t proto;
+	unsigned char msg[SLIMPROTO_MSG_SIZE];
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t cond;
+	struct timespec timeout;
+	u64_t start;
+	u32_t waited;
+	int err, errors = 0;
+
+	slimproto_clock_set(mock_clock);
+
+	/* a start with sub-millisecond usec, which the old sum got wrong */
+	mock_usec = 1234567890ULL * 1000000 + 999999;
+	slimproto_init(&proto);
+
+	errors += check("at init", slimproto_set_jiffies(&proto, msg, 0), 0);
+
+	mock_usec += 1500;
+	errors += check("after 1.5ms", slimproto_set_jiffies(&proto, msg, 0), 1);
+	errors += check("packed", (msg[0] << 24) | (msg[1] << 16) | (msg[2] << 8) | msg[3], 1);
+
+	mock_usec += 3600ULL * 1000000;
+	errors += check("after 1h", slimproto_set_jiffies(&proto, msg, 0), 3600001);
+
+	slimproto_clock_set(NULL);
+
+	/* timed waits use the system clock */
+	slimproto_cond_init(&cond);
+	pthread_mutex_lock(&mutex);
+
+	start = slimproto_clock_usec();
+	slimproto_cond_timeout(&timeout, 200);
+	do {
+		err = pthread_cond_timedwait(&cond, &mutex, &timeout);
+	} while (err == 0);
+	waited = (u32_t) ((slimproto_clock_usec() - start) / 1000);
+
+	pthread_mutex_unlock(&mutex);
+
+	printf("timed wait: %u ms (expect 200)\n", waited);
+	if ( (err != ETIMEDOUT) || (waited < 200) || (waited > 400) )
+		errors++;
+
+	slimproto_destroy(&proto);
+
+	printf("%s: %i errors\n", errors ? "FAIL" : "PASS", errors);
+
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,800 @@
+/*
+ * Mock Squeezebox Server for end-to-end latency benchmarks.
+ *
+ * Speaks enough slimproto to drive one player: answers HELO with vers and
+ * audg, sends strm s/p/u/q/t/f, and serves the streams over HTTP from
+ * local files, or a generated tone when none are given.  It then runs
+ * scenarios against the player and reports what the STAT events show:
+ *
+ *   start     strm s to STMc, STMh and STMs (the first audio played),
+ *             strm q to STMf
+ *   pause     strm p to STMp and until the played time stops, strm u to
+ *             STMr and until it moves again, strm f to STMf
+ *   gapless   the next track queued on STMd, as the server does, and the
+ *             gap between the end of one track and STMs of the next
+ *   underrun  the stream served at half its play rate; stalls and the
+ *             silence played, from played time against wall time
+ *
+ * Run the player against it on the null output, everything on localhost:
+ *
+ *   ./mock_server -p 13483 &
+ *   squeezeslave -Z -P 13483 127.0.0.1
+ *
+ * Gap and stall timing needs the play rate: .wav files, raw .pcm (16-bit
+ * stereo 44.1kHz little endian) or the tone.  Other files are sent as flc,
+ * mp3 or ogg by their extension.
+ *
+ * usage: mock_server [-p port] [-n runs] [-s start|pause|gapless|underrun|all] [file...]
+ *
+ * compile with: gcc -o mock_server mock_server.c -lpthread -lm
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define SLIMPROTO_PORT	3483
+#define MAX_TRACKS	16
+#define MAX_EVENTS	256
+#define TONE_SECS	10
+#define WAIT_MSEC	15000	/* for a player event */
+#define PLAY_MSEC	2000	/* played before pausing or stopping */
+#define CHUNK_MSEC	50	/* a throttled stream is sent this often */
+#define UNDERRUN_RATE	50	/* percent of the play rate */
+
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+
+typedef struct {
+	const char *name;
+	unsigned char *data;
+	long len;
+	char format;			/* strm format: p, f, m or o */
+	char size, rate, channels, endian;	/* strm PCM fields */
+	long byterate;			/* bytes per second played, 0 if unknown */
+	long audio_len;			/* bytes of audio, without a WAV header */
+} track_t;
+
+typedef struct {
+	char op[5];			/* HELO, STAT, DSCO, BYE!... */
+	char code[5];			/* the STAT event */
+	unsigned int elapsed_ms;	/* played time of the track */
+	double t;			/* msec, when it arrived */
+} event_t;
+
+static track_t tracks[MAX_TRACKS];
+static int num_tracks;
+static int http_port;
+static volatile int throttle;		/* percent of the play rate, 0 for none */
+
+static int player_fd = -1;
+static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+static event_t events[MAX_EVENTS];
+static int event_head, event_count;
+static bool player_gone;
+
+static double now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void pack32(unsigned char *p, unsigned int v) {
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static unsigned int unpack32(const unsigned char *p) {
+	return ((unsigned int) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static unsigned int unpackle(const unsigned char *p, int n) {
+	unsigned int v = 0;
+
+	while (n-- > 0)
+		v = (v << 8) | p[n];
+	return v;
+}
+
+/* Loads a track, working out the strm fields and play rate. */
+static int load_track(track_t *t, const char *name) {
+	static const unsigned int rates[] = { 11025, 22050, 32000, 44100, 48000, 8000, 12000, 16000, 24000, 96000 };
+	const char *ext = strrchr(name, '.');
+	FILE *fp;
+	long pos;
+	unsigned int chunk, len, rate = 0, channels = 0, bits = 0;
+	int i;
+
+	fp = fopen(name, "rb");
+	if (fp == NULL) {
+		perror(name);
+		return -1;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	t->len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	t->data = malloc(t->len);
+	if ( (t->data == NULL) || (fread(t->data, 1, t->len, fp) != (size_t) t->len) ) {
+		fprintf(stderr, "%s: cannot read\n", name);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	t->name = name;
+	t->format = 'p';
+	t->size = '1';
+	t->rate = '3';
+	t->channels = '2';
+	t->endian = '1';
+	t->audio_len = t->len;
+	t->byterate = 44100 * 4;
+
+	if (ext == NULL)
+		ext = "";
+
+	if (strcasecmp(ext, ".wav") == 0) {
+		/* the player reads the header, the rate is for us */
+		t->byterate = 0;
+
+		for (pos = 12; pos + 8 <= t->len; pos += 8 + len + (len & 1)) {
+			chunk = unpack32(t->data + pos);
+			len = unpackle(t->data + pos + 4, 4);
+
+			if ( (chunk == 0x666d7420) && (len >= 16) ) {		/* "fmt " */
+				channels = unpackle(t->data + pos + 10, 2);
+				rate = unpackle(t->data + pos + 12, 4);
+				bits = unpackle(t->data + pos + 22, 2);
+			}
+			else if (chunk == 0x64617461) {				/* "data" */
+				t->audio_len = len;
+				t->byterate = rate * channels * (bits / 8);
+				break;
+			}
+		}
+
+		t->size = (bits >= 8 && bits <= 32) ? '0' + bits / 8 - 1 : '?';
+		t->channels = (channels == 1) ? '1' : '2';
+		t->rate = '?';
+		for (i = 0; i < 10; i++) {
+			if (rates[i] == rate)
+				t->rate = '0' + i;
+		}
+	}
+	else if (strcasecmp(ext, ".pcm") != 0 && strcasecmp(ext, ".raw") != 0) {
+		t->byterate = 0;
+		t->size = t->rate = t->channels = t->endian = '?';
+
+		if (strcasecmp(ext, ".flac") == 0 || strcasecmp(ext, ".flc") == 0)
+			t->format = 'f';
+		else if (strcasecmp(ext, ".mp3") == 0)
+			t->format = 'm';
+		else if (strcasecmp(ext, ".ogg") == 0)
+			t->format = 'o';
+		else {
+			fprintf(stderr, "%s: unknown format\n", name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* A 440Hz tone, 16-bit stereo at 44.1kHz. */
+static void tone_track(track_t *t) {
+	short *pcm;
+	long i, frames = 44100L * TONE_SECS;
+
+	pcm = malloc(frames * 4);
+	for (i = 0; i < frames; i++)
+		pcm[2 * i] = pcm[2 * i + 1] = (short) (8192 * sin(2 * M_PI * 440 * i / 44100.0));
+
+	t->name = "tone";
+	t->data = (unsigned char *) pcm;
+	t->len = t->audio_len = frames * 4;
+	t->format = 'p';
+	t->size = '1';
+	t->rate = '3';
+	t->channels = '2';
+	t->endian = (*(unsigned char *) &(short) { 1 }) ? '1' : '0';
+	t->byterate = 44100 * 4;
+}
+
+static double track_msec(const track_t *t) {
+	return t->byterate ? t->audio_len * 1000.0 / t->byterate : 0.0;
+}
+
+static int send_frame(const char *cmd, const unsigned char *data, int len) {
+	unsigned char buf[2 + 4 + 512];
+	int n;
+
+	buf[0] = (4 + len) >> 8;
+	buf[1] = (4 + len) & 0xFF;
+	memcpy(buf + 2, cmd, 4);
+	memcpy(buf + 6, data, len);
+
+	pthread_mutex_lock(&send_mutex);
+	n = send(player_fd, buf, 6 + len, MSG_NOSIGNAL);
+	pthread_mutex_unlock(&send_mutex);
+
+	return n;
+}
+
+/* strm with the track to play for 's', or the interval or time in the
+** replay gain field otherwise.  Autostart '3' queues the track after the
+** one playing, '1' starts it now.
+*/
+static void send_strm_autostart(char command, char autostart, int track, unsigned int value) {
+	unsigned char buf[24 + 64];
+	int len = 24;
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = command;
+	buf[1] = autostart;
+	buf[10] = '0';				/* transition */
+	pack32(buf + 14, value);
+
+	if (command == 's') {
+		const track_t *t = &tracks[track];
+
+		buf[2] = t->format;
+		buf[3] = t->size;
+		buf[4] = t->rate;
+		buf[5] = t->channels;
+		buf[6] = t->endian;
+		buf[7] = 255;			/* autostart threshold, kbytes */
+		pack32(buf + 14, 0);		/* no replay gain */
+		buf[18] = http_port >> 8;
+		buf[19] = http_port & 0xFF;	/* on the slimproto address */
+
+		len += snprintf((char *) buf + 24, sizeof(buf) - 24,
+			"GET /stream/%d HTTP/1.0\r\n\r\n", track);
+	}
+	else {
+		memset(buf + 2, '0', 5);
+	}
+
+	send_frame("strm", buf, len);
+}
+
+static void send_strm(char command, int track, unsigned int value) {
+	send_strm_autostart(command, '1', track, value);
+}
+
+static void send_audg(double gain) {
+	unsigned char buf[18];
+	unsigned int fixed = (unsigned int) (gain * 65536);
+
+	pack32(buf, fixed);
+	pack32(buf + 4, fixed);
+	buf[8] = 1;				/* digital volume control */
+	buf[9] = 255;				/* preamp */
+	pack32(buf + 10, fixed);
+	pack32(buf + 14, fixed);
+
+	send_frame("audg", buf, sizeof(buf));
+}
+
+static void *player_thread(void *arg) {
+	unsigned char hdr[8], data[1024], skip[1024];
+	unsigned int len;
+	event_t ev;
+	int n, got;
+
+	while (true) {
+		for (got = 0; got < 8; got += n) {
+			n = recv(player_fd, hdr + got, 8 - got, 0);
+			if (n <= 0)
+				goto gone;
+		}
+
+		len = unpack32(hdr + 4);
+		memset(data, 0, sizeof(data));
+
+		/* keeps the start of longer messages */
+		for (got = 0; got < (int) len; got += n) {
+			n = recv(player_fd, (got < (int) sizeof(data)) ? data + got : skip,
+				(got < (int) sizeof(data)) ? MIN((int) len, (int) sizeof(data)) - got : MIN((int) len - got, (int) sizeof(skip)), 0);
+			if (n <= 0)
+				goto gone;
+		}
+
+		memset(&ev, 0, sizeof(ev));
+		memcpy(ev.op, hdr, 4);
+		if (memcmp(hdr, "STAT", 4) == 0) {
+			memcpy(ev.code, data, 4);
+			ev.elapsed_ms = unpack32(data + 43);
+		}
+		ev.t = now_ms();
+
+		pthread_mutex_lock(&event_mutex);
+		if (event_count == MAX_EVENTS) {
+			event_head = (event_head + 1) % MAX_EVENTS;
+			event_count--;
+		}
+		events[(event_head + event_count++) % MAX_EVENTS] = ev;
+		pthread_cond_broadcast(&event_cond);
+		pthread_mutex_unlock(&event_mutex);
+	}
+
+gone:
+	pthread_mutex_lock(&event_mutex);
+	player_gone = true;
+	pthread_cond_broadcast(&event_cond);
+	pthread_mutex_unlock(&event_mutex);
+
+	return NULL;
+}
+
+/* Takes the next event, waiting up to msec.  Returns false on timeout. */
+static bool next_event(event_t *ev, int msec) {
+	struct timespec ts;
+	bool got = false;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += msec / 1000;
+	ts.tv_nsec += (msec % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&event_mutex);
+	while ( (event_count == 0) && !player_gone ) {
+		if (pthread_cond_timedwait(&event_cond, &event_mutex, &ts) == ETIMEDOUT)
+			break;
+	}
+
+	if (event_count > 0) {
+		*ev = events[event_head];
+		event_head = (event_head + 1) % MAX_EVENTS;
+		event_count--;
+		got = true;
+	}
+	pthread_mutex_unlock(&event_mutex);
+
+	return got;
+}
+
+/* Waits for the STAT event code, or another message op, dropping any
+** other events.
+*/
+static bool wait_for(const char *code, event_t *ev) {
+	double end = now_ms() + WAIT_MSEC;
+	double left;
+
+	while ( (left = end - now_ms()) > 0 ) {
+		if (!next_event(ev, (int) left))
+			break;
+		if ( (strcmp(ev->code, code) == 0) || (strcmp(ev->op, code) == 0) )
+			return true;
+	}
+
+	fprintf(stderr, "mock_server: no %s from the player\n", code);
+	return false;
+}
+
+static void flush_events(void) {
+	pthread_mutex_lock(&event_mutex);
+	event_head = event_count = 0;
+	pthread_mutex_unlock(&event_mutex);
+}
+
+/* Asks for the played time with strm t. */
+static bool played_ms(unsigned int *elapsed) {
+	event_t ev;
+
+	send_strm('t', 0, 0);
+	if (!wait_for("STMt", &ev))
+		return false;
+
+	*elapsed = ev.elapsed_ms;
+	return true;
+}
+
+/* Waits for the played time to move, or with still to stop moving, asking
+** every few msec.  Returns when it did, in msec from since, or -1.
+*/
+static double played_change(double since, bool still) {
+	unsigned int last, now;
+	double t;
+
+	if (!played_ms(&last))
+		return -1;
+
+	while (now_ms() - since < WAIT_MSEC) {
+		usleep(10000);
+
+		t = now_ms();
+		if (!played_ms(&now))
+			return -1;
+
+		if ( (now != last) != still )
+			return (still ? t : now_ms()) - since;
+		last = now;
+	}
+
+	return -1;
+}
+
+static void *stream_thread(void *arg) {
+	int fd = (int) (long) arg;
+	char req[1024], hdr[256];
+	const track_t *t;
+	long off, chunk;
+	int n, got = 0, track = -1, rate = throttle;
+	double next;
+
+	while (got < (int) sizeof(req) - 1) {
+		n = recv(fd, req + got, sizeof(req) - 1 - got, 0);
+		if (n <= 0)
+			goto done;
+		got += n;
+		req[got] = '\0';
+		if (strstr(req, "\r\n\r\n") != NULL)
+			break;
+	}
+
+	if ( (sscanf(req, "GET /stream/%d", &track) != 1) || (track < 0) || (track >= num_tracks) ) {
+		n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 404 Not Found\r\n\r\n");
+		send(fd, hdr, n, MSG_NOSIGNAL);
+		goto done;
+	}
+
+	t = &tracks[track];
+	n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n"
+		"Content-Length: %ld\r\n\r\n", t->len);
+	if (send(fd, hdr, n, MSG_NOSIGNAL) != n)
+		goto done;
+
+	/* unthrottled, as fast as the player takes it */
+	chunk = 16384;
+	if ( rate && t->byterate )
+		chunk = t->byterate * rate / 100 * CHUNK_MSEC / 1000;
+
+	next = now_ms();
+	for (off = 0; off < t->len; off += chunk) {
+		if (chunk > t->len - off)
+			chunk = t->len - off;
+		if (send(fd, t->data + off, chunk, MSG_NOSIGNAL) != chunk)
+			break;
+
+		if ( rate && t->byterate ) {
+			next += CHUNK_MSEC;
+			if (next > now_ms())
+				usleep((useconds_t) ((next - now_ms()) * 1000));
+		}
+	}
+
+done:
+	close(fd);
+	return NULL;
+}
+
+static void *http_thread(void *arg) {
+	int listen_fd = (int) (long) arg;
+	pthread_t thread;
+	int fd;
+
+	while ( (fd = accept(listen_fd, NULL, NULL)) >= 0 ) {
+		pthread_create(&thread, NULL, stream_thread, (void *) (long) fd);
+		pthread_detach(thread);
+	}
+
+	return NULL;
+}
+
+static int listen_on(int port) {
+	struct sockaddr_in addr;
+	int fd, on = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	if ( (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) || (listen(fd, 4) != 0) ) {
+		fprintf(stderr, "mock_server: cannot listen on %i: %s\n", port, strerror(errno));
+		exit(1);
+	}
+
+	return fd;
+}
+
+/* Stops whatever plays and waits for the player to settle. */
+static void stop_player(void) {
+	event_t ev;
+
+	throttle = 0;
+	send_strm('q', 0, 0);
+	wait_for("STMf", &ev);
+	usleep(200000);
+	flush_events();
+}
+
+static int scenario_start(int runs) {
+	event_t ev;
+	double t0, c = 0, h = 0, s = 0, q = 0, smax = 0;
+	int i, ok = 0;
+
+	for (i = 0; i < runs; i++) {
+		flush_events();
+		t0 = now_ms();
+		send_strm('s', i % num_tracks, 0);
+
+		if (!wait_for("STMc", &ev))
+			break;
+		c += ev.t - t0;
+		if (!wait_for("STMh", &ev))
+			break;
+		h += ev.t - t0;
+		if (!wait_for("STMs", &ev))
+			break;
+		s += ev.t - t0;
+		if (ev.t - t0 > smax)
+			smax = ev.t - t0;
+
+		usleep(PLAY_MSEC * 1000);
+
+		flush_events();
+		t0 = now_ms();
+		send_strm('q', 0, 0);
+		if (!wait_for("STMf", &ev))
+			break;
+		q += ev.t - t0;
+
+		usleep(200000);
+		ok++;
+	}
+
+	if (ok == 0)
+		return 1;
+
+	printf("start: %i runs, strm s -> STMc %.1f ms, STMh %.1f ms, STMs %.1f ms (max %.1f), strm q -> STMf %.1f ms\n",
+		ok, c / ok, h / ok, s / ok, smax, q / ok);
+
+	return ok < runs;
+}
+
+static int scenario_pause(void) {
+	event_t ev;
+	double t0, p, stopped, r, resumed, f;
+
+	flush_events();
+	send_strm('s', 0, 0);
+	if (!wait_for("STMs", &ev))
+		return 1;
+	usleep(PLAY_MSEC * 1000);
+
+	flush_events();
+	t0 = now_ms();
+	send_strm('p', 0, 0);
+	if (!wait_for("STMp", &ev))
+		return 1;
+	p = ev.t - t0;
+	stopped = played_change(t0, true);
+
+	usleep(1000000);
+
+	flush_events();
+	t0 = now_ms();
+	send_strm('u', 0, 0);
+	if (!wait_for("STMr", &ev))
+		return 1;
+	r = ev.t - t0;
+	resumed = played_change(t0, false);
+
+	flush_events();
+	t0 = now_ms();
+	send_strm('f', 0, 0);
+	if (!wait_for("STMf", &ev))
+		return 1;
+	f = ev.t - t0;
+
+	printf("pause: strm p -> STMp %.1f ms, silent %.1f ms; strm u -> STMr %.1f ms, playing %.1f ms; strm f -> STMf %.1f ms\n",
+		p, stopped, r, resumed, f);
+
+	stop_player();
+	return (stopped < 0) || (resumed < 0);
+}
+
+static int scenario_gapless(void) {
+	event_t ev;
+	double start = 0, gap, max_gap = 0, sum = 0;
+	int n = (num_tracks > 1) ? num_tracks : 3;
+	int sent = 1, started = 0, errors = 0;
+	bool ready = false;
+
+	if (track_msec(&tracks[0]) == 0) {
+		printf("gapless: needs PCM tracks\n");
+		return 0;
+	}
+
+	flush_events();
+	send_strm('s', 0, 0);
+
+	/* the server sends the next track once the decoder is ready for it,
+	** but only one track ahead of the one playing
+	*/
+	while (next_event(&ev, WAIT_MSEC)) {
+		if (strcmp(ev.code, "STMd") == 0) {
+			ready = true;
+		}
+		else if (strcmp(ev.code, "STMs") == 0) {
+			if (started > 0) {
+				gap = ev.t - start - track_msec(&tracks[(started - 1) % num_tracks]);
+
+				printf("gapless: track %i -> %i gap %.1f ms\n", started, started + 1, gap);
+
+				sum += gap;
+				if (fabs(gap) > fabs(max_gap))
+					max_gap = gap;
+				/* a track cut short shows as a large negative gap */
+				if (fabs(gap) > 100)
+					errors++;
+			}
+			start = ev.t;
+			started++;
+		}
+		else if ( (strcmp(ev.code, "STMu") == 0) || (strcmp(ev.op, "BYE!") == 0) ) {
+			/* the last track ends in STMu, with nothing queued */
+			break;
+		}
+
+		if ( ready && (sent == started) && (sent < n) ) {
+			send_strm_autostart('s', '3', sent % num_tracks, 0);
+			sent++;
+			ready = false;
+		}
+	}
+
+	if (started < n)
+		errors++;
+
+	printf("gapless: %i changes, average gap %.1f ms, worst %.1f ms\n",
+		started - 1, (started > 1) ? sum / (started - 1) : 0.0, max_gap);
+
+	stop_player();
+	return errors > 0;
+}
+
+static int scenario_underrun(void) {
+	event_t ev;
+	double wall0 = 0, silent = 0, behind, last_behind = 0;
+	unsigned int played0 = 0;
+	int stalls = 0;
+	bool started = false, stalled = false;
+
+	if (track_msec(&tracks[0]) == 0) {
+		printf("underrun: needs a PCM track\n");
+		return 0;
+	}
+
+	flush_events();
+	throttle = UNDERRUN_RATE;
+	send_strm('s', 0, 0);
+
+	/* the player reports STMt every second while playing */
+	while (next_event(&ev, WAIT_MSEC)) {
+		if (strcmp(ev.code, "STMs") == 0) {
+			started = true;
+			wall0 = ev.t;
+			played0 = 0;
+		}
+		else if (started && (strcmp(ev.code, "STMt") == 0)) {
+			behind = (ev.t - wall0) - (ev.elapsed_ms - played0);
+			/* a stall may run over several reports */
+			if (behind - last_behind > CHUNK_MSEC) {
+				if (!stalled)
+					stalls++;
+				silent += behind - last_behind;
+				stalled = true;
+			}
+			else {
+				stalled = false;
+			}
+			last_behind = behind;
+		}
+		else if ( (strcmp(ev.code, "STMu") == 0) || (strcmp(ev.op, "BYE!") == 0) ) {
+			break;
+		}
+	}
+
+	printf("underrun: served at %i%%, %i stalls, %.1f ms silent in %.1f s\n",
+		UNDERRUN_RATE, stalls, silent, (now_ms() - wall0) / 1000);
+
+	stop_player();
+	return !started;
+}
+
+int main(int argc, char *argv[]) {
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	pthread_t thread;
+	event_t ev;
+	const char *scenario = "all";
+	int port = SLIMPROTO_PORT, runs = 5;
+	int listen_fd, opt, on = 1, errors = 0;
+	bool all;
+
+	while ( (opt = getopt(argc, argv, "p:n:s:")) != -1 ) {
+		switch (opt) {
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'n':
+				runs = atoi(optarg);
+				break;
+			case 's':
+				scenario = optarg;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-p port] [-n runs] [-s start|pause|gapless|underrun|all] [file...]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	for (; (optind < argc) && (num_tracks < MAX_TRACKS); optind++) {
+		if (load_track(&tracks[num_tracks], argv[optind]) == 0)
+			num_tracks++;
+	}
+	if (num_tracks == 0)
+		tone_track(&tracks[num_tracks++]);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	http_port = port + 1;
+	pthread_create(&thread, NULL, http_thread, (void *) (long) listen_on(http_port));
+
+	listen_fd = listen_on(port);
+	printf("mock_server: waiting for a player on 127.0.0.1:%i, streams on %i\n", port, http_port);
+	fflush(stdout);
+
+	player_fd = accept(listen_fd, (struct sockaddr *) &addr, &addr_len);
+	setsockopt(player_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	pthread_create(&thread, NULL, player_thread, NULL);
+
+	if (!wait_for("HELO", &ev))
+		return 1;
+
+	send_frame("vers", (const unsigned char *) "7.9.0", 5);
+	send_audg(1.0);
+	stop_player();
+
+	all = (strcmp(scenario, "all") == 0);
+
+	if (all || strcmp(scenario, "start") == 0)
+		errors += scenario_start(runs);
+	if (all || strcmp(scenario, "pause") == 0)
+		errors += scenario_pause();
+	if (all || strcmp(scenario, "gapless") == 0)
+		errors += scenario_gapless();
+	if (all || strcmp(scenario, "underrun") == 0)
+		errors += scenario_underrun();
+
+	close(player_fd);
+
+	printf("%s: %i errors\n", errors ? "FAIL" : "PASS", errors);
+
+	return errors ? 1 : 0;
+}